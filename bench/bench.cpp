@@ -0,0 +1,650 @@
+/*
+* Benchmarks:
+*
+* One binary that measures the primitives of the sessions side by side, on Linux as well as Windows,
+* with the harness of common/Benchmark.h (thread sweeps, warmup, repetitions with confidence intervals,
+* JSON/CSV output and comparison with a baseline). Build it with CMake (see CMakeLists.txt) or the
+* bench project of the solution, then for example:
+*
+*   bench --filter swap --threads 1,2,4,8 --json swap.json
+*   bench --baseline swap.json --filter swap       (exit code 1 if something got slower)
+*
+* The containers of sessions 2 and 3 come from common/Containers.h, as in the examples, so both measure
+* the same code. What an example defines for itself is copied here, kept as close to the original as a
+* benchmark allows (no output in the measured paths). Operations are always the total over all threads:
+* ns/op going down as threads go up is scaling.
+*/
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if __has_include(<version>)
+#include <version> /* (!) Not __cplusplus: MSVC leaves it at 199711L unless /Zc:__cplusplus */
+#endif
+#if defined(__cpp_lib_barrier)
+#include <barrier>
+#define HAS_STD_BARRIER 1
+#else
+#define HAS_STD_BARRIER 0
+#endif
+
+#if CONCURRENCY_PARALLEL_STL /* (!) Set by CMakeLists.txt when TBB, which GCC's parallel algorithms use, is found */
+#include <execution>
+#endif
+
+#include "../common/Actor.h"
+#include "../common/Barrier.h"
+#include "../common/Benchmark.h"
+#include "../common/Containers.h"
+#include "../common/DeterministicReduce.h"
+#include "../common/FileReduce.h"
+#include "../common/LockFreeStack.h"
+#include "../common/ParallelReduce.h"
+#include "../common/ParallelSort.h"
+#include "../common/PoolAllocator.h"
+#include "../common/QueueLocks.h"
+#include "../common/SeqLock.h"
+#include "../common/SharedMemory.h"
+#include "../common/SharedRing.h"
+#include "../common/SwapCell.h"
+#include "../common/ThreadGuard.h"
+#include "../common/ThreadPool.h"
+
+/* (!) s1t15: the number of threads is a parameter instead of hardware_concurrency() */
+template<typename Iterator, typename T>
+struct accumulateBlock
+{
+  void operator()(Iterator first, Iterator last, T& result)
+  {
+    result = std::accumulate(first, last, result);
+  }
+};
+
+template<typename Iterator, typename T>
+T accumulateParallel(Iterator first, Iterator last, T init, unsigned long threads)
+{
+  auto length = std::distance(first, last);
+
+  if (!length) {
+    return init;
+  }
+
+  const unsigned long min_per_thread = 25;
+  const unsigned long max_threads = (length + min_per_thread - 1) / min_per_thread;
+  const unsigned long num_threads = std::min(threads, max_threads);
+
+  const auto block_size = length / num_threads;
+
+  std::vector<T> results(num_threads);
+  std::vector<std::thread> spawned(num_threads - 1);
+
+  Iterator block_start = first;
+
+  for (unsigned long i = 0; i < (num_threads - 1); ++i) {
+    Iterator block_end = block_start;
+    std::advance(block_end, block_size);
+    spawned[i] = std::thread(accumulateBlock<Iterator, T>(), block_start, block_end, std::ref(results[i]));
+    block_start = block_end;
+  }
+
+  accumulateBlock<Iterator, T>()(block_start, last, results[num_threads - 1]);
+  std::for_each(spawned.begin(), spawned.end(), std::mem_fn(&std::thread::join));
+
+  return std::accumulate(results.begin(), results.end(), init);
+}
+
+template<typename Allocator>
+void stackBenchmark(BenchmarkRun& run)
+{
+  ThreadSafeStack<int, std::mutex, Allocator> stack;
+  run.parallel([&](unsigned thread) {
+    int value;
+    for (uint64_t i = 0; i < run.operationsOf(thread); ++i) {
+      stack.push(static_cast<int>(i));
+      stack.pop(value); /* (!) Never empty: this thread just pushed */
+    }
+  });
+}
+
+template<typename Stack>
+void tryPopBenchmark(BenchmarkRun& run)
+{
+  Stack stack;
+  run.parallel([&](unsigned thread) {
+    int value;
+    for (uint64_t i = 0; i < run.operationsOf(thread); ++i) {
+      stack.push(static_cast<int>(i));
+      stack.try_pop(value);
+    }
+  });
+}
+
+/* (!) s3t23: a batch pushed with one lock or CAS, popped with another. Operations count values */
+template<typename Stack>
+void batchBenchmark(BenchmarkRun& run, size_t batch)
+{
+  Stack stack;
+  run.parallel([&](unsigned thread) {
+    std::vector<int> values(batch);
+    for (uint64_t i = 0; i < run.operationsOf(thread); i += batch) {
+      std::fill(values.begin(), values.end(), static_cast<int>(i));
+      stack.push_range(values.begin(), values.end());
+      stack.try_pop_n(values.begin(), values.size());
+    }
+  });
+}
+
+template<typename Mutex>
+void lockBenchmark(BenchmarkRun& run)
+{
+  Mutex mutex;
+  uint64_t counter = 0;
+  run.parallel([&](unsigned thread) {
+    for (uint64_t i = 0; i < run.operationsOf(thread); ++i) {
+      std::lock_guard<Mutex> lock(mutex);
+      ++counter;
+    }
+  });
+}
+
+template<typename Allocator>
+void listAddBenchmark(BenchmarkRun& run)
+{
+  ThreadSafeLinkedList<std::mutex, Allocator> list;
+  run.parallel([&](unsigned thread) {
+    for (uint64_t i = 0; i < run.operationsOf(thread); ++i) {
+      list.add(static_cast<int>(i));
+    }
+  });
+}
+
+/* (!) s2t04 and s2t05, and the two ways of locking two mutexes that came after them */
+struct Widget
+{
+  explicit Widget(std::string&& name)
+    : m_name(name)
+  {
+  }
+
+  std::mutex m_mutex;
+  std::string m_name;
+};
+
+void swapLockAdopt(Widget& lhs, Widget& rhs)
+{
+  if (&lhs != &rhs) {
+    std::lock(lhs.m_mutex, rhs.m_mutex);
+    std::lock_guard<std::mutex> lock_a(lhs.m_mutex, std::adopt_lock);
+    std::lock_guard<std::mutex> lock_b(rhs.m_mutex, std::adopt_lock);
+    std::swap(lhs.m_name, rhs.m_name);
+  }
+}
+
+void swapUniqueDefer(Widget& lhs, Widget& rhs)
+{
+  if (&lhs != &rhs) {
+    std::unique_lock<std::mutex> lock_a(lhs.m_mutex, std::defer_lock);
+    std::unique_lock<std::mutex> lock_b(rhs.m_mutex, std::defer_lock);
+    std::lock(lock_a, lock_b);
+    std::swap(lhs.m_name, rhs.m_name);
+  }
+}
+
+void swapScopedLock(Widget& lhs, Widget& rhs)
+{
+  if (&lhs != &rhs) {
+    std::scoped_lock lock(lhs.m_mutex, rhs.m_mutex);
+    std::swap(lhs.m_name, rhs.m_name);
+  }
+}
+
+void swapAddressOrder(Widget& lhs, Widget& rhs) /* (!) Lock ordering instead of std::lock's back-off */
+{
+  if (&lhs != &rhs) {
+    Widget& first = &lhs < &rhs ? lhs : rhs;
+    Widget& second = &lhs < &rhs ? rhs : lhs;
+    std::lock_guard<std::mutex> lock_a(first.m_mutex);
+    std::lock_guard<std::mutex> lock_b(second.m_mutex);
+    std::swap(lhs.m_name, rhs.m_name);
+  }
+}
+
+/* (!) s3t15: the name behind a SwapCell, swapped without mutexes */
+struct SwapWidget
+{
+  explicit SwapWidget(std::string&& name)
+    : m_name(std::move(name))
+  {
+  }
+
+  SwapCell<std::string> m_name;
+};
+
+void swapCells(SwapWidget& lhs, SwapWidget& rhs)
+{
+  swap(lhs.m_name, rhs.m_name);
+}
+
+template<typename W>
+void swapBenchmark(BenchmarkRun& run, void (*swap)(W&, W&))
+{
+  std::vector<std::unique_ptr<W>> widgets;
+  for (int i = 0; i < 8; ++i) { /* (!) Few widgets: threads collide on the same pairs, in both orders */
+    widgets.push_back(std::make_unique<W>("Widget " + std::to_string(i)));
+  }
+
+  run.parallel([&](unsigned thread) {
+    uint32_t state = 2463534242u + thread;
+    for (uint64_t i = 0; i < run.operationsOf(thread); ++i) {
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      swap(*widgets[state % 8], *widgets[(state >> 8) % 8]);
+    }
+  });
+}
+
+/* (!) s2t07, the widget without its output. The double-checked variant uses an atomic: the one in s2t07 is a data race */
+struct Resource
+{
+  int value = 42;
+};
+
+struct LazyMutex
+{
+  std::unique_ptr<Resource> resource;
+  std::mutex mutex;
+
+  Resource& get()
+  {
+    std::unique_lock<std::mutex> lk(mutex);
+    if (!resource) {
+      resource.reset(new Resource);
+    }
+    lk.unlock();
+    return *resource;
+  }
+};
+
+struct LazyDoubleChecked
+{
+  std::atomic<Resource*> resource{ nullptr };
+  std::mutex mutex;
+
+  ~LazyDoubleChecked()
+  {
+    delete resource.load();
+  }
+
+  Resource& get()
+  {
+    Resource* r = resource.load(std::memory_order_acquire);
+    if (!r) {
+      std::lock_guard<std::mutex> lk(mutex);
+      r = resource.load(std::memory_order_relaxed);
+      if (!r) {
+        r = new Resource;
+        resource.store(r, std::memory_order_release);
+      }
+    }
+    return *r;
+  }
+};
+
+struct LazyCallOnce
+{
+  std::unique_ptr<Resource> resource;
+  std::once_flag flag;
+
+  Resource& get()
+  {
+    std::call_once(flag, [this] { resource.reset(new Resource); });
+    return *resource;
+  }
+};
+
+struct LazyStatic
+{
+  Resource& get()
+  {
+    static Resource resource; /* (!) Initialized once since C++11, with a guard check when it is initialized at run time */
+    return resource;
+  }
+};
+
+template<typename Lazy>
+void lazyBenchmark(BenchmarkRun& run)
+{
+  Lazy lazy; /* (!) Fresh per run: the first access of every run initializes */
+  std::atomic<uint64_t> total{ 0 };
+
+  run.parallel([&](unsigned thread) {
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < run.operationsOf(thread); ++i) {
+      sum += static_cast<uint64_t>(lazy.get().value);
+      std::atomic_signal_fence(std::memory_order_seq_cst); /* (!) Keeps the compiler from hoisting get() out of the loop */
+    }
+    total += sum;
+  });
+
+  if (total.load() != 42 * run.operations()) {
+    throw std::logic_error("Lazy initialization returned a wrong value");
+  }
+}
+
+/* (!) Thread creation: each of the threads() threads starts and joins its share of threads, one at a time */
+template<typename Start>
+void spawnBenchmark(BenchmarkRun& run, Start start)
+{
+  run.parallel([&](unsigned thread) {
+    for (uint64_t i = 0; i < run.operationsOf(thread); ++i) {
+      start();
+    }
+  });
+}
+
+/* (!) s3t11: an operation is one round trip of all threads, so every thread makes all of them */
+template<typename Wait>
+void barrierBenchmark(BenchmarkRun& run, Wait wait)
+{
+  run.parallel([&](unsigned thread) {
+    for (uint64_t i = 0; i < run.operations(); ++i) {
+      wait(thread);
+    }
+  });
+}
+
+/* (!) s3t12: every run sorts the same shuffled ints, generated before the measurement */
+template<typename Sort>
+void sortBenchmark(BenchmarkRun& run, Sort sort)
+{
+  std::vector<int> values(run.operations());
+  std::mt19937 random(42);
+  std::generate(values.begin(), values.end(), [&random] { return static_cast<int>(random()); });
+
+  run.measure([&] { sort(values); });
+  if (!std::is_sorted(values.begin(), values.end())) {
+    throw std::logic_error("Not sorted");
+  }
+}
+
+/* (!) s3t14: a small record read all the time, written by thread 0 every 1024 reads */
+struct Config
+{
+  uint64_t version = 0;
+  uint32_t limits[6] = {};
+};
+
+template<typename Mutex, typename Lock>
+class LockedConfig
+{
+public:
+  Config read() const
+  {
+    Lock lock(m_mutex);
+    return m_config;
+  }
+
+  void write(Config const& config)
+  {
+    std::lock_guard<Mutex> lock(m_mutex);
+    m_config = config;
+  }
+
+private:
+  mutable Mutex m_mutex;
+  Config m_config;
+};
+
+template<typename Widget>
+void readMostlyBenchmark(BenchmarkRun& run)
+{
+  Widget widget;
+  std::atomic<uint64_t> total{ 0 };
+
+  run.parallel([&](unsigned thread) {
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < run.operationsOf(thread); ++i) {
+      if (thread == 0 && i % 1024 == 0) {
+        Config config;
+        config.version = i;
+        widget.write(config);
+      }
+      sum += widget.read().version;
+    }
+    total += sum;
+  });
+}
+
+/* (!) 16M uint32_t ones in the temporary directory, written on first use and removed at exit */
+struct InputOfOnes
+{
+  static constexpr size_t Count = 1 << 24;
+
+  InputOfOnes()
+    : path((std::filesystem::temp_directory_path() / "concurrency-bench.bin").string())
+  {
+    std::vector<uint32_t> ones(Count, 1);
+    std::ofstream(path, std::ios::binary).write(reinterpret_cast<char const*>(ones.data()), Count * sizeof(uint32_t));
+  }
+
+  ~InputOfOnes()
+  {
+    std::error_code ignored;
+    std::filesystem::remove(path, ignored);
+  }
+
+  static std::string const& get()
+  {
+    static InputOfOnes input;
+    return input.path;
+  }
+
+  std::string path;
+};
+
+void fileBenchmark(BenchmarkRun& run, FileAccess access)
+{
+  std::string const& path = InputOfOnes::get();
+  ThreadPool pool(run.threads());
+  uint64_t sum = 0;
+  run.measure([&] { sum = accumulateFile<uint32_t>(pool, path, uint64_t(0), std::plus<>(), access); }); /* (!) Cached after the warmup */
+  if (sum != InputOfOnes::Count) {
+    throw std::logic_error("accumulateFile is wrong");
+  }
+}
+
+static std::vector<double> halves(1 << 22, 0.5); /* (!) Exact in every mode, so every mode can be checked */
+
+void sumBenchmark(BenchmarkRun& run, Summation summation)
+{
+  ThreadPool pool(run.threads());
+  double sum = 0;
+  run.measure([&] { sum = sumDeterministic(pool, halves.begin(), halves.end(), summation); });
+  if (sum != halves.size() / 2) {
+    throw std::logic_error("sumDeterministic is wrong");
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  BenchmarkSuite suite;
+
+  static std::vector<int> numbers(1 << 22, 1);
+  suite.add("accumulateParallel/4M ints", numbers.size(), [](BenchmarkRun& run) {
+    long long sum = 0;
+    run.measure([&] { sum = accumulateParallel(numbers.begin(), numbers.end(), 0LL, run.threads()); });
+    if (sum != static_cast<long long>(numbers.size())) {
+      throw std::logic_error("accumulateParallel is wrong");
+    }
+  });
+
+  static std::list<int> list(1 << 20, 1);
+  suite.add("accumulateParallel/1M list advance", list.size(), [](BenchmarkRun& run) {
+    long long sum = 0;
+    run.measure([&] { sum = accumulateParallel(list.begin(), list.end(), 0LL, run.threads()); });
+    if (sum != static_cast<long long>(list.size())) {
+      throw std::logic_error("accumulateParallel is wrong");
+    }
+  });
+  suite.add("accumulateParallel/1M list chunks", list.size(), [](BenchmarkRun& run) {
+    ThreadPool pool(run.threads());
+    long long sum = 0;
+    run.measure([&] { sum = accumulateParallel(pool, list.begin(), list.end(), 0LL); });
+    if (sum != static_cast<long long>(list.size())) {
+      throw std::logic_error("accumulateParallel is wrong");
+    }
+  });
+
+  suite.add("accumulateParallel/4M doubles", halves.size(), [](BenchmarkRun& run) {
+    ThreadPool pool(run.threads());
+    double sum = 0;
+    run.measure([&] { sum = accumulateParallel(pool, halves.begin(), halves.end(), 0.0); });
+    if (sum != halves.size() / 2) {
+      throw std::logic_error("accumulateParallel is wrong");
+    }
+  });
+  suite.add("sumDeterministic/4M doubles plain", halves.size(), [](BenchmarkRun& run) { sumBenchmark(run, Summation::Plain); });
+  suite.add("sumDeterministic/4M doubles compensated", halves.size(), [](BenchmarkRun& run) { sumBenchmark(run, Summation::Compensated); });
+  suite.add("sumDeterministic/4M doubles exact", halves.size(), [](BenchmarkRun& run) { sumBenchmark(run, Summation::Exact); });
+
+  suite.add("accumulateFile/64MB mapped", InputOfOnes::Count, [](BenchmarkRun& run) { fileBenchmark(run, FileAccess::Map); });
+  suite.add("accumulateFile/64MB read", InputOfOnes::Count, [](BenchmarkRun& run) { fileBenchmark(run, FileAccess::Read); });
+
+  suite.add("ThreadSafeStack/push+pop", 1000000, [](BenchmarkRun& run) { stackBenchmark<PoolAllocator<int>>(run); });
+  suite.add("ThreadSafeStack/push+pop std::allocator", 1000000, [](BenchmarkRun& run) { stackBenchmark<std::allocator<int>>(run); });
+
+  suite.add("stack/LockFreeStack push+pop", 1000000, [](BenchmarkRun& run) { tryPopBenchmark<LockFreeStack<int>>(run); });
+  suite.add("stack/FlatCombining push+pop", 1000000, [](BenchmarkRun& run) { tryPopBenchmark<CombiningStack>(run); });
+  for (size_t batch : { 1, 16, 256 }) {
+    suite.add("stack/ThreadSafeStack batch " + std::to_string(batch), 1 << 20, [batch](BenchmarkRun& run) { batchBenchmark<ThreadSafeStack<int>>(run, batch); });
+    suite.add("stack/LockFreeStack batch " + std::to_string(batch), 1 << 20, [batch](BenchmarkRun& run) { batchBenchmark<LockFreeStack<int>>(run, batch); });
+  }
+
+  suite.add("SharedRing/push+pop 64B", 1000000, [](BenchmarkRun& run) {
+    const std::string name = "/bench.ring";
+    SharedMemory memory(name, SharedRing::bytes(1024, 64));
+    SharedMemory::remove(name); /* (!) Only this process maps it */
+    SharedRing* ring = SharedRing::create(memory.data(), 1024, 64);
+    run.parallel([&](unsigned thread) {
+      char message[64] = {};
+      size_t size;
+      for (uint64_t i = 0; i < run.operationsOf(thread); ++i) {
+        ring->push(message, sizeof(message));
+        ring->tryPop(message, size);
+      }
+    });
+  });
+
+  suite.add("lock/std::mutex", 1000000, [](BenchmarkRun& run) { lockBenchmark<std::mutex>(run); });
+  suite.add("lock/TicketLock", 1000000, [](BenchmarkRun& run) { lockBenchmark<TicketLock>(run); });
+  suite.add("lock/McsLock", 1000000, [](BenchmarkRun& run) { lockBenchmark<McsLock>(run); });
+  suite.add("lock/ClhLock", 1000000, [](BenchmarkRun& run) { lockBenchmark<ClhLock>(run); });
+
+  suite.add("processData/std::mutex", 1000000, [](BenchmarkRun& run) {
+    WrapperData<> wrapper;
+    run.parallel([&](unsigned thread) {
+      for (uint64_t i = 0; i < run.operationsOf(thread); ++i) {
+        wrapper.processData([i](Data& data) { data.doSomething(i); });
+      }
+    });
+  });
+
+  suite.add("processData/Actor post", 1000000, [](BenchmarkRun& run) {
+    Actor<Data> actor("data");
+    run.parallel([&](unsigned thread) {
+      for (uint64_t i = 0; i < run.operationsOf(thread); ++i) {
+        actor.post([i](Data& data) { data.doSomething(i); });
+      }
+      actor.call([](Data&) {}).get(); /* (!) The timing includes running this thread's posts */
+    });
+  });
+
+  suite.add("ThreadSafeLinkedList/add", 1000000, [](BenchmarkRun& run) { listAddBenchmark<PoolAllocator<int>>(run); });
+  suite.add("ThreadSafeLinkedList/add std::allocator", 1000000, [](BenchmarkRun& run) { listAddBenchmark<std::allocator<int>>(run); });
+
+  suite.add("ThreadSafeLinkedList/contains (64)", 1000000, [](BenchmarkRun& run) {
+    ThreadSafeLinkedList<> list;
+    for (int i = 0; i < 64; ++i) {
+      list.add(i);
+    }
+    run.parallel([&](unsigned thread) {
+      for (uint64_t i = 0; i < run.operationsOf(thread); ++i) {
+        list.contains(static_cast<int>(i % 128));
+      }
+    });
+  });
+
+  suite.add("swap/std::lock + adopt_lock", 1000000, [](BenchmarkRun& run) { swapBenchmark(run, swapLockAdopt); });
+  suite.add("swap/unique_lock + defer_lock", 1000000, [](BenchmarkRun& run) { swapBenchmark(run, swapUniqueDefer); });
+  suite.add("swap/std::scoped_lock", 1000000, [](BenchmarkRun& run) { swapBenchmark(run, swapScopedLock); });
+  suite.add("swap/address order", 1000000, [](BenchmarkRun& run) { swapBenchmark(run, swapAddressOrder); });
+  suite.add("swap/SwapCell", 1000000, [](BenchmarkRun& run) { swapBenchmark(run, swapCells); });
+
+  suite.add("lazy init/mutex", 4000000, lazyBenchmark<LazyMutex>);
+  suite.add("lazy init/double-checked atomic", 4000000, lazyBenchmark<LazyDoubleChecked>);
+  suite.add("lazy init/std::call_once", 4000000, lazyBenchmark<LazyCallOnce>);
+  suite.add("lazy init/function static", 4000000, lazyBenchmark<LazyStatic>);
+
+  suite.add("thread/std::thread + join", 2000, [](BenchmarkRun& run) {
+    spawnBenchmark(run, [] { std::thread([] {}).join(); });
+  });
+  suite.add("thread/ThreadGuard", 2000, [](BenchmarkRun& run) {
+    spawnBenchmark(run, [] { ThreadGuard guard{ std::thread([] {}) }; });
+  });
+  suite.add("thread/JoiningThread", 2000, [](BenchmarkRun& run) {
+    spawnBenchmark(run, [] { JoiningThread thread([] {}); });
+  });
+  suite.add("thread/ThreadPool submit + get", 20000, [](BenchmarkRun& run) {
+    ThreadPool pool;
+    spawnBenchmark(run, [&pool] { pool.submit([] {}).get(); });
+  });
+
+  suite.add("barrier/Barrier", 20000, [](BenchmarkRun& run) {
+    Barrier<> barrier(run.threads());
+    barrierBenchmark(run, [&barrier](unsigned thread) { barrier.arriveAndWait(thread); });
+  });
+  suite.add("barrier/Phaser", 20000, [](BenchmarkRun& run) {
+    Phaser phaser(run.threads());
+    barrierBenchmark(run, [&phaser](unsigned) { phaser.arriveAndAwaitAdvance(); });
+  });
+#if HAS_STD_BARRIER /* (!) Built as C++20 */
+  suite.add("barrier/std::barrier", 20000, [](BenchmarkRun& run) {
+    std::barrier<> barrier(run.threads());
+    barrierBenchmark(run, [&barrier](unsigned) { barrier.arrive_and_wait(); });
+  });
+#endif
+
+  suite.add("sort/std::sort", 1 << 22, [](BenchmarkRun& run) {
+    sortBenchmark(run, [](std::vector<int>& v) { std::sort(v.begin(), v.end()); });
+  }, false);
+#if CONCURRENCY_PARALLEL_STL
+  suite.add("sort/std::sort(par)", 1 << 22, [](BenchmarkRun& run) {
+    sortBenchmark(run, [](std::vector<int>& v) { std::sort(std::execution::par, v.begin(), v.end()); });
+  }, false);
+#endif
+  suite.add("sort/parallelSort", 1 << 22, [](BenchmarkRun& run) {
+    ThreadPool pool(run.threads());
+    sortBenchmark(run, [&pool](std::vector<int>& v) { parallelSort(pool, v.begin(), v.end()); });
+  });
+
+  suite.add("read mostly/std::mutex", 4000000, readMostlyBenchmark<LockedConfig<std::mutex, std::lock_guard<std::mutex>>>);
+  suite.add("read mostly/std::shared_mutex", 4000000,
+            readMostlyBenchmark<LockedConfig<std::shared_mutex, std::shared_lock<std::shared_mutex>>>);
+  suite.add("read mostly/SeqLocked", 4000000, readMostlyBenchmark<SeqLocked<Config>>);
+  suite.add("read mostly/MultiWriterSeqLocked", 4000000, readMostlyBenchmark<MultiWriterSeqLocked<Config>>);
+
+  return suite.run(argc, argv);
+}
@@ -0,0 +1,276 @@
+/*
+* Common: actor
+*
+* WrapperData::processData (s2t03) lets every thread lock the mutex and work on Data itself, so Data's
+* cache lines travel to whichever core calls next, and a function that keeps a pointer to Data breaks
+* the protection altogether. Actor<T> turns it around: one thread owns the T and is the only one that
+* ever touches it. Other threads hand it work:
+*
+*   - post(f)   - f(T&) runs on the owner some time later; nothing comes back (an exception is counted in
+*                 failures() and dropped)
+*   - call(f)   - the same, with a std::future for f's result or exception
+*
+* Messages go through a lock-free multiple-producer, single-consumer mailbox (Vyukov's intrusive queue):
+* posting is one exchange on the mailbox head, however many threads post. The owner drains the mailbox
+* in batches of up to BatchSize messages and only goes to sleep (on a Futex) when it finds it empty;
+* posting wakes it with a system call only then. Messages are allocated from the NodePool
+* (common/PoolAllocator.h), which returns them to the posting threads' caches in batches.
+*
+* The destructor runs everything posted so far, then stops the owner thread. call(...).get() on the
+* owner thread itself, from inside a message, would wait forever.
+*/
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <new>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include "Futex.h"
+#include "PoolAllocator.h"
+#include "ThreadRegistry.h"
+
+template<typename T>
+class Actor
+{
+public:
+  static constexpr unsigned BatchSize = 256; /* (!) Messages run between two looks at the stop flag and the sleep check */
+
+  template<typename... Args>
+  explicit Actor(std::string name, Args&&... args)
+    : m_state(std::forward<Args>(args)...)
+    , m_owner(&Actor::run, this, std::move(name))
+  {
+  }
+
+  Actor(Actor const&) = delete;
+  Actor& operator=(Actor const&) = delete;
+
+  ~Actor()
+  {
+    m_stopping.store(true);
+    wake();
+    m_owner.join();
+  }
+
+  template<typename Function>
+  void post(Function f)
+  {
+    push(new Post<Function>(std::move(f)));
+  }
+
+  template<typename Function>
+  auto call(Function f) -> std::future<std::invoke_result_t<Function&, T&>>
+  {
+    auto* message = new Call<Function, std::invoke_result_t<Function&, T&>>(std::move(f));
+    auto result = message->promise.get_future();
+    push(message);
+    return result;
+  }
+
+  /* (!) Messages run, and the batches they ran in: their ratio is the mean batch size */
+  uint64_t messages() const
+  {
+    return m_messages.load(std::memory_order_relaxed);
+  }
+
+  uint64_t batches() const
+  {
+    return m_batches.load(std::memory_order_relaxed);
+  }
+
+  uint64_t failures() const
+  {
+    return m_failures.load(std::memory_order_relaxed);
+  }
+
+private:
+  struct Message
+  {
+    virtual ~Message() = default;
+    virtual void run(T& state) = 0;
+
+    static void* operator new(size_t size)
+    {
+      return size <= NodePool::MaxSize ? NodePool::instance().allocate(size) : ::operator new(size);
+    }
+
+    static void operator delete(void* p, size_t size) /* (!) The virtual destructor passes the size of the derived message */
+    {
+      if (size <= NodePool::MaxSize) {
+        NodePool::instance().deallocate(p, size);
+      } else {
+        ::operator delete(p);
+      }
+    }
+
+    std::atomic<Message*> next{ nullptr };
+  };
+
+  /* (!) The mailbox's stub: never run, never deleted */
+  struct Stub : Message
+  {
+    void run(T&) override
+    {
+    }
+  };
+
+  template<typename Function>
+  struct Post : Message
+  {
+    explicit Post(Function&& f)
+      : function(std::move(f))
+    {
+    }
+
+    void run(T& state) override
+    {
+      function(state);
+    }
+
+    Function function;
+  };
+
+  template<typename Function, typename Result>
+  struct Call : Message
+  {
+    explicit Call(Function&& f)
+      : function(std::move(f))
+    {
+    }
+
+    void run(T& state) override
+    {
+      try {
+        if constexpr (std::is_void_v<Result>) {
+          function(state);
+          promise.set_value();
+        } else {
+          promise.set_value(function(state));
+        }
+      } catch (...) {
+        promise.set_exception(std::current_exception());
+      }
+    }
+
+    Function function;
+    std::promise<Result> promise;
+  };
+
+  void push(Message* message)
+  {
+    message->next.store(nullptr, std::memory_order_relaxed);
+    Message* previous = m_head.exchange(message); /* (!) The only point where producers meet */
+    previous->next.store(message, std::memory_order_release);
+
+    if (m_idle.load()) { /* (!) seq_cst against the owner's store of m_idle: one of the two sees the other */
+      wake();
+    }
+  }
+
+  void wake()
+  {
+    m_signal.fetchAdd(1);
+    m_signal.notifyOne();
+  }
+
+  /* (!) Owner only. Null if the mailbox is empty, or a producer hasn't linked its message in yet */
+  Message* pop()
+  {
+    Message* tail = m_tail;
+    Message* next = tail->next.load(std::memory_order_acquire);
+
+    if (tail == &m_stub) {
+      if (next == nullptr) {
+        return nullptr;
+      }
+      m_tail = next;
+      tail = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+
+    if (next != nullptr) {
+      m_tail = next;
+      return tail;
+    }
+
+    if (tail != m_head.load()) {
+      return nullptr; /* (!) Behind tail, a producer is halfway through push() */
+    }
+
+    push(&m_stub); /* (!) tail is the last message: put the stub behind it, so that tail can be taken out */
+    next = tail->next.load(std::memory_order_acquire);
+    if (next != nullptr) {
+      m_tail = next;
+      return tail;
+    }
+    return nullptr;
+  }
+
+  /* (!) Owner only: true if a message is in the mailbox, or on its way in */
+  bool pending() const
+  {
+    return m_tail->next.load(std::memory_order_acquire) != nullptr || m_head.load() != m_tail;
+  }
+
+  void run(std::string name)
+  {
+    ThreadRegistry::instance().registerThread(ThreadRole::Worker, std::move(name));
+
+    for (;;) {
+      unsigned ran = 0;
+      while (ran < BatchSize) {
+        Message* message = pop();
+        if (message == nullptr) {
+          break;
+        }
+
+        try {
+          message->run(m_state);
+        } catch (...) {
+          m_failures.fetch_add(1, std::memory_order_relaxed); /* (!) Only posts throw here: calls keep theirs in the promise */
+        }
+        delete message; /* (!) Back to the NodePool, through the owner's cache */
+        ++ran;
+      }
+
+      if (ran != 0) {
+        m_messages.fetch_add(ran, std::memory_order_relaxed);
+        m_batches.fetch_add(1, std::memory_order_relaxed);
+        continue;
+      }
+
+      if (pending()) {
+        std::this_thread::yield(); /* (!) A producer between its exchange and its link */
+        continue;
+      }
+
+      const uint32_t signal = m_signal.load();
+      m_idle.store(true);
+      if (!pending()) {
+        if (m_stopping.load()) {
+          break; /* (!) Everything posted before the destructor has run */
+        }
+        m_signal.waitWhileEqual(signal);
+      }
+      m_idle.store(false);
+    }
+  }
+
+  alignas(64) std::atomic<Message*> m_head{ &m_stub };
+  alignas(64) std::atomic<bool> m_idle{ false };
+  Futex m_signal;
+  alignas(64) Message* m_tail = &m_stub; /* (!) The rest belongs to the owner thread */
+  Stub m_stub;
+  T m_state;
+  std::atomic<uint64_t> m_messages{ 0 };
+  std::atomic<uint64_t> m_batches{ 0 };
+  std::atomic<uint64_t> m_failures{ 0 };
+  std::atomic<bool> m_stopping{ false };
+  std::thread m_owner; /* (!) Declared last: started once everything else is constructed */
+};
@@ -0,0 +1,279 @@
+/*
+* Common: latch, barrier and phaser
+*
+* accumulateParallel synchronizes once, by joining its threads. An iterative job (reduce, use the result,
+* reduce again) would have to start and join a set of threads per round; with these the threads stay and
+* wait for each other instead.
+*
+* Latch   - a one-shot count down: threads wait until the count reaches zero (std::latch).
+* Barrier - a reusable meeting point for a fixed set of participants, each identified by a number in
+*           [0, participants). The last one to arrive runs the completion function, then all of them
+*           continue. Arrivals are counted in a combining tree (a node per 4 participants, a node per 4
+*           nodes above that) so that no single counter takes every arrival, and the phase number works
+*           as the sense of a sense-reversing barrier: waiters wait for it to change.
+* Phaser  - a barrier whose participants can register and deregister between phases, like Java's
+*           Phaser. Membership and arrivals have to change together, so it keeps parties, unarrived
+*           parties and the phase in one 64-bit word updated by compare-and-swap: simpler, but a single
+*           contended word, unlike Barrier.
+*
+* All three wait on a Futex (common/Futex.h): a short spin, then a sleep in the kernel.
+*/
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "Futex.h"
+
+class Latch
+{
+public:
+  explicit Latch(ptrdiff_t count)
+    : m_count(count)
+    , m_released(count == 0 ? 1 : 0)
+  {
+  }
+
+  Latch(Latch const&) = delete;
+  Latch& operator=(Latch const&) = delete;
+
+  void countDown(ptrdiff_t n = 1)
+  {
+    const ptrdiff_t before = m_count.fetch_sub(n, std::memory_order_acq_rel);
+    if (before < n) {
+      throw std::logic_error("Latch counted down below zero");
+    }
+    if (before == n) {
+      m_released.store(1);
+      m_released.notifyAll();
+    }
+  }
+
+  bool tryWait() const noexcept
+  {
+    return m_released.load(std::memory_order_acquire) != 0;
+  }
+
+  void wait() const noexcept
+  {
+    m_released.waitWhileEqual(0);
+  }
+
+  void arriveAndWait(ptrdiff_t n = 1)
+  {
+    countDown(n);
+    wait();
+  }
+
+private:
+  std::atomic<ptrdiff_t> m_count;
+  Futex m_released;
+};
+
+struct NoCompletion
+{
+  void operator()() noexcept
+  {
+  }
+};
+
+template<typename Completion = NoCompletion>
+class Barrier
+{
+public:
+  static constexpr unsigned FanIn = 4;
+
+  explicit Barrier(unsigned participants, Completion completion = Completion())
+    : m_participants(participants)
+    , m_completion(std::move(completion))
+  {
+    if (participants == 0) {
+      throw std::invalid_argument("A barrier needs participants");
+    }
+
+    /* (!) Level 0 has a node per FanIn participants, every level above a node per FanIn nodes below */
+    unsigned below = participants;
+    do {
+      const unsigned nodes = (below + FanIn - 1) / FanIn;
+      std::vector<Node> level(nodes);
+      for (unsigned i = 0; i < nodes; ++i) {
+        level[i].expected = std::min(FanIn, below - i * FanIn);
+      }
+      m_levels.push_back(std::move(level));
+      below = nodes;
+    } while (below > 1);
+  }
+
+  Barrier(Barrier const&) = delete;
+  Barrier& operator=(Barrier const&) = delete;
+
+  unsigned participants() const noexcept
+  {
+    return m_participants;
+  }
+
+  /* (!) Returns the phase that was completed. participant must be unique among the threads of a phase */
+  uint32_t arriveAndWait(unsigned participant)
+  {
+    const uint32_t phase = m_phase.load(std::memory_order_acquire); /* (!) Read before arriving: the sense to wait out */
+
+    unsigned index = participant;
+    for (auto&& level : m_levels) {
+      index /= FanIn;
+      Node& node = level[index];
+
+      if (node.arrived.fetch_add(1, std::memory_order_acq_rel) + 1 != node.expected) {
+        m_phase.waitWhileEqual(phase); /* (!) Not the last one here: someone else carries the arrival up */
+        return phase;
+      }
+      node.arrived.store(0, std::memory_order_relaxed); /* (!) Everyone of this node has arrived: safe to reset */
+    }
+
+    m_completion(); /* (!) Last arriver of the whole barrier, before anyone is released */
+    m_phase.store(phase + 1);
+    m_phase.notifyAll();
+    return phase;
+  }
+
+private:
+  struct alignas(64) Node /* (!) A cache line each: nodes are arrived at by different threads */
+  {
+    std::atomic<unsigned> arrived{ 0 };
+    unsigned expected = 0;
+  };
+
+  const unsigned m_participants;
+  Completion m_completion;
+  std::vector<std::vector<Node>> m_levels;
+  alignas(64) Futex m_phase{ 0 };
+};
+
+class Phaser
+{
+public:
+  static constexpr uint32_t MaxParties = 0xffff;
+
+  explicit Phaser(uint32_t parties = 0)
+    : m_state(pack(0, parties, parties))
+  {
+    if (parties > MaxParties) {
+      throw std::invalid_argument("Too many parties");
+    }
+  }
+
+  Phaser(Phaser const&) = delete;
+  Phaser& operator=(Phaser const&) = delete;
+
+  /* (!) Adds a party to the current phase; returns that phase */
+  uint32_t registerParty()
+  {
+    uint64_t state = m_state.load();
+    for (;;) {
+      if (parties(state) == MaxParties) {
+        throw std::logic_error("Too many parties");
+      }
+      if (m_state.compare_exchange_weak(state, pack(phase(state), parties(state) + 1, unarrived(state) + 1))) {
+        return phase(state);
+      }
+    }
+  }
+
+  /* (!) Returns the phase arrived at, without waiting for the others */
+  uint32_t arrive()
+  {
+    return arrive(0);
+  }
+
+  /* (!) Arrives and leaves: the next phases wait for one party less */
+  uint32_t arriveAndDeregister()
+  {
+    return arrive(1);
+  }
+
+  /* (!) Returns the new phase */
+  uint32_t arriveAndAwaitAdvance()
+  {
+    const uint32_t phase = arrive(0);
+    return awaitAdvance(phase);
+  }
+
+  /* (!) Waits until the given phase is over; returns the current phase */
+  uint32_t awaitAdvance(uint32_t phase) const
+  {
+    uint32_t published = m_phase.load(std::memory_order_acquire);
+    while (static_cast<int32_t>(published - phase) <= 0) { /* (!) May still lag behind the state, so not just != */
+      published = m_phase.waitWhileEqual(published);
+    }
+    return published;
+  }
+
+  uint32_t phase() const
+  {
+    return phase(m_state.load());
+  }
+
+  uint32_t parties() const
+  {
+    return parties(m_state.load());
+  }
+
+private:
+  static uint64_t pack(uint32_t phase, uint32_t parties, uint32_t unarrived)
+  {
+    return (uint64_t(phase) << 32) | (uint64_t(parties) << 16) | unarrived;
+  }
+
+  static uint32_t phase(uint64_t state)
+  {
+    return static_cast<uint32_t>(state >> 32);
+  }
+
+  static uint32_t parties(uint64_t state)
+  {
+    return static_cast<uint32_t>(state >> 16) & 0xffff;
+  }
+
+  static uint32_t unarrived(uint64_t state)
+  {
+    return static_cast<uint32_t>(state) & 0xffff;
+  }
+
+  uint32_t arrive(uint32_t leaving)
+  {
+    uint64_t state = m_state.load();
+    for (;;) {
+      if (unarrived(state) == 0) {
+        throw std::logic_error("More arrivals than registered parties");
+      }
+
+      const uint32_t current = phase(state);
+      const uint32_t remaining = parties(state) - leaving;
+      const uint64_t next = unarrived(state) == 1 ? pack(current + 1, remaining, remaining) /* (!) Last: the phase advances */
+                                                  : pack(current, remaining, unarrived(state) - 1);
+
+      if (m_state.compare_exchange_weak(state, next)) {
+        if (unarrived(state) == 1) {
+          publish(current + 1);
+        }
+        return current;
+      }
+    }
+  }
+
+  /* (!) The word the waiters sleep on follows the state. Two advances can publish out of order, so it only moves forward */
+  void publish(uint32_t phase)
+  {
+    uint32_t seen = m_phase.load();
+    while (static_cast<int32_t>(phase - seen) > 0 && !m_phase.compareExchange(seen, phase)) {
+    }
+    m_phase.notifyAll();
+  }
+
+  std::atomic<uint64_t> m_state;
+  Futex m_phase{ 0 };
+};
@@ -0,0 +1,569 @@
+/*
+* Common: benchmark harness
+*
+* Every example of session 3 measures something with its own loop and its own table. BenchmarkSuite is
+* the shared part: benchmarks are registered by name with a number of operations and a function, and the
+* suite runs each of them for every thread count of a sweep, with warmup runs first and then repetitions.
+* Each repetition gives a time per operation; the report has their mean, standard deviation and the 95%
+* confidence interval of the mean (Student's t, since there are only a handful of repetitions).
+*
+* Results can be written as JSON or CSV, and a JSON file from an earlier run can be given as a baseline:
+* a benchmark is a regression if its mean is slower than the baseline's by more than the threshold and
+* the two confidence intervals don't overlap, so that noise alone doesn't fail a run.
+*
+* Inside a benchmark, BenchmarkRun::parallel() runs a body on threads() threads that start together and
+* times only the part where they all run; BenchmarkRun::measure() times a region on the calling thread.
+* With --perf the harness also counts the hardware counters of common/PerfCounters.h in those regions,
+* and reports IPC and misses per operation; the counters are opened before the threads start, so opening
+* them is not part of the time.
+*
+*   --list                  print the benchmarks
+*   --filter <text>         only the benchmarks whose name contains text
+*   --threads <1,2,4>       thread counts (default: powers of two up to 2 * hardware concurrency)
+*   --warmup <n>            unmeasured runs before the repetitions (default 1)
+*   --repetitions <n>       measured runs (default 5)
+*   --scale <x>             multiply every benchmark's operations by x
+*   --json <file>           write the results as JSON ('-' for stdout)
+*   --csv <file>            write the results as CSV ('-' for stdout)
+*   --baseline <file>       compare with an earlier JSON result, exit code 1 on a regression
+*   --threshold <percent>   slowdown that counts as a regression (default 5)
+*   --perf                  count cycles, instructions and misses
+*/
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "PerfCounters.h"
+#include "ThreadGuard.h"
+
+struct BenchmarkResult
+{
+  std::string name;
+  unsigned threads = 1;
+  uint64_t operations = 0;
+  std::vector<double> samples; /* (!) Nanoseconds per operation, one per repetition */
+  double mean = 0;
+  double stddev = 0;
+  double ci95 = 0; /* (!) Half width */
+  double min = 0;
+  double max = 0;
+  bool hasPerf = false;
+  PerfSample perf; /* (!) Summed over the repetitions */
+};
+
+class BenchmarkRun
+{
+public:
+  using Clock = std::chrono::steady_clock;
+
+  BenchmarkRun(unsigned threads, uint64_t operations, PerfTotals* perf)
+    : m_threads(threads)
+    , m_operations(operations)
+    , m_perf(perf)
+  {
+  }
+
+  unsigned threads() const
+  {
+    return m_threads;
+  }
+
+  uint64_t operations() const
+  {
+    return m_operations;
+  }
+
+  /* (!) The operations of one of the threads() threads: they add up to operations() */
+  uint64_t operationsOf(unsigned thread) const
+  {
+    return m_operations / m_threads + (thread < m_operations % m_threads ? 1 : 0);
+  }
+
+  /* (!) Runs body(thread) on threads() threads; starting and joining them is not timed */
+  template<typename Body>
+  void parallel(Body body)
+  {
+    std::atomic<unsigned> ready{ 0 };
+    std::atomic<unsigned> done{ 0 };
+    std::atomic<bool> go{ false };
+    Clock::time_point start;
+
+    {
+      std::vector<JoiningThread> threads;
+      for (unsigned t = 1; t < m_threads; ++t) {
+        threads.emplace_back([&, t] {
+          Counters counters(m_perf);
+          ++ready;
+          while (!go.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+          }
+          counters.run([&] { body(t); });
+          ++done;
+        });
+      }
+
+      Counters counters(m_perf);
+      while (ready.load() != m_threads - 1) {
+        std::this_thread::yield();
+      }
+
+      start = Clock::now();
+      go.store(true, std::memory_order_release);
+      counters.run([&] { body(0u); }); /* (!) The calling thread is thread 0 */
+
+      while (done.load() != m_threads - 1) {
+        std::this_thread::yield();
+      }
+      m_elapsed += Clock::now() - start;
+      m_timed = true;
+    }
+  }
+
+  /* (!) Times a region on the calling thread; may be called more than once, the times add up */
+  template<typename Function>
+  void measure(Function function)
+  {
+    Counters counters(m_perf);
+    const auto start = Clock::now();
+    counters.run(function);
+    m_elapsed += Clock::now() - start;
+    m_timed = true;
+  }
+
+  bool timed() const
+  {
+    return m_timed;
+  }
+
+  Clock::duration elapsed() const
+  {
+    return m_elapsed;
+  }
+
+private:
+  /*
+  * (!) A thread's counters, opened before the region (perf_event_open is a system call per event) and
+  * added to the totals after it (PerfTotals takes a lock): only reading them is timed
+  */
+  class Counters
+  {
+  public:
+    explicit Counters(PerfTotals* totals)
+      : m_totals(totals)
+      , m_counters(totals ? std::make_unique<PerfCounters>() : nullptr)
+    {
+    }
+
+    ~Counters()
+    {
+      if (m_counters) {
+        m_totals->add(m_sample);
+      }
+    }
+
+    Counters(Counters const&) = delete;
+    Counters& operator=(Counters const&) = delete;
+
+    template<typename Function>
+    void run(Function&& function)
+    {
+      if (m_counters) {
+        m_counters->start();
+      }
+      function();
+      if (m_counters) {
+        m_sample = m_counters->stop();
+      }
+    }
+
+  private:
+    PerfTotals* m_totals;
+    std::unique_ptr<PerfCounters> m_counters;
+    PerfSample m_sample;
+  };
+
+  unsigned m_threads;
+  uint64_t m_operations;
+  PerfTotals* m_perf;
+  Clock::duration m_elapsed{ 0 };
+  bool m_timed = false;
+};
+
+class BenchmarkSuite
+{
+public:
+  using Function = std::function<void(BenchmarkRun&)>;
+
+  /* (!) sweep = false: the benchmark ignores threads() and runs once, with 1 */
+  void add(std::string name, uint64_t operations, Function function, bool sweep = true)
+  {
+    m_benchmarks.push_back(Benchmark{ std::move(name), operations, std::move(function), sweep });
+  }
+
+  int run(int argc, char* argv[])
+  {
+    Options options;
+    try {
+      options = parse(argc, argv);
+    } catch (std::exception const& e) {
+      std::cerr << e.what() << std::endl;
+      return 2;
+    }
+
+    if (options.list) {
+      for (auto&& b : m_benchmarks) {
+        std::cout << b.name << (b.sweep ? "" : " (single thread)") << std::endl;
+      }
+      return 0;
+    }
+
+    if (options.perf) {
+      const PerfCounters probe;
+      if (!probe.status().empty()) {
+        std::cerr << "Unavailable counters:" << std::endl << probe.status() << std::endl;
+      }
+    }
+
+    std::vector<BenchmarkResult> results;
+    printHeader(options.perf);
+
+    for (auto&& benchmark : m_benchmarks) {
+      if (benchmark.name.find(options.filter) == std::string::npos) {
+        continue;
+      }
+
+      for (unsigned threads : benchmark.sweep ? options.threads : std::vector<unsigned>{ 1 }) {
+        results.push_back(measure(benchmark, threads, options));
+        print(results.back(), options.perf);
+      }
+    }
+
+    try {
+      if (!options.json.empty()) {
+        output(options.json, [&](std::ostream& os) { writeJson(os, results); });
+      }
+      if (!options.csv.empty()) {
+        output(options.csv, [&](std::ostream& os) { writeCsv(os, results); });
+      }
+      if (!options.baseline.empty()) {
+        return compare(results, options.baseline, options.threshold) ? 0 : 1;
+      }
+    } catch (std::exception const& e) {
+      std::cerr << e.what() << std::endl;
+      return 2;
+    }
+    return 0;
+  }
+
+private:
+  struct Benchmark
+  {
+    std::string name;
+    uint64_t operations;
+    Function function;
+    bool sweep;
+  };
+
+  struct Options
+  {
+    bool list = false;
+    bool perf = false;
+    std::string filter;
+    std::vector<unsigned> threads;
+    unsigned warmup = 1;
+    unsigned repetitions = 5;
+    double scale = 1;
+    std::string json;
+    std::string csv;
+    std::string baseline;
+    double threshold = 5;
+  };
+
+  static Options parse(int argc, char* argv[])
+  {
+    Options options;
+    const auto value = [&](int& i) -> std::string {
+      if (i + 1 >= argc) {
+        throw std::invalid_argument(std::string("Missing value for ") + argv[i]);
+      }
+      return argv[++i];
+    };
+
+    for (int i = 1; i < argc; ++i) {
+      const std::string arg = argv[i];
+      if (arg == "--list") {
+        options.list = true;
+      } else if (arg == "--perf") {
+        options.perf = true;
+      } else if (arg == "--filter") {
+        options.filter = value(i);
+      } else if (arg == "--threads") {
+        std::stringstream list(value(i));
+        for (std::string item; std::getline(list, item, ',');) {
+          options.threads.push_back(static_cast<unsigned>(std::max(1ul, std::stoul(item))));
+        }
+      } else if (arg == "--warmup") {
+        options.warmup = static_cast<unsigned>(std::stoul(value(i)));
+      } else if (arg == "--repetitions") {
+        options.repetitions = std::max(2u, static_cast<unsigned>(std::stoul(value(i)))); /* (!) A deviation needs two */
+      } else if (arg == "--scale") {
+        options.scale = std::stod(value(i));
+      } else if (arg == "--json") {
+        options.json = value(i);
+      } else if (arg == "--csv") {
+        options.csv = value(i);
+      } else if (arg == "--baseline") {
+        options.baseline = value(i);
+      } else if (arg == "--threshold") {
+        options.threshold = std::stod(value(i));
+      } else {
+        throw std::invalid_argument("Unknown option " + arg + " (see common/Benchmark.h)");
+      }
+    }
+
+    if (options.threads.empty()) {
+      const unsigned max = 2 * std::max(1u, std::thread::hardware_concurrency());
+      for (unsigned t = 1; t <= max; t *= 2) {
+        options.threads.push_back(t);
+      }
+    }
+    return options;
+  }
+
+  static BenchmarkResult measure(Benchmark const& benchmark, unsigned threads, Options const& options)
+  {
+    BenchmarkResult result;
+    result.name = benchmark.name;
+    result.threads = threads;
+    result.operations = std::max<uint64_t>(1, static_cast<uint64_t>(static_cast<double>(benchmark.operations) * options.scale));
+
+    PerfTotals perf;
+
+    for (unsigned i = 0; i < options.warmup + options.repetitions; ++i) {
+      const bool warmup = i < options.warmup;
+      BenchmarkRun run(threads, result.operations, options.perf && !warmup ? &perf : nullptr);
+
+      const auto start = BenchmarkRun::Clock::now();
+      benchmark.function(run);
+      const auto elapsed = run.timed() ? run.elapsed() : BenchmarkRun::Clock::now() - start; /* (!) Untimed: the whole call */
+
+      if (!warmup) {
+        result.samples.push_back(std::chrono::duration<double, std::nano>(elapsed).count() / static_cast<double>(result.operations));
+      }
+    }
+
+    summarize(result);
+    if (options.perf) {
+      result.hasPerf = true;
+      result.perf = perf.total();
+    }
+    return result;
+  }
+
+  /* (!) Two sided 95% quantiles of Student's t for 1..30 degrees of freedom */
+  static double t95(size_t degrees)
+  {
+    static const double table[] = { 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                                    2.201,  2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+                                    2.080,  2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042 };
+    return degrees == 0 ? 0 : degrees <= 30 ? table[degrees - 1] : 1.96;
+  }
+
+  static void summarize(BenchmarkResult& result)
+  {
+    auto const& s = result.samples;
+    const double n = static_cast<double>(s.size());
+
+    double sum = 0;
+    for (double x : s) {
+      sum += x;
+    }
+    result.mean = sum / n;
+
+    double squares = 0;
+    for (double x : s) {
+      squares += (x - result.mean) * (x - result.mean);
+    }
+    result.stddev = s.size() > 1 ? std::sqrt(squares / (n - 1)) : 0;
+    result.ci95 = t95(s.size() - 1) * result.stddev / std::sqrt(n);
+    result.min = *std::min_element(s.begin(), s.end());
+    result.max = *std::max_element(s.begin(), s.end());
+  }
+
+  static void printHeader(bool perf)
+  {
+    std::cout << std::left << std::setw(40) << "benchmark" << std::right << std::setw(8) << "threads" << std::setw(14) << "ns/op"
+              << std::setw(12) << "+/- 95%" << std::setw(14) << "Mops/s";
+    if (perf) {
+      std::cout << std::setw(8) << "IPC" << std::setw(12) << "L1D/op" << std::setw(12) << "LLC/op" << std::setw(12) << "br/op";
+    }
+    std::cout << std::endl;
+  }
+
+  static void print(BenchmarkResult const& r, bool perf)
+  {
+    std::cout << std::left << std::setw(40) << r.name << std::right << std::setw(8) << r.threads << std::fixed << std::setprecision(2)
+              << std::setw(14) << r.mean << std::setw(12) << r.ci95 << std::setw(14) << 1000.0 / r.mean;
+
+    if (perf) {
+      const auto field = [&](PerfEvent event, int width) {
+        if (r.perf.has(event)) {
+          std::cout << std::setw(width) << r.perf.per(event, r.operations * r.samples.size());
+        } else {
+          std::cout << std::setw(width) << "n/a";
+        }
+      };
+      if (r.perf.has(PerfEvent::Cycles) && r.perf.has(PerfEvent::Instructions)) {
+        std::cout << std::setw(8) << r.perf.ipc();
+      } else {
+        std::cout << std::setw(8) << "n/a";
+      }
+      field(PerfEvent::L1DMisses, 12);
+      field(PerfEvent::LLCMisses, 12);
+      field(PerfEvent::BranchMisses, 12);
+    }
+    std::cout << std::endl;
+  }
+
+  template<typename Writer>
+  static void output(std::string const& path, Writer writer)
+  {
+    if (path == "-") {
+      writer(std::cout);
+      return;
+    }
+
+    std::ofstream file(path);
+    if (!file) {
+      throw std::runtime_error("Cannot open " + path);
+    }
+    writer(file);
+  }
+
+  static void writeJson(std::ostream& os, std::vector<BenchmarkResult> const& results)
+  {
+    os << "{\n  \"hardware_concurrency\": " << std::thread::hardware_concurrency() << ",\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+      auto const& r = results[i];
+      os << (i ? ",\n" : "\n") << "    {\"name\": \"" << r.name << "\", \"threads\": " << r.threads << ", \"operations\": " << r.operations
+         << ", \"repetitions\": " << r.samples.size() << std::setprecision(4) << std::fixed << ", \"mean_ns\": " << r.mean
+         << ", \"stddev_ns\": " << r.stddev << ", \"ci95_ns\": " << r.ci95 << ", \"min_ns\": " << r.min << ", \"max_ns\": " << r.max;
+      if (r.hasPerf) {
+        const uint64_t ops = r.operations * r.samples.size();
+        for (unsigned e = 0; e < PerfEventCount; ++e) {
+          const auto event = static_cast<PerfEvent>(e);
+          std::string key = perfEventName(event);
+          std::replace(key.begin(), key.end(), ' ', '_');
+          os << ", \"" << key << "_per_op\": ";
+          if (r.perf.has(event)) {
+            os << r.perf.per(event, ops);
+          } else {
+            os << "null";
+          }
+        }
+      }
+      os << "}";
+    }
+    os << "\n  ]\n}\n";
+  }
+
+  static void writeCsv(std::ostream& os, std::vector<BenchmarkResult> const& results)
+  {
+    os << "name,threads,operations,repetitions,mean_ns,stddev_ns,ci95_ns,min_ns,max_ns,ipc\n";
+    for (auto&& r : results) {
+      os << r.name << ',' << r.threads << ',' << r.operations << ',' << r.samples.size() << std::setprecision(4) << std::fixed << ','
+         << r.mean << ',' << r.stddev << ',' << r.ci95 << ',' << r.min << ',' << r.max << ',';
+      if (r.hasPerf && r.perf.has(PerfEvent::Cycles) && r.perf.has(PerfEvent::Instructions)) {
+        os << r.perf.ipc();
+      }
+      os << '\n';
+    }
+  }
+
+  /* (!) Reads back what writeJson() wrote: one benchmark object per line */
+  static std::map<std::pair<std::string, unsigned>, BenchmarkResult> readJson(std::string const& path)
+  {
+    std::ifstream file(path);
+    if (!file) {
+      throw std::runtime_error("Cannot open " + path);
+    }
+
+    const auto field = [](std::string const& line, std::string const& key) -> std::string {
+      const auto at = line.find("\"" + key + "\": ");
+      if (at == std::string::npos) {
+        return std::string();
+      }
+      auto begin = at + key.size() + 4;
+      if (line[begin] == '"') {
+        return line.substr(begin + 1, line.find('"', begin + 1) - begin - 1);
+      }
+      return line.substr(begin, line.find_first_of(",}", begin) - begin);
+    };
+
+    std::map<std::pair<std::string, unsigned>, BenchmarkResult> results;
+    for (std::string line; std::getline(file, line);) {
+      if (line.find("\"name\"") == std::string::npos) {
+        continue;
+      }
+      BenchmarkResult r;
+      r.name = field(line, "name");
+      r.threads = static_cast<unsigned>(std::stoul(field(line, "threads")));
+      r.mean = std::stod(field(line, "mean_ns"));
+      r.ci95 = std::stod(field(line, "ci95_ns"));
+      results[{ r.name, r.threads }] = r;
+    }
+    return results;
+  }
+
+  static bool compare(std::vector<BenchmarkResult> const& results, std::string const& path, double threshold)
+  {
+    const auto baseline = readJson(path);
+    unsigned regressions = 0;
+    unsigned improvements = 0;
+
+    std::cout << std::endl << "Compared with " << path << " (threshold " << std::fixed << std::setprecision(1) << threshold << "%):" << std::endl;
+    for (auto&& r : results) {
+      const auto b = baseline.find({ r.name, r.threads });
+      if (b == baseline.end()) {
+        continue;
+      }
+
+      const auto& base = b->second;
+      const double change = (r.mean - base.mean) / base.mean * 100;
+      const bool overlap = r.mean - r.ci95 <= base.mean + base.ci95 && base.mean - base.ci95 <= r.mean + r.ci95;
+
+      const char* verdict = "";
+      if (change > threshold && !overlap) { /* (!) Slower, and not explained by the noise of either run */
+        verdict = "  REGRESSION";
+        ++regressions;
+      } else if (change < -threshold && !overlap) {
+        verdict = "  improvement";
+        ++improvements;
+      }
+
+      std::cout << std::left << std::setw(40) << r.name << std::right << std::setw(8) << r.threads << std::fixed << std::setprecision(2)
+                << std::setw(14) << base.mean << " -> " << std::setw(10) << r.mean << std::showpos << std::setw(10) << change << "%"
+                << std::noshowpos << verdict << std::endl;
+    }
+
+    std::cout << regressions << " regressions, " << improvements << " improvements" << std::endl;
+    return regressions == 0;
+  }
+
+  std::vector<Benchmark> m_benchmarks;
+};
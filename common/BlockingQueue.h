@@ -0,0 +1,115 @@
+/*
+* Common: blocking queue
+*
+* A mutex and condition variable protected queue, optionally bounded. push() blocks while the queue is
+* full and pop() while it is empty; both take a StopToken and give up as soon as a stop is requested,
+* which is how a consumer parked on an empty queue is told to shut down without a poison pill.
+*
+* close() is the other way to end a stream: pushes are refused from then on, and pop() returns false
+* once the remaining elements have been consumed.
+*/
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+#include "StopToken.h"
+
+template<typename T>
+class BlockingQueue
+{
+public:
+  explicit BlockingQueue(size_t capacity = 0 /* (!) 0: unbounded */)
+    : m_capacity(capacity)
+  {
+  }
+
+  BlockingQueue(BlockingQueue const&) = delete;
+  BlockingQueue& operator=(BlockingQueue const&) = delete;
+
+  /* (!) Returns false if the queue was closed or the stop was requested before there was room */
+  bool push(T value, StopToken const& token = StopToken())
+  {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+
+      if (!interruptibleWait(m_notFull, lock, token, [this] { return m_closed || !full(); }) || m_closed) {
+        return false;
+      }
+
+      m_items.push_back(std::move(value));
+    }
+
+    m_notEmpty.notify_one();
+    return true;
+  }
+
+  /* (!) Returns false if the queue is closed and drained, or the stop was requested while it was empty */
+  bool pop(T& value, StopToken const& token = StopToken())
+  {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+
+      if (!interruptibleWait(m_notEmpty, lock, token, [this] { return m_closed || !m_items.empty(); }) ||
+          m_items.empty()) {
+        return false;
+      }
+
+      value = std::move(m_items.front());
+      m_items.pop_front();
+    }
+
+    m_notFull.notify_one();
+    return true;
+  }
+
+  bool tryPop(T& value)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if (m_items.empty()) {
+        return false;
+      }
+
+      value = std::move(m_items.front());
+      m_items.pop_front();
+    }
+
+    m_notFull.notify_one();
+    return true;
+  }
+
+  void close()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_closed = true;
+    }
+
+    m_notEmpty.notify_all();
+    m_notFull.notify_all();
+  }
+
+  size_t size() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_items.size();
+  }
+
+private:
+  bool full() const
+  {
+    return m_capacity != 0 && m_items.size() >= m_capacity;
+  }
+
+  const size_t m_capacity;
+  mutable std::mutex m_mutex;
+  std::condition_variable m_notEmpty;
+  std::condition_variable m_notFull;
+  std::deque<T> m_items;
+  bool m_closed = false;
+};
@@ -0,0 +1,318 @@
+/*
+* Common: containers
+*
+* ThreadSafeLinkedList (S2t02), ThreadSafeStack (s2t09) and WrapperData (s2t03) are what most of session
+* 3 measures itself against. Session 2 keeps them as they were written there; these are the versions
+* that session 3 grew out of them, in one place, so that every example and bench/bench.cpp measure the
+* same code under the same name:
+*
+*   - the lock is a parameter: std::mutex by default, TracedMutex (common/Trace.h) to see its waits in a
+*     trace, or one of the locks of common/QueueLocks.h
+*   - the nodes come from PoolAllocator (common/PoolAllocator.h) unless another allocator is given, and
+*     are made before locking: the lock only covers a splice
+*   - the stack's top is the front of its list. Besides push() and the two pop()s it has try_pop(), for
+*     consumers that find it empty now and then, and bulk operations that take the lock once per batch:
+*     push_range(), try_pop_n() and pop_all(), spelled as on LockFreeStack (common/LockFreeStack.h)
+*   - add() and push() count themselves and time themselves, lock wait included, into metrics that are
+*     shared by all the containers of a type (common/Metrics.h, compiled away unless CONCURRENCY_METRICS=1)
+*
+* CombiningStack and CombiningWrapperData do the same on FlatCombining (common/FlatCombining.h); the
+* stack has the same try_pop(), push_range() and try_pop_n().
+*/
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <initializer_list>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "FlatCombining.h"
+#include "Metrics.h"
+#include "PoolAllocator.h"
+
+template<typename Mutex = std::mutex, typename Allocator = PoolAllocator<int>>
+class ThreadSafeLinkedList
+{
+public:
+  using List = std::list<int, Allocator>;
+
+  void add(int value)
+  {
+    metrics::ScopedTimer timer(addLatency);
+    adds.increment();
+
+    List node(1, value); /* (!) Allocated before locking, so only linking the node in is inside the lock */
+
+    std::lock_guard<Mutex> guard(myMutex);
+    myList.splice(myList.end(), node);
+  }
+
+  bool contains(int value)
+  {
+    std::lock_guard<Mutex> guard(myMutex);
+    return std::find(myList.begin(), myList.end(), value) != myList.end();
+  }
+
+  size_t size()
+  {
+    std::lock_guard<Mutex> guard(myMutex);
+    return myList.size();
+  }
+
+  static inline metrics::Counter adds;
+  static inline metrics::Histogram addLatency;
+
+private:
+  List myList;
+  Mutex myMutex;
+};
+
+struct empty_stack : std::exception
+{
+  const char* what() const throw() override
+  {
+    return "empty stack";
+  }
+};
+
+template<typename T, typename Mutex = std::mutex, typename Allocator = PoolAllocator<T>>
+class ThreadSafeStack
+{
+public:
+  using List = std::list<T, Allocator>; /* (!) The top is the front. Unlike std::stack's deque, nodes can be made outside the lock */
+
+  ThreadSafeStack()
+  {
+  }
+
+  ThreadSafeStack(const ThreadSafeStack& other)
+  {
+    std::lock_guard<Mutex> lock(other.m);
+    data = other.data;
+  }
+
+  ThreadSafeStack& operator=(const ThreadSafeStack&) = delete;
+
+  void push(T new_value)
+  {
+    metrics::ScopedTimer timer(pushLatency);
+    pushes.increment();
+
+    List node(1, std::move(new_value)); /* (!) Allocated before locking: the lock only covers the splice */
+
+    std::lock_guard<Mutex> lock(m);
+    data.splice(data.begin(), node);
+  }
+
+  /* (!) As many pushes in a row, the last on top, under one lock */
+  template<typename InputIt>
+  void push_range(InputIt first, InputIt last)
+  {
+    metrics::ScopedTimer timer(pushLatency);
+
+    List chain(first, last); /* (!) All the nodes made before locking */
+    chain.reverse();
+    pushes.add(chain.size());
+
+    std::lock_guard<Mutex> lock(m);
+    data.splice(data.begin(), chain); /* (!) O(1): relinks the ends of the chain */
+  }
+
+  void push(std::initializer_list<T> values)
+  {
+    push_range(values.begin(), values.end());
+  }
+
+  std::shared_ptr<T> pop()
+  {
+    std::lock_guard<Mutex> lock(m);
+
+    if (data.empty()) {
+      throw empty_stack();
+    }
+
+    const std::shared_ptr<T> ret(std::make_shared<T>(data.front())); /* (!) Allocate return value before modifying the stack */
+    data.pop_front();
+
+    return ret;
+  }
+
+  void pop(T& value)
+  {
+    std::lock_guard<Mutex> lock(m);
+
+    if (data.empty()) {
+      throw empty_stack();
+    }
+
+    value = data.front();
+    data.pop_front();
+  }
+
+  /* (!) pop(T&) without the exception, for consumers that may find the stack empty */
+  bool try_pop(T& value)
+  {
+    std::lock_guard<Mutex> lock(m);
+
+    if (data.empty()) {
+      return false;
+    }
+
+    value = data.front();
+    data.pop_front();
+    return true;
+  }
+
+  /* (!) Up to n values, top first; returns how many. The lock only covers walking to the nth node and unlinking */
+  template<typename OutputIt>
+  size_t try_pop_n(OutputIt out, size_t n)
+  {
+    List taken;
+    {
+      std::lock_guard<Mutex> lock(m);
+      const size_t count = std::min(n, data.size());
+      taken.splice(taken.begin(), data, data.begin(), std::next(data.begin(), count));
+    }
+
+    std::move(taken.begin(), taken.end(), out); /* (!) Copied out after unlocking, and the nodes freed */
+    return taken.size();
+  }
+
+  /* (!) Everything, top first; returns how many. O(1) under the lock: the stack's list is swapped with an empty one */
+  template<typename OutputIt>
+  size_t pop_all(OutputIt out)
+  {
+    List all;
+    {
+      std::lock_guard<Mutex> lock(m);
+      all.swap(data);
+    }
+
+    std::move(all.begin(), all.end(), out);
+    return all.size();
+  }
+
+  bool empty() const
+  {
+    std::lock_guard<Mutex> lock(m);
+    return data.empty();
+  }
+
+  static inline metrics::Counter pushes; /* (!) Shared by all the stacks of a type, no cost per instance */
+  static inline metrics::Histogram pushLatency;
+
+private:
+  List data;
+  mutable Mutex m;
+};
+
+/* (!) s2t03's Data, doing some work on every call and counting the calls */
+struct Data
+{
+  uint64_t calls = 0;
+  uint64_t checksum = 0;
+  std::string log = std::string(256, ' ');
+
+  void doSomething(uint64_t value)
+  {
+    ++calls;
+    checksum = checksum * 31 + value;
+    log[calls % log.size()] = static_cast<char>('a' + value % 26);
+  }
+};
+
+template<typename Mutex = std::mutex>
+class WrapperData
+{
+public:
+  template<typename Function>
+  void processData(Function func)
+  {
+    std::lock_guard<Mutex> l(m);
+    func(data); /* (!) As in s2t03, the reference must not escape func */
+  }
+
+  uint64_t calls()
+  {
+    std::lock_guard<Mutex> l(m);
+    return data.calls;
+  }
+
+private:
+  Data data;
+  Mutex m;
+};
+
+class CombiningStack
+{
+public:
+  void push(int value)
+  {
+    m_stack.apply([value](std::vector<int>& stack) { stack.push_back(value); });
+  }
+
+  bool try_pop(int& value)
+  {
+    return m_stack.apply([&value](std::vector<int>& stack) {
+      if (stack.empty()) {
+        return false;
+      }
+      value = stack.back(); /* (!) Written by the combiner: the result is handed back like a return value */
+      stack.pop_back();
+      return true;
+    });
+  }
+
+  template<typename InputIt>
+  void push_range(InputIt first, InputIt last)
+  {
+    m_stack.apply([=](std::vector<int>& stack) { stack.insert(stack.end(), first, last); });
+  }
+
+  /* (!) Up to n values in one operation, top first: the combiner pops them all while it holds the data */
+  template<typename OutputIt>
+  size_t try_pop_n(OutputIt out, size_t n)
+  {
+    return m_stack.apply([=](std::vector<int>& stack) mutable {
+      size_t popped = 0;
+      for (; popped < n && !stack.empty(); ++popped) {
+        *out++ = stack.back();
+        stack.pop_back();
+      }
+      return popped;
+    });
+  }
+
+  FlatCombining<std::vector<int>> const& combining() const
+  {
+    return m_stack;
+  }
+
+private:
+  FlatCombining<std::vector<int>> m_stack;
+};
+
+class CombiningWrapperData
+{
+public:
+  template<typename Function>
+  void processData(Function func)
+  {
+    data.apply(func);
+  }
+
+  uint64_t calls()
+  {
+    return data.apply([](Data& d) { return d.calls; });
+  }
+
+private:
+  FlatCombining<Data> data;
+};
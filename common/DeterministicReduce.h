@@ -0,0 +1,272 @@
+/*
+* Common: deterministic reduction
+*
+* accumulateParallel (s1t15, common/ParallelReduce.h) cuts the range into one block per thread, so the
+* order in which floating-point numbers are added depends on the number of threads, and the sum changes
+* in its last bits from one machine to the next. sumDeterministic() fixes the order instead:
+*
+*   - the range is cut into leaves of LeafSize elements, whatever the number of threads; the threads
+*     only decide who computes which leaves
+*   - each leaf is summed from left to right, and the leaf sums are combined in a fixed binary tree
+*     (leaf 0 with 1, 2 with 3, then the pairs, and so on)
+*
+* so the result is the same, bit for bit, on any number of cores. How each leaf sums and how two sums
+* combine is the Summation:
+*
+*   - Plain: doubles, as accumulate would; only the order is fixed
+*   - Compensated: Neumaier's variant of Kahan summation, which carries the rounding error of every
+*     addition along; about twice the work, and error independent of the number of elements
+*   - Exact: an exact fixed-point accumulator spanning the whole double range (ExactSum), rounded once
+*     at the end; the result is the correctly rounded sum, which is the same for any order at all. Each
+*     addition touches three limbs, so it is several times slower than Plain
+*
+* The accumulators are usable on their own: add() a value, merge() another accumulator, result().
+*/
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <type_traits>
+#include <vector>
+
+#include "ParallelBlocks.h"
+#include "ThreadPool.h"
+
+enum class Summation
+{
+  Plain,
+  Compensated,
+  Exact
+};
+
+class PlainSum
+{
+public:
+  void add(double x)
+  {
+    m_sum += x;
+  }
+
+  void merge(PlainSum const& other)
+  {
+    m_sum += other.m_sum;
+  }
+
+  double result() const
+  {
+    return m_sum;
+  }
+
+private:
+  double m_sum = 0;
+};
+
+class NeumaierSum
+{
+public:
+  void add(double x)
+  {
+    const double t = m_sum + x;
+    if (std::fabs(m_sum) >= std::fabs(x)) {
+      m_compensation += (m_sum - t) + x; /* (!) The low bits of x lost in t */
+    } else {
+      m_compensation += (x - t) + m_sum;
+    }
+    m_sum = t;
+  }
+
+  void merge(NeumaierSum const& other)
+  {
+    add(other.m_sum);
+    m_compensation += other.m_compensation;
+  }
+
+  double result() const
+  {
+    return m_sum + m_compensation;
+  }
+
+private:
+  double m_sum = 0;
+  double m_compensation = 0;
+};
+
+/* (!) Every finite double is an integer multiple of 2^-1074: the sum is kept as such an integer, in 32-bit limbs */
+class ExactSum
+{
+public:
+  static constexpr int MinExponent = -1074;
+  static constexpr size_t Limbs = 68; /* (!) 2176 bits: the largest double is below 2^1024, leaving 2^60 of headroom */
+
+  ExactSum()
+    : m_limbs(Limbs, 0)
+  {
+  }
+
+  void add(double x)
+  {
+    uint64_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    const unsigned biased = static_cast<unsigned>(bits >> 52) & 0x7FF;
+    if (biased == 0x7FF) {
+      m_special += x; /* (!) Infinities and NaN can't be counted in limbs; they decide the result anyway */
+      return;
+    }
+
+    /* (!) x = magnitude * 2^(shift + MinExponent): subnormals have no hidden bit, and the exponent of the smallest normals */
+    const uint64_t fraction = bits & ((uint64_t(1) << 52) - 1);
+    const uint64_t magnitude = biased == 0 ? fraction : fraction | uint64_t(1) << 52;
+    if (magnitude == 0) {
+      return;
+    }
+    const unsigned shift = biased == 0 ? 0 : biased - 1;
+
+    const size_t limb = shift / 32;
+    const unsigned offset = shift % 32;
+    const uint64_t low = (magnitude << offset) & Mask;
+    const uint64_t rest = offset == 0 ? magnitude >> 32 : magnitude >> (32 - offset);
+
+    const int64_t sign = bits >> 63 ? -1 : 1;
+    m_limbs[limb] += sign * static_cast<int64_t>(low);
+    m_limbs[limb + 1] += sign * static_cast<int64_t>(rest & Mask);
+    m_limbs[limb + 2] += sign * static_cast<int64_t>(rest >> 32);
+
+    if (++m_pending == NormalizeEvery) {
+      normalize();
+    }
+  }
+
+  void merge(ExactSum const& other)
+  {
+    for (size_t i = 0; i < Limbs; ++i) {
+      m_limbs[i] += other.m_limbs[i];
+    }
+    m_special += other.m_special;
+    normalize();
+  }
+
+  /* (!) Rounded to nearest, ties to even; below the normal range the rounding happens twice */
+  double result() const
+  {
+    if (m_special != 0 || std::isnan(m_special)) {
+      return m_special;
+    }
+
+    std::vector<int64_t> limbs(m_limbs);
+    carry(limbs);
+    const bool negative = limbs[Limbs - 1] < 0;
+    if (negative) {
+      for (auto&& l : limbs) {
+        l = -l;
+      }
+      carry(limbs);
+    }
+
+    size_t top = Limbs;
+    while (top > 0 && limbs[top - 1] == 0) {
+      --top;
+    }
+    if (top == 0) {
+      return 0;
+    }
+    const size_t k = top - 1;
+
+    auto limb = [&](size_t i) { return i <= k ? static_cast<uint64_t>(limbs[k - i]) : uint64_t(0); };
+    unsigned bits = 0;
+    while (bits < 32 && (limb(0) >> bits) != 0) {
+      ++bits;
+    }
+
+    /* (!) The 64 most significant bits, and whether anything below them is set */
+    const uint64_t head = (limb(0) << (64 - bits)) | (limb(1) << (32 - bits)) | (bits == 32 ? 0 : limb(2) >> bits);
+    bool sticky = (limb(2) & ((uint64_t(1) << bits) - 1)) != 0;
+    for (size_t i = 0; i + 3 <= k && !sticky; ++i) {
+      sticky = limbs[i] != 0;
+    }
+
+    uint64_t mantissa = head >> 11;
+    const uint64_t rest = head & 0x7FF;
+    if (rest > 0x400 || (rest == 0x400 && (sticky || (mantissa & 1)))) {
+      ++mantissa;
+    }
+    const int exponent = static_cast<int>(32 * k) + static_cast<int>(bits) - 64 + 11 + MinExponent;
+
+    const double magnitude = std::ldexp(static_cast<double>(mantissa), exponent); /* (!) 2^53 after rounding up is still exact */
+    return negative ? -magnitude : magnitude;
+  }
+
+private:
+  static constexpr uint64_t Mask = 0xFFFFFFFF;
+  static constexpr unsigned NormalizeEvery = 1 << 20; /* (!) Adds of less than 2^32 each: far from overflowing a limb */
+
+  /* (!) Brings every limb but the top one into [0, 2^32); the top one keeps the sign */
+  static void carry(std::vector<int64_t>& limbs)
+  {
+    for (size_t i = 0; i + 1 < Limbs; ++i) {
+      const int64_t c = limbs[i] >> 32; /* (!) Arithmetic shift: rounds towards minus infinity */
+      limbs[i] -= c * (int64_t(1) << 32);
+      limbs[i + 1] += c;
+    }
+  }
+
+  void normalize()
+  {
+    carry(m_limbs);
+    m_pending = 0;
+  }
+
+  std::vector<int64_t> m_limbs;
+  unsigned m_pending = 0;
+  double m_special = 0;
+};
+
+namespace detail
+{
+  constexpr size_t LeafSize = 4096;
+
+  template<typename Accumulator, typename Iterator>
+  double sumTree(ThreadPool& pool, Iterator first, Iterator last)
+  {
+    const size_t length = static_cast<size_t>(last - first);
+    if (length == 0) {
+      return 0;
+    }
+
+    const size_t leaves = (length + LeafSize - 1) / LeafSize;
+    std::vector<Accumulator> sums(leaves);
+
+    const size_t blocks = parallelBlocks(leaves, 1, pool.threads());
+    forBlocks(pool, blocks, [&](size_t b) {
+      for (size_t leaf = leaves * b / blocks; leaf < leaves * (b + 1) / blocks; ++leaf) { /* (!) Which thread sums a leaf doesn't matter */
+        Iterator it = first + leaf * LeafSize;
+        const Iterator end = leaf + 1 < leaves ? it + LeafSize : last;
+        for (; it != end; ++it) {
+          sums[leaf].add(static_cast<double>(*it));
+        }
+      }
+    });
+
+    for (size_t width = 1; width < leaves; width *= 2) { /* (!) The fixed tree: only the number of leaves shapes it */
+      for (size_t i = 0; i + width < leaves; i += 2 * width) {
+        sums[i].merge(sums[i + width]);
+      }
+    }
+    return sums[0].result();
+  }
+}
+
+template<typename Iterator>
+double sumDeterministic(ThreadPool& pool, Iterator first, Iterator last, Summation summation = Summation::Compensated)
+{
+  using Category = typename std::iterator_traits<Iterator>::iterator_category;
+  static_assert(std::is_base_of<std::random_access_iterator_tag, Category>::value, "The leaves are found by position");
+
+  switch (summation) {
+    case Summation::Plain: return detail::sumTree<PlainSum>(pool, first, last);
+    case Summation::Exact: return detail::sumTree<ExactSum>(pool, first, last);
+    default: return detail::sumTree<NeumaierSum>(pool, first, last);
+  }
+}
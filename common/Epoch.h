@@ -0,0 +1,203 @@
+/*
+* Common: epoch based reclamation
+*
+* A lock-free structure can unlink an object while another thread is still reading it, so the object
+* can't be deleted on the spot. Epoch based reclamation delays the delete until every thread that might
+* have seen the object has moved on:
+*
+*   - a thread reads shared pointers only inside an EpochGuard, which announces the global epoch it
+*     entered in (in a per-thread slot, indexed by the ThreadRegistry index)
+*   - an unlinked object is retire()d: queued together with the global epoch of the moment
+*   - the global epoch only advances when every thread inside a guard has announced the current one,
+*     so once it is two ahead of an object's epoch, nobody can still hold that object
+*
+* Guards cost two stores and a fence; they nest. A thread that stays inside a guard holds back all
+* reclamation, so guards should be short. Each thread frees its own retired objects, every so many
+* retire() calls or on collect(); whatever is left at exit is freed with the Epoch instance.
+*
+* The threads beyond ThreadRegistry's limit share its Overflow slot under a mutex. Their guards count
+* as one that lasts while any of them is inside, announced by the first to enter: safe, since an older
+* announcement only holds back more, but overlapping overflow threads delay reclamation.
+*/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "ThreadRegistry.h"
+
+class Epoch
+{
+public:
+  static constexpr unsigned CollectEvery = 128; /* (!) retire() calls between two reclamation attempts of a thread */
+
+  static Epoch& instance()
+  {
+    static Epoch epoch;
+    return epoch;
+  }
+
+  Epoch(Epoch const&) = delete;
+  Epoch& operator=(Epoch const&) = delete;
+
+  ~Epoch()
+  {
+    for (unsigned i = 0; i < ThreadRegistry::MaxThreads; ++i) {
+      for (auto&& r : m_slots[i].retired) {
+        r.deleter(r.object);
+      }
+    }
+  }
+
+  void enter()
+  {
+    Slot& slot = current();
+    auto lock = overflowLock(slot);
+    if (slot.nesting++ == 0) {
+      slot.announced.store(m_epoch.load(), std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst); /* (!) Announced before any shared pointer is read */
+    }
+  }
+
+  void exit()
+  {
+    Slot& slot = current();
+    auto lock = overflowLock(slot);
+    if (--slot.nesting == 0) {
+      slot.announced.store(Quiescent, std::memory_order_release);
+    }
+  }
+
+  /* (!) object must already be unreachable for threads that enter a guard from now on */
+  template<typename T>
+  void retire(T* object)
+  {
+    retire(object, [](void* p) { delete static_cast<T*>(p); });
+  }
+
+  void retire(void* object, void (*deleter)(void*))
+  {
+    Slot& slot = current();
+    bool due;
+    {
+      auto lock = overflowLock(slot);
+      slot.retired.push_back(Retired{ object, deleter, m_epoch.load() });
+      due = ++slot.sinceCollect >= CollectEvery;
+    }
+    if (due) {
+      collect();
+    }
+  }
+
+  /* (!) Tries to advance the epoch, then frees what the calling thread retired two epochs ago or earlier */
+  void collect()
+  {
+    Slot& slot = current();
+    auto lock = overflowLock(slot);
+    slot.sinceCollect = 0;
+    tryAdvance();
+
+    const uint64_t safe = m_epoch.load();
+    size_t freed = 0;
+    while (freed < slot.retired.size() && slot.retired[freed].epoch + 2 <= safe) { /* (!) Retired in epoch order */
+      slot.retired[freed].deleter(slot.retired[freed].object);
+      ++freed;
+    }
+    slot.retired.erase(slot.retired.begin(), slot.retired.begin() + freed);
+  }
+
+  uint64_t epoch() const
+  {
+    return m_epoch.load();
+  }
+
+  /* (!) Objects the calling thread retired that are not freed yet */
+  size_t pending()
+  {
+    Slot& slot = current();
+    auto lock = overflowLock(slot);
+    return slot.retired.size();
+  }
+
+private:
+  static constexpr uint64_t Quiescent = 0;
+
+  struct Retired
+  {
+    void* object;
+    void (*deleter)(void*);
+    uint64_t epoch;
+  };
+
+  struct alignas(64) Slot
+  {
+    std::atomic<uint64_t> announced{ Quiescent };
+    unsigned nesting = 0;        /* (!) The rest is only used by the thread of this index, or under m_overflow */
+    unsigned sinceCollect = 0;
+    std::vector<Retired> retired; /* (!) Left to the next thread of the index when this one exits */
+  };
+
+  Epoch()
+    : m_slots(new Slot[ThreadRegistry::MaxThreads])
+  {
+  }
+
+  Slot& current()
+  {
+    const unsigned index = ThreadRegistry::index();
+
+    unsigned used = m_used.load(std::memory_order_relaxed);
+    while (used <= index && !m_used.compare_exchange_weak(used, index + 1)) {
+    }
+    return m_slots[index];
+  }
+
+  /* (!) Only the Overflow slot is shared between threads */
+  std::unique_lock<std::mutex> overflowLock(Slot& slot)
+  {
+    if (&slot != &m_slots[ThreadRegistry::Overflow]) {
+      return {};
+    }
+    return std::unique_lock<std::mutex>(m_overflow);
+  }
+
+  bool tryAdvance()
+  {
+    uint64_t epoch = m_epoch.load();
+    const unsigned used = m_used.load();
+
+    for (unsigned i = 0; i < used; ++i) {
+      const uint64_t announced = m_slots[i].announced.load();
+      if (announced != Quiescent && announced != epoch) {
+        return false; /* (!) Someone may still hold objects of the previous epoch */
+      }
+    }
+    return m_epoch.compare_exchange_strong(epoch, epoch + 1);
+  }
+
+  std::atomic<uint64_t> m_epoch{ 1 };
+  std::atomic<unsigned> m_used{ 0 }; /* (!) Slots [0, m_used) have been used; the others needn't be scanned */
+  std::unique_ptr<Slot[]> m_slots;
+  std::mutex m_overflow;
+};
+
+class EpochGuard
+{
+public:
+  EpochGuard()
+  {
+    Epoch::instance().enter();
+  }
+
+  ~EpochGuard()
+  {
+    Epoch::instance().exit();
+  }
+
+  EpochGuard(EpochGuard const&) = delete;
+  EpochGuard& operator=(EpochGuard const&) = delete;
+};
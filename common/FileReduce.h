@@ -0,0 +1,325 @@
+/*
+* Common: file reduction
+*
+* accumulateParallel (s1t15, common/ParallelReduce.h) reduces a container, so a file of numbers has to be
+* read into a std::vector first: the whole file is copied once before any thread starts adding, and the
+* vector must fit in memory. accumulateFile<Element>() reduces the file itself, a flat array of Element
+* in native byte order, in one of two ways:
+*
+*   - FileAccess::Map: the file is memory-mapped, with sequential and huge page hints. The workers take
+*     chunks of 4MB in order (an atomic counter hands them out) and, before reducing one, ask the
+*     kernel to read ahead the chunk they are likely to take next, so that the page faults of one chunk
+*     overlap the additions of the others
+*   - FileAccess::Read: the calling thread reads the file with large preads into page-aligned buffers,
+*     and a worker reduces each buffer while the next ones are being read. This suits files that can't
+*     be mapped (pipes excepted: the file must be seekable) and systems where faulting in a mapping costs
+*     more than a copy
+*
+* Neither needs more memory than a few chunks per worker, so the file may be larger than RAM. op must be
+* associative, as for accumulateParallel: the chunks are reduced separately, from their first element,
+* and combined in file order. A file whose size isn't a whole number of elements is rejected, as are
+* errors of the operating system, with a std::runtime_error.
+*/
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <new>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "ParallelBlocks.h"
+#include "ParallelReduce.h"
+#include "ThreadPool.h"
+
+enum class FileAccess
+{
+  Map,
+  Read
+};
+
+/* (!) A read-only file, mapped on demand. Closes and unmaps on destruction */
+class InputFile
+{
+public:
+  static constexpr size_t PageSize = 4096;
+
+  explicit InputFile(std::string const& path)
+  {
+#if defined(_WIN32)
+    m_file = ::CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE) {
+      fail("Can't open " + path);
+    }
+    LARGE_INTEGER size;
+    if (!::GetFileSizeEx(m_file, &size)) {
+      ::CloseHandle(m_file);
+      fail("Can't get the size of " + path);
+    }
+    m_size = static_cast<size_t>(size.QuadPart);
+#else
+    m_file = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (m_file < 0) {
+      fail("Can't open " + path);
+    }
+    struct stat status;
+    if (::fstat(m_file, &status) != 0) {
+      const int error = errno;
+      ::close(m_file);
+      errno = error;
+      fail("Can't get the size of " + path);
+    }
+    m_size = static_cast<size_t>(status.st_size);
+    ::posix_fadvise(m_file, 0, 0, POSIX_FADV_SEQUENTIAL); /* (!) A larger readahead window for read() */
+#endif
+  }
+
+  ~InputFile()
+  {
+#if defined(_WIN32)
+    if (m_view != nullptr) {
+      ::UnmapViewOfFile(m_view);
+      ::CloseHandle(m_mapping);
+    }
+    ::CloseHandle(m_file);
+#else
+    if (m_view != nullptr) {
+      ::munmap(m_view, m_size);
+    }
+    ::close(m_file);
+#endif
+  }
+
+  InputFile(InputFile const&) = delete;
+  InputFile& operator=(InputFile const&) = delete;
+
+  size_t size() const
+  {
+    return m_size;
+  }
+
+  /* (!) The whole file, mapped read-only. Not for an empty file */
+  char const* map()
+  {
+    if (m_view != nullptr) {
+      return m_view;
+    }
+
+#if defined(_WIN32)
+    m_mapping = ::CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_mapping == nullptr) {
+      fail("Can't map the file");
+    }
+    m_view = static_cast<char*>(::MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+    if (m_view == nullptr) {
+      ::CloseHandle(m_mapping);
+      fail("Can't map the file");
+    }
+#else
+    void* view = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_file, 0);
+    if (view == MAP_FAILED) {
+      fail("Can't map the file");
+    }
+    m_view = static_cast<char*>(view);
+    ::madvise(m_view, m_size, MADV_SEQUENTIAL); /* (!) Hints: failures don't matter */
+#if defined(MADV_HUGEPAGE)
+    ::madvise(m_view, m_size, MADV_HUGEPAGE); /* (!) Only honoured where the page cache has huge pages */
+#endif
+#endif
+    return m_view;
+  }
+
+  /* (!) Asks for [offset, offset + length) of the mapping to be read in the background */
+  void prefetch(size_t offset, size_t length) const
+  {
+    if (m_view == nullptr || offset >= m_size) {
+      return;
+    }
+    length = std::min(length, m_size - offset);
+    const size_t start = offset / PageSize * PageSize;
+#if defined(_WIN32)
+    WIN32_MEMORY_RANGE_ENTRY range{ m_view + start, length + (offset - start) };
+    ::PrefetchVirtualMemory(::GetCurrentProcess(), 1, &range, 0);
+#else
+    ::madvise(m_view + start, length + (offset - start), MADV_WILLNEED);
+#endif
+  }
+
+  /* (!) Reads length bytes at offset, fewer only at the end of the file. Returns the number read */
+  size_t read(size_t offset, char* buffer, size_t length) const
+  {
+    size_t done = 0;
+    while (done < length) {
+#if defined(_WIN32)
+      OVERLAPPED position{};
+      position.Offset = static_cast<DWORD>(offset + done);
+      position.OffsetHigh = static_cast<DWORD>(static_cast<uint64_t>(offset + done) >> 32);
+      DWORD n = 0;
+      const DWORD request = static_cast<DWORD>(std::min<size_t>(length - done, 1u << 30));
+      if (!::ReadFile(m_file, buffer + done, request, &n, &position) && ::GetLastError() != ERROR_HANDLE_EOF) {
+        fail("Can't read the file");
+      }
+#else
+      const ssize_t n = ::pread(m_file, buffer + done, length - done, static_cast<off_t>(offset + done));
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        fail("Can't read the file");
+      }
+#endif
+      if (n == 0) {
+        break; /* (!) End of file */
+      }
+      done += static_cast<size_t>(n);
+    }
+    return done;
+  }
+
+  /* (!) Drops the file's pages from the page cache, so that the next pass reads from the disk (Linux only) */
+  void evict() const
+  {
+#if !defined(_WIN32)
+    ::posix_fadvise(m_file, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+  }
+
+private:
+  [[noreturn]] static void fail(std::string const& what)
+  {
+#if defined(_WIN32)
+    throw std::system_error(static_cast<int>(::GetLastError()), std::system_category(), what);
+#else
+    throw std::system_error(errno, std::generic_category(), what);
+#endif
+  }
+
+#if defined(_WIN32)
+  HANDLE m_file = INVALID_HANDLE_VALUE;
+  HANDLE m_mapping = nullptr;
+#else
+  int m_file = -1;
+#endif
+  size_t m_size = 0;
+  char* m_view = nullptr;
+};
+
+namespace detail
+{
+  constexpr size_t FileChunkBytes = 4 << 20; /* (!) 1024 pages: long sequential reads, and still many chunks per worker */
+  constexpr size_t ReadAheadChunks = 2;      /* (!) Buffers per worker in FileAccess::Read */
+
+  struct AlignedDelete
+  {
+    void operator()(char* p) const
+    {
+      ::operator delete[](p, std::align_val_t(InputFile::PageSize));
+    }
+  };
+
+  using AlignedBuffer = std::unique_ptr<char[], AlignedDelete>;
+
+  inline AlignedBuffer alignedBuffer(size_t bytes)
+  {
+    return AlignedBuffer(static_cast<char*>(::operator new[](bytes, std::align_val_t(InputFile::PageSize))));
+  }
+}
+
+template<typename Element, typename T, typename BinaryOperation = std::plus<>>
+T accumulateFile(ThreadPool& pool, std::string const& path, T init, BinaryOperation op = BinaryOperation(),
+                 FileAccess access = FileAccess::Map)
+{
+  static_assert(std::is_trivially_copyable<Element>::value, "The file holds the bytes of Elements");
+
+  InputFile file(path);
+  if (file.size() % sizeof(Element) != 0) {
+    throw std::runtime_error(path + " is not a whole number of elements");
+  }
+  if (file.size() == 0) {
+    return init;
+  }
+
+  const size_t perChunk = std::max<size_t>(1, detail::FileChunkBytes / sizeof(Element));
+  const size_t elements = file.size() / sizeof(Element);
+  const size_t chunks = (elements + perChunk - 1) / perChunk;
+  std::vector<T> results(chunks);
+
+  auto reduce = [&](Element const* first, size_t chunk) {
+    const size_t count = std::min(perChunk, elements - chunk * perChunk);
+    results[chunk] = detail::reduceChunk<T>(first, count, op);
+  };
+
+  if (access == FileAccess::Map) {
+    Element const* data = reinterpret_cast<Element const*>(file.map()); /* (!) Page aligned, so aligned for Element */
+    const size_t workers = std::min<size_t>(chunks, pool.threads() + 1);
+    std::atomic<size_t> next{ 0 };
+
+    detail::forBlocks(pool, workers, [&](size_t) {
+      for (size_t chunk = next++; chunk < chunks; chunk = next++) {
+        file.prefetch((chunk + workers) * perChunk * sizeof(Element), perChunk * sizeof(Element)); /* (!) Our likely next chunk */
+        reduce(data + chunk * perChunk, chunk);
+      }
+    });
+  } else {
+    const size_t depth = (pool.threads() + 1) * detail::ReadAheadChunks;
+    std::vector<detail::AlignedBuffer> buffers;
+    std::vector<std::future<void>> pending(depth);
+    std::exception_ptr error;
+
+    try {
+      for (size_t chunk = 0; chunk < chunks; ++chunk) {
+        const size_t slot = chunk % depth;
+        if (pending[slot].valid()) {
+          pending[slot].get(); /* (!) The buffer is free again once its chunk is reduced */
+        } else {
+          buffers.push_back(detail::alignedBuffer(perChunk * sizeof(Element)));
+        }
+
+        char* buffer = buffers[slot].get();
+        const size_t bytes = std::min(perChunk, elements - chunk * perChunk) * sizeof(Element);
+        if (file.read(chunk * perChunk * sizeof(Element), buffer, bytes) != bytes) {
+          throw std::runtime_error(path + " got shorter while it was read");
+        }
+        pending[slot] = pool.submit([&reduce, buffer, chunk] { reduce(reinterpret_cast<Element const*>(buffer), chunk); });
+      }
+    } catch (...) {
+      error = std::current_exception();
+    }
+
+    for (auto&& f : pending) {
+      if (f.valid()) {
+        f.wait(); /* (!) The tasks use the buffers and results */
+      }
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    for (auto&& f : pending) {
+      if (f.valid()) {
+        f.get();
+      }
+    }
+  }
+
+  return std::accumulate(results.begin(), results.end(), init, op);
+}
@@ -0,0 +1,190 @@
+/*
+* Common: flat combining
+*
+* ThreadSafeStack (s2t09) and WrapperData::processData (s2t03) lock a mutex around every operation. With
+* many threads, each operation moves the mutex's cache line and the protected data's lines to another
+* core and back, and that transfer costs more than the operation itself.
+*
+* FlatCombining<T> keeps the data next to a combiner lock and a publication record per thread (indexed
+* by the ThreadRegistry index). apply(f) publishes f in the calling thread's record and then either:
+*
+*   - finds the lock free, takes it and becomes the combiner: it runs every published operation in one
+*     pass over the records, while the data stays in its cache, and marks each one done
+*   - or waits (on the lock's Futex) until a combiner has run its operation for it
+*
+* A thread's operation therefore runs on whichever thread happened to combine: it must not depend on
+* thread-local state, and the results it returns or throws are handed back to the thread that applied
+* it. As with processData, the reference to T must not escape the function.
+*
+* The combiner sees all pending operations at once, so batched operations come naturally: a pop of n
+* elements is one apply() that pops n times (see s3t17).
+*
+* The threads beyond ThreadRegistry's limit share its Overflow record, so they can't publish: they
+* wait for the lock like a mutex and run their own operation before combining the others.
+*/
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "Futex.h"
+#include "ThreadRegistry.h"
+
+template<typename T>
+class FlatCombining
+{
+public:
+  static constexpr unsigned Passes = 3; /* (!) Passes over the records a combiner makes while it still finds operations */
+
+  template<typename... Args>
+  explicit FlatCombining(Args&&... args)
+    : m_data(std::forward<Args>(args)...)
+    , m_records(new Record[ThreadRegistry::MaxThreads])
+  {
+  }
+
+  FlatCombining(FlatCombining const&) = delete;
+  FlatCombining& operator=(FlatCombining const&) = delete;
+
+  /* (!) Runs f(T&) under the combiner lock, maybe on another thread, and returns its result */
+  template<typename Function>
+  auto apply(Function f) -> std::invoke_result_t<Function&, T&>
+  {
+    using Result = std::invoke_result_t<Function&, T&>;
+
+    Operation<Function, Result> operation(f);
+    Record& record = current();
+    const bool published = &record != &m_records[ThreadRegistry::Overflow];
+    if (published) {
+      record.operation.store(&operation, std::memory_order_release);
+    }
+
+    for (;;) {
+      if (operation.done.load(std::memory_order_acquire)) {
+        break;
+      }
+
+      uint32_t free = 0;
+      if (m_lock.load(std::memory_order_relaxed) == 0 && m_lock.compareExchange(free, 1)) {
+        if (!published) {
+          execute(&operation);
+        }
+        combine(); /* (!) Our own record included */
+        m_lock.store(0);
+        m_lock.notifyAll();
+        break;
+      }
+
+      m_lock.waitWhileEqual(1); /* (!) Wakes when the combiner is done, whether or not it saw us */
+    }
+
+    if (operation.error) {
+      std::rethrow_exception(operation.error);
+    }
+    if constexpr (!std::is_void_v<Result>) {
+      return std::move(*operation.result);
+    }
+  }
+
+  /* (!) Operations run by combiners, and the combining passes that found any */
+  uint64_t operations() const
+  {
+    return m_operations.load(std::memory_order_relaxed);
+  }
+
+  uint64_t combines() const
+  {
+    return m_combines.load(std::memory_order_relaxed);
+  }
+
+private:
+  struct OperationBase
+  {
+    void (*run)(OperationBase*, T&);
+    std::atomic<bool> done{ false };
+    std::exception_ptr error;
+  };
+
+  template<typename Function, typename Result>
+  struct Operation : OperationBase
+  {
+    explicit Operation(Function& f)
+      : function(f)
+    {
+      this->run = [](OperationBase* base, T& data) {
+        auto* self = static_cast<Operation*>(base);
+        if constexpr (std::is_void_v<Result>) {
+          self->function(data);
+        } else {
+          self->result.emplace(self->function(data));
+        }
+      };
+    }
+
+    Function& function;
+    std::optional<std::conditional_t<std::is_void_v<Result>, char, Result>> result;
+  };
+
+  struct alignas(64) Record
+  {
+    std::atomic<OperationBase*> operation{ nullptr };
+  };
+
+  Record& current()
+  {
+    const unsigned index = ThreadRegistry::index();
+
+    unsigned used = m_used.load(std::memory_order_relaxed);
+    while (used <= index && !m_used.compare_exchange_weak(used, index + 1)) {
+    }
+    return m_records[index];
+  }
+
+  void execute(OperationBase* operation)
+  {
+    try {
+      operation->run(operation, m_data);
+    } catch (...) {
+      operation->error = std::current_exception();
+    }
+    operation->done.store(true, std::memory_order_release); /* (!) Last touch: the owner may return and destroy it */
+  }
+
+  void combine()
+  {
+    uint64_t ran = 0;
+    for (unsigned pass = 0; pass < Passes; ++pass) {
+      const uint64_t before = ran;
+      const unsigned used = m_used.load();
+
+      for (unsigned i = 0; i < used; ++i) {
+        OperationBase* operation = m_records[i].operation.load(std::memory_order_acquire);
+        if (operation == nullptr) {
+          continue;
+        }
+
+        m_records[i].operation.store(nullptr, std::memory_order_relaxed); /* (!) Its owner waits, so nobody republishes meanwhile */
+        execute(operation);
+        ++ran;
+      }
+
+      if (ran == before) {
+        break;
+      }
+      m_combines.fetch_add(1, std::memory_order_relaxed);
+    }
+    m_operations.fetch_add(ran, std::memory_order_relaxed);
+  }
+
+  alignas(64) Futex m_lock; /* (!) 1 while a thread combines */
+  std::atomic<unsigned> m_used{ 0 };
+  alignas(64) T m_data;
+  std::unique_ptr<Record[]> m_records;
+  std::atomic<uint64_t> m_operations{ 0 };
+  std::atomic<uint64_t> m_combines{ 0 };
+};
@@ -0,0 +1,230 @@
+/*
+* Common: futex
+*
+* A condition variable needs a mutex, and both cost a system call or two even when nobody is waiting.
+* The barriers, latches and locks of session 3 only ever wait for one 32-bit word to change, which the
+* kernel supports directly: futex(FUTEX_WAIT) sleeps only if the word still holds the expected value, and
+* futex(FUTEX_WAKE) wakes the threads sleeping on it. Windows has the same pair as WaitOnAddress and
+* WakeByAddressAll.
+*
+* Futex wraps such a word. waitWhileEqual() spins for a short while first (a wait that ends within a
+* few hundred nanoseconds shouldn't pay for two context switches), yields a few times, then sleeps.
+* The waiters are counted, so notifyAll() and notifyOne() make no system call when nobody sleeps.
+* waitWhileEqualFor() sleeps at most for a given time, for waiters that must look at something else
+* now and then.
+*
+* A Futex constructed with Futex::ProcessShared may live in memory shared between processes
+* (common/SharedMemory.h): Linux then hashes the word by its physical page instead of by address.
+* WaitOnAddress only works within a process, so on Windows such a Futex naps for a millisecond instead.
+*
+* Elsewhere the sleep is a yield loop.
+*/
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#pragma comment(lib, "Synchronization.lib")
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+/* (!) Tells the core that this is a spin loop: on x86 it stops the other hyperthread from starving */
+inline void cpuRelax()
+{
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+  _mm_pause();
+#elif defined(__i386__) || defined(__x86_64__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#else
+  std::this_thread::yield();
+#endif
+}
+
+class Futex
+{
+public:
+  static constexpr unsigned Spins = 128;
+  static constexpr unsigned Yields = 4;
+
+  /* (!) On a single core nobody can change the value while we spin */
+  static unsigned defaultSpins()
+  {
+    static const unsigned spins = std::thread::hardware_concurrency() > 1 ? Spins : 0;
+    return spins;
+  }
+
+  struct ProcessShared
+  {
+  };
+
+  explicit Futex(uint32_t value = 0) noexcept
+    : m_value(value)
+  {
+  }
+
+  Futex(uint32_t value, ProcessShared) noexcept
+    : m_value(value)
+    , m_shared(true)
+  {
+  }
+
+  Futex(Futex const&) = delete;
+  Futex& operator=(Futex const&) = delete;
+
+  uint32_t load(std::memory_order order = std::memory_order_seq_cst) const noexcept
+  {
+    return m_value.load(order);
+  }
+
+  /* (!) The stores are seq_cst: notify() must not miss a waiter that registered before it looked */
+  void store(uint32_t value) noexcept
+  {
+    m_value.store(value);
+  }
+
+  uint32_t fetchAdd(uint32_t value) noexcept
+  {
+    return m_value.fetch_add(value);
+  }
+
+  bool compareExchange(uint32_t& expected, uint32_t desired) noexcept
+  {
+    return m_value.compare_exchange_strong(expected, desired);
+  }
+
+  uint32_t exchange(uint32_t value) noexcept
+  {
+    return m_value.exchange(value);
+  }
+
+  /* (!) Returns the new value, which is different from expected (acquire) */
+  uint32_t waitWhileEqual(uint32_t expected, unsigned spins = defaultSpins()) const noexcept
+  {
+    for (unsigned i = 0; i < spins; ++i) {
+      const uint32_t value = m_value.load(std::memory_order_acquire);
+      if (value != expected) {
+        return value;
+      }
+      cpuRelax();
+    }
+
+    for (unsigned i = 0; i < Yields; ++i) { /* (!) Then gives the core away, to whoever is to change the value if threads outnumber cores */
+      const uint32_t value = m_value.load(std::memory_order_acquire);
+      if (value != expected) {
+        return value;
+      }
+      std::this_thread::yield();
+    }
+
+    for (;;) {
+      const uint32_t value = m_value.load(std::memory_order_acquire);
+      if (value != expected) {
+        return value;
+      }
+
+      m_waiters.fetch_add(1);
+      sleep(expected); /* (!) Returns at once if the value is no longer expected */
+      m_waiters.fetch_sub(1);
+    }
+  }
+
+  /* (!) As waitWhileEqual, but gives up after about timeout: then returns expected */
+  uint32_t waitWhileEqualFor(uint32_t expected, std::chrono::milliseconds timeout, unsigned spins = defaultSpins()) const noexcept
+  {
+    for (unsigned i = 0; i < spins; ++i) {
+      const uint32_t value = m_value.load(std::memory_order_acquire);
+      if (value != expected) {
+        return value;
+      }
+      cpuRelax();
+    }
+
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    for (;;) {
+      const uint32_t value = m_value.load(std::memory_order_acquire);
+      const auto now = std::chrono::steady_clock::now();
+      if (value != expected || now >= deadline) {
+        return value;
+      }
+
+      m_waiters.fetch_add(1);
+      sleep(expected, std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now) + std::chrono::milliseconds(1));
+      m_waiters.fetch_sub(1);
+    }
+  }
+
+  void notifyAll() noexcept
+  {
+    if (m_waiters.load() != 0) {
+      wake(false);
+    }
+  }
+
+  void notifyOne() noexcept
+  {
+    if (m_waiters.load() != 0) {
+      wake(true);
+    }
+  }
+
+private:
+  /* (!) A negative timeout: no limit */
+  void sleep(uint32_t expected, std::chrono::milliseconds timeout = std::chrono::milliseconds(-1)) const noexcept
+  {
+#if defined(__linux__)
+    timespec limit{ static_cast<time_t>(timeout.count() / 1000), static_cast<long>(timeout.count() % 1000 * 1000000) };
+    ::syscall(SYS_futex, reinterpret_cast<uint32_t const*>(&m_value), m_shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE, expected,
+              timeout.count() < 0 ? nullptr : &limit, nullptr, 0);
+#elif defined(_WIN32)
+    if (m_shared) {
+      ::Sleep(1);
+    } else {
+      ::WaitOnAddress(const_cast<std::atomic<uint32_t>*>(&m_value), &expected, sizeof(expected),
+                      timeout.count() < 0 ? INFINITE : static_cast<DWORD>(timeout.count()));
+    }
+#else
+    (void)timeout;
+    if (m_value.load(std::memory_order_acquire) == expected) {
+      std::this_thread::yield();
+    }
+#endif
+  }
+
+  void wake(bool one) noexcept
+  {
+#if defined(__linux__)
+    ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_value), m_shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE, one ? 1 : INT32_MAX,
+              nullptr, nullptr, 0);
+#elif defined(_WIN32)
+    if (m_shared) {
+      return; /* (!) The waiters nap */
+    }
+    if (one) {
+      ::WakeByAddressSingle(&m_value);
+    } else {
+      ::WakeByAddressAll(&m_value);
+    }
+#else
+    (void)one;
+#endif
+  }
+
+  static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "The kernel waits on a plain 32-bit word");
+
+  std::atomic<uint32_t> m_value;
+  mutable std::atomic<uint32_t> m_waiters{ 0 };
+  bool m_shared = false;
+};
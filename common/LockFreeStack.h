@@ -0,0 +1,171 @@
+/*
+* Common: lock-free stack
+*
+* The lock-free alternative to ThreadSafeStack (s2t09): a Treiber stack, a singly linked list whose head
+* is replaced with a compare-and-swap. push() links a new node in front of the head it read; try_pop()
+* swings the head to the second node. Nobody ever waits for a lock holder that was descheduled.
+*
+* A popped node can't be deleted at once, because another thread may have read the same head and be about
+* to read its next pointer. Nodes are retired to the Epoch (common/Epoch.h) instead, and try_pop() reads
+* inside an EpochGuard. That also rules out the ABA problem: a node's memory can't come back as a new node
+* while some thread still holds its address.
+*
+* Every operation still succeeds on a single cache line, the head, so under heavy contention the stack
+* scales no better than a mutex; it only degrades more gracefully. The bulk operations pay that price
+* once per batch: push_range() links the whole chain first and swings the head to it with one CAS,
+* try_pop_n() cuts off the first n nodes with one CAS, and pop_all() takes the whole list with one
+* exchange. They are spelled, and take their arguments, as on ThreadSafeStack (common/Containers.h).
+*/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <initializer_list>
+#include <utility>
+
+#include "Epoch.h"
+
+template<typename T>
+class LockFreeStack
+{
+public:
+  LockFreeStack() = default;
+
+  LockFreeStack(LockFreeStack const&) = delete;
+  LockFreeStack& operator=(LockFreeStack const&) = delete;
+
+  ~LockFreeStack()
+  {
+    Node* node = m_head.load();
+    while (node != nullptr) {
+      Node* next = node->next;
+      delete node;
+      node = next;
+    }
+  }
+
+  void push(T value)
+  {
+    Node* node = new Node{ std::move(value), m_head.load(std::memory_order_relaxed) };
+    while (!m_head.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+  }
+
+  /* (!) As many pushes in a row, the last on top */
+  template<typename InputIt>
+  void push_range(InputIt first, InputIt last)
+  {
+    Node* top = nullptr;
+    Node* bottom = nullptr;
+    try {
+      for (; first != last; ++first) {
+        top = new Node{ *first, top };
+        bottom = bottom != nullptr ? bottom : top;
+      }
+    } catch (...) {
+      while (top != nullptr) { /* (!) Nothing was published yet */
+        delete std::exchange(top, top->next);
+      }
+      throw;
+    }
+    if (top == nullptr) {
+      return;
+    }
+
+    bottom->next = m_head.load(std::memory_order_relaxed);
+    while (!m_head.compare_exchange_weak(bottom->next, top, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+  }
+
+  void push(std::initializer_list<T> values)
+  {
+    push_range(values.begin(), values.end());
+  }
+
+  /* (!) No exception when empty, unlike ThreadSafeStack::pop: between empty() and pop() another thread may have popped */
+  bool try_pop(T& value)
+  {
+    EpochGuard guard;
+
+    Node* node = m_head.load(std::memory_order_acquire);
+    while (node != nullptr && !m_head.compare_exchange_weak(node, node->next, std::memory_order_acquire)) {
+    }
+    if (node == nullptr) {
+      return false;
+    }
+
+    value = std::move(node->value); /* (!) Unlinked: only this thread touches the value now */
+    Epoch::instance().retire(node);
+    return true;
+  }
+
+  /* (!) Up to n values, top first; returns how many */
+  template<typename OutputIt>
+  size_t try_pop_n(OutputIt out, size_t n)
+  {
+    if (n == 0) {
+      return 0;
+    }
+
+    EpochGuard guard;
+
+    Node* first = m_head.load(std::memory_order_acquire);
+    size_t count;
+    for (;;) {
+      if (first == nullptr) {
+        return 0;
+      }
+      Node* last = first; /* (!) The next pointers of pushed nodes never change: the walk is safe, the CAS checks it still applies */
+      count = 1;
+      while (count < n && last->next != nullptr) {
+        last = last->next;
+        ++count;
+      }
+      if (m_head.compare_exchange_weak(first, last->next, std::memory_order_acquire)) {
+        break;
+      }
+    }
+
+    return drain(first, count, out);
+  }
+
+  /* (!) Everything, top first; returns how many */
+  template<typename OutputIt>
+  size_t pop_all(OutputIt out)
+  {
+    Node* first = m_head.exchange(nullptr, std::memory_order_acquire);
+    size_t count = 0;
+    for (Node* node = first; node != nullptr; node = node->next) {
+      ++count;
+    }
+    return drain(first, count, out);
+  }
+
+  bool empty() const
+  {
+    return m_head.load() == nullptr;
+  }
+
+private:
+  struct Node
+  {
+    T value;
+    Node* next;
+  };
+
+  /* (!) The count nodes from first are unlinked: only this thread takes their values. Others may still read them */
+  template<typename OutputIt>
+  static size_t drain(Node* first, size_t count, OutputIt out)
+  {
+    Node* node = first;
+    for (size_t i = 0; i < count; ++i) {
+      Node* next = node->next;
+      *out++ = std::move(node->value);
+      Epoch::instance().retire(node);
+      node = next;
+    }
+    return count;
+  }
+
+  alignas(64) std::atomic<Node*> m_head{ nullptr };
+};
@@ -0,0 +1,374 @@
+/*
+* Common: asynchronous logger
+*
+* Writing to std::cout from worker threads with std::endl takes the stream's lock and flushes on every
+* line, so the workers end up waiting on each other and on the terminal. Here each thread logs into its
+* own single-producer ring buffer instead, and one background thread drains all the rings, formats the
+* records and writes them with one flush per batch.
+*
+* log() never blocks and never formats: it copies the arguments into a fixed-size slot of the calling
+* thread's ring. When the ring is full the record is dropped and counted (see dropped()), the caller is
+* never made to wait. Formatting ({} placeholders, each replaced by operator<< of the next argument)
+* happens on the drain thread. Each line is tagged with the ThreadRegistry index of the thread that
+* logged it.
+*
+* The format string is stored as a pointer, so it must be a string literal. Other character pointers and
+* string views among the arguments are copied into a std::string, since they may not outlive the call.
+*/
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "ThreadRegistry.h"
+
+enum class LogLevel
+{
+  Debug,
+  Info,
+  Warning,
+  Error
+};
+
+class Logger
+{
+  struct Ring;
+
+public:
+  static constexpr size_t RecordSize = 256;
+
+  explicit Logger(std::ostream& out = std::cout, size_t recordsPerThread = 4096,
+                  std::chrono::milliseconds flushInterval = std::chrono::milliseconds(10))
+    : m_out(out)
+    , m_id(nextId())
+    , m_capacity(roundUpToPowerOfTwo(recordsPerThread))
+    , m_flushInterval(flushInterval)
+    , m_start(std::chrono::steady_clock::now())
+    , m_drainThread(&Logger::drain, this)
+  {
+  }
+
+  ~Logger() /* (!) Everything logged before destruction is written */
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping = true;
+    }
+    m_wakeup.notify_one();
+    m_drainThread.join();
+
+    std::vector<std::shared_ptr<Ring>> rings;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      rings = m_rings;
+    }
+    writePublished(rings); /* (!) Published after the drain thread's last pass: their arguments must be destroyed too */
+  }
+
+  Logger(Logger const&) = delete;
+  Logger& operator=(Logger const&) = delete;
+
+  /* (!) Returns false if the record was dropped because this thread's ring is full */
+  template<typename... Args>
+  bool log(LogLevel level, const char* format, Args&&... args)
+  {
+    using Arguments = std::tuple<Stored<Args>...>;
+    static_assert(sizeof(Arguments) <= sizeof(Record::arguments), "Too many or too large log arguments");
+    static_assert(alignof(Arguments) <= alignof(std::max_align_t), "Over-aligned log arguments");
+
+    Ring& ring = localRing();
+
+    const uint64_t head = ring.head.load(std::memory_order_relaxed);
+    if (head - ring.tailCache >= m_capacity) {
+      ring.tailCache = ring.tail.load(std::memory_order_acquire); /* (!) Only look at the consumer's index when we seem to be full */
+      if (head - ring.tailCache >= m_capacity) {
+        ring.dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+    }
+
+    Record& record = ring.records[head & (m_capacity - 1)];
+    record.time = std::chrono::steady_clock::now().time_since_epoch().count();
+    record.level = level;
+    record.thread = ring.thread;
+    record.format = format;
+    record.write = &writeRecord<Arguments>;
+    ::new (static_cast<void*>(record.arguments)) Arguments(std::forward<Args>(args)...);
+
+    ring.head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  template<typename... Args>
+  bool info(const char* format, Args&&... args)
+  {
+    return log(LogLevel::Info, format, std::forward<Args>(args)...);
+  }
+
+  /* (!) Waits until everything logged so far, by any thread, has been written and flushed */
+  void flush()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    const uint64_t request = ++m_flushRequested;
+    m_wakeup.notify_one();
+    m_flushed.wait(lock, [this, request] { return m_flushCompleted >= request; });
+  }
+
+  uint64_t dropped() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint64_t total = 0;
+    for (auto&& ring : m_rings) {
+      total += ring->dropped.load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+  uint64_t written() const
+  {
+    return m_written.load(std::memory_order_relaxed);
+  }
+
+private:
+  template<typename T>
+  using Stored = std::conditional_t<std::is_convertible<std::decay_t<T>, std::string_view>::value &&
+                                      !std::is_same<std::decay_t<T>, std::string>::value,
+                                    std::string, std::decay_t<T>>;
+
+  struct Record
+  {
+    int64_t time;
+    LogLevel level;
+    uint32_t thread;
+    const char* format;
+    void (*write)(std::ostream&, const char*, void*);
+    alignas(std::max_align_t) unsigned char arguments[RecordSize - 32];
+  };
+
+  static_assert(sizeof(Record) == RecordSize, "Unexpected log record layout");
+
+  struct Ring
+  {
+    explicit Ring(size_t capacity)
+      : records(new Record[capacity])
+    {
+    }
+
+    std::unique_ptr<Record[]> records;
+    unsigned thread = 0; /* (!) ThreadRegistry index of the owner, only touched by the owner */
+    std::atomic<bool> inUse{ true };
+    std::atomic<uint64_t> dropped{ 0 };
+
+    alignas(64) std::atomic<uint64_t> head{ 0 }; /* (!) Written by the logging thread */
+    uint64_t tailCache = 0;
+    alignas(64) std::atomic<uint64_t> tail{ 0 }; /* (!) Written by the drain thread */
+  };
+
+  /* (!) The thread's rings, one per Logger it used; released for reuse when the thread exits */
+  struct ThreadRings
+  {
+    struct Binding
+    {
+      uint64_t logger;
+      std::shared_ptr<Ring> ring;
+    };
+
+    ~ThreadRings()
+    {
+      for (auto&& b : bindings) {
+        b.ring->inUse.store(false, std::memory_order_release);
+      }
+    }
+
+    std::vector<Binding> bindings;
+  };
+
+  Ring& localRing()
+  {
+    thread_local ThreadRings rings;
+
+    if (!rings.bindings.empty() && rings.bindings.back().logger == m_id) {
+      return *rings.bindings.back().ring; /* (!) Common case: one logger per program */
+    }
+
+    for (auto&& b : rings.bindings) {
+      if (b.logger == m_id) {
+        return *b.ring;
+      }
+    }
+
+    rings.bindings.push_back({ m_id, acquireRing() });
+    rings.bindings.back().ring->thread = ThreadRegistry::index();
+    return *rings.bindings.back().ring;
+  }
+
+  std::shared_ptr<Ring> acquireRing()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    for (auto&& ring : m_rings) {
+      bool free = false;
+      if (ring->inUse.compare_exchange_strong(free, true, std::memory_order_acq_rel)) {
+        ring->tailCache = ring->tail.load(std::memory_order_acquire);
+        return ring; /* (!) Left by a thread that has exited; its pending records are still drained */
+      }
+    }
+
+    m_rings.push_back(std::make_shared<Ring>(m_capacity));
+    return m_rings.back();
+  }
+
+  template<typename Arguments>
+  static void writeRecord(std::ostream& out, const char* format, void* storage)
+  {
+    auto& arguments = *static_cast<Arguments*>(storage);
+
+    std::apply([&out, &format](auto const&... a) {
+      ((format = writeUntilPlaceholder(out, format), out << a), ...);
+    }, arguments);
+    out << format;
+
+    arguments.~Arguments();
+  }
+
+  static const char* writeUntilPlaceholder(std::ostream& out, const char* format)
+  {
+    const char* p = format;
+    while (*p && !(p[0] == '{' && p[1] == '}')) {
+      ++p;
+    }
+    out.write(format, p - format);
+    return *p ? p + 2 : p; /* (!) Extra arguments are appended at the end */
+  }
+
+  void drain()
+  {
+    ThreadRegistry::instance().registerThread(ThreadRole::Background, "logger");
+
+    std::vector<std::shared_ptr<Ring>> rings;
+
+    for (;;) {
+      bool stopping;
+      uint64_t flushRequest;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_wakeup.wait_for(lock, m_flushInterval, [this] { return m_stopping || m_flushRequested > m_flushCompleted; });
+        stopping = m_stopping;
+        flushRequest = m_flushRequested;
+        rings = m_rings;
+      }
+
+      writePublished(rings);
+
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_flushCompleted = std::max(m_flushCompleted, flushRequest);
+      }
+      m_flushed.notify_all();
+
+      if (stopping) {
+        return; /* (!) Producers racing with the destructor are not waited for; it writes what they published */
+      }
+    }
+  }
+
+  /* (!) Takes what is published in every ring, then writes it in time order with one flush */
+  void writePublished(std::vector<std::shared_ptr<Ring>> const& rings)
+  {
+    m_pending.clear();
+    m_records.clear();
+    for (auto&& ring : rings) {
+      const uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+      const uint64_t head = ring->head.load(std::memory_order_acquire);
+      for (uint64_t i = tail; i != head; ++i) {
+        Record* r = &ring->records[i & (m_capacity - 1)];
+        m_records.emplace_back(r->time, r, r->thread);
+      }
+      m_pending.emplace_back(ring.get(), head);
+    }
+
+    std::stable_sort(m_records.begin(), m_records.end(),
+                     [](auto const& a, auto const& b) { return std::get<0>(a) < std::get<0>(b); });
+
+    if (!m_records.empty()) {
+      m_batch.str(std::string());
+      for (auto&& [time, record, thread] : m_records) {
+        writePrefix(m_batch, *record, thread);
+        record->write(m_batch, record->format, record->arguments); /* (!) Also destroys the arguments */
+        m_batch << '\n';
+      }
+
+      m_out << m_batch.str();
+      m_out.flush();
+      m_written.fetch_add(m_records.size(), std::memory_order_relaxed);
+    }
+
+    for (auto&& [ring, head] : m_pending) {
+      ring->tail.store(head, std::memory_order_release); /* (!) Hand the slots back only after formatting */
+    }
+  }
+
+  void writePrefix(std::ostream& out, Record const& record, unsigned thread) const
+  {
+    static const char* const names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+    const auto since = std::chrono::steady_clock::duration(record.time) - m_start.time_since_epoch();
+    const auto micros = std::chrono::duration_cast<std::chrono::microseconds>(since).count();
+
+    out << '[' << micros / 1000 << '.' << (micros % 1000) / 100 << (micros % 100) / 10 << micros % 10 << "ms] ["
+        << names[static_cast<int>(record.level)] << "] [T" << thread << "] ";
+  }
+
+  static uint64_t nextId()
+  {
+    static std::atomic<uint64_t> id{ 0 };
+    return ++id;
+  }
+
+  static size_t roundUpToPowerOfTwo(size_t n)
+  {
+    size_t p = 2;
+    while (p < n) {
+      p <<= 1;
+    }
+    return p;
+  }
+
+  std::ostream& m_out;
+  const uint64_t m_id;
+  const size_t m_capacity;
+  const std::chrono::milliseconds m_flushInterval;
+  const std::chrono::steady_clock::time_point m_start;
+
+  mutable std::mutex m_mutex; /* (!) Ring registration and flush requests only, never taken by log() */
+  std::condition_variable m_wakeup;
+  std::condition_variable m_flushed;
+  std::vector<std::shared_ptr<Ring>> m_rings;
+  bool m_stopping = false;
+  uint64_t m_flushRequested = 0;
+  uint64_t m_flushCompleted = 0;
+  std::atomic<uint64_t> m_written{ 0 };
+
+  /* (!) Only used by the drain thread, and by the destructor once it has joined it */
+  std::ostringstream m_batch;
+  std::vector<std::pair<Ring*, uint64_t>> m_pending;
+  std::vector<std::tuple<int64_t, Record*, unsigned>> m_records;
+
+  std::thread m_drainThread; /* (!) Declared last: starts once everything else is initialized */
+};
@@ -0,0 +1,326 @@
+/*
+* Common: sharded metrics
+*
+* A single std::atomic counter bumped by every thread is itself a point of contention: each increment
+* has to own the cache line, so the line bounces between cores and the counter gets slower the more
+* threads use it. ShardedCounter gives each thread its own cache line instead (the thread's
+* ThreadRegistry index picks the shard), increments it with a relaxed fetch_add that never leaves the
+* core's cache, and only adds the shards up when somebody reads the value.
+*
+* ShardedHistogram records latencies the same way into log-linear buckets, in the style of
+* HdrHistogram: values below 32 are exact, above that every power of two is split into 32 buckets, so
+* any value is known to within about 3%. snapshot() merges the shards into a HistogramSnapshot, which
+* answers count, mean, min/max and percentiles; snapshots merge too.
+*
+* The containers of the examples are instrumented through metrics::Counter, metrics::Histogram and
+* metrics::ScopedTimer. They are only real when the program is built with CONCURRENCY_METRICS=1
+* (/D CONCURRENCY_METRICS=1, -DCONCURRENCY_METRICS=1); otherwise they are empty types whose member
+* functions do nothing, and the instrumentation compiles away, clock reads included.
+*/
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "ThreadRegistry.h"
+
+#if !defined(CONCURRENCY_METRICS)
+#define CONCURRENCY_METRICS 0
+#endif
+
+class ShardedCounter
+{
+public:
+  static constexpr unsigned Shards = 64;
+
+  void add(uint64_t n)
+  {
+    m_shards[ThreadRegistry::index() % Shards].value.fetch_add(n, std::memory_order_relaxed); /* (!) Never bounces between cores */
+  }
+
+  void increment()
+  {
+    add(1);
+  }
+
+  /* (!) Not a snapshot: increments that race with the read may or may not be included */
+  uint64_t value() const
+  {
+    uint64_t total = 0;
+    for (auto&& shard : m_shards) {
+      total += shard.value.load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+  void reset()
+  {
+    for (auto&& shard : m_shards) {
+      shard.value.store(0, std::memory_order_relaxed);
+    }
+  }
+
+private:
+  struct alignas(64) Shard
+  {
+    std::atomic<uint64_t> value{ 0 };
+  };
+
+  Shard m_shards[Shards];
+};
+
+class HistogramSnapshot
+{
+public:
+  static constexpr unsigned SubBucketBits = 5;
+  static constexpr unsigned SubBuckets = 1u << SubBucketBits;
+  static constexpr unsigned Buckets = SubBuckets + (64 - SubBucketBits) * SubBuckets;
+
+  HistogramSnapshot()
+    : m_counts(Buckets, 0)
+  {
+  }
+
+  static unsigned bucketOf(uint64_t value)
+  {
+    if (value < SubBuckets) {
+      return static_cast<unsigned>(value);
+    }
+
+#if defined(_MSC_VER)
+    unsigned long msb;
+    _BitScanReverse64(&msb, value);
+#else
+    const unsigned msb = 63 - static_cast<unsigned>(__builtin_clzll(value));
+#endif
+
+    const unsigned shift = static_cast<unsigned>(msb) - SubBucketBits;
+    return SubBuckets + shift * SubBuckets + static_cast<unsigned>((value >> shift) - SubBuckets);
+  }
+
+  /* (!) The middle of the bucket's range */
+  static uint64_t valueOf(unsigned bucket)
+  {
+    if (bucket < SubBuckets) {
+      return bucket;
+    }
+
+    const unsigned shift = (bucket - SubBuckets) / SubBuckets;
+    const uint64_t top = SubBuckets + (bucket - SubBuckets) % SubBuckets;
+    return (top << shift) + ((uint64_t(1) << shift) >> 1);
+  }
+
+  void add(unsigned bucket, uint64_t count)
+  {
+    m_counts[bucket] += count;
+    m_total += count;
+  }
+
+  void merge(HistogramSnapshot const& other)
+  {
+    for (unsigned i = 0; i < Buckets; ++i) {
+      m_counts[i] += other.m_counts[i];
+    }
+    m_total += other.m_total;
+  }
+
+  uint64_t count() const
+  {
+    return m_total;
+  }
+
+  /* (!) percentile in [0, 100] */
+  uint64_t percentile(double percentile) const
+  {
+    if (m_total == 0) {
+      return 0;
+    }
+
+    const auto rank = static_cast<uint64_t>(std::max(1.0, percentile / 100.0 * static_cast<double>(m_total) + 0.5));
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < Buckets; ++i) {
+      seen += m_counts[i];
+      if (seen >= rank) {
+        return valueOf(i);
+      }
+    }
+    return max();
+  }
+
+  double mean() const
+  {
+    if (m_total == 0) {
+      return 0;
+    }
+
+    double sum = 0;
+    for (unsigned i = 0; i < Buckets; ++i) {
+      sum += static_cast<double>(m_counts[i]) * static_cast<double>(valueOf(i));
+    }
+    return sum / static_cast<double>(m_total);
+  }
+
+  uint64_t min() const
+  {
+    for (unsigned i = 0; i < Buckets; ++i) {
+      if (m_counts[i]) {
+        return valueOf(i);
+      }
+    }
+    return 0;
+  }
+
+  uint64_t max() const
+  {
+    for (unsigned i = Buckets; i-- > 0;) {
+      if (m_counts[i]) {
+        return valueOf(i);
+      }
+    }
+    return 0;
+  }
+
+private:
+  std::vector<uint64_t> m_counts;
+  uint64_t m_total = 0;
+};
+
+class ShardedHistogram
+{
+public:
+  static constexpr unsigned Shards = 64;
+
+  ShardedHistogram() = default;
+
+  ~ShardedHistogram()
+  {
+    for (auto&& shard : m_shards) {
+      delete shard.load(std::memory_order_relaxed);
+    }
+  }
+
+  ShardedHistogram(ShardedHistogram const&) = delete;
+  ShardedHistogram& operator=(ShardedHistogram const&) = delete;
+
+  void record(uint64_t value)
+  {
+    shard().counts[HistogramSnapshot::bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void record(std::chrono::nanoseconds duration)
+  {
+    record(static_cast<uint64_t>(std::max<int64_t>(0, duration.count())));
+  }
+
+  HistogramSnapshot snapshot() const
+  {
+    HistogramSnapshot merged;
+    for (auto&& s : m_shards) {
+      if (const Shard* shard = s.load(std::memory_order_acquire)) {
+        for (unsigned i = 0; i < HistogramSnapshot::Buckets; ++i) {
+          if (const auto n = shard->counts[i].load(std::memory_order_relaxed)) {
+            merged.add(i, n);
+          }
+        }
+      }
+    }
+    return merged;
+  }
+
+private:
+  struct Shard
+  {
+    std::atomic<uint64_t> counts[HistogramSnapshot::Buckets] = {};
+  };
+
+  /* (!) Shards are allocated by the first thread that records into them: 15KB each */
+  Shard& shard()
+  {
+    auto& slot = m_shards[ThreadRegistry::index() % Shards];
+
+    Shard* shard = slot.load(std::memory_order_acquire);
+    if (!shard) {
+      auto fresh = std::make_unique<Shard>();
+      if (slot.compare_exchange_strong(shard, fresh.get(), std::memory_order_acq_rel)) {
+        shard = fresh.release();
+      }
+    }
+    return *shard;
+  }
+
+  std::atomic<Shard*> m_shards[Shards] = {};
+};
+
+namespace metrics
+{
+  constexpr bool Enabled = CONCURRENCY_METRICS != 0;
+
+  struct NullCounter
+  {
+    void add(uint64_t) const
+    {
+    }
+
+    void increment() const
+    {
+    }
+
+    uint64_t value() const
+    {
+      return 0;
+    }
+  };
+
+  struct NullHistogram
+  {
+    template<typename T>
+    void record(T) const
+    {
+    }
+
+    HistogramSnapshot snapshot() const
+    {
+      return HistogramSnapshot();
+    }
+  };
+
+  using Counter = std::conditional_t<Enabled, ShardedCounter, NullCounter>;
+  using Histogram = std::conditional_t<Enabled, ShardedHistogram, NullHistogram>;
+
+  /* (!) Records the lifetime of the scope into a histogram; no clock is read when metrics are off */
+  class ScopedTimer
+  {
+  public:
+    explicit ScopedTimer(Histogram& histogram)
+      : m_histogram(histogram)
+    {
+      if constexpr (Enabled) {
+        m_start = std::chrono::steady_clock::now();
+      }
+    }
+
+    ~ScopedTimer()
+    {
+      if constexpr (Enabled) {
+        m_histogram.record(std::chrono::steady_clock::now() - m_start);
+      }
+    }
+
+    ScopedTimer(ScopedTimer const&) = delete;
+    ScopedTimer& operator=(ScopedTimer const&) = delete;
+
+  private:
+    Histogram& m_histogram;
+    std::chrono::steady_clock::time_point m_start;
+  };
+}
@@ -0,0 +1,63 @@
+/*
+* Common: parallel blocks
+*
+* The split of accumulateParallel (s1t15), shared by the parallel algorithms of common/ParallelSort.h and
+* common/ParallelReduce.h: a range is cut into one block per thread, but no block is smaller than a
+* minimum, below which starting the work costs more than doing it. The blocks run on a ThreadPool, the
+* calling thread taking one of them, so the caller must not be one of the pool's workers.
+*/
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <future>
+#include <vector>
+
+#include "ThreadPool.h"
+
+namespace detail
+{
+  /* (!) The rule of s1t15: a block per thread, but no block smaller than minPerBlock */
+  inline size_t parallelBlocks(size_t length, size_t minPerBlock, size_t threads)
+  {
+    const size_t maxBlocks = (length + minPerBlock - 1) / minPerBlock;
+    return std::max<size_t>(1, std::min<size_t>(threads != 0 ? threads : 2, maxBlocks));
+  }
+
+  /* (!) Before any result or exception is taken: the tasks may refer to the caller's locals */
+  template<typename Result>
+  void waitAll(std::vector<std::future<Result>> const& pending)
+  {
+    for (auto&& f : pending) {
+      f.wait();
+    }
+  }
+
+  /* (!) Runs body(0) .. body(blocks - 1), block 0 on the calling thread. Waits for all of them before rethrowing */
+  template<typename Body>
+  void forBlocks(ThreadPool& pool, size_t blocks, Body const& body)
+  {
+    std::vector<std::future<void>> pending;
+    pending.reserve(blocks - 1);
+    std::exception_ptr error;
+
+    try {
+      for (size_t b = 1; b < blocks; ++b) {
+        pending.push_back(pool.submit([&body, b] { body(b); }));
+      }
+      body(0);
+    } catch (...) {
+      error = std::current_exception();
+    }
+
+    waitAll(pending);
+
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    for (auto&& f : pending) {
+      f.get(); /* (!) Rethrows the first failed block's exception */
+    }
+  }
+}
@@ -0,0 +1,105 @@
+/*
+* Common: parallel reduction
+*
+* accumulateParallel (s1t15) takes any iterator, but splits the range with std::advance, which walks a
+* std::list node by node: the calling thread goes through the whole list before it starts on its own
+* block, and the last threads start only when it has walked that far. The lists of the repository
+* (myList in s2t01, ThreadSafeLinkedList in S2t02) are exactly that case.
+*
+* accumulateParallel() here looks at the iterator category:
+*
+*   - random access: s1t15's blocks, computed in O(1), run on a ThreadPool
+*   - anything else: the calling thread walks the range once and hands each chunk of ChunkSize elements
+*     to the pool as soon as it has walked past it, so the workers reduce the first chunks while the
+*     rest of the list is still being walked. The walk remains sequential, so with a cheap operation
+*     (adding ints) a list can't be reduced much faster than one thread walks it; the more work per
+*     element, the more the workers take over.
+*
+* op must be associative: the chunks are reduced separately and then combined in order. Each chunk
+* starts from its first element, so op needs no identity element.
+*/
+#pragma once
+
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <numeric>
+#include <type_traits>
+#include <vector>
+
+#include "ParallelBlocks.h"
+#include "ThreadPool.h"
+#include "Trace.h"
+
+namespace detail
+{
+  constexpr size_t MinReduceBlock = 25; /* (!) s1t15's min_per_thread */
+  constexpr size_t ReduceChunkSize = 4096; /* (!) A task per 4096 nodes: cheap next to walking them, and enough chunks to share */
+
+  /* (!) Reduces count elements starting at first, starting from the first of them */
+  template<typename T, typename Iterator, typename BinaryOperation>
+  T reduceChunk(Iterator first, size_t count, BinaryOperation& op)
+  {
+    trace::Scope scope("reduce chunk", "reduce");
+    T result = *first;
+    while (--count != 0) {
+      result = op(std::move(result), *++first);
+    }
+    return result;
+  }
+}
+
+template<typename Iterator, typename T, typename BinaryOperation = std::plus<>>
+T accumulateParallel(ThreadPool& pool, Iterator first, Iterator last, T init, BinaryOperation op = BinaryOperation())
+{
+  using Category = typename std::iterator_traits<Iterator>::iterator_category;
+
+  if constexpr (std::is_base_of<std::random_access_iterator_tag, Category>::value) {
+    const size_t length = static_cast<size_t>(last - first);
+    if (length == 0) {
+      return init;
+    }
+
+    const size_t blocks = detail::parallelBlocks(length, detail::MinReduceBlock, pool.threads());
+
+    std::vector<T> results(blocks);
+    detail::forBlocks(pool, blocks, [&](size_t b) {
+      const size_t begin = length * b / blocks;
+      const size_t end = length * (b + 1) / blocks;
+      results[b] = detail::reduceChunk<T>(first + begin, end - begin, op);
+    });
+
+    return std::accumulate(results.begin(), results.end(), init, op);
+  } else {
+    std::vector<std::future<T>> pending;
+    std::exception_ptr error;
+
+    try {
+      while (first != last) {
+        Iterator chunk = first;
+        size_t count = 0;
+        while (first != last && count < detail::ReduceChunkSize) {
+          ++first;
+          ++count;
+        }
+        pending.push_back(pool.submit([chunk, count, &op] { return detail::reduceChunk<T>(chunk, count, op); }));
+      }
+    } catch (...) {
+      error = std::current_exception(); /* (!) Thrown by submit(), or by the iterator */
+    }
+
+    detail::waitAll(pending);
+
+    if (error) {
+      std::rethrow_exception(error);
+    }
+
+    T result = std::move(init);
+    for (auto&& f : pending) {
+      result = op(std::move(result), f.get());
+    }
+    return result;
+  }
+}
@@ -0,0 +1,236 @@
+/*
+* Common: parallel sort and merge
+*
+* accumulateParallel (s1t15) cuts its range into one block per hardware thread, but no block smaller than
+* a minimum, and combines the blocks' results. Sorting can be cut the same way: parallelSort() sorts the
+* blocks with std::sort, then merges neighbouring runs in rounds until one run is left. Every merge is
+* itself parallel: parallelMerge() cuts the output into blocks and finds, by binary search, where each
+* block starts in the two inputs (the "merge path"), so the blocks can be merged independently.
+*
+* The blocks run on a ThreadPool instead of a thread each, the calling thread taking one of them, so
+* the threads are created once for all the sorts of a program. The caller must not be one of the
+* pool's workers: it waits for the other blocks.
+*
+* Both take a comparator, are stable where std::merge is (parallelSort is not stable: std::sort isn't),
+* and fall back to std::sort and std::merge when the range is too small to be worth a task. The merge
+* rounds need a buffer of the same size as the range. It is uninitialized storage, so the value type need
+* not be default constructible, only move constructible: unless the type is trivial, the sorted blocks
+* are move-constructed into the buffer, in parallel, and the first round merges them back.
+*/
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "ParallelBlocks.h"
+#include "ThreadPool.h"
+#include "Trace.h"
+
+namespace detail
+{
+  constexpr size_t MinSortBlock = 16 * 1024;  /* (!) s1t15's min_per_thread: below this a task costs more than it saves */
+  constexpr size_t MinMergeBlock = 32 * 1024; /* (!) Merging an element is cheaper than sorting one */
+
+  /* (!) How many of the first k merged elements come from a; b[j] goes first only if it is less than a[i] */
+  template<typename Iterator1, typename Iterator2, typename Compare>
+  size_t mergeSplit(size_t k, Iterator1 a, size_t n1, Iterator2 b, size_t n2, Compare& comp)
+  {
+    size_t low = k > n2 ? k - n2 : 0;
+    size_t high = std::min(k, n1);
+
+    while (low < high) {
+      const size_t i = low + (high - low) / 2;
+      const size_t j = k - i;
+      if (!comp(b[j - 1], a[i])) { /* (!) a[i] is merged before b[j - 1], so it is among the first k */
+        low = i + 1;
+      } else {
+        high = i;
+      }
+    }
+    return low;
+  }
+
+  /* (!) std::merge, moving instead of copying if Move. Move iterators would hand rvalues to the comparator */
+  template<bool Move, typename Iterator1, typename Iterator2, typename OutputIterator, typename Compare>
+  void mergeBlock(Iterator1 first1, Iterator1 last1, Iterator2 first2, Iterator2 last2, OutputIterator out, Compare& comp)
+  {
+    if constexpr (Move) {
+      while (first1 != last1 && first2 != last2) {
+        if (comp(*first2, *first1)) {
+          *out++ = std::move(*first2++);
+        } else {
+          *out++ = std::move(*first1++);
+        }
+      }
+      out = std::move(first1, last1, out);
+      std::move(first2, last2, out);
+    } else {
+      std::merge(first1, last1, first2, last2, out, comp);
+    }
+  }
+
+  template<bool Move, typename Iterator1, typename Iterator2, typename OutputIterator, typename Compare>
+  void parallelMerge(ThreadPool& pool, Iterator1 first1, Iterator1 last1, Iterator2 first2, Iterator2 last2, OutputIterator out, Compare& comp)
+  {
+    const size_t n1 = static_cast<size_t>(std::distance(first1, last1));
+    const size_t n2 = static_cast<size_t>(std::distance(first2, last2));
+    const size_t total = n1 + n2;
+    const size_t blocks = parallelBlocks(total, MinMergeBlock, pool.threads());
+
+    if (blocks == 1) {
+      mergeBlock<Move>(first1, last1, first2, last2, out, comp);
+      return;
+    }
+
+    /* (!) All splits before any block starts: a moving block empties elements that the searches of its neighbours compare */
+    std::vector<size_t> splits(blocks + 1);
+    for (size_t b = 0; b <= blocks; ++b) {
+      splits[b] = mergeSplit(total * b / blocks, first1, n1, first2, n2, comp);
+    }
+
+    forBlocks(pool, blocks, [&](size_t b) {
+      trace::Scope scope("merge block", "sort");
+      const size_t begin = total * b / blocks;
+      const size_t end = total * (b + 1) / blocks;
+      mergeBlock<Move>(first1 + splits[b], first1 + splits[b + 1], first2 + (begin - splits[b]), first2 + (end - splits[b + 1]),
+                       out + begin, comp);
+    });
+  }
+
+  /* (!) The other array of parallelSort's merge rounds: owns the storage and whatever was constructed in it */
+  template<typename Value>
+  class MergeBuffer
+  {
+  public:
+    explicit MergeBuffer(size_t length)
+      : m_data(std::allocator<Value>().allocate(length))
+      , m_length(length)
+    {
+    }
+
+    ~MergeBuffer()
+    {
+      for (auto&& [begin, end] : m_constructed) {
+        std::destroy(m_data + begin, m_data + end);
+      }
+      std::allocator<Value>().deallocate(m_data, m_length);
+    }
+
+    MergeBuffer(MergeBuffer const&) = delete;
+    MergeBuffer& operator=(MergeBuffer const&) = delete;
+
+    /* (!) Moves the range into the buffer, so that the rounds can assign to its elements; true if it did. Trivial types are assigned as they are */
+    template<typename Iterator>
+    bool constructFrom(ThreadPool& pool, Iterator first)
+    {
+      if constexpr (!std::is_trivial_v<Value>) {
+        const size_t blocks = parallelBlocks(m_length, MinMergeBlock, pool.threads());
+        m_constructed.resize(blocks); /* (!) A block's entry stays empty until its elements are all constructed */
+
+        forBlocks(pool, blocks, [&](size_t b) {
+          const size_t begin = m_length * b / blocks;
+          const size_t end = m_length * (b + 1) / blocks;
+          std::uninitialized_move(first + begin, first + end, m_data + begin); /* (!) Destroys its part if it throws */
+          m_constructed[b] = { begin, end };
+        });
+        return true;
+      }
+      return false;
+    }
+
+    Value* get() const
+    {
+      return m_data;
+    }
+
+  private:
+    Value* m_data;
+    size_t m_length;
+    std::vector<std::pair<size_t, size_t>> m_constructed;
+  };
+
+  template<typename Iterator, typename OutputIterator>
+  void parallelMove(ThreadPool& pool, Iterator first, Iterator last, OutputIterator out)
+  {
+    const size_t length = static_cast<size_t>(std::distance(first, last));
+    const size_t blocks = parallelBlocks(length, MinMergeBlock, pool.threads());
+
+    forBlocks(pool, blocks, [&](size_t b) {
+      const size_t begin = length * b / blocks;
+      const size_t end = length * (b + 1) / blocks;
+      std::move(first + begin, first + end, out + begin);
+    });
+  }
+}
+
+/* (!) All iterators random access. Returns the end of the output */
+template<typename Iterator1, typename Iterator2, typename OutputIterator, typename Compare = std::less<>>
+OutputIterator parallelMerge(ThreadPool& pool, Iterator1 first1, Iterator1 last1, Iterator2 first2, Iterator2 last2,
+                             OutputIterator out, Compare comp = Compare())
+{
+  detail::parallelMerge<false>(pool, first1, last1, first2, last2, out, comp);
+  return out + (std::distance(first1, last1) + std::distance(first2, last2));
+}
+
+template<typename Iterator, typename Compare = std::less<>>
+void parallelSort(ThreadPool& pool, Iterator first, Iterator last, Compare comp = Compare())
+{
+  using Value = typename std::iterator_traits<Iterator>::value_type;
+
+  const size_t length = static_cast<size_t>(std::distance(first, last));
+  const size_t blocks = detail::parallelBlocks(length, detail::MinSortBlock, pool.threads());
+
+  if (blocks == 1) {
+    std::sort(first, last, comp);
+    return;
+  }
+
+  /* (!) runs[r] is where run r starts; the last entry is the end */
+  std::vector<size_t> runs(blocks + 1);
+  for (size_t b = 0; b <= blocks; ++b) {
+    runs[b] = length * b / blocks;
+  }
+
+  detail::forBlocks(pool, blocks, [&](size_t b) {
+    trace::Scope scope("sort block", "sort");
+    std::sort(first + runs[b], first + runs[b + 1], comp);
+  });
+
+  detail::MergeBuffer<Value> buffer(length);
+  bool inBuffer = buffer.constructFrom(pool, first); /* (!) Then the first round merges back into the range */
+
+  /* (!) Every round merges pairs of neighbouring runs into the other array, an odd run out is only moved */
+  auto round = [&](auto source, auto target) {
+    std::vector<size_t> merged;
+    for (size_t r = 0; r + 1 < runs.size(); r += 2) {
+      merged.push_back(runs[r]);
+      if (r + 2 < runs.size()) {
+        detail::parallelMerge<true>(pool, source + runs[r], source + runs[r + 1], source + runs[r + 1], source + runs[r + 2],
+                                    target + runs[r], comp);
+      } else {
+        detail::parallelMove(pool, source + runs[r], source + runs[r + 1], target + runs[r]);
+      }
+    }
+    merged.push_back(length);
+    runs.swap(merged);
+  };
+
+  while (runs.size() > 2) {
+    if (inBuffer) {
+      round(buffer.get(), first);
+    } else {
+      round(first, buffer.get());
+    }
+    inBuffer = !inBuffer;
+  }
+
+  if (inBuffer) {
+    detail::parallelMove(pool, buffer.get(), buffer.get() + length, first);
+  }
+}
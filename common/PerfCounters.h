@@ -0,0 +1,364 @@
+/*
+* Common: hardware performance counters
+*
+* A benchmark that only reports time says that accumulateParallel or a contended ThreadSafeStack is slow,
+* not why. The CPU counts the why: cycles and instructions (their ratio, IPC, drops when the core is
+* waiting for memory), L1D and last level cache misses, branch misses, and on Intel the loads that hit a
+* line modified in another core's cache (HITM), which is what false sharing and a contended lock cost.
+*
+* PerfCounters opens those counters for the calling thread through perf_event_open, counting user space
+* only, which is what perf_event_paranoid = 2 (the usual default) allows. start() and stop() return the
+* counts of the region in between, scaled up when the kernel had to multiplex the counters. To count
+* several threads, each one counts itself and adds its PerfSample to a PerfTotals, which is what
+* ScopedPerfCounters does.
+*
+* Counters that can't be opened (no PMU in a VM or container, perf_event_paranoid = 3, a kernel without
+* the event, or not Linux) are reported as unavailable, and reports print n/a for them instead of failing.
+* HITM has no generic event: set CONCURRENCY_PERF_HITM to the CPU's raw event (hex config, e.g. 0x4d2 for
+* MEM_LOAD_L3_HIT_RETIRED.XSNP_HITM on Skylake) to count it.
+*
+* The software counters (task clock, context switches, page faults) work without a PMU.
+*/
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+enum class PerfEvent : unsigned
+{
+  Cycles,
+  Instructions,
+  BranchMisses,
+  L1DMisses,
+  LLCMisses,
+  Hitm,
+  TaskClock,
+  ContextSwitches,
+  PageFaults
+};
+
+constexpr unsigned PerfEventCount = 9;
+
+inline const char* perfEventName(PerfEvent event)
+{
+  static const char* const names[PerfEventCount] = { "cycles", "instructions", "branch misses", "L1D misses", "LLC misses",
+                                                     "HITM", "task clock ns", "context switches", "page faults" };
+  return names[static_cast<unsigned>(event)];
+}
+
+struct PerfSample
+{
+  std::array<uint64_t, PerfEventCount> values{};
+  std::array<bool, PerfEventCount> available{};
+  unsigned threads = 0; /* (!) How many samples were added together */
+
+  bool has(PerfEvent event) const
+  {
+    return available[static_cast<unsigned>(event)];
+  }
+
+  uint64_t operator[](PerfEvent event) const
+  {
+    return values[static_cast<unsigned>(event)];
+  }
+
+  double ipc() const
+  {
+    if (!has(PerfEvent::Cycles) || !has(PerfEvent::Instructions) || (*this)[PerfEvent::Cycles] == 0) {
+      return 0;
+    }
+    return static_cast<double>((*this)[PerfEvent::Instructions]) / static_cast<double>((*this)[PerfEvent::Cycles]);
+  }
+
+  double per(PerfEvent event, uint64_t operations) const
+  {
+    return operations ? static_cast<double>((*this)[event]) / static_cast<double>(operations) : 0;
+  }
+
+  /* (!) A counter is only available in the sum if it was available in every part */
+  PerfSample& operator+=(PerfSample const& other)
+  {
+    for (unsigned i = 0; i < PerfEventCount; ++i) {
+      values[i] += other.values[i];
+      available[i] = threads == 0 ? other.available[i] : available[i] && other.available[i];
+    }
+    threads += other.threads;
+    return *this;
+  }
+};
+
+class PerfCounters
+{
+public:
+  static std::vector<PerfEvent> allEvents()
+  {
+    std::vector<PerfEvent> events;
+    for (unsigned i = 0; i < PerfEventCount; ++i) {
+      events.push_back(static_cast<PerfEvent>(i));
+    }
+    return events;
+  }
+
+  /* (!) Counts the thread that constructs it */
+  explicit PerfCounters(std::vector<PerfEvent> const& events = allEvents())
+  {
+    m_fds.fill(-1);
+    for (auto event : events) {
+      open(event);
+    }
+    start();
+  }
+
+  ~PerfCounters()
+  {
+#if defined(__linux__)
+    for (int fd : m_fds) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+    }
+#endif
+  }
+
+  PerfCounters(PerfCounters const&) = delete;
+  PerfCounters& operator=(PerfCounters const&) = delete;
+
+  bool available(PerfEvent event) const
+  {
+    return m_fds[static_cast<unsigned>(event)] >= 0;
+  }
+
+  bool hardwareAvailable() const
+  {
+    return available(PerfEvent::Cycles) && available(PerfEvent::Instructions);
+  }
+
+  /* (!) Why the counters that failed did, one line per distinct reason */
+  std::string status() const
+  {
+    std::string status;
+    for (auto&& failure : m_failures) {
+      status += (status.empty() ? "" : "\n") + failure.first + ":" + failure.second;
+    }
+    return status;
+  }
+
+  void start()
+  {
+    for (unsigned i = 0; i < PerfEventCount; ++i) {
+      m_start[i] = read(i);
+    }
+  }
+
+  /* (!) The counts since start(); the counters keep running, so stop() can be called again for a running total */
+  PerfSample stop() const
+  {
+    PerfSample sample;
+    sample.threads = 1;
+
+    for (unsigned i = 0; i < PerfEventCount; ++i) {
+      if (m_fds[i] < 0) {
+        continue;
+      }
+
+      const Reading now = read(i);
+      const uint64_t value = now.value - m_start[i].value;
+      const uint64_t enabled = now.enabled - m_start[i].enabled;
+      const uint64_t running = now.running - m_start[i].running;
+
+      sample.available[i] = true;
+      sample.values[i] = running == 0 || running == enabled
+                           ? value
+                           : static_cast<uint64_t>(static_cast<double>(value) * static_cast<double>(enabled) / static_cast<double>(running));
+    }
+    return sample;
+  }
+
+private:
+  struct Reading
+  {
+    uint64_t value = 0;
+    uint64_t enabled = 0;
+    uint64_t running = 0;
+  };
+
+  void open(PerfEvent event)
+  {
+#if defined(__linux__)
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.exclude_kernel = 1; /* (!) Allowed up to perf_event_paranoid = 2 */
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    const auto cache = [](uint64_t cache, uint64_t result) {
+      return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (result << 16);
+    };
+
+    switch (event) {
+      case PerfEvent::Cycles: attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+      case PerfEvent::Instructions: attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+      case PerfEvent::BranchMisses: attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+      case PerfEvent::L1DMisses:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = cache(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_MISS);
+        break;
+      case PerfEvent::LLCMisses:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = cache(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_MISS);
+        break;
+      case PerfEvent::Hitm: {
+        const char* raw = std::getenv("CONCURRENCY_PERF_HITM");
+        if (!raw || !*raw) {
+          fail(event, "set CONCURRENCY_PERF_HITM to the raw event of this CPU");
+          return;
+        }
+        attr.type = PERF_TYPE_RAW;
+        attr.config = std::strtoull(raw, nullptr, 16);
+        break;
+      }
+      case PerfEvent::TaskClock: attr.type = PERF_TYPE_SOFTWARE; attr.config = PERF_COUNT_SW_TASK_CLOCK; break;
+      case PerfEvent::ContextSwitches: attr.type = PERF_TYPE_SOFTWARE; attr.config = PERF_COUNT_SW_CONTEXT_SWITCHES; break;
+      case PerfEvent::PageFaults: attr.type = PERF_TYPE_SOFTWARE; attr.config = PERF_COUNT_SW_PAGE_FAULTS; break;
+    }
+
+    const long fd = ::syscall(SYS_perf_event_open, &attr, 0 /* (!) This thread */, -1 /* (!) Any CPU */, -1, 0);
+    if (fd < 0) {
+      const int error = errno;
+      fail(event, error == ENOENT || error == EOPNOTSUPP ? "no such counter here (no PMU in a VM or container?)"
+                  : error == EACCES || error == EPERM    ? "not permitted (perf_event_paranoid, or seccomp)"
+                                                         : std::strerror(error));
+      return;
+    }
+    m_fds[static_cast<unsigned>(event)] = static_cast<int>(fd);
+#else
+    fail(event, "perf_event_open is Linux only");
+#endif
+  }
+
+  void fail(PerfEvent event, std::string const& reason)
+  {
+    auto failure = std::find_if(m_failures.begin(), m_failures.end(), [&reason](auto&& f) { return f.first == reason; });
+    if (failure == m_failures.end()) {
+      failure = m_failures.insert(m_failures.end(), { reason, std::string() });
+    }
+    failure->second += std::string(" ") + perfEventName(event);
+  }
+
+  Reading read(unsigned index) const
+  {
+    Reading reading;
+#if defined(__linux__)
+    if (m_fds[index] >= 0) {
+      uint64_t values[3] = {};
+      if (::read(m_fds[index], values, sizeof(values)) == static_cast<ssize_t>(sizeof(values))) {
+        reading.value = values[0];
+        reading.enabled = values[1];
+        reading.running = values[2];
+      }
+    }
+#else
+    (void)index;
+#endif
+    return reading;
+  }
+
+  std::array<int, PerfEventCount> m_fds;
+  std::array<Reading, PerfEventCount> m_start;
+  std::vector<std::pair<std::string, std::string>> m_failures; /* (!) Reason, events */
+};
+
+/* (!) The counters of many threads, added together */
+class PerfTotals
+{
+public:
+  void add(PerfSample const& sample)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_total += sample;
+  }
+
+  PerfSample total() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_total;
+  }
+
+private:
+  mutable std::mutex m_mutex;
+  PerfSample m_total;
+};
+
+/* (!) Counts the calling thread from construction to destruction, into a PerfTotals */
+class ScopedPerfCounters
+{
+public:
+  explicit ScopedPerfCounters(PerfTotals& totals, std::vector<PerfEvent> const& events = PerfCounters::allEvents())
+    : m_totals(totals)
+    , m_counters(events)
+  {
+    m_counters.start(); /* (!) Opening the counters is not part of the region */
+  }
+
+  ~ScopedPerfCounters()
+  {
+    m_totals.add(m_counters.stop());
+  }
+
+  ScopedPerfCounters(ScopedPerfCounters const&) = delete;
+  ScopedPerfCounters& operator=(ScopedPerfCounters const&) = delete;
+
+private:
+  PerfTotals& m_totals;
+  PerfCounters m_counters;
+};
+
+/* (!) One line: IPC, then every counter per operation ("per element", "per push"...), n/a where unavailable */
+inline void printPerf(std::ostream& os, PerfSample const& sample, uint64_t operations, const char* unit)
+{
+  const auto flags = os.flags();
+  const auto precision = os.precision();
+  os << std::fixed << std::setprecision(3);
+
+  os << "IPC ";
+  if (sample.has(PerfEvent::Cycles) && sample.has(PerfEvent::Instructions)) {
+    os << sample.ipc();
+  } else {
+    os << "n/a";
+  }
+
+  os << " | " << unit << ":";
+  for (unsigned i = 0; i < PerfEventCount; ++i) {
+    const auto event = static_cast<PerfEvent>(i);
+    os << " " << perfEventName(event) << " ";
+    if (sample.has(event)) {
+      os << sample.per(event, operations);
+    } else {
+      os << "n/a";
+    }
+    if (i + 1 < PerfEventCount) {
+      os << ",";
+    }
+  }
+  os << std::endl;
+
+  os.flags(flags);
+  os.precision(precision);
+}
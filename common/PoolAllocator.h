@@ -0,0 +1,296 @@
+/*
+* Common: pool allocator
+*
+* ThreadSafeLinkedList (S2t02) allocates a list node from the global heap for every add(), inside its
+* critical section: the lock is held for the duration of a malloc, and the mallocs of all threads
+* contend in the heap as well.
+*
+* NodePool serves small blocks (up to MaxSize bytes, in size classes of Granularity bytes) from free
+* lists. Each thread has its own free list per size class, so allocating and freeing a node is a pop or
+* push without any atomic operation. A thread that frees more than it allocates (a consumer of nodes
+* another thread allocated) hands them back to a central pool in batches of BatchSize, under a mutex per
+* size class; a thread whose list runs empty takes a batch from there, or carves a new chunk. Memory is
+* never returned to the system: the pool only grows to the peak number of live nodes.
+*
+* PoolAllocator<T> is a stateless standard allocator on top of it, for the Allocator parameter of
+* std::list and friends. All PoolAllocators compare equal, so nodes can be spliced between containers:
+* a node allocated before taking a lock can be linked in under it (see common/Containers.h).
+* Requests for more than one object, or for bigger or overaligned types, go to operator new.
+*/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <vector>
+
+class NodePool
+{
+public:
+  static constexpr size_t Granularity = 16;
+  static constexpr size_t MaxSize = 256;
+  static constexpr size_t Classes = MaxSize / Granularity;
+  static constexpr size_t BatchSize = 64;         /* (!) Blocks moved to or from the central pool at once */
+  static constexpr size_t ChunkSize = 64 * 1024;
+
+  static NodePool& instance()
+  {
+    static NodePool* pool = new NodePool; /* (!) Never destroyed: containers with static storage may free into it at exit */
+    return *pool;
+  }
+
+  NodePool(NodePool const&) = delete;
+  NodePool& operator=(NodePool const&) = delete;
+
+  void* allocate(size_t size)
+  {
+    const size_t c = sizeClass(size);
+    Cache* caches = localCaches();
+    if (caches == nullptr) {
+      return fetchOne(c); /* (!) Thread exiting: its caches are gone */
+    }
+
+    Cache& cache = caches[c];
+    if (cache.head == nullptr) {
+      refill(c, cache);
+    }
+
+    Block* block = cache.head;
+    cache.head = block->next;
+    --cache.count;
+    return block;
+  }
+
+  void deallocate(void* p, size_t size) noexcept
+  {
+    const size_t c = sizeClass(size);
+    Block* block = static_cast<Block*>(p);
+    Cache* caches = localCaches();
+    if (caches == nullptr) {
+      giveBack(c, Batch{ block, 1 });
+      return;
+    }
+
+    Cache& cache = caches[c];
+    block->next = cache.head;
+    cache.head = block;
+    if (++cache.count >= 2 * BatchSize) { /* (!) Keeps BatchSize, so that alternating frees and allocations stay local */
+      giveBack(c, cache.split(BatchSize));
+    }
+  }
+
+  /* (!) Batches taken from or given to the central pool, and chunks carved, since the start */
+  uint64_t centralTransfers() const
+  {
+    return m_transfers.load(std::memory_order_relaxed);
+  }
+
+  uint64_t chunks() const
+  {
+    return m_chunks.load(std::memory_order_relaxed);
+  }
+
+private:
+  struct Block
+  {
+    Block* next;
+  };
+
+  struct Batch
+  {
+    Block* head;
+    size_t count;
+  };
+
+  struct Cache
+  {
+    Block* head = nullptr;
+    size_t count = 0;
+
+    /* (!) Detaches the first n blocks */
+    Batch split(size_t n)
+    {
+      Batch batch{ head, n };
+      Block* last = head;
+      for (size_t i = 1; i < n; ++i) {
+        last = last->next;
+      }
+      head = last->next;
+      last->next = nullptr;
+      count -= n;
+      return batch;
+    }
+  };
+
+  struct alignas(64) Central
+  {
+    std::mutex mutex;
+    std::vector<Batch> batches;
+  };
+
+  /* (!) Hands the thread's blocks back to the central pool when it exits */
+  struct LocalCaches
+  {
+    Cache caches[Classes];
+
+    ~LocalCaches()
+    {
+      for (size_t c = 0; c < Classes; ++c) {
+        if (caches[c].head != nullptr) {
+          instance().giveBack(c, Batch{ caches[c].head, caches[c].count });
+        }
+      }
+      state() = Destroyed;
+    }
+  };
+
+  enum State
+  {
+    Uninitialized,
+    Live,
+    Destroyed
+  };
+
+  NodePool() = default;
+
+  static size_t sizeClass(size_t size)
+  {
+    return (size + Granularity - 1) / Granularity - 1;
+  }
+
+  static size_t blockSize(size_t c)
+  {
+    return (c + 1) * Granularity;
+  }
+
+  /* (!) Trivially destructible, so it can still be read after LocalCaches is destroyed */
+  static State& state()
+  {
+    static thread_local State s = Uninitialized;
+    return s;
+  }
+
+  static Cache* localCaches()
+  {
+    State& s = state();
+    if (s == Live) {
+      return local().caches;
+    }
+    if (s == Destroyed) {
+      return nullptr;
+    }
+    s = Live;
+    return local().caches; /* (!) The first use constructs it */
+  }
+
+  static LocalCaches& local()
+  {
+    static thread_local LocalCaches caches;
+    return caches;
+  }
+
+  void refill(size_t c, Cache& cache)
+  {
+    m_transfers.fetch_add(1, std::memory_order_relaxed);
+    {
+      std::lock_guard<std::mutex> lock(m_central[c].mutex);
+      auto& batches = m_central[c].batches;
+      if (!batches.empty()) {
+        cache.head = batches.back().head;
+        cache.count = batches.back().count;
+        batches.pop_back();
+        return;
+      }
+    }
+    carve(c, cache);
+  }
+
+  /* (!) Cuts a new chunk into blocks of the class, all for the calling thread */
+  void carve(size_t c, Cache& cache)
+  {
+    m_chunks.fetch_add(1, std::memory_order_relaxed);
+    const size_t size = blockSize(c);
+    const size_t blocks = ChunkSize / size;
+    char* chunk = static_cast<char*>(::operator new(blocks * size)); /* (!) Never freed, see instance() */
+
+    for (size_t i = 0; i < blocks; ++i) {
+      reinterpret_cast<Block*>(chunk + i * size)->next = i + 1 < blocks ? reinterpret_cast<Block*>(chunk + (i + 1) * size) : cache.head;
+    }
+    cache.head = reinterpret_cast<Block*>(chunk);
+    cache.count += blocks;
+  }
+
+  void* fetchOne(size_t c)
+  {
+    Cache cache;
+    refill(c, cache);
+    Block* block = cache.head;
+    cache.head = block->next;
+    if (--cache.count != 0) {
+      giveBack(c, Batch{ cache.head, cache.count });
+    }
+    return block;
+  }
+
+  void giveBack(size_t c, Batch batch) noexcept
+  {
+    m_transfers.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(m_central[c].mutex);
+    m_central[c].batches.push_back(batch); /* (!) Could throw bad_alloc, and end the program as noexcept */
+  }
+
+  Central m_central[Classes];
+  std::atomic<uint64_t> m_transfers{ 0 };
+  std::atomic<uint64_t> m_chunks{ 0 };
+};
+
+template<typename T>
+class PoolAllocator
+{
+public:
+  using value_type = T;
+
+  PoolAllocator() noexcept = default;
+
+  template<typename U>
+  PoolAllocator(PoolAllocator<U> const&) noexcept
+  {
+  }
+
+  T* allocate(size_t n)
+  {
+    if (pooled(n)) {
+      return static_cast<T*>(NodePool::instance().allocate(sizeof(T)));
+    }
+    return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, size_t n) noexcept
+  {
+    if (pooled(n)) {
+      NodePool::instance().deallocate(p, sizeof(T));
+    } else {
+      ::operator delete(p);
+    }
+  }
+
+private:
+  static constexpr bool pooled(size_t n)
+  {
+    return n == 1 && sizeof(T) <= NodePool::MaxSize && alignof(T) <= alignof(std::max_align_t);
+  }
+};
+
+template<typename T, typename U>
+bool operator==(PoolAllocator<T> const&, PoolAllocator<U> const&) noexcept
+{
+  return true;
+}
+
+template<typename T, typename U>
+bool operator!=(PoolAllocator<T> const&, PoolAllocator<U> const&) noexcept
+{
+  return false;
+}
@@ -0,0 +1,322 @@
+/*
+* Common: queue locks
+*
+* std::mutex makes no promise about who gets the lock next. Under contention, the thread that has just
+* released it usually takes it again before a sleeping waiter has even woken up, so some threads starve;
+* and all waiters wait on the same word, whose cache line every acquisition moves around. These locks
+* serve their waiters in arrival order instead:
+*
+*   - TicketLock: take a number, wait until it is served. Waiters still share the "now serving" line,
+*     but back off in proportion to the number of waiters ahead of them, so they read it less often
+*   - McsLock: waiters form a linked list, each one waiting on a flag in its own node, which its
+*     predecessor clears on unlock. A release touches one other cache line, whatever the queue length
+*   - ClhLock: the same with the list the other way round: each waiter waits on its predecessor's node,
+*     and takes that node over for its next acquisition
+*
+* All three are Lockable (lock, try_lock, unlock), so std::lock_guard, std::unique_lock and std::lock
+* take them like a std::mutex. try_lock() never waits: it only takes a lock that nobody holds or waits
+* for, which std::lock relies on to take two locks without deadlocking. The queue nodes come from a
+* per-thread cache; the lock remembers the holder's node, so lock() and unlock() need no extra argument.
+* Nodes are never freed while the program runs (a thread that exits hands its nodes to a global list for
+* the next one): a releasing thread may still touch a node when its owner has long gone.
+*
+* Every wait is a Futex wait (common/Futex.h): it spins briefly, then sleeps. A strictly FIFO lock
+* hands over to the waiter at the head of the queue even if it was preempted, so on machines with
+* fewer cores than threads the handover costs a wakeup, which is the price of the fairness.
+*/
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Futex.h"
+
+namespace detail
+{
+  /* (!) Queue nodes of the calling thread. Node must be default constructible */
+  template<typename Node>
+  class NodeCache
+  {
+  public:
+    static Node* take()
+    {
+      auto& free = local().free;
+      if (free.empty()) {
+        return global().take();
+      }
+      Node* node = free.back();
+      free.pop_back();
+      return node;
+    }
+
+    static void give(Node* node)
+    {
+      local().free.push_back(node);
+    }
+
+  private:
+    struct Global
+    {
+      std::mutex mutex;
+      std::vector<Node*> free;
+
+      Node* take()
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (free.empty()) {
+          return new Node;
+        }
+        Node* node = free.back();
+        free.pop_back();
+        return node;
+      }
+    };
+
+    struct Local
+    {
+      std::vector<Node*> free;
+
+      ~Local()
+      {
+        Global& g = global();
+        std::lock_guard<std::mutex> lock(g.mutex);
+        g.free.insert(g.free.end(), free.begin(), free.end());
+      }
+    };
+
+    static Global& global()
+    {
+      static Global* g = new Global; /* (!) Never destroyed, like the nodes: threads may exit after main() */
+      return *g;
+    }
+
+    static Local& local()
+    {
+      static thread_local Local l;
+      return l;
+    }
+  };
+}
+
+class TicketLock
+{
+public:
+  static constexpr unsigned BackoffPerWaiter = 64; /* (!) Pauses between two reads, per waiter ahead */
+  static constexpr unsigned BackoffRounds = 16;    /* (!) Reads before sleeping */
+
+  TicketLock() = default;
+  TicketLock(TicketLock const&) = delete;
+  TicketLock& operator=(TicketLock const&) = delete;
+
+  void lock()
+  {
+    const uint32_t ticket = m_next.fetch_add(1, std::memory_order_relaxed);
+    const unsigned rounds = Futex::defaultSpins() != 0 ? BackoffRounds : 0;
+
+    for (unsigned round = 0;; ++round) {
+      const uint32_t serving = m_serving.load(std::memory_order_acquire);
+      if (serving == ticket) {
+        return;
+      }
+
+      if (round < rounds) {
+        const uint32_t ahead = ticket - serving; /* (!) Wraps around correctly */
+        for (unsigned i = 0; i < ahead * BackoffPerWaiter; ++i) {
+          cpuRelax();
+        }
+      } else {
+        m_serving.waitWhileEqual(serving, 0); /* (!) Woken by every release, and waits again if it's not its turn */
+      }
+    }
+  }
+
+  bool try_lock()
+  {
+    uint32_t serving = m_serving.load(std::memory_order_acquire);
+    return m_next.compare_exchange_strong(serving, serving + 1, std::memory_order_acquire); /* (!) Only if nobody holds or waits */
+  }
+
+  void unlock()
+  {
+    m_serving.store(m_serving.load(std::memory_order_relaxed) + 1);
+    m_serving.notifyAll();
+  }
+
+private:
+  alignas(64) std::atomic<uint32_t> m_next{ 0 };
+  alignas(64) Futex m_serving{ 0 };
+};
+
+class McsLock
+{
+public:
+  McsLock() = default;
+  McsLock(McsLock const&) = delete;
+  McsLock& operator=(McsLock const&) = delete;
+
+  void lock()
+  {
+    Node* node = enqueueable();
+    Node* predecessor = m_tail.exchange(node, std::memory_order_acq_rel);
+    if (predecessor != nullptr) {
+      predecessor->next.store(node, std::memory_order_release);
+      node->waiting.waitWhileEqual(1); /* (!) Our own node: nobody else waits on this line */
+    }
+    m_holder = node;
+  }
+
+  bool try_lock()
+  {
+    Node* node = enqueueable();
+    Node* empty = nullptr;
+    if (!m_tail.compare_exchange_strong(empty, node, std::memory_order_acq_rel)) {
+      detail::NodeCache<Node>::give(node);
+      return false;
+    }
+    m_holder = node;
+    return true;
+  }
+
+  void unlock()
+  {
+    Node* node = m_holder;
+    Node* successor = node->next.load(std::memory_order_acquire);
+
+    if (successor == nullptr) {
+      Node* expected = node;
+      if (m_tail.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel)) {
+        detail::NodeCache<Node>::give(node);
+        return;
+      }
+
+      const unsigned spins = Futex::defaultSpins();
+      for (unsigned i = 0; (successor = node->next.load(std::memory_order_acquire)) == nullptr; ++i) {
+        if (i < spins) { /* (!) A successor has swapped the tail but not linked itself in yet */
+          cpuRelax();
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    }
+
+    successor->waiting.store(0);
+    successor->waiting.notifyOne();
+    detail::NodeCache<Node>::give(node);
+  }
+
+private:
+  struct alignas(64) Node
+  {
+    std::atomic<Node*> next{ nullptr };
+    Futex waiting{ 1 };
+  };
+
+  static Node* enqueueable()
+  {
+    Node* node = detail::NodeCache<Node>::take();
+    node->next.store(nullptr, std::memory_order_relaxed);
+    node->waiting.store(1);
+    return node;
+  }
+
+  alignas(64) std::atomic<Node*> m_tail{ nullptr };
+  Node* m_holder = nullptr; /* (!) Only used by the thread holding the lock */
+};
+
+class ClhLock
+{
+public:
+  ClhLock()
+    : m_tail(tagged(new Node))
+  {
+  }
+
+  ClhLock(ClhLock const&) = delete;
+  ClhLock& operator=(ClhLock const&) = delete;
+
+  ~ClhLock()
+  {
+    delete nodeOf(m_tail.load()); /* (!) The node of the last release; every other node belongs to some thread's cache */
+  }
+
+  void lock()
+  {
+    Node* node = enqueueable();
+    Node* predecessor = nodeOf(m_tail.exchange(tagged(node), std::memory_order_acq_rel));
+    predecessor->locked.waitWhileEqual(1); /* (!) Each waiter watches a different node */
+    acquired(node, predecessor);
+  }
+
+  /* (!) Never waits: the tail is only replaced if it is still the same enqueue of a released node */
+  bool try_lock()
+  {
+    uint64_t tail = m_tail.load(std::memory_order_acquire);
+    Node* predecessor = nodeOf(tail);
+    if (predecessor->locked.load() != 0) {
+      return false;
+    }
+
+    Node* node = enqueueable();
+    if (!m_tail.compare_exchange_strong(tail, tagged(node), std::memory_order_acq_rel)) {
+      detail::NodeCache<Node>::give(node);
+      return false;
+    }
+    acquired(node, predecessor);
+    return true;
+  }
+
+  void unlock()
+  {
+    Node* node = m_holder;
+    detail::NodeCache<Node>::give(m_predecessor); /* (!) Nobody waits on it any more: it becomes ours */
+    node->locked.store(0);
+    node->locked.notifyOne();
+  }
+
+private:
+  struct alignas(64) Node
+  {
+    Futex locked{ 0 };
+    uint64_t enqueues = 0; /* (!) Only changed by the thread whose cache the node is in */
+  };
+
+  /*
+  * (!) A node that try_lock() saw released at the tail can be reused and queued again before its
+  * compare-exchange: comparing the pointer alone, it would then queue behind a holder. So the tail also
+  * holds the node's enqueue count, in the bits of the address that user space doesn't use (above bit
+  * 47 on 64-bit machines, the upper half on 32-bit ones): the same node queued again is another value.
+  */
+  static constexpr unsigned CountShift = sizeof(void*) == 8 ? 48 : 32;
+  static constexpr uint64_t AddressMask = (uint64_t(1) << CountShift) - 1;
+
+  static uint64_t tagged(Node* node)
+  {
+    return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(node)) | node->enqueues << CountShift;
+  }
+
+  static Node* nodeOf(uint64_t tail)
+  {
+    return reinterpret_cast<Node*>(static_cast<uintptr_t>(tail & AddressMask));
+  }
+
+  static Node* enqueueable()
+  {
+    Node* node = detail::NodeCache<Node>::take();
+    node->locked.store(1);
+    ++node->enqueues;
+    return node;
+  }
+
+  void acquired(Node* node, Node* predecessor)
+  {
+    m_holder = node;
+    m_predecessor = predecessor;
+  }
+
+  alignas(64) std::atomic<uint64_t> m_tail;
+  Node* m_holder = nullptr; /* (!) Only used by the thread holding the lock */
+  Node* m_predecessor = nullptr;
+};
\ No newline at end of file
@@ -0,0 +1,139 @@
+/*
+* Common: sequence lock
+*
+* The s2t04/s2t05 Widget locks m_mutex for every access. For small state that is read all the time and
+* written rarely (a configuration record, a snapshot of statistics) that is the wrong trade: every read
+* writes the mutex's cache line, so readers on different cores take it from each other even though none
+* of them changes anything. std::shared_mutex doesn't help, its reader count is just as shared.
+*
+* SeqLocked<T> keeps a sequence number next to the value. A writer makes it odd, writes, and makes it
+* even again; a reader reads the number, copies the value, and reads the number again, retrying if it
+* changed or was odd. Readers write nothing shared, so they scale with the number of cores; a writer
+* never waits for them, and readers only retry while a write is in progress.
+*
+* T must be trivially copyable: a reader may copy a half-written value before it notices and retries.
+* The value is kept in atomic words read and written relaxed, so the torn copy is not a data race.
+*
+* SeqLocked<T> expects one writer at a time (one thread, or writers serialized by their own lock).
+* MultiWriterSeqLocked<T> takes the odd sequence number with a compare-and-swap instead, which makes it
+* the writers' lock as well.
+*/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "Futex.h"
+
+template<typename T, bool MultipleWriters = false>
+class SeqLocked
+{
+  static_assert(std::is_trivially_copyable<T>::value, "Readers copy the value while it may be written");
+
+public:
+  explicit SeqLocked(T const& value = T())
+  {
+    store(value);
+  }
+
+  SeqLocked(SeqLocked const&) = delete;
+  SeqLocked& operator=(SeqLocked const&) = delete;
+
+  T read() const noexcept
+  {
+    T value;
+    for (;;) {
+      const uint32_t before = m_sequence.load(std::memory_order_acquire);
+      if (before & 1) {
+        cpuRelax(); /* (!) A write is in progress */
+        continue;
+      }
+
+      load(value);
+      std::atomic_thread_fence(std::memory_order_acquire); /* (!) The copy may not move after the second read */
+
+      if (m_sequence.load(std::memory_order_relaxed) == before) {
+        return value;
+      }
+    }
+  }
+
+  void write(T const& value) noexcept
+  {
+    const uint32_t sequence = beginWrite();
+    store(value);
+    m_sequence.store(sequence + 2, std::memory_order_release);
+  }
+
+  /* (!) Read, modify, write as one write: f(T&) sees the latest value */
+  template<typename Function>
+  void update(Function f)
+  {
+    const uint32_t sequence = beginWrite();
+    T value;
+    load(value);
+    f(value);
+    store(value);
+    m_sequence.store(sequence + 2, std::memory_order_release);
+  }
+
+  /* (!) Even while no write is in progress; changes with every write */
+  uint32_t sequence() const noexcept
+  {
+    return m_sequence.load(std::memory_order_acquire);
+  }
+
+private:
+  using Word = uintptr_t; /* (!) Lock-free everywhere: 64-bit atomics on 32-bit x86 may be a locked instruction, a write */
+
+  static constexpr size_t Words = (sizeof(T) + sizeof(Word) - 1) / sizeof(Word);
+
+  /* (!) Returns the even sequence number the write started from; the number is odd from here on */
+  uint32_t beginWrite() noexcept
+  {
+    uint32_t sequence = m_sequence.load(std::memory_order_acquire); /* (!) After the previous write, for update() to load its words */
+
+    if constexpr (MultipleWriters) {
+      for (;;) {
+        if (!(sequence & 1) &&
+            m_sequence.compare_exchange_weak(sequence, sequence + 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+          break; /* (!) Acquire: synchronizes with the previous writer's release of the sequence */
+        }
+        cpuRelax();
+        sequence = m_sequence.load(std::memory_order_relaxed);
+      }
+    } else {
+      m_sequence.store(sequence + 1, std::memory_order_relaxed);
+    }
+
+    std::atomic_thread_fence(std::memory_order_release); /* (!) A reader that sees any new word also sees the odd number */
+    return sequence;
+  }
+
+  void load(T& value) const noexcept
+  {
+    Word words[Words];
+    for (size_t i = 0; i < Words; ++i) {
+      words[i] = m_words[i].load(std::memory_order_relaxed);
+    }
+    std::memcpy(&value, words, sizeof(T));
+  }
+
+  void store(T const& value) noexcept
+  {
+    Word words[Words] = {};
+    std::memcpy(words, &value, sizeof(T));
+    for (size_t i = 0; i < Words; ++i) {
+      m_words[i].store(words[i], std::memory_order_relaxed);
+    }
+  }
+
+  alignas(64) std::atomic<uint32_t> m_sequence{ 0 }; /* (!) With the value on one cache line: a read is one miss */
+  std::atomic<Word> m_words[Words];
+};
+
+template<typename T>
+using MultiWriterSeqLocked = SeqLocked<T, true>;
@@ -0,0 +1,233 @@
+/*
+* Common: shared memory
+*
+* Everything else in common/ shares memory between the threads of one process. SharedMemory maps a
+* named region that several processes of one machine map at once: shm_open and mmap on POSIX, a named
+* file mapping backed by the paging file on Windows.
+*
+*   - SharedMemory(name, size) creates the region, replacing one of the same name that a crashed run
+*     left behind, and fills it with zeros. On Windows a region goes away with the last process that maps
+*     it, so one of the same name belongs to a running process, and the constructor fails instead
+*   - SharedMemory(name) opens a region that another process created
+*
+* Each process may map the region at a different address, so whatever lives in it must not hold
+* pointers, only offsets (common/SharedRing.h). On POSIX the name stays until remove(): the creator
+* removes it once everybody has opened it, or at the end. Errors raise a std::system_error.
+*
+* processAlive() tells the structures in the region whether a peer that left something half done is
+* still running (on Linux, a zombie that its parent hasn't waited for yet counts as dead). Process ids
+* are reused, so a crashed peer may look alive for a while longer; the peers must also share a process
+* id namespace (one container, or none).
+*/
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <system_error>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace detail
+{
+  constexpr std::chrono::milliseconds PeerCheckInterval{ 10 }; /* (!) How long a waiter sleeps before it looks for crashed peers */
+}
+
+/* (!) getpid() is a system call: cached, and forgotten in the child of a fork() */
+inline uint32_t currentProcess()
+{
+#if defined(_WIN32)
+  return static_cast<uint32_t>(::GetCurrentProcessId());
+#else
+  static std::atomic<uint32_t> cached{ 0 };
+  uint32_t process = cached.load(std::memory_order_relaxed);
+  if (process == 0) {
+    static const int forgetOnFork = ::pthread_atfork(nullptr, nullptr, [] { cached.store(0, std::memory_order_relaxed); });
+    (void)forgetOnFork;
+    process = static_cast<uint32_t>(::getpid());
+    cached.store(process, std::memory_order_relaxed);
+  }
+  return process;
+#endif
+}
+
+inline bool processAlive(uint32_t process)
+{
+#if defined(_WIN32)
+  HANDLE handle = ::OpenProcess(SYNCHRONIZE, FALSE, process);
+  if (handle == nullptr) {
+    return ::GetLastError() == ERROR_ACCESS_DENIED; /* (!) Exists, but isn't ours to look at */
+  }
+  const bool running = ::WaitForSingleObject(handle, 0) == WAIT_TIMEOUT;
+  ::CloseHandle(handle);
+  return running;
+#else
+  if (::kill(static_cast<pid_t>(process), 0) != 0 && errno != EPERM) { /* (!) Signal 0: only checks that the process exists */
+    return false;
+  }
+#if defined(__linux__)
+  std::ifstream status("/proc/" + std::to_string(process) + "/stat"); /* (!) A dead child exists until its parent waits for it */
+  std::string line;
+  if (std::getline(status, line)) {
+    const size_t name = line.rfind(')');
+    if (name != std::string::npos && name + 2 < line.size() && (line[name + 2] == 'Z' || line[name + 2] == 'X')) {
+      return false;
+    }
+  }
+#endif
+  return true;
+#endif
+}
+
+class SharedMemory
+{
+public:
+  /* (!) Creates the region */
+  SharedMemory(std::string const& name, size_t size)
+    : m_size(size)
+  {
+#if defined(_WIN32)
+    m_mapping = ::CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, static_cast<DWORD>(static_cast<uint64_t>(size) >> 32),
+                                     static_cast<DWORD>(size), name.c_str());
+    if (m_mapping == nullptr) {
+      fail("Can't create " + name);
+    }
+    if (::GetLastError() == ERROR_ALREADY_EXISTS) { /* (!) Another process's region, which CreateFileMapping would just open */
+      ::CloseHandle(m_mapping);
+      throw std::system_error(ERROR_ALREADY_EXISTS, std::system_category(), "Can't create " + name + ": in use");
+    }
+    map(name);
+#else
+    ::shm_unlink(name.c_str()); /* (!) Left behind by a crashed run, or missing */
+    const int file = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (file < 0) {
+      fail("Can't create " + name);
+    }
+    if (::ftruncate(file, static_cast<off_t>(size)) != 0) {
+      const int error = errno;
+      ::close(file);
+      ::shm_unlink(name.c_str());
+      errno = error;
+      fail("Can't size " + name);
+    }
+    map(file, name);
+#endif
+  }
+
+  /* (!) Opens the region that another process created */
+  explicit SharedMemory(std::string const& name)
+  {
+#if defined(_WIN32)
+    m_mapping = ::OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+    if (m_mapping == nullptr) {
+      fail("Can't open " + name);
+    }
+    map(name);
+#else
+    const int file = ::shm_open(name.c_str(), O_RDWR, 0);
+    if (file < 0) {
+      fail("Can't open " + name);
+    }
+    struct stat status;
+    if (::fstat(file, &status) != 0) {
+      const int error = errno;
+      ::close(file);
+      errno = error;
+      fail("Can't get the size of " + name);
+    }
+    m_size = static_cast<size_t>(status.st_size);
+    map(file, name);
+#endif
+  }
+
+  ~SharedMemory()
+  {
+#if defined(_WIN32)
+    ::UnmapViewOfFile(m_view);
+    ::CloseHandle(m_mapping);
+#else
+    ::munmap(m_view, m_size);
+#endif
+  }
+
+  SharedMemory(SharedMemory const&) = delete;
+  SharedMemory& operator=(SharedMemory const&) = delete;
+
+  /* (!) The name goes, the mappings stay until their processes unmap them. Nothing to do on Windows */
+  static void remove(std::string const& name)
+  {
+#if !defined(_WIN32)
+    ::shm_unlink(name.c_str());
+#else
+    (void)name;
+#endif
+  }
+
+  void* data() const
+  {
+    return m_view;
+  }
+
+  size_t size() const
+  {
+    return m_size;
+  }
+
+private:
+#if defined(_WIN32)
+  void map(std::string const& name)
+  {
+    m_view = ::MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (m_view == nullptr) {
+      const DWORD error = ::GetLastError();
+      ::CloseHandle(m_mapping);
+      ::SetLastError(error);
+      fail("Can't map " + name);
+    }
+    MEMORY_BASIC_INFORMATION information;
+    if (m_size == 0 && ::VirtualQuery(m_view, &information, sizeof(information)) != 0) {
+      m_size = information.RegionSize; /* (!) Rounded up to whole pages */
+    }
+  }
+#else
+  void map(int file, std::string const& name)
+  {
+    void* view = ::mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    const int error = errno;
+    ::close(file); /* (!) The mapping keeps the region */
+    if (view == MAP_FAILED) {
+      errno = error;
+      fail("Can't map " + name);
+    }
+    m_view = view;
+  }
+#endif
+
+  [[noreturn]] static void fail(std::string const& what)
+  {
+#if defined(_WIN32)
+    throw std::system_error(static_cast<int>(::GetLastError()), std::system_category(), what);
+#else
+    throw std::system_error(errno, std::generic_category(), what);
+#endif
+  }
+
+#if defined(_WIN32)
+  HANDLE m_mapping = nullptr;
+#endif
+  void* m_view = nullptr;
+  size_t m_size = 0;
+};
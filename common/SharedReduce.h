@@ -0,0 +1,179 @@
+/*
+* Common: shared reduction
+*
+* accumulateParallel (s1t15, common/ParallelReduce.h) combines the results of the threads of one
+* process. When the work is spread over processes, each one reduces its own share (with
+* accumulateParallel, or sumDeterministic from common/DeterministicReduce.h) and SharedReduction<T>
+* combines their partial results. It lives in a SharedMemory region (common/SharedMemory.h), with a slot
+* per participant, numbered 0 to participants - 1:
+*
+*   - join(rank), as soon as the participant starts: its process id goes into its slot
+*   - contribute(rank, part), when its part is ready
+*   - combine(init, op) in one of them (or in another process): waits for every part, then reduces them
+*     in rank order, so that the result doesn't depend on which process finished first
+*
+* A participant that crashes before it contributes would make combine() wait forever, so combine()
+* stops waiting for a participant whose process is gone, and for one that hasn't joined after a timeout.
+* Their ranks come back in Combined::missing, for the caller to redo their share or give up. A
+* participant that hangs is still alive: combine() waits for it. A region serves one reduction.
+*/
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "Futex.h"
+#include "SharedMemory.h"
+
+template<typename T>
+class SharedReduction
+{
+public:
+  static_assert(std::is_trivially_copyable<T>::value, "The parts are copied into shared memory");
+
+  static constexpr uint32_t Magic = 0x43554452; /* (!) "RDUC", written last by create() */
+
+  struct Combined
+  {
+    T value;
+    std::vector<size_t> missing;
+  };
+
+  static size_t bytes(size_t participants)
+  {
+    return headerBytes() + participants * sizeof(Slot);
+  }
+
+  static SharedReduction* create(void* memory, size_t participants)
+  {
+    auto* reduction = new (memory) SharedReduction(participants);
+    for (size_t rank = 0; rank < participants; ++rank) {
+      new (&reduction->slot(rank)) Slot();
+    }
+    reduction->m_magic.store(Magic, std::memory_order_release);
+    return reduction;
+  }
+
+  /* (!) Waits a second at most for the creator to finish create() */
+  static SharedReduction* attach(void* memory)
+  {
+    auto* reduction = static_cast<SharedReduction*>(memory);
+    for (int i = 0; reduction->m_magic.load(std::memory_order_acquire) != Magic; ++i) {
+      if (i == 1000) {
+        throw std::runtime_error("No SharedReduction in this memory");
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return reduction;
+  }
+
+  SharedReduction(SharedReduction const&) = delete;
+  SharedReduction& operator=(SharedReduction const&) = delete;
+
+  size_t participants() const
+  {
+    return m_participants;
+  }
+
+  void join(size_t rank)
+  {
+    slot(checked(rank)).state.store(Joined | currentProcess(), std::memory_order_release);
+  }
+
+  void contribute(size_t rank, T const& part)
+  {
+    Slot& s = slot(checked(rank));
+    s.part = part;
+    s.state.store(Contributed, std::memory_order_release);
+    m_contributions.fetchAdd(1);
+    m_contributions.notifyAll();
+  }
+
+  /* (!) timeout: for the participants that haven't joined */
+  template<typename BinaryOperation = std::plus<>>
+  Combined combine(T init, BinaryOperation op = BinaryOperation(), std::chrono::milliseconds timeout = std::chrono::seconds(10))
+  {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    Combined result{ init, {} };
+
+    for (;;) {
+      const uint32_t contributions = m_contributions.load();
+      const bool late = std::chrono::steady_clock::now() >= deadline;
+      bool waiting = false;
+      result.missing.clear();
+
+      for (size_t rank = 0; rank < m_participants; ++rank) {
+        const uint64_t state = slot(rank).state.load(std::memory_order_acquire);
+        if (state == Contributed) {
+          continue;
+        }
+        const bool gone = state == 0 ? late : !processAlive(static_cast<uint32_t>(state));
+        if (gone) {
+          result.missing.push_back(rank);
+        } else {
+          waiting = true;
+        }
+      }
+      if (!waiting) {
+        break;
+      }
+      m_contributions.waitWhileEqualFor(contributions, detail::PeerCheckInterval); /* (!) Nobody wakes us when a participant dies */
+    }
+
+    for (size_t rank = 0, m = 0; rank < m_participants; ++rank) {
+      if (m < result.missing.size() && result.missing[m] == rank) {
+        ++m;
+      } else if (slot(rank).state.load(std::memory_order_acquire) == Contributed) {
+        result.value = op(result.value, slot(rank).part);
+      }
+    }
+    return result;
+  }
+
+private:
+  static constexpr uint64_t Joined = uint64_t(1) << 32;      /* (!) | process id */
+  static constexpr uint64_t Contributed = uint64_t(2) << 32;
+
+  struct Slot
+  {
+    std::atomic<uint64_t> state{ 0 };
+    T part{};
+  };
+
+  static_assert(std::atomic<uint64_t>::is_always_lock_free, "Atomics in shared memory can't hide a lock");
+
+  explicit SharedReduction(size_t participants)
+    : m_participants(participants)
+  {
+  }
+
+  size_t checked(size_t rank) const
+  {
+    if (rank >= m_participants) {
+      throw std::out_of_range("No such participant in the SharedReduction");
+    }
+    return rank;
+  }
+
+  static size_t headerBytes()
+  {
+    return (sizeof(SharedReduction) + alignof(Slot) - 1) / alignof(Slot) * alignof(Slot);
+  }
+
+  Slot& slot(size_t rank)
+  {
+    return reinterpret_cast<Slot*>(reinterpret_cast<char*>(this) + headerBytes())[rank]; /* (!) Wherever this process mapped it */
+  }
+
+  std::atomic<uint32_t> m_magic{ 0 };
+  const size_t m_participants;
+  Futex m_contributions{ 0, Futex::ProcessShared() };
+};
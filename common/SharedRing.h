@@ -0,0 +1,301 @@
+/*
+* Common: shared ring
+*
+* ThreadSafeStack (s2t09) and ThreadSafeLinkedList (S2t02) hold pointers and a std::mutex, so they only
+* work within one process. SharedRing is a bounded queue of messages (up to messageSize() bytes each)
+* that lives entirely in a SharedMemory region (common/SharedMemory.h), for several processes of one
+* machine to exchange packets:
+*
+*   - it holds offsets instead of pointers, so every process may map the region at its own address
+*   - any number of processes (and threads) may push and pop: it is Vyukov's bounded queue, where
+*     each cell says whose turn it is and the positions only count. With one producer and one
+*     consumer the compare-exchanges never fail, so it doubles as the SPSC ring
+*   - push() and pop() wait while the ring is full or empty on process-shared Futexes, which the other
+*     side only wakes (a system call) when somebody sleeps
+*
+* A process can die in the middle of a push or a pop, leaving a cell claimed forever. So a claim
+* records the process id in the cell's state word along with the lap and the phase, and a waiter that
+* has made no progress for PeerCheckInterval looks at the cells it is stuck behind: one that a dead
+* process was writing is dropped, one that a dead process was reading is freed, and its message is lost.
+* recoveries() counts them. Messages from live processes are never lost nor duplicated.
+*
+* create() builds the ring at the start of the region, which must hold bytes(capacity, messageSize);
+* the other processes attach(). All of them must run the same build: the layout is the compiler's.
+*/
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+#include "Futex.h"
+#include "SharedMemory.h"
+
+class SharedRing
+{
+public:
+  static constexpr uint32_t Magic = 0x474E4952; /* (!) "RING", written last by create() */
+  static constexpr size_t CacheLine = 64;
+
+  static size_t bytes(size_t capacity, size_t messageSize)
+  {
+    return headerBytes() + capacity * cellBytes(messageSize);
+  }
+
+  /* (!) capacity: a power of two */
+  static SharedRing* create(void* memory, size_t capacity, size_t messageSize)
+  {
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+      throw std::invalid_argument("The capacity of a SharedRing is a power of two");
+    }
+    auto* ring = new (memory) SharedRing(capacity, messageSize);
+    for (size_t i = 0; i < capacity; ++i) {
+      new (&ring->cell(i)) Cell{ { encode(0, Empty, 0) }, 0 };
+    }
+    ring->m_magic.store(Magic, std::memory_order_release);
+    return ring;
+  }
+
+  /* (!) Waits a second at most for the creator to finish create() */
+  static SharedRing* attach(void* memory)
+  {
+    auto* ring = static_cast<SharedRing*>(memory);
+    for (int i = 0; ring->m_magic.load(std::memory_order_acquire) != Magic; ++i) {
+      if (i == 1000) {
+        throw std::runtime_error("No SharedRing in this memory");
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return ring;
+  }
+
+  SharedRing(SharedRing const&) = delete;
+  SharedRing& operator=(SharedRing const&) = delete;
+
+  size_t capacity() const
+  {
+    return m_capacity;
+  }
+
+  size_t messageSize() const
+  {
+    return m_messageSize;
+  }
+
+  uint64_t recoveries() const
+  {
+    return m_recoveries.load(std::memory_order_relaxed);
+  }
+
+  /* (!) False if the ring is full */
+  bool tryPush(void const* message, size_t size)
+  {
+    if (size > m_messageSize) {
+      throw std::length_error("Message larger than the cells of the SharedRing");
+    }
+
+    const uint32_t process = currentProcess();
+    for (;;) {
+      uint64_t position = m_enqueue.load(std::memory_order_acquire);
+      Cell& c = cell(position);
+      const uint32_t lap = lapAt(position);
+      uint64_t state = c.state.load(std::memory_order_acquire);
+
+      if (state == encode(lap, Empty, 0)) {
+        if (c.state.compare_exchange_strong(state, encode(lap, Writing, process))) {
+          m_enqueue.compare_exchange_strong(position, position + 1); /* (!) Or another producer did, seeing our claim */
+          c.size = static_cast<uint32_t>(size);
+          std::memcpy(payload(c), message, size);
+          c.state.store(encode(lap, Full, 0), std::memory_order_release);
+          m_pushed.fetchAdd(1);
+          m_pushed.notifyOne();
+          return true;
+        }
+      } else if (lapOf(state) == lap || lapOf(state) == nextLap(lap)) {
+        m_enqueue.compare_exchange_strong(position, position + 1); /* (!) Claimed, or dropped by a recovery: help it past */
+      } else if (lapOf(state) == previousLap(lap)) {
+        return false; /* (!) The message of the previous lap is still there */
+      }
+    }
+  }
+
+  /* (!) False if the ring is empty. buffer holds messageSize() bytes */
+  bool tryPop(void* buffer, size_t& size)
+  {
+    const uint32_t process = currentProcess();
+    for (;;) {
+      uint64_t position = m_dequeue.load(std::memory_order_acquire);
+      Cell& c = cell(position);
+      const uint32_t lap = lapAt(position);
+      uint64_t state = c.state.load(std::memory_order_acquire);
+
+      if (state == encode(lap, Full, 0)) {
+        if (c.state.compare_exchange_strong(state, encode(lap, Reading, process))) {
+          m_dequeue.compare_exchange_strong(position, position + 1);
+          size = c.size;
+          std::memcpy(buffer, payload(c), size);
+          c.state.store(encode(nextLap(lap), Empty, 0), std::memory_order_release);
+          m_popped.fetchAdd(1);
+          m_popped.notifyOne();
+          return true;
+        }
+      } else if (lapOf(state) == lap && (phaseOf(state) == Empty || phaseOf(state) == Writing)) {
+        return false; /* (!) Not pushed yet, or still being written */
+      } else if (lapOf(state) == lap || lapOf(state) == nextLap(lap)) {
+        m_dequeue.compare_exchange_strong(position, position + 1); /* (!) Being read, or gone */
+      } else if (lapOf(state) == previousLap(lap)) {
+        return false; /* (!) The message of the previous lap is still being read: nothing for this lap yet */
+      }
+    }
+  }
+
+  void push(void const* message, size_t size)
+  {
+    for (;;) {
+      const uint32_t popped = m_popped.load();
+      if (tryPush(message, size)) {
+        return;
+      }
+      if (m_popped.waitWhileEqualFor(popped, detail::PeerCheckInterval) == popped) {
+        recover();
+      }
+    }
+  }
+
+  /* (!) Returns the size of the message */
+  size_t pop(void* buffer)
+  {
+    for (;;) {
+      const uint32_t pushed = m_pushed.load();
+      size_t size;
+      if (tryPop(buffer, size)) {
+        return size;
+      }
+      if (m_pushed.waitWhileEqualFor(pushed, detail::PeerCheckInterval) == pushed) {
+        recover();
+      }
+    }
+  }
+
+private:
+  enum Phase : uint64_t
+  {
+    Empty,   /* (!) For the producer of this lap */
+    Writing, /* (!) Claimed by a producer */
+    Full,    /* (!) For the consumer of this lap */
+    Reading  /* (!) Claimed by a consumer; then Empty for the next lap */
+  };
+
+  /* (!) Followed by messageSize bytes */
+  struct Cell
+  {
+    std::atomic<uint64_t> state; /* (!) lap:30 | phase:2 | process:32 */
+    uint32_t size;
+  };
+
+  static_assert(std::atomic<uint64_t>::is_always_lock_free, "Atomics in shared memory can't hide a lock");
+  static_assert(std::atomic<uint32_t>::is_always_lock_free, "Atomics in shared memory can't hide a lock");
+
+  static constexpr uint32_t LapMask = (1u << 30) - 1;
+
+  static uint64_t encode(uint32_t lap, Phase phase, uint32_t process)
+  {
+    return static_cast<uint64_t>(lap) << 34 | static_cast<uint64_t>(phase) << 32 | process;
+  }
+
+  static uint32_t lapOf(uint64_t state)
+  {
+    return static_cast<uint32_t>(state >> 34);
+  }
+
+  static Phase phaseOf(uint64_t state)
+  {
+    return static_cast<Phase>(state >> 32 & 3);
+  }
+
+  static uint32_t processOf(uint64_t state)
+  {
+    return static_cast<uint32_t>(state);
+  }
+
+  static uint32_t nextLap(uint32_t lap)
+  {
+    return (lap + 1) & LapMask;
+  }
+
+  static uint32_t previousLap(uint32_t lap)
+  {
+    return (lap - 1) & LapMask;
+  }
+
+  static size_t headerBytes()
+  {
+    return (sizeof(SharedRing) + CacheLine - 1) / CacheLine * CacheLine;
+  }
+
+  static size_t cellBytes(size_t messageSize)
+  {
+    return (sizeof(Cell) + messageSize + CacheLine - 1) / CacheLine * CacheLine; /* (!) No two cells share a line */
+  }
+
+  SharedRing(size_t capacity, size_t messageSize)
+    : m_capacity(capacity)
+    , m_messageSize(messageSize)
+    , m_cellBytes(cellBytes(messageSize))
+  {
+  }
+
+  uint32_t lapAt(uint64_t position) const
+  {
+    return static_cast<uint32_t>(position / m_capacity) & LapMask;
+  }
+
+  Cell& cell(uint64_t position)
+  {
+    char* base = reinterpret_cast<char*>(this) + headerBytes(); /* (!) Relative to wherever this process mapped the ring */
+    return *reinterpret_cast<Cell*>(base + (position & (m_capacity - 1)) * m_cellBytes);
+  }
+
+  static char* payload(Cell& c)
+  {
+    return reinterpret_cast<char*>(&c) + sizeof(Cell);
+  }
+
+  /* (!) Frees the cells the waiters are stuck behind, if the process that claimed them is gone */
+  void recover()
+  {
+    bool recovered = false;
+    for (uint64_t position : { m_enqueue.load(), m_dequeue.load() }) {
+      Cell& c = cell(position);
+      uint64_t state = c.state.load(std::memory_order_acquire);
+      const Phase phase = phaseOf(state);
+      if ((phase == Writing || phase == Reading) && !processAlive(processOf(state)) &&
+          c.state.compare_exchange_strong(state, encode(nextLap(lapOf(state)), Empty, 0))) {
+        m_recoveries.fetch_add(1, std::memory_order_relaxed);
+        recovered = true;
+      }
+    }
+
+    if (recovered) {
+      m_pushed.fetchAdd(1); /* (!) Both sides may be stuck behind the cell */
+      m_pushed.notifyAll();
+      m_popped.fetchAdd(1);
+      m_popped.notifyAll();
+    }
+  }
+
+  std::atomic<uint32_t> m_magic{ 0 };
+  const size_t m_capacity;
+  const size_t m_messageSize;
+  const size_t m_cellBytes;
+  std::atomic<uint64_t> m_recoveries{ 0 };
+  alignas(CacheLine) std::atomic<uint64_t> m_enqueue{ 0 };
+  alignas(CacheLine) std::atomic<uint64_t> m_dequeue{ 0 };
+  alignas(CacheLine) Futex m_pushed{ 0, Futex::ProcessShared() }; /* (!) Counts pushes: consumers sleep on it */
+  alignas(CacheLine) Futex m_popped{ 0, Futex::ProcessShared() }; /* (!) Counts pops: producers sleep on it */
+};
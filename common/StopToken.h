@@ -0,0 +1,263 @@
+/*
+* Common: cooperative cancellation
+*
+* The BackgroundTask of s1t04 loops a million times on a detached thread and nothing can make it stop
+* early. A StopSource lets the owner ask for a stop, and the task polls the StopToken it was given:
+*
+*   StopSource source;
+*   JoiningThread t([](StopToken token) { while (!token.stopRequested()) { ... } });
+*
+* Tasks that are blocked rather than busy register a StopCallback, which runs on the thread that calls
+* requestStop() (or right away, if the stop was already requested). interruptibleWait() uses one to wake
+* a condition variable wait, so a stop request reaches a blocked thread immediately instead of at its
+* next timeout.
+*
+* This mirrors std::stop_source/std::stop_token/std::stop_callback from C++20 for the C++17 examples.
+*/
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+namespace detail
+{
+  class StopCallbackBase
+  {
+  public:
+    virtual void invoke() = 0;
+
+  protected:
+    ~StopCallbackBase() = default;
+
+  private:
+    friend class StopState;
+
+    StopCallbackBase* m_previous = nullptr;
+    StopCallbackBase* m_next = nullptr;
+  };
+
+  class StopState
+  {
+  public:
+    bool stopRequested() const noexcept
+    {
+      return m_requested.load(std::memory_order_acquire);
+    }
+
+    bool requestStop()
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+
+      if (m_requested.exchange(true, std::memory_order_acq_rel)) {
+        return false;
+      }
+
+      m_stoppingThread = std::this_thread::get_id();
+
+      while (m_callbacks) {
+        StopCallbackBase* callback = m_callbacks;
+        unlink(callback);
+        m_running = callback;
+
+        lock.unlock(); /* (!) Callbacks may take other locks, never run them under ours */
+        callback->invoke();
+        lock.lock();
+
+        m_running = nullptr; /* (!) The callback may already be destroyed, don't touch it */
+        m_callbackDone.notify_all();
+      }
+
+      return true;
+    }
+
+    /* (!) Returns false if the stop was already requested: the caller runs the callback itself */
+    bool add(StopCallbackBase* callback)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if (m_requested.load(std::memory_order_relaxed)) {
+        return false;
+      }
+
+      callback->m_next = m_callbacks;
+      if (m_callbacks) {
+        m_callbacks->m_previous = callback;
+      }
+      m_callbacks = callback;
+      return true;
+    }
+
+    void remove(StopCallbackBase* callback)
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+
+      if (m_running == callback && m_stoppingThread != std::this_thread::get_id()) {
+        m_callbackDone.wait(lock, [this, callback] { return m_running != callback; }); /* (!) Don't destroy it while it runs */
+        return;
+      }
+
+      if (m_running != callback) {
+        unlink(callback); /* (!) A no-op if it was already invoked */
+      }
+    }
+
+  private:
+    void unlink(StopCallbackBase* callback)
+    {
+      if (callback->m_previous) {
+        callback->m_previous->m_next = callback->m_next;
+      } else if (m_callbacks == callback) {
+        m_callbacks = callback->m_next;
+      }
+
+      if (callback->m_next) {
+        callback->m_next->m_previous = callback->m_previous;
+      }
+
+      callback->m_previous = callback->m_next = nullptr;
+    }
+
+    std::atomic<bool> m_requested{ false };
+    std::mutex m_mutex;
+    std::condition_variable m_callbackDone;
+    StopCallbackBase* m_callbacks = nullptr;
+    StopCallbackBase* m_running = nullptr;
+    std::thread::id m_stoppingThread;
+  };
+}
+
+class StopToken
+{
+public:
+  StopToken() noexcept = default;
+
+  bool stopRequested() const noexcept
+  {
+    return m_state && m_state->stopRequested();
+  }
+
+  bool stopPossible() const noexcept /* (!) False for a default constructed token: nobody can stop it */
+  {
+    return m_state != nullptr;
+  }
+
+private:
+  friend class StopSource;
+  template<typename Callback>
+  friend class StopCallback;
+
+  explicit StopToken(std::shared_ptr<detail::StopState> state) noexcept
+    : m_state(std::move(state))
+  {
+  }
+
+  std::shared_ptr<detail::StopState> m_state;
+};
+
+class StopSource
+{
+public:
+  StopSource()
+    : m_state(std::make_shared<detail::StopState>())
+  {
+  }
+
+  StopToken getToken() const noexcept
+  {
+    return StopToken(m_state);
+  }
+
+  bool stopRequested() const noexcept
+  {
+    return m_state->stopRequested();
+  }
+
+  /* (!) Runs every registered callback on this thread; true only for the first request */
+  bool requestStop()
+  {
+    return m_state->requestStop();
+  }
+
+private:
+  std::shared_ptr<detail::StopState> m_state;
+};
+
+template<typename Callback>
+class StopCallback : private detail::StopCallbackBase
+{
+public:
+  template<typename C>
+  StopCallback(StopToken const& token, C&& callback)
+    : m_callback(std::forward<C>(callback))
+    , m_state(token.m_state)
+  {
+    if (m_state && !m_state->add(this)) {
+      m_state.reset();
+      m_callback(); /* (!) Already stopped: run it now, on the registering thread */
+    }
+  }
+
+  ~StopCallback()
+  {
+    if (m_state) {
+      m_state->remove(this);
+    }
+  }
+
+  StopCallback(StopCallback const&) = delete;
+  StopCallback& operator=(StopCallback const&) = delete;
+
+private:
+  void invoke() override
+  {
+    m_callback();
+  }
+
+  Callback m_callback;
+  std::shared_ptr<detail::StopState> m_state;
+};
+
+template<typename Callback>
+StopCallback(StopToken const&, Callback) -> StopCallback<Callback>;
+
+/*
+* (!) Waits until pred() holds or a stop is requested, and returns pred(). The lock is released while the
+* callback is registered and unregistered, so requestStop() must not be called with this mutex held.
+*/
+template<typename Predicate>
+bool interruptibleWait(std::condition_variable& condition, std::unique_lock<std::mutex>& lock, StopToken const& token,
+                       Predicate pred)
+{
+  if (!token.stopPossible()) {
+    condition.wait(lock, pred); /* (!) Nobody can stop it: a plain wait */
+    return true;
+  }
+
+  if (pred()) {
+    return true;
+  }
+
+  std::mutex* mutex = lock.mutex();
+  lock.unlock();
+
+  {
+    StopCallback wake(token, [mutex, &condition] {
+      std::lock_guard<std::mutex> guard(*mutex); /* (!) The waiter is either before its check or inside wait() */
+      condition.notify_all();
+    });
+
+    lock.lock();
+    while (!pred() && !token.stopRequested()) {
+      condition.wait(lock);
+    }
+    lock.unlock(); /* (!) Unregistering may wait for the callback, which needs the mutex */
+  }
+
+  lock.lock();
+  return pred();
+}
@@ -0,0 +1,269 @@
+/*
+* Common: swap cell
+*
+* The Widgets of s2t04/s2t05 swap their names under both mutexes, copying string buffers while holding
+* them. SwapCell<T> keeps its value behind a pointer instead, so that changing it never copies under a
+* lock:
+*
+*   - read() returns a Snapshot: the current value, kept alive by an EpochGuard (common/Epoch.h) for as
+*     long as the snapshot exists, however often the cell is written meanwhile
+*   - store() replaces the value with a single compare-and-swap; the old value is retired and deleted
+*     once no snapshot can refer to it any more
+*   - update() copies the value, changes the copy and installs it with a compare-and-swap
+*   - swap(a, b) exchanges the values of two cells atomically, a double compare-and-swap built from
+*     single ones with a small descriptor
+*
+* The two-cell swap writes a descriptor into the first cell, then the second (in address order, so two
+* swaps meet in the same cell first), decides success with a compare-and-swap on the descriptor's status
+* and replaces the descriptor in both cells with the swapped values. Until then, a reader that finds a
+* descriptor reads through it: the old value while the swap is undecided, the new one after. A writer
+* that finds one completes it if both cells are taken, and otherwise aborts it after a short spin, so
+* no thread ever waits for a stalled one. Only the thread that owns a descriptor installs it, which is
+* what makes retiring it safe once that thread has taken it out of both cells.
+*/
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+#include "Epoch.h"
+#include "Futex.h"
+
+template<typename T>
+class SwapCell
+{
+public:
+  /* (!) A value of the cell, valid while the snapshot exists. It keeps its thread inside an epoch guard: don't pass it to another thread */
+  class Snapshot
+  {
+  public:
+    Snapshot(Snapshot&& other) noexcept
+      : m_value(other.m_value)
+    {
+      other.m_value = nullptr;
+    }
+
+    ~Snapshot()
+    {
+      if (m_value != nullptr) { /* (!) Never null unless moved from */
+        Epoch::instance().exit();
+      }
+    }
+
+    Snapshot(Snapshot const&) = delete;
+    Snapshot& operator=(Snapshot const&) = delete;
+    Snapshot& operator=(Snapshot&&) = delete;
+
+    T const& operator*() const
+    {
+      return *m_value;
+    }
+
+    T const* operator->() const
+    {
+      return m_value;
+    }
+
+    T const* get() const
+    {
+      return m_value;
+    }
+
+  private:
+    friend class SwapCell;
+
+    explicit Snapshot(std::atomic<uintptr_t> const& cell)
+    {
+      Epoch::instance().enter(); /* (!) Before the pointer is read */
+      m_value = value(cell, cell.load(std::memory_order_acquire));
+    }
+
+    T const* m_value;
+  };
+
+  explicit SwapCell(T value = T())
+    : m_word(reinterpret_cast<uintptr_t>(new T(std::move(value))))
+  {
+  }
+
+  SwapCell(SwapCell const&) = delete;
+  SwapCell& operator=(SwapCell const&) = delete;
+
+  ~SwapCell()
+  {
+    delete reinterpret_cast<T*>(m_word.load()); /* (!) Nobody may use the cell any more, so no swap is in progress */
+  }
+
+  Snapshot read() const
+  {
+    return Snapshot(m_word);
+  }
+
+  /* (!) A compare-and-swap rather than an exchange: a swap's descriptor must not be overwritten */
+  void store(T value)
+  {
+    T* desired = new T(std::move(value));
+    EpochGuard guard;
+
+    for (;;) {
+      uintptr_t current = settled(m_word);
+      if (m_word.compare_exchange_weak(current, reinterpret_cast<uintptr_t>(desired))) {
+        Epoch::instance().retire(reinterpret_cast<T*>(current));
+        return;
+      }
+    }
+  }
+
+  /* (!) f(T&) changes a copy of the current value; it may be called again if another write got there first */
+  template<typename Function>
+  void update(Function f)
+  {
+    EpochGuard guard;
+
+    for (;;) {
+      uintptr_t current = settled(m_word);
+      std::unique_ptr<T> desired(new T(*reinterpret_cast<T*>(current)));
+      f(*desired);
+
+      if (m_word.compare_exchange_strong(current, reinterpret_cast<uintptr_t>(desired.get()))) {
+        Epoch::instance().retire(reinterpret_cast<T*>(current));
+        desired.release();
+        return;
+      }
+    }
+  }
+
+  friend void swap(SwapCell& lhs, SwapCell& rhs)
+  {
+    if (&lhs != &rhs) {
+      swapCells(lhs, rhs);
+    }
+  }
+
+private:
+  static constexpr uintptr_t DescriptorTag = 1; /* (!) Values come from new, so their lowest bit is free */
+
+  enum Status : uint32_t
+  {
+    Undecided,
+    Succeeded,
+    Failed
+  };
+
+  struct Descriptor
+  {
+    std::atomic<uintptr_t>* cells[2];
+    uintptr_t expected[2];
+    std::atomic<uint32_t> status{ Undecided };
+  };
+
+  static bool isDescriptor(uintptr_t word)
+  {
+    return (word & DescriptorTag) != 0;
+  }
+
+  static Descriptor* descriptor(uintptr_t word)
+  {
+    return reinterpret_cast<Descriptor*>(word & ~DescriptorTag);
+  }
+
+  /* (!) The value a word read from cell stands for: a swap in progress is read through. Inside a guard */
+  static T const* value(std::atomic<uintptr_t> const& cell, uintptr_t word)
+  {
+    if (isDescriptor(word)) {
+      Descriptor* d = descriptor(word);
+      const int i = d->cells[0] == &cell ? 0 : 1;
+      return reinterpret_cast<T const*>(d->expected[d->status.load() == Succeeded ? 1 - i : i]);
+    }
+    return reinterpret_cast<T const*>(word);
+  }
+
+  /* (!) The cell's value, once no descriptor is in it: writers resolve the swaps they meet. Inside a guard */
+  static uintptr_t settled(std::atomic<uintptr_t>& cell)
+  {
+    for (;;) {
+      const uintptr_t word = cell.load();
+      if (!isDescriptor(word)) {
+        return word;
+      }
+      resolve(descriptor(word));
+    }
+  }
+
+  /* (!) Completes a swap that holds both of its cells, aborts one that doesn't make progress, and takes it out of the cells */
+  static void resolve(Descriptor* d)
+  {
+    const uintptr_t tagged = reinterpret_cast<uintptr_t>(d) | DescriptorTag;
+
+    if (d->status.load() == Undecided) {
+      const unsigned spins = Futex::defaultSpins();
+      for (unsigned i = 0; i < spins && d->status.load() == Undecided && d->cells[1]->load() != tagged; ++i) {
+        cpuRelax(); /* (!) Give the owner a moment to take the second cell */
+      }
+
+      uint32_t undecided = Undecided;
+      d->status.compare_exchange_strong(undecided, d->cells[1]->load() == tagged ? Succeeded : Failed);
+    }
+
+    release(d, tagged);
+  }
+
+  static void release(Descriptor* d, uintptr_t tagged)
+  {
+    const bool succeeded = d->status.load() == Succeeded;
+    for (int i = 0; i < 2; ++i) {
+      uintptr_t expected = tagged;
+      d->cells[i]->compare_exchange_strong(expected, d->expected[succeeded ? 1 - i : i]);
+    }
+  }
+
+  static void swapCells(SwapCell& lhs, SwapCell& rhs)
+  {
+    std::atomic<uintptr_t>* first = &lhs.m_word;
+    std::atomic<uintptr_t>* second = &rhs.m_word;
+    if (second < first) {
+      std::swap(first, second);
+    }
+
+    EpochGuard guard;
+
+    for (;;) {
+      Descriptor* d = new Descriptor{ { first, second }, { settled(*first), settled(*second) } };
+      const uintptr_t tagged = reinterpret_cast<uintptr_t>(d) | DescriptorTag;
+
+      if (!install(*first, d->expected[0], tagged)) {
+        delete d; /* (!) Never published */
+        continue;
+      }
+
+      uint32_t undecided = Undecided;
+      d->status.compare_exchange_strong(undecided, install(*second, d->expected[1], tagged) ? Succeeded : Failed);
+      release(d, tagged);
+
+      const bool succeeded = d->status.load() == Succeeded;
+      Epoch::instance().retire(d); /* (!) Out of both cells, and nobody else puts it back */
+      if (succeeded) {
+        return;
+      }
+    }
+  }
+
+  /* (!) Puts the descriptor into the cell if it still holds expected. Resolves the swaps it finds there */
+  static bool install(std::atomic<uintptr_t>& cell, uintptr_t expected, uintptr_t tagged)
+  {
+    for (;;) {
+      uintptr_t word = expected;
+      if (cell.compare_exchange_strong(word, tagged)) {
+        return true;
+      }
+      if (!isDescriptor(word)) {
+        return false; /* (!) Another write changed the value */
+      }
+      resolve(descriptor(word));
+    }
+  }
+
+  alignas(64) std::atomic<uintptr_t> m_word; /* (!) A T*, or a Descriptor* with DescriptorTag set during a swap */
+};
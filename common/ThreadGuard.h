@@ -0,0 +1,187 @@
+/*
+* Common: thread guards
+*
+* The scoped thread classes of sessions 1 and 2 in one place, so the examples stop carrying their own copy.
+*
+* ThreadGuard   - takes ownership of an existing std::thread and joins it on destruction (s1t13, s2t01,
+*                 S2t02). It refuses a thread that isn't joinable, which is always a programming error.
+* JoiningThread - starts the thread itself, like the std::thread constructor, and joins it on destruction
+*                 (or on move assignment). It can be moved around and stored in containers. If the callable
+*                 takes a StopToken as its first parameter it gets one, and a stop is requested before the
+*                 join, so a cooperative loop ends instead of keeping the destructor waiting.
+* JoinThreads   - joins every thread of a vector it doesn't own; used by the ThreadPool so that an exception
+*                 thrown while the workers are being started doesn't leave joinable threads behind.
+*
+* With tracing on (common/Trace.h), starting a thread, a JoiningThread's whole run and every join show up
+* in the trace under the "thread" category.
+*/
+#pragma once
+
+#include <functional>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "StopToken.h"
+#include "Trace.h"
+
+class ThreadGuard
+{
+  std::thread t;
+
+public:
+  explicit ThreadGuard(std::thread& t_)
+    : t(std::move(t_))
+  {
+    if (!t.joinable()) {
+      throw std::logic_error("No thread");
+    }
+  }
+
+  explicit ThreadGuard(std::thread&& t_)
+    : ThreadGuard(t_) /* (!) Both lvalues (s1t13) and temporaries (S2t02) hand over ownership */
+  {
+  }
+
+  ~ThreadGuard()
+  {
+    trace::Scope scope("join", "thread");
+    t.join();
+  }
+
+  ThreadGuard(ThreadGuard const&) = delete;
+  ThreadGuard& operator=(ThreadGuard const&) = delete;
+};
+
+class JoiningThread
+{
+  StopSource m_stop;
+  std::thread t;
+
+public:
+  JoiningThread() noexcept = default;
+
+  template<typename Callable, typename... Args,
+           typename = std::enable_if_t<!std::is_same<std::decay_t<Callable>, JoiningThread>::value &&
+                                       !std::is_same<std::decay_t<Callable>, std::thread>::value>>
+  explicit JoiningThread(Callable&& func, Args&&... args)
+  {
+    trace::Scope scope("spawn", "thread");
+
+    if constexpr (std::is_invocable<std::decay_t<Callable>, StopToken, std::decay_t<Args>...>::value) {
+      t = std::thread(&JoiningThread::run<std::decay_t<Callable>, StopToken, std::decay_t<Args>...>, std::forward<Callable>(func),
+                      m_stop.getToken(), std::forward<Args>(args)...);
+    } else {
+      t = std::thread(&JoiningThread::run<std::decay_t<Callable>, std::decay_t<Args>...>, std::forward<Callable>(func),
+                      std::forward<Args>(args)...);
+    }
+  }
+
+  explicit JoiningThread(std::thread t_) noexcept
+    : t(std::move(t_))
+  {
+  }
+
+  JoiningThread(JoiningThread&& other) noexcept
+    : m_stop(other.m_stop)
+    , t(std::move(other.t))
+  {
+  }
+
+  JoiningThread& operator=(JoiningThread&& other) noexcept
+  {
+    if (joinable()) {
+      m_stop.requestStop();
+      join(); /* (!) std::thread would call std::terminate() here */
+    }
+    m_stop = other.m_stop;
+    t = std::move(other.t);
+    return *this;
+  }
+
+  ~JoiningThread()
+  {
+    if (joinable()) {
+      m_stop.requestStop();
+      join();
+    }
+  }
+
+  JoiningThread(JoiningThread const&) = delete;
+  JoiningThread& operator=(JoiningThread const&) = delete;
+
+  bool joinable() const noexcept
+  {
+    return t.joinable();
+  }
+
+  void join()
+  {
+    trace::Scope scope("join", "thread");
+    t.join();
+  }
+
+  void detach()
+  {
+    t.detach();
+  }
+
+  std::thread::id get_id() const noexcept
+  {
+    return t.get_id();
+  }
+
+  std::thread& asThread() noexcept
+  {
+    return t;
+  }
+
+  bool requestStop()
+  {
+    return m_stop.requestStop();
+  }
+
+  StopSource getStopSource() const noexcept
+  {
+    return m_stop;
+  }
+
+  StopToken getStopToken() const noexcept
+  {
+    return m_stop.getToken();
+  }
+
+private:
+  /* (!) Runs on the new thread */
+  template<typename Callable, typename... Args>
+  static void run(Callable func, Args... args)
+  {
+    trace::Scope scope("run", "thread");
+    std::invoke(std::move(func), std::move(args)...);
+  }
+};
+
+class JoinThreads
+{
+  std::vector<std::thread>& threads;
+
+public:
+  explicit JoinThreads(std::vector<std::thread>& threads_)
+    : threads(threads_)
+  {
+  }
+
+  ~JoinThreads()
+  {
+    for (auto&& t : threads) {
+      if (t.joinable()) {
+        t.join();
+      }
+    }
+  }
+
+  JoinThreads(JoinThreads const&) = delete;
+  JoinThreads& operator=(JoinThreads const&) = delete;
+};
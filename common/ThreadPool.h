@@ -0,0 +1,240 @@
+/*
+* Common: thread pool
+*
+* A fixed set of worker threads fed from one queue, so a task costs a queue push instead of a thread
+* creation and a join. submit() returns a std::future for the task's result (exceptions included).
+*
+* The queue can be bounded: with a capacity, submit() blocks while the queue is full, which pushes back
+* on producers instead of letting the backlog grow without limit.
+*
+* shutdown() stops accepting work and joins the workers. ShutdownMode::Drain runs everything that is
+* already queued first; ShutdownMode::Immediate discards the queue (the discarded tasks' futures report
+* std::future_errc::broken_promise) and only waits for the tasks that are running. The destructor
+* performs a graceful shutdown.
+*
+* A task whose first parameter is a StopToken gets the pool's token. An immediate shutdown requests a
+* stop on it, so cooperative tasks that are already running end early instead of holding up the join.
+*/
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "StopToken.h"
+#include "ThreadGuard.h"
+#include "ThreadRegistry.h"
+
+namespace detail
+{
+  template<typename Function, typename... Args>
+  using PoolTaskResult = typename std::conditional_t<std::is_invocable<Function, StopToken, Args...>::value,
+                                                     std::invoke_result<Function, StopToken, Args...>,
+                                                     std::invoke_result<Function, Args...>>::type;
+}
+
+enum class ShutdownMode
+{
+  Drain,
+  Immediate
+};
+
+class ThreadPool
+{
+public:
+  explicit ThreadPool(unsigned threads = std::thread::hardware_concurrency(), size_t capacity = 0 /* (!) 0: unbounded */)
+    : m_capacity(capacity)
+    , m_joiner(m_threads)
+  {
+    threads = threads != 0 ? threads : 2;
+
+    try {
+      for (unsigned i = 0; i < threads; ++i) {
+        m_threads.emplace_back(&ThreadPool::work, this, i);
+      }
+    } catch (...) {
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+      }
+      m_notEmpty.notify_all();
+      throw; /* (!) m_joiner joins the workers that did start */
+    }
+  }
+
+  ~ThreadPool()
+  {
+    shutdown(ShutdownMode::Drain);
+  }
+
+  ThreadPool(ThreadPool const&) = delete;
+  ThreadPool& operator=(ThreadPool const&) = delete;
+
+  template<typename Function, typename... Args>
+  auto submit(Function&& f, Args&&... args)
+    -> std::future<detail::PoolTaskResult<std::decay_t<Function>, std::decay_t<Args>...>>
+  {
+    using Result = detail::PoolTaskResult<std::decay_t<Function>, std::decay_t<Args>...>;
+
+    std::packaged_task<Result()> task(
+      [f = std::forward<Function>(f), arguments = std::make_tuple(std::forward<Args>(args)...),
+       token = m_stop.getToken()]() mutable {
+        if constexpr (std::is_invocable<std::decay_t<Function>, StopToken, std::decay_t<Args>...>::value) {
+          return std::apply(std::move(f), std::tuple_cat(std::make_tuple(token), std::move(arguments)));
+        } else {
+          return std::apply(std::move(f), std::move(arguments));
+        }
+      });
+    auto result = task.get_future();
+
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_notFull.wait(lock, [this] { return m_stopping || m_capacity == 0 || m_queue.size() < m_capacity; });
+
+      if (m_stopping) {
+        throw std::runtime_error("ThreadPool is shutting down");
+      }
+
+      m_queue.emplace_back(std::move(task));
+    }
+
+    m_notEmpty.notify_one();
+    return result;
+  }
+
+  /* (!) Returns the number of queued tasks that were discarded. Must not be called from a worker */
+  size_t shutdown(ShutdownMode mode)
+  {
+    std::deque<Work> discarded;
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping = true;
+
+      if (mode == ShutdownMode::Immediate) {
+        discarded.swap(m_queue);
+      }
+    }
+
+    m_notEmpty.notify_all();
+    m_notFull.notify_all(); /* (!) Producers blocked on a full queue get their exception */
+
+    if (mode == ShutdownMode::Immediate) {
+      m_stop.requestStop(); /* (!) Outside m_mutex: stop callbacks may take their own locks */
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(m_joinMutex);
+      for (auto&& t : m_threads) {
+        if (t.joinable()) {
+          t.join();
+        }
+      }
+    }
+
+    return discarded.size(); /* (!) Destroying the packaged tasks breaks their promises */
+  }
+
+  size_t threads() const
+  {
+    return m_threads.size();
+  }
+
+  size_t capacity() const
+  {
+    return m_capacity;
+  }
+
+  StopToken stopToken() const noexcept
+  {
+    return m_stop.getToken();
+  }
+
+private:
+  /* (!) std::function needs a copyable target, std::packaged_task is move only */
+  class Work
+  {
+    struct Base
+    {
+      virtual ~Base() = default;
+      virtual void call() = 0;
+    };
+
+    template<typename Function>
+    struct Impl : Base
+    {
+      explicit Impl(Function&& f_)
+        : f(std::move(f_))
+      {
+      }
+
+      void call() override
+      {
+        f();
+      }
+
+      Function f;
+    };
+
+    std::unique_ptr<Base> m_impl;
+
+  public:
+    template<typename Function>
+    explicit Work(Function&& f)
+      : m_impl(new Impl<std::decay_t<Function>>(std::forward<Function>(f)))
+    {
+    }
+
+    void operator()()
+    {
+      m_impl->call();
+    }
+  };
+
+  void work(unsigned number)
+  {
+    ThreadRegistry::instance().registerThread(ThreadRole::Worker, "pool-" + std::to_string(number));
+
+    for (;;) {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_notEmpty.wait(lock, [this] { return m_stopping || !m_queue.empty(); });
+
+      if (m_queue.empty()) {
+        return; /* (!) Stopping and nothing left to drain */
+      }
+
+      Work work = std::move(m_queue.front());
+      m_queue.pop_front();
+      lock.unlock();
+
+      if (m_capacity != 0) {
+        m_notFull.notify_one();
+      }
+
+      work(); /* (!) packaged_task stores any exception in the future */
+    }
+  }
+
+  std::mutex m_mutex;
+  std::condition_variable m_notEmpty;
+  std::condition_variable m_notFull;
+  std::deque<Work> m_queue;
+  const size_t m_capacity;
+  bool m_stopping = false;
+  StopSource m_stop;
+
+  std::mutex m_joinMutex;
+  std::vector<std::thread> m_threads;
+  JoinThreads m_joiner; /* (!) Declared last: destroyed first */
+};
@@ -0,0 +1,330 @@
+/*
+* Common: thread registry
+*
+* s1t14 tells the master thread apart by comparing std::this_thread::get_id() with a global
+* std::thread::id. The registry generalizes that: every thread that registers gets a role, a name (also
+* given to the OS, so it shows up in top, gdb and perf), and a small dense index. The index is reused
+* once its thread exits, so it can index a per-thread array of MaxThreads entries directly, without
+* hashing a std::thread::id.
+*
+* Past MaxThreads - 1 live threads, the others all get the last index, Overflow, instead of an
+* exception out of whatever hot path asked for the index first. Arrays that only spread contention
+* (common/Metrics.h) simply share its entry; structures that need an entry of their own
+* (common/Epoch.h, common/FlatCombining.h) take a slower path for it. Overflow threads don't show up in
+* snapshot().
+*
+* snapshot() samples each live thread's CPU time (its CLOCK_THREAD_CPUTIME_ID clock) and its voluntary
+* and involuntary context switches (/proc/self/task/<tid>/status). usageByRole() adds the totals of the
+* threads that have already exited, which answers "which roles are eating the CPU" under load.
+*
+* Threads that never register are given the Other role on their first call to index() or role(), and
+* keep the name the OS already knows them by: only registerThread() names threads.
+* CPU time and context switches are only sampled on Linux; elsewhere they are reported as zero.
+*/
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <fstream>
+#endif
+
+enum class ThreadRole
+{
+  Master,
+  Worker,
+  IO,
+  Background,
+  Other
+};
+
+inline const char* roleName(ThreadRole role)
+{
+  switch (role) {
+    case ThreadRole::Master: return "master";
+    case ThreadRole::Worker: return "worker";
+    case ThreadRole::IO: return "io";
+    case ThreadRole::Background: return "background";
+    default: return "other";
+  }
+}
+
+struct ThreadSample
+{
+  unsigned index = 0;
+  ThreadRole role = ThreadRole::Other;
+  std::string name;
+  long tid = 0;
+  std::chrono::nanoseconds cpuTime{ 0 };
+  uint64_t voluntarySwitches = 0;
+  uint64_t involuntarySwitches = 0;
+};
+
+struct RoleUsage
+{
+  ThreadRole role = ThreadRole::Other;
+  unsigned liveThreads = 0;
+  unsigned exitedThreads = 0;
+  std::chrono::nanoseconds cpuTime{ 0 };
+  uint64_t voluntarySwitches = 0;
+  uint64_t involuntarySwitches = 0;
+};
+
+class ThreadRegistry
+{
+public:
+  static constexpr unsigned MaxThreads = 1024;
+  static constexpr unsigned Overflow = MaxThreads - 1; /* (!) Shared by the threads beyond the limit */
+
+  static ThreadRegistry& instance()
+  {
+    static ThreadRegistry registry;
+    return registry;
+  }
+
+  /* (!) Registers the calling thread, or changes its role and name if it is registered already */
+  unsigned registerThread(ThreadRole role, std::string name)
+  {
+#if defined(__linux__)
+    ::pthread_setname_np(::pthread_self(), name.substr(0, 15).c_str()); /* (!) The kernel keeps 15 characters */
+#endif
+    return enroll(role, std::move(name));
+  }
+
+  /* (!) Called automatically when a registered thread exits; its totals go to its role */
+  void unregisterThread()
+  {
+    Local& local = current();
+    if (local.index == Unregistered) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (local.index == Overflow) {
+      local.index = Unregistered; /* (!) The slot isn't its own */
+      return;
+    }
+
+    Slot& slot = m_slots[local.index];
+    sample(slot);
+
+    RoleUsage& retired = m_retired[slot.sample.role];
+    retired.role = slot.sample.role;
+    ++retired.exitedThreads;
+    retired.cpuTime += slot.sample.cpuTime;
+    retired.voluntarySwitches += slot.sample.voluntarySwitches;
+    retired.involuntarySwitches += slot.sample.involuntarySwitches;
+
+    slot = Slot();
+    m_free.push_back(local.index);
+    local.index = Unregistered;
+  }
+
+  /* (!) Dense index of the calling thread, in [0, MaxThreads) */
+  static unsigned index()
+  {
+    Local& local = current();
+    if (local.index == Unregistered) {
+      instance().enroll(ThreadRole::Other, osName()); /* (!) Doesn't rename it: that may be the whole process */
+    }
+    return local.index;
+  }
+
+  static ThreadRole role()
+  {
+    index();
+    return current().role;
+  }
+
+  static std::string name()
+  {
+    const unsigned i = index();
+    ThreadRegistry& registry = instance();
+    std::lock_guard<std::mutex> lock(registry.m_mutex);
+    return registry.m_slots[i].sample.name;
+  }
+
+  std::vector<ThreadSample> snapshot()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::vector<ThreadSample> samples;
+    for (unsigned i = 0; i < m_used; ++i) {
+      if (m_slots[i].live) {
+        sample(m_slots[i]);
+        samples.push_back(m_slots[i].sample);
+      }
+    }
+    return samples;
+  }
+
+  std::vector<RoleUsage> usageByRole()
+  {
+    const auto live = snapshot();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::map<ThreadRole, RoleUsage> usage = m_retired;
+
+    for (auto&& s : live) {
+      RoleUsage& u = usage[s.role];
+      u.role = s.role;
+      ++u.liveThreads;
+      u.cpuTime += s.cpuTime;
+      u.voluntarySwitches += s.voluntarySwitches;
+      u.involuntarySwitches += s.involuntarySwitches;
+    }
+
+    std::vector<RoleUsage> result;
+    for (auto&& [role, u] : usage) {
+      result.push_back(u);
+    }
+    return result;
+  }
+
+private:
+  static constexpr unsigned Unregistered = ~0u;
+
+  struct Slot
+  {
+    bool live = false;
+    ThreadSample sample;
+#if defined(__linux__)
+    bool hasClock = false;
+    clockid_t clock{};
+#endif
+  };
+
+  struct Local
+  {
+    ~Local()
+    {
+      if (index != Unregistered) {
+        ThreadRegistry::instance().unregisterThread();
+      }
+    }
+
+    unsigned index = Unregistered;
+    ThreadRole role = ThreadRole::Other;
+  };
+
+  ThreadRegistry()
+    : m_slots(MaxThreads)
+  {
+    m_slots[Overflow].sample.index = Overflow;
+    m_slots[Overflow].sample.name = "overflow";
+  }
+
+  unsigned enroll(ThreadRole role, std::string name)
+  {
+    Local& local = current();
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (local.index == Unregistered) {
+      local.index = allocateIndex();
+    }
+    local.role = role;
+    if (local.index == Overflow) {
+      return local.index;
+    }
+
+    Slot& slot = m_slots[local.index];
+    slot.live = true;
+    slot.sample.index = local.index;
+    slot.sample.role = role;
+    slot.sample.name = std::move(name);
+#if defined(__linux__)
+    slot.sample.tid = static_cast<long>(::syscall(SYS_gettid));
+    slot.hasClock = ::pthread_getcpuclockid(::pthread_self(), &slot.clock) == 0;
+#endif
+    return local.index;
+  }
+
+  static std::string osName()
+  {
+#if defined(__linux__)
+    char name[16] = {};
+    if (::pthread_getname_np(::pthread_self(), name, sizeof(name)) == 0) {
+      return name;
+    }
+#endif
+    return "thread";
+  }
+
+  static Local& current()
+  {
+    thread_local Local local;
+    return local;
+  }
+
+  unsigned allocateIndex()
+  {
+    if (!m_free.empty()) {
+      const unsigned index = m_free.back(); /* (!) Reuse indices so that per-thread arrays stay small */
+      m_free.pop_back();
+      return index;
+    }
+
+    if (m_used == Overflow) {
+      return Overflow; /* (!) Full: an exception here would come out of ShardedCounter::add and the like */
+    }
+
+    return m_used++;
+  }
+
+  static void sample(Slot& slot)
+  {
+#if defined(__linux__)
+    timespec cpu{};
+    if (slot.hasClock && ::clock_gettime(slot.clock, &cpu) == 0) { /* (!) Only valid while the thread is alive */
+      slot.sample.cpuTime = std::chrono::seconds(cpu.tv_sec) + std::chrono::nanoseconds(cpu.tv_nsec);
+    }
+
+    std::ifstream status("/proc/self/task/" + std::to_string(slot.sample.tid) + "/status");
+    std::string key;
+    uint64_t value;
+    while (status >> key) {
+      if (key == "voluntary_ctxt_switches:" && status >> value) {
+        slot.sample.voluntarySwitches = value;
+      } else if (key == "nonvoluntary_ctxt_switches:" && status >> value) {
+        slot.sample.involuntarySwitches = value;
+      }
+    }
+#else
+    (void)slot;
+#endif
+  }
+
+  std::mutex m_mutex;
+  std::vector<Slot> m_slots;
+  std::vector<unsigned> m_free;
+  unsigned m_used = 0;
+  std::map<ThreadRole, RoleUsage> m_retired;
+};
+
+/* (!) For threads that should not keep their slot for their whole lifetime */
+class ScopedThreadRole
+{
+public:
+  ScopedThreadRole(ThreadRole role, std::string name)
+  {
+    ThreadRegistry::instance().registerThread(role, std::move(name));
+  }
+
+  ~ScopedThreadRole()
+  {
+    ThreadRegistry::instance().unregisterThread();
+  }
+
+  ScopedThreadRole(ScopedThreadRole const&) = delete;
+  ScopedThreadRole& operator=(ScopedThreadRole const&) = delete;
+};
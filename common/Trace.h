@@ -0,0 +1,350 @@
+/*
+* Common: tracing
+*
+* When accumulateParallel or one of the locked containers is slower than expected, the question is where
+* the time goes: starting threads, running the blocks, waiting for locks, holding them, or joining. The
+* Tracer records that as timed events and writes them in the Chrome trace event format, which Perfetto
+* (ui.perfetto.dev) and chrome://tracing show as one timeline per thread.
+*
+* Every thread records into its own buffer, a list of 1024 event chunks that only that thread appends to,
+* so recording takes no lock; the chunks are only locked when one fills up. Buffers outlive their thread,
+* so the events of joined threads are still there when the trace is written. Each event is a "complete"
+* event: its begin and end time in one record.
+*
+*   trace::Scope     - records the lifetime of a scope: trace::Scope scope("accumulateBlock", "accumulate");
+*   TracedMutex      - a std::mutex that records how long lock() waited and how long the lock was held
+*   Tracer::start()  - tracing is compiled in but off until started, and off again after stop()
+*   Tracer::clear()  - forgets what was recorded so far: each thread frees its chunks and its count of
+*                      dropped events before it records its next event, since only it may touch them
+*
+* While tracing is off, a scope costs one relaxed atomic load. Building with CONCURRENCY_TRACE=0 removes
+* even that: trace::Scope becomes an empty type and TracedMutex does nothing but lock its std::mutex.
+*/
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "ThreadRegistry.h"
+
+#if !defined(CONCURRENCY_TRACE)
+#define CONCURRENCY_TRACE 1
+#endif
+
+struct TraceEvent
+{
+  const char* name;
+  const char* category;
+  uint64_t start;
+  uint64_t duration;
+};
+
+class Tracer
+{
+public:
+  static constexpr size_t ChunkSize = 1024;
+  static constexpr size_t MaxChunksPerThread = 1024; /* (!) Then events are dropped: 40MB per thread at most */
+
+  static Tracer& instance()
+  {
+    static Tracer tracer;
+    return tracer;
+  }
+
+  static bool enabled() noexcept
+  {
+    return s_enabled.load(std::memory_order_relaxed);
+  }
+
+  /* (!) Nanoseconds since the tracer was created */
+  static uint64_t now() noexcept
+  {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - epoch()).count());
+  }
+
+  void start()
+  {
+    s_enabled.store(true, std::memory_order_relaxed);
+  }
+
+  void stop()
+  {
+    s_enabled.store(false, std::memory_order_relaxed);
+  }
+
+  /* (!) Events recorded so far are left out of write() at once, and released by their thread on its next event */
+  void clear()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_since.store(now(), std::memory_order_relaxed);
+    for (auto&& buffer : m_buffers) {
+      buffer->dropped.store(0, std::memory_order_relaxed);
+      buffer->cleared.store(true, std::memory_order_release);
+    }
+  }
+
+  /* (!) name and category must outlive the tracer: string literals */
+  void complete(const char* name, const char* category, uint64_t start, uint64_t end)
+  {
+    Buffer& buffer = local();
+
+    if (buffer.cleared.load(std::memory_order_relaxed) && buffer.cleared.exchange(false, std::memory_order_acquire)) {
+      std::lock_guard<std::mutex> lock(buffer.mutex); /* (!) write() may be reading the chunks */
+      buffer.chunks.clear();
+      buffer.current = nullptr;
+    }
+
+    if (!buffer.current || buffer.current->size.load(std::memory_order_relaxed) == ChunkSize) {
+      std::lock_guard<std::mutex> lock(buffer.mutex);
+      if (buffer.chunks.size() == MaxChunksPerThread) {
+        ++buffer.dropped;
+        return;
+      }
+      buffer.chunks.push_back(std::make_unique<Chunk>());
+      buffer.current = buffer.chunks.back().get();
+    }
+
+    Chunk& chunk = *buffer.current;
+    const size_t size = chunk.size.load(std::memory_order_relaxed);
+    chunk.events[size] = TraceEvent{ name, category, start, end - start };
+    chunk.size.store(size + 1, std::memory_order_release); /* (!) Publishes the event to write() */
+  }
+
+  /* (!) Can run while other threads are still recording: it writes what they published so far */
+  size_t write(std::ostream& os)
+  {
+    std::vector<Buffer*> buffers;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      for (auto&& buffer : m_buffers) {
+        buffers.push_back(buffer.get());
+      }
+    }
+
+    const uint64_t since = m_since.load(std::memory_order_relaxed);
+    size_t events = 0;
+    os << "{\"traceEvents\":[\n";
+    os << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"Concurrency\"}}";
+
+    for (Buffer* buffer : buffers) {
+      os << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->id << ",\"args\":{\"name\":\"";
+      escape(os, buffer->name.c_str());
+      os << "\"}}";
+
+      std::lock_guard<std::mutex> lock(buffer->mutex);
+      for (auto&& chunk : buffer->chunks) {
+        const size_t size = chunk->size.load(std::memory_order_acquire);
+        for (size_t i = 0; i < size; ++i) {
+          const TraceEvent& e = chunk->events[i];
+          if (e.start < since) {
+            continue;
+          }
+          os << ",\n{\"name\":\"";
+          escape(os, e.name);
+          os << "\",\"cat\":\"";
+          escape(os, e.category);
+          os << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->id << ",\"ts\":" << e.start / 1000 << '.' << digits3(e.start % 1000)
+             << ",\"dur\":" << e.duration / 1000 << '.' << digits3(e.duration % 1000) << "}"; /* (!) Microseconds */
+          ++events;
+        }
+      }
+    }
+
+    os << "\n],\"displayTimeUnit\":\"ns\"}\n";
+    return events;
+  }
+
+  size_t writeFile(std::string const& path)
+  {
+    std::ofstream file(path);
+    if (!file) {
+      throw std::runtime_error("Cannot open " + path);
+    }
+    return write(file);
+  }
+
+  uint64_t dropped()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint64_t total = 0;
+    for (auto&& buffer : m_buffers) {
+      total += buffer->dropped.load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Chunk
+  {
+    TraceEvent events[ChunkSize];
+    std::atomic<size_t> size{ 0 };
+  };
+
+  struct Buffer
+  {
+    uint32_t id = 0;
+    std::string name;
+    std::mutex mutex; /* (!) Guards chunks; the owner only takes it for a new chunk */
+    std::vector<std::unique_ptr<Chunk>> chunks;
+    Chunk* current = nullptr; /* (!) Owner thread only */
+    std::atomic<uint64_t> dropped{ 0 };
+    std::atomic<bool> cleared{ false }; /* (!) Set by clear(), the owner frees the chunks */
+  };
+
+  Tracer() = default;
+
+  static Clock::time_point epoch()
+  {
+    static const Clock::time_point start = Clock::now();
+    return start;
+  }
+
+  /* (!) Created on the thread's first event, and named after its ThreadRegistry name at that point */
+  Buffer& local()
+  {
+    thread_local Buffer* buffer = nullptr;
+    if (!buffer) {
+      auto fresh = std::make_unique<Buffer>();
+      fresh->name = ThreadRegistry::name();
+
+      std::lock_guard<std::mutex> lock(m_mutex);
+      fresh->id = static_cast<uint32_t>(m_buffers.size() + 1);
+      buffer = fresh.get();
+      m_buffers.push_back(std::move(fresh));
+    }
+    return *buffer;
+  }
+
+  static void escape(std::ostream& os, const char* s)
+  {
+    for (; *s; ++s) {
+      if (*s == '"' || *s == '\\') {
+        os << '\\' << *s;
+      } else if (static_cast<unsigned char>(*s) >= 0x20) {
+        os << *s;
+      }
+    }
+  }
+
+  static std::string digits3(uint64_t n)
+  {
+    return std::string(1, char('0' + n / 100)) + char('0' + n / 10 % 10) + char('0' + n % 10);
+  }
+
+  static inline std::atomic<bool> s_enabled{ false };
+
+  std::mutex m_mutex;
+  std::vector<std::unique_ptr<Buffer>> m_buffers;
+  std::atomic<uint64_t> m_since{ 0 };
+};
+
+class TraceScope
+{
+public:
+  TraceScope(const char* name, const char* category) noexcept
+    : m_name(name)
+    , m_category(category)
+    , m_start(Tracer::enabled() ? Tracer::now() : NotTraced)
+  {
+  }
+
+  ~TraceScope()
+  {
+    if (m_start != NotTraced) { /* (!) A scope that began untraced stays untraced */
+      Tracer::instance().complete(m_name, m_category, m_start, Tracer::now());
+    }
+  }
+
+  TraceScope(TraceScope const&) = delete;
+  TraceScope& operator=(TraceScope const&) = delete;
+
+private:
+  static constexpr uint64_t NotTraced = ~uint64_t(0);
+
+  const char* m_name;
+  const char* m_category;
+  uint64_t m_start;
+};
+
+namespace trace
+{
+  constexpr bool Enabled = CONCURRENCY_TRACE != 0;
+
+  struct NullScope
+  {
+    NullScope(const char*, const char*) noexcept
+    {
+    }
+  };
+
+  using Scope = std::conditional_t<Enabled, TraceScope, NullScope>;
+}
+
+/* (!) Meets the Lockable requirements, so it works with std::lock_guard, std::unique_lock and std::scoped_lock */
+class TracedMutex
+{
+public:
+  explicit TracedMutex(const char* name = "mutex") noexcept
+    : m_name(name)
+  {
+  }
+
+  TracedMutex(TracedMutex const&) = delete;
+  TracedMutex& operator=(TracedMutex const&) = delete;
+
+  void lock()
+  {
+    if constexpr (trace::Enabled) {
+      if (Tracer::enabled()) {
+        if (!m_mutex.try_lock()) { /* (!) Only contended acquisitions show up as waits */
+          const uint64_t start = Tracer::now();
+          m_mutex.lock();
+          Tracer::instance().complete(m_name, "lock wait", start, Tracer::now());
+        }
+        m_acquired = Tracer::now();
+        return;
+      }
+    }
+    m_mutex.lock();
+  }
+
+  bool try_lock()
+  {
+    if (!m_mutex.try_lock()) {
+      return false;
+    }
+    if constexpr (trace::Enabled) {
+      if (Tracer::enabled()) {
+        m_acquired = Tracer::now();
+      }
+    }
+    return true;
+  }
+
+  void unlock()
+  {
+    if constexpr (trace::Enabled) {
+      if (m_acquired != 0) { /* (!) Written and read by the owner only */
+        Tracer::instance().complete(m_name, "lock hold", m_acquired, Tracer::now());
+        m_acquired = 0;
+      }
+    }
+    m_mutex.unlock();
+  }
+
+private:
+  std::mutex m_mutex;
+  const char* m_name;
+  uint64_t m_acquired = 0;
+};
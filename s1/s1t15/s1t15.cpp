@@ -12,17 +12,22 @@
 */
 
 #include <algorithm>
+#include <functional>
 #include <numeric>
 #include <thread>
 #include <vector>
 #include <random>
 #include <iostream>
+#include <string>
+
+#include "../../common/Trace.h"
 
 template<typename Iterator, typename T>
 struct accumulateBlock
 {
   void operator()(Iterator first, Iterator last, T& result)
   {
+    trace::Scope scope("accumulateBlock", "accumulate"); /* (!) Free while tracing is off */
     result = std::accumulate(first, last, result);
   }
 };
@@ -52,12 +57,18 @@ T accumulateParallel(Iterator first, Iterator last, T init)
   for (unsigned long i = 0; i < (num_threads - 1); ++i) {
     Iterator block_end = block_start;
     std::advance(block_end, block_size);
-    threads[i] = std::thread(accumulateBlock<Iterator, T>(), block_start, block_end, std::ref(results[i]));
+    {
+      trace::Scope scope("spawn", "thread");
+      threads[i] = std::thread(accumulateBlock<Iterator, T>(), block_start, block_end, std::ref(results[i]));
+    }
     block_start = block_end;
   }
 
   accumulateBlock<Iterator, T>()(block_start, last, results[num_threads - 1]);
-  std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join)); /* (!) Join all the spawned threads */
+  {
+    trace::Scope scope("join", "thread");
+    std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join)); /* (!) Join all the spawned threads */
+  }
 
   return std::accumulate(results.begin(), results.end(), init);
 }
@@ -76,8 +87,16 @@ static std::vector<T> generate(T size)
   return data;
 }
 
-int main()
+int main(int argc, char* argv[])
 {
+  if (argc > 1) { /* (!) s1t15 trace.json: writes a trace of a larger run, to open in ui.perfetto.dev */
+    Tracer::instance().start();
+    auto many(generate(10000000));
+    accumulateParallel(many.begin(), many.end(), 0);
+    Tracer::instance().stop();
+    std::cout << Tracer::instance().writeFile(argv[1]) << " events written to " << argv[1] << std::endl;
+  }
+
   auto numbers(generate(10));
 
   std::cout << "Numbers to add:";
@@ -18,28 +18,7 @@
 #include <thread>
 #include <iostream>
 
-/* Scoped thread class from Session 1*/
-class ThreadGuard
-{
-  std::thread t;
-
-public:
-  explicit ThreadGuard(std::thread&& t_)
-    : t(std::move(t_))
-  {
-    if (!t.joinable()) {
-      throw std::logic_error("No thread");
-    }
-  }
-
-  ~ThreadGuard()
-  {
-    t.join();
-  }
-
-  ThreadGuard(ThreadGuard const&) = delete;
-  ThreadGuard& operator=(ThreadGuard const&) = delete;
-};
+#include "../../common/ThreadGuard.h" /* (!) Scoped thread class from Session 1 */
 
 struct ThreadSafeLinkedList
 {
@@ -12,28 +12,7 @@
 #include <thread>
 #include <iostream>
 
-/* Scoped thread class from Session 1*/
-class ThreadGuard
-{
-  std::thread t;
-
-public:
-  explicit ThreadGuard(std::thread& t_)
-    : t(std::move(t_))
-  {
-    if (!t.joinable()) {
-      throw std::logic_error("No thread");
-    }
-  }
-
-  ~ThreadGuard()
-  {
-    t.join();
-  }
-
-  ThreadGuard(ThreadGuard const&) = delete;
-  ThreadGuard& operator=(ThreadGuard const&) = delete;
-};
+#include "../../common/ThreadGuard.h" /* (!) Scoped thread class from Session 1 */
 
 std::list<int> myList; /* (!) Data structure which is not thread safe */
 std::mutex myMutex; /* (!) Protects myList instance */
@@ -59,8 +38,8 @@ void contains(int i)
 
 int main()
 {
-  ThreadGuard t1(std::thread (add));
-  ThreadGuard t2(std::thread(contains, 0));
+  ThreadGuard t1{ std::thread(add) }; /* (!) Braces: with parentheses this declares a function and no thread runs */
+  ThreadGuard t2{ std::thread(contains, 0) };
 
   return 0;
 }
@@ -0,0 +1,1095 @@
+/*
+* Session 3, example 01 (event loop):
+*
+* A minimal edge-triggered epoll reactor. Every EventLoop owns one epoll instance and is driven by
+* exactly one thread; all the state of the ConnectionHandles registered with it is only ever touched
+* from that thread, so no locking is needed on the I/O path. Other threads talk to a loop by posting
+* closures into its task queue, which wakes the loop through an eventfd.
+*
+* An EventLoopGroup runs one loop per core. When listening, every loop gets its own socket bound to
+* the same port with SO_REUSEPORT, so the kernel spreads incoming connections over the loops without
+* a shared accept queue.
+*
+* Optionally the connection I/O runs on io_uring instead of recv()/send() (see UringBackend below). The
+* backend is chosen at runtime: IoBackend::Auto uses io_uring when the kernel offers what is needed and
+* silently falls back to plain system calls otherwise. The ConnectionHandle API is the same either way.
+*/
+#pragma once
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "IoUring.h"
+
+struct Packet
+{
+  std::string payload;
+};
+
+struct ConnectionInfo
+{
+  std::string host;
+  unsigned short port;
+};
+
+enum class IoBackend
+{
+  Auto, /* (!) io_uring when available, system calls otherwise */
+  Syscalls,
+  IoUring
+};
+
+inline void throwSystemError(const char* what)
+{
+  throw std::system_error(errno, std::generic_category(), what);
+}
+
+inline void setNonBlocking(int fd)
+{
+  const int flags = ::fcntl(fd, F_GETFL, 0);
+
+  if (flags < 0 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    throwSystemError("fcntl");
+  }
+}
+
+/* (!) Anything registered with an EventLoop; the loop dispatches readiness through this interface */
+class Watcher
+{
+public:
+  virtual ~Watcher() = default;
+  virtual void onEvents(uint32_t events) = 0;
+};
+
+class EventLoop;
+
+class ConnectionHandle : public Watcher, public std::enable_shared_from_this<ConnectionHandle>
+{
+public:
+  using ReceiveCallback = std::function<void(ConnectionHandle&, Packet)>;
+
+  ConnectionHandle(EventLoop& loop, int fd)
+    : m_loop(loop)
+    , m_fd(fd)
+  {
+  }
+
+  ~ConnectionHandle() override
+  {
+    if (m_fd >= 0) {
+      ::close(m_fd);
+    }
+  }
+
+  ConnectionHandle(ConnectionHandle const&) = delete;
+  ConnectionHandle& operator=(ConnectionHandle const&) = delete;
+
+  void sendData(Packet p); /* (!) Thread safe: hops onto the loop thread when called from outside */
+
+  void receiveData(ReceiveCallback callback); /* (!) Persistent handler invoked on the loop thread for every packet */
+
+  std::future<Packet> receiveData(); /* (!) One-shot: the future is fulfilled with the next packet */
+
+  void close();
+
+  EventLoop& loop() const
+  {
+    return m_loop;
+  }
+
+  int fd() const
+  {
+    return m_fd;
+  }
+
+  void onEvents(uint32_t events) override;
+
+private:
+  friend class EventLoop;
+  friend class UringBackend;
+
+  void handleReadable();
+  void consumeInput();
+  void flushOutput();
+  void deliver(Packet p);
+  void closeNow(std::exception_ptr reason);
+
+  EventLoop& m_loop;
+  int m_fd;
+
+  std::string m_input; /* (!) Bytes of a partially received frame */
+  std::string m_output; /* (!) Framed bytes the kernel didn't accept yet */
+  size_t m_outputOffset = 0;
+  bool m_writable = true; /* (!) Edge-triggered: remember the last known writability instead of polling for it */
+
+  ReceiveCallback m_onReceive;
+  std::deque<std::promise<Packet>> m_waiting;
+  std::deque<Packet> m_unclaimed; /* (!) Packets that arrived before anybody asked for them */
+  bool m_closed = false;
+
+  struct UringState
+  {
+    int fileSlot = -1; /* (!) Index in the ring's registered file table */
+    int sendSlot = -1; /* (!) Registered buffer holding the bytes of the send in flight */
+    unsigned operations = 0; /* (!) Submitted and not completed yet; the handle must outlive them */
+    bool waitingForSlot = false;
+  };
+
+  UringState m_uring;
+};
+
+/*
+* Completion based I/O: instead of waiting for readiness and then calling recv()/send(), every connection
+* keeps one receive queued in the ring, and outgoing bytes are copied into registered buffers and queued
+* as fixed-buffer writes on fixed files. All the work queued while the loop handles one batch of events is
+* submitted with a single io_uring_enter() call, and the ring's fd sits in the loop's epoll set, so
+* completions, accepts and posted tasks are all dispatched from the same place.
+*
+* Receives use kernel-selected buffers (IORING_OP_PROVIDE_BUFFERS) rather than registered ones: a
+* registered buffer per outstanding receive would pin memory for every idle connection.
+*/
+class UringBackend : public Watcher
+{
+public:
+  explicit UringBackend(EventLoop& loop);
+
+  void add(std::shared_ptr<ConnectionHandle> const& handle);
+  void remove(ConnectionHandle& handle, std::shared_ptr<ConnectionHandle> owner);
+  void send(ConnectionHandle& handle);
+
+  void submit()
+  {
+    m_ring.submit();
+    while (m_ring.stashed()) { /* (!) Completions getSqe() moved out of the ring: epoll won't report them */
+      onEvents(EPOLLIN);
+      m_ring.submit();
+    }
+  }
+
+  void onEvents(uint32_t events) override;
+
+private:
+  enum Operation : uint64_t
+  {
+    Receive = 1,
+    Send = 2,
+    ProvideBuffers = 3
+  };
+
+  static constexpr unsigned receiveBufferSize = 4096;
+  static constexpr unsigned receiveBufferCount = 1024;
+  static constexpr unsigned sendSlotSize = 16 * 1024;
+  static constexpr unsigned sendSlotCount = 256;
+  static constexpr uint16_t bufferGroup = 0;
+
+  void queueReceive(ConnectionHandle& handle);
+  void provide(unsigned first, unsigned count);
+  void onReceived(ConnectionHandle& handle, int result, uint32_t flags);
+  void onSent(ConnectionHandle& handle, int result);
+  void completed(ConnectionHandle& handle);
+
+  EventLoop& m_loop;
+
+  std::unique_ptr<char[]> m_receiveBuffers;
+  std::unique_ptr<char[]> m_sendBuffers;
+  IoUring m_ring; /* (!) Declared after the buffers so it is torn down before the memory the kernel writes to */
+  std::vector<unsigned> m_freeSendSlots;
+  std::deque<std::shared_ptr<ConnectionHandle>> m_waitingForSlot;
+  std::vector<unsigned> m_freeFileSlots;
+  std::unordered_map<ConnectionHandle*, std::shared_ptr<ConnectionHandle>> m_closing; /* (!) Closed, but with operations in flight */
+};
+
+class EventLoop
+{
+public:
+  using AcceptCallback = std::function<void(std::shared_ptr<ConnectionHandle>)>;
+
+  explicit EventLoop(IoBackend backend = IoBackend::Auto)
+    : m_epoll(::epoll_create1(EPOLL_CLOEXEC))
+    , m_wakeupFd(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+    , m_waker(*this)
+  {
+    if (m_epoll < 0 || m_wakeupFd < 0) {
+      throwSystemError("epoll_create1/eventfd");
+    }
+
+    watch(m_wakeupFd, EPOLLIN | EPOLLET, &m_waker);
+
+    if (backend != IoBackend::Syscalls) {
+      try {
+        m_uring = std::make_unique<UringBackend>(*this);
+      } catch (std::exception const& e) {
+        if (backend == IoBackend::IoUring) {
+          throw;
+        }
+        m_fallbackReason = e.what(); /* (!) Auto: keep going with plain system calls */
+      }
+    }
+  }
+
+  ~EventLoop()
+  {
+    m_connections.clear();
+    m_graveyard.clear();
+    m_uring.reset();
+
+    for (auto&& acceptor : m_acceptors) {
+      ::close(acceptor->fd);
+    }
+
+    ::close(m_wakeupFd);
+    ::close(m_epoll);
+  }
+
+  EventLoop(EventLoop const&) = delete;
+  EventLoop& operator=(EventLoop const&) = delete;
+
+  void run()
+  {
+    m_threadId = std::this_thread::get_id();
+
+    if (m_uring) { /* (!) Fixed-buffer writes can't pass MSG_NOSIGNAL, so keep SIGPIPE away from this thread */
+      sigset_t signals;
+      sigemptyset(&signals);
+      sigaddset(&signals, SIGPIPE);
+      pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    }
+
+    std::vector<epoll_event> events(256);
+
+    while (!m_stopped.load(std::memory_order_acquire)) {
+      if (m_uring) {
+        m_uring->submit(); /* (!) Everything queued during the previous iteration goes out in one system call */
+      }
+
+      const int n = ::epoll_wait(m_epoll, events.data(), static_cast<int>(events.size()), -1);
+
+      if (n < 0 && errno != EINTR) {
+        throwSystemError("epoll_wait");
+      }
+
+      for (int i = 0; i < n; ++i) {
+        static_cast<Watcher*>(events[i].data.ptr)->onEvents(events[i].events);
+      }
+
+      runPendingTasks();
+      m_graveyard.clear(); /* (!) Closed handles are destroyed only once nothing on the stack refers to them */
+    }
+
+    runPendingTasks();
+  }
+
+  void stop()
+  {
+    m_stopped.store(true, std::memory_order_release);
+    wakeup();
+  }
+
+  void post(std::function<void()> task)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_tasksMutex);
+      m_tasks.emplace_back(std::move(task));
+    }
+
+    if (!m_wakeupPending.exchange(true, std::memory_order_acq_rel)) { /* (!) One eventfd write per batch of posted tasks */
+      wakeup();
+    }
+  }
+
+  bool inLoopThread() const
+  {
+    return std::this_thread::get_id() == m_threadId;
+  }
+
+  /* (!) Takes ownership of a connected, non-blocking socket and registers it for readiness */
+  std::shared_ptr<ConnectionHandle> adopt(int fd)
+  {
+    auto handle = std::make_shared<ConnectionHandle>(*this, fd);
+
+    if (inLoopThread()) {
+      registerConnection(handle);
+    } else {
+      post([this, handle] {
+        registerConnection(handle);
+      });
+    }
+
+    return handle;
+  }
+
+  void listen(int listenFd, AcceptCallback onAccept)
+  {
+    auto acceptor = std::make_unique<Acceptor>(*this, listenFd, std::move(onAccept));
+    watch(listenFd, EPOLLIN | EPOLLET, acceptor.get());
+    m_acceptors.emplace_back(std::move(acceptor));
+  }
+
+  size_t connectionCount() const /* (!) Only meaningful on the loop thread */
+  {
+    return m_connections.size();
+  }
+
+  const char* backendName() const
+  {
+    return m_uring ? "io_uring" : "syscalls";
+  }
+
+  std::string const& fallbackReason() const
+  {
+    return m_fallbackReason;
+  }
+
+private:
+  friend class ConnectionHandle;
+  friend class UringBackend;
+
+  struct Waker : Watcher
+  {
+    explicit Waker(EventLoop& loop)
+      : loop(loop)
+    {
+    }
+
+    void onEvents(uint32_t) override
+    {
+      uint64_t value;
+      while (::read(loop.m_wakeupFd, &value, sizeof(value)) > 0) {
+      }
+    }
+
+    EventLoop& loop;
+  };
+
+  struct Acceptor : Watcher
+  {
+    Acceptor(EventLoop& loop, int fd, AcceptCallback onAccept)
+      : loop(loop)
+      , fd(fd)
+      , onAccept(std::move(onAccept))
+    {
+    }
+
+    void onEvents(uint32_t) override
+    {
+      for (;;) { /* (!) Edge-triggered: drain the accept queue, there won't be another notification */
+        const int client = ::accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (client < 0) {
+          if (errno == EINTR || errno == ECONNABORTED) {
+            continue;
+          }
+          return; /* (!) EAGAIN, or EMFILE: keep serving the connections we already have */
+        }
+
+        const int one = 1;
+        ::setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        onAccept(loop.adopt(client));
+      }
+    }
+
+    EventLoop& loop;
+    int fd;
+    AcceptCallback onAccept;
+  };
+
+  void watch(int fd, uint32_t events, Watcher* watcher)
+  {
+    epoll_event event{};
+    event.events = events;
+    event.data.ptr = watcher;
+
+    if (::epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+      throwSystemError("epoll_ctl");
+    }
+  }
+
+  void registerConnection(std::shared_ptr<ConnectionHandle> const& handle)
+  {
+    if (handle->m_closed) {
+      return;
+    }
+
+    m_connections.emplace(handle->m_fd, handle);
+
+    if (m_uring) {
+      m_uring->add(handle);
+    } else {
+      watch(handle->m_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, handle.get()); /* (!) Registered once; ET never needs EPOLL_CTL_MOD */
+    }
+  }
+
+  void unregisterConnection(ConnectionHandle& handle)
+  {
+    std::shared_ptr<ConnectionHandle> owner;
+
+    auto it = m_connections.find(handle.m_fd);
+    if (it != m_connections.end()) {
+      owner = std::move(it->second);
+      m_connections.erase(it);
+    }
+
+    if (m_uring) {
+      m_uring->remove(handle, std::move(owner));
+    } else {
+      ::epoll_ctl(m_epoll, EPOLL_CTL_DEL, handle.m_fd, nullptr);
+      if (owner) {
+        m_graveyard.emplace_back(std::move(owner));
+      }
+    }
+  }
+
+  void runPendingTasks()
+  {
+    m_wakeupPending.store(false, std::memory_order_release);
+
+    {
+      std::lock_guard<std::mutex> lock(m_tasksMutex);
+      m_running.swap(m_tasks); /* (!) Run the batch without holding the lock, so tasks can post more tasks */
+    }
+
+    for (auto&& task : m_running) {
+      task();
+    }
+
+    m_running.clear();
+  }
+
+  void wakeup()
+  {
+    const uint64_t one = 1;
+    ssize_t written = ::write(m_wakeupFd, &one, sizeof(one));
+    (void) written;
+  }
+
+  int m_epoll;
+  int m_wakeupFd;
+  Waker m_waker;
+
+  std::thread::id m_threadId;
+  std::atomic<bool> m_stopped{ false };
+  std::atomic<bool> m_wakeupPending{ false };
+
+  std::mutex m_tasksMutex;
+  std::vector<std::function<void()>> m_tasks;
+  std::vector<std::function<void()>> m_running;
+
+  std::unordered_map<int, std::shared_ptr<ConnectionHandle>> m_connections;
+  std::vector<std::shared_ptr<ConnectionHandle>> m_graveyard;
+  std::vector<std::unique_ptr<Acceptor>> m_acceptors;
+
+  std::unique_ptr<UringBackend> m_uring;
+  std::string m_fallbackReason;
+};
+
+/* (!) Wire format: 4 byte big-endian length followed by the payload */
+inline void appendFrame(std::string& out, Packet const& p)
+{
+  const uint32_t length = htonl(static_cast<uint32_t>(p.payload.size()));
+  out.append(reinterpret_cast<const char*>(&length), sizeof(length));
+  out.append(p.payload);
+}
+
+inline void ConnectionHandle::sendData(Packet p)
+{
+  if (!m_loop.inLoopThread()) {
+    m_loop.post([self = shared_from_this(), p = std::move(p)]() mutable {
+      self->sendData(std::move(p));
+    });
+    return;
+  }
+
+  if (m_closed) {
+    return;
+  }
+
+  appendFrame(m_output, p);
+
+  if (m_writable) {
+    flushOutput();
+  }
+}
+
+inline void ConnectionHandle::receiveData(ReceiveCallback callback)
+{
+  if (!m_loop.inLoopThread()) {
+    m_loop.post([self = shared_from_this(), callback = std::move(callback)]() mutable {
+      self->receiveData(std::move(callback));
+    });
+    return;
+  }
+
+  m_onReceive = std::move(callback);
+
+  while (m_onReceive && !m_unclaimed.empty()) {
+    Packet p = std::move(m_unclaimed.front());
+    m_unclaimed.pop_front();
+    m_onReceive(*this, std::move(p));
+  }
+}
+
+inline std::future<Packet> ConnectionHandle::receiveData()
+{
+  auto promise = std::make_shared<std::promise<Packet>>();
+  auto future = promise->get_future();
+
+  auto claim = [self = shared_from_this(), promise] {
+    if (!self->m_unclaimed.empty()) {
+      promise->set_value(std::move(self->m_unclaimed.front()));
+      self->m_unclaimed.pop_front();
+    } else if (self->m_closed) {
+      promise->set_exception(std::make_exception_ptr(std::runtime_error("Connection closed")));
+    } else {
+      self->m_waiting.emplace_back(std::move(*promise));
+    }
+  };
+
+  if (m_loop.inLoopThread()) {
+    claim();
+  } else {
+    m_loop.post(std::move(claim));
+  }
+
+  return future;
+}
+
+inline void ConnectionHandle::close()
+{
+  if (!m_loop.inLoopThread()) {
+    m_loop.post([self = shared_from_this()] {
+      self->close();
+    });
+    return;
+  }
+
+  closeNow(std::make_exception_ptr(std::runtime_error("Connection closed")));
+}
+
+inline void ConnectionHandle::onEvents(uint32_t events)
+{
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    closeNow(std::make_exception_ptr(std::runtime_error("Connection reset")));
+    return;
+  }
+
+  if (events & (EPOLLIN | EPOLLRDHUP)) {
+    handleReadable();
+  }
+
+  if (!m_closed && (events & EPOLLOUT)) {
+    m_writable = true;
+    flushOutput();
+  }
+}
+
+inline void ConnectionHandle::handleReadable()
+{
+  char buffer[16 * 1024];
+
+  for (;;) { /* (!) Edge-triggered: read until the kernel reports EAGAIN */
+    const ssize_t n = ::recv(m_fd, buffer, sizeof(buffer), 0);
+
+    if (n > 0) {
+      m_input.append(buffer, static_cast<size_t>(n));
+      continue;
+    }
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+
+    consumeInput(); /* (!) n == 0 or a hard error: the frames that came before it are still delivered, as with io_uring */
+    if (!m_closed) {
+      closeNow(std::make_exception_ptr(std::runtime_error("Connection closed by peer")));
+    }
+    return;
+  }
+
+  consumeInput();
+}
+
+inline void ConnectionHandle::consumeInput()
+{
+  size_t offset = 0;
+
+  while (m_input.size() - offset >= sizeof(uint32_t)) {
+    uint32_t length;
+    std::memcpy(&length, m_input.data() + offset, sizeof(length));
+    length = ntohl(length);
+
+    if (m_input.size() - offset - sizeof(length) < length) {
+      break;
+    }
+
+    deliver(Packet{ m_input.substr(offset + sizeof(length), length) });
+    offset += sizeof(length) + length;
+
+    if (m_closed) {
+      return;
+    }
+  }
+
+  m_input.erase(0, offset);
+
+  if (m_input.empty()) {
+    std::string().swap(m_input); /* (!) Idle connections shouldn't keep their receive buffer around */
+  }
+}
+
+inline void ConnectionHandle::flushOutput()
+{
+  if (m_loop.m_uring) {
+    m_loop.m_uring->send(*this);
+    return;
+  }
+
+  while (m_outputOffset < m_output.size()) {
+    const ssize_t n = ::send(m_fd, m_output.data() + m_outputOffset, m_output.size() - m_outputOffset, MSG_NOSIGNAL);
+
+    if (n >= 0) {
+      m_outputOffset += static_cast<size_t>(n);
+      continue;
+    }
+
+    if (errno == EINTR) {
+      continue;
+    }
+
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      m_writable = false; /* (!) Wait for the next EPOLLOUT edge */
+      return;
+    }
+
+    closeNow(std::make_exception_ptr(std::runtime_error("Send failed")));
+    return;
+  }
+
+  m_output.clear();
+  m_outputOffset = 0;
+
+  if (m_output.capacity() > 64 * 1024) {
+    std::string().swap(m_output);
+  }
+}
+
+inline void ConnectionHandle::deliver(Packet p)
+{
+  if (!m_waiting.empty()) { /* (!) Futures asked first, so they are served first */
+    m_waiting.front().set_value(std::move(p));
+    m_waiting.pop_front();
+  } else if (m_onReceive) {
+    m_onReceive(*this, std::move(p));
+  } else {
+    m_unclaimed.emplace_back(std::move(p));
+  }
+}
+
+inline void ConnectionHandle::closeNow(std::exception_ptr reason)
+{
+  if (m_closed) {
+    return;
+  }
+
+  m_closed = true;
+
+  for (auto&& waiting : m_waiting) {
+    waiting.set_exception(reason);
+  }
+
+  m_waiting.clear(); /* (!) m_onReceive may be running right now, it is released with the handle itself */
+
+  m_loop.unregisterConnection(*this);
+
+  ::close(m_fd);
+  m_fd = -1;
+}
+
+inline UringBackend::UringBackend(EventLoop& loop)
+  : m_loop(loop)
+  , m_receiveBuffers(new char[receiveBufferSize * receiveBufferCount])
+  , m_sendBuffers(new char[sendSlotSize * sendSlotCount])
+  , m_ring(4096, 64 * 1024)
+{
+  if (!m_ring.supports({ IORING_OP_RECV, IORING_OP_WRITE_FIXED, IORING_OP_PROVIDE_BUFFERS })) {
+    throw std::runtime_error("io_uring lacks RECV, WRITE_FIXED or PROVIDE_BUFFERS");
+  }
+
+  m_ring.registerBuffers({ iovec{ m_sendBuffers.get(), sendSlotSize * sendSlotCount } });
+
+  rlimit files{};
+  ::getrlimit(RLIMIT_NOFILE, &files);
+  const auto fileSlots = static_cast<unsigned>(std::min<rlim_t>(files.rlim_cur, 64 * 1024));
+  m_ring.registerFiles(std::vector<int>(fileSlots, -1)); /* (!) Sparse table, filled in as connections arrive */
+
+  for (unsigned i = fileSlots; i > 0; --i) {
+    m_freeFileSlots.push_back(i - 1);
+  }
+
+  for (unsigned i = sendSlotCount; i > 0; --i) {
+    m_freeSendSlots.push_back(i - 1);
+  }
+
+  provide(0, receiveBufferCount);
+  m_ring.submitAndWait(1);
+
+  int provided = 0;
+  m_ring.forEachCompletion([&provided](io_uring_cqe const& cqe) {
+    provided = cqe.res;
+  });
+
+  if (provided < 0) {
+    throw std::system_error(-provided, std::generic_category(), "IORING_OP_PROVIDE_BUFFERS");
+  }
+
+  m_loop.watch(m_ring.fd(), EPOLLIN, this); /* (!) Level-triggered: the ring fd is readable while completions are pending */
+}
+
+inline void UringBackend::add(std::shared_ptr<ConnectionHandle> const& handle)
+{
+  if (m_freeFileSlots.empty()) {
+    handle->closeNow(std::make_exception_ptr(std::runtime_error("No free io_uring file slot")));
+    return;
+  }
+
+  handle->m_uring.fileSlot = static_cast<int>(m_freeFileSlots.back());
+  m_freeFileSlots.pop_back();
+  m_ring.updateFile(static_cast<unsigned>(handle->m_uring.fileSlot), handle->m_fd);
+
+  queueReceive(*handle);
+}
+
+inline void UringBackend::remove(ConnectionHandle& handle, std::shared_ptr<ConnectionHandle> owner)
+{
+  ::shutdown(handle.m_fd, SHUT_RDWR); /* (!) Completes the receive that is still queued */
+
+  if (handle.m_uring.fileSlot >= 0) {
+    m_ring.updateFile(static_cast<unsigned>(handle.m_uring.fileSlot), -1);
+  }
+
+  if (!owner) {
+    return;
+  }
+
+  if (handle.m_uring.operations > 0) {
+    m_closing.emplace(&handle, std::move(owner));
+  } else {
+    if (handle.m_uring.fileSlot >= 0) {
+      m_freeFileSlots.push_back(static_cast<unsigned>(handle.m_uring.fileSlot));
+    }
+    m_loop.m_graveyard.emplace_back(std::move(owner));
+  }
+}
+
+inline void UringBackend::send(ConnectionHandle& handle)
+{
+  auto& state = handle.m_uring;
+
+  if (handle.m_closed || state.sendSlot >= 0 || handle.m_outputOffset == handle.m_output.size()) {
+    return; /* (!) At most one send in flight per connection keeps the byte stream in order */
+  }
+
+  if (m_freeSendSlots.empty()) {
+    if (!state.waitingForSlot) {
+      state.waitingForSlot = true;
+      m_waitingForSlot.emplace_back(handle.shared_from_this());
+    }
+    return;
+  }
+
+  state.sendSlot = static_cast<int>(m_freeSendSlots.back());
+  m_freeSendSlots.pop_back();
+
+  char* buffer = m_sendBuffers.get() + static_cast<size_t>(state.sendSlot) * sendSlotSize;
+  const size_t length = std::min<size_t>(handle.m_output.size() - handle.m_outputOffset, sendSlotSize);
+  std::memcpy(buffer, handle.m_output.data() + handle.m_outputOffset, length);
+
+  io_uring_sqe* sqe = m_ring.getSqe();
+  sqe->opcode = IORING_OP_WRITE_FIXED;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->fd = state.fileSlot;
+  sqe->addr = reinterpret_cast<uint64_t>(buffer);
+  sqe->len = static_cast<uint32_t>(length);
+  sqe->buf_index = 0;
+  sqe->user_data = reinterpret_cast<uint64_t>(&handle) | Send;
+
+  ++state.operations;
+}
+
+inline void UringBackend::onEvents(uint32_t)
+{
+  m_ring.forEachCompletion([this](io_uring_cqe const& cqe) {
+    const auto operation = cqe.user_data & 7;
+
+    if (operation == ProvideBuffers) {
+      return;
+    }
+
+    auto& handle = *reinterpret_cast<ConnectionHandle*>(cqe.user_data & ~uint64_t(7));
+
+    if (operation == Receive) {
+      onReceived(handle, cqe.res, cqe.flags);
+    } else {
+      onSent(handle, cqe.res);
+    }
+
+    completed(handle);
+  });
+}
+
+inline void UringBackend::queueReceive(ConnectionHandle& handle)
+{
+  io_uring_sqe* sqe = m_ring.getSqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT; /* (!) The kernel picks a buffer only when data arrives */
+  sqe->fd = handle.m_uring.fileSlot;
+  sqe->len = receiveBufferSize;
+  sqe->buf_group = bufferGroup;
+  sqe->user_data = reinterpret_cast<uint64_t>(&handle) | Receive;
+
+  ++handle.m_uring.operations;
+}
+
+inline void UringBackend::provide(unsigned first, unsigned count)
+{
+  io_uring_sqe* sqe = m_ring.getSqe();
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = static_cast<int>(count);
+  sqe->addr = reinterpret_cast<uint64_t>(m_receiveBuffers.get() + static_cast<size_t>(first) * receiveBufferSize);
+  sqe->len = receiveBufferSize;
+  sqe->off = first;
+  sqe->buf_group = bufferGroup;
+  sqe->user_data = ProvideBuffers;
+}
+
+inline void UringBackend::onReceived(ConnectionHandle& handle, int result, uint32_t flags)
+{
+  if (flags & IORING_CQE_F_BUFFER) {
+    const unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+
+    if (result > 0 && !handle.m_closed) {
+      handle.m_input.append(m_receiveBuffers.get() + static_cast<size_t>(id) * receiveBufferSize, static_cast<size_t>(result));
+    }
+
+    provide(id, 1); /* (!) The bytes were copied out, give the buffer straight back */
+  }
+
+  if (handle.m_closed) {
+    return;
+  }
+
+  if (result > 0 || result == -ENOBUFS || result == -EINTR || result == -EAGAIN) {
+    queueReceive(handle); /* (!) Queued before parsing, so a close from a callback finds it and shuts it down */
+    if (result > 0) {
+      handle.consumeInput();
+    }
+    return;
+  }
+
+  handle.closeNow(std::make_exception_ptr(std::runtime_error("Connection closed by peer")));
+}
+
+inline void UringBackend::onSent(ConnectionHandle& handle, int result)
+{
+  m_freeSendSlots.push_back(static_cast<unsigned>(handle.m_uring.sendSlot));
+  handle.m_uring.sendSlot = -1;
+
+  if (result < 0) {
+    handle.closeNow(std::make_exception_ptr(std::runtime_error("Send failed")));
+  } else if (!handle.m_closed) {
+    handle.m_outputOffset += static_cast<size_t>(result);
+
+    if (handle.m_outputOffset == handle.m_output.size()) {
+      handle.m_output.clear();
+      handle.m_outputOffset = 0;
+    }
+
+    send(handle);
+  }
+
+  while (!m_freeSendSlots.empty() && !m_waitingForSlot.empty()) {
+    auto waiting = std::move(m_waitingForSlot.front());
+    m_waitingForSlot.pop_front();
+    waiting->m_uring.waitingForSlot = false;
+    send(*waiting);
+  }
+}
+
+inline void UringBackend::completed(ConnectionHandle& handle)
+{
+  if (--handle.m_uring.operations > 0 || !handle.m_closed) {
+    return;
+  }
+
+  auto it = m_closing.find(&handle);
+  if (it != m_closing.end()) { /* (!) Last operation of a closed connection: now it can really go */
+    m_freeFileSlots.push_back(static_cast<unsigned>(handle.m_uring.fileSlot));
+    m_loop.m_graveyard.emplace_back(std::move(it->second));
+    m_closing.erase(it);
+  }
+}
+
+class EventLoopGroup
+{
+public:
+  explicit EventLoopGroup(unsigned loops = std::thread::hardware_concurrency(), IoBackend backend = IoBackend::Auto)
+  {
+    loops = loops != 0 ? loops : 2;
+
+    for (unsigned i = 0; i < loops; ++i) {
+      m_loops.emplace_back(std::make_unique<EventLoop>(backend));
+    }
+  }
+
+  ~EventLoopGroup()
+  {
+    stop();
+  }
+
+  EventLoopGroup(EventLoopGroup const&) = delete;
+  EventLoopGroup& operator=(EventLoopGroup const&) = delete;
+
+  void start()
+  {
+    std::vector<std::promise<void>> started(m_loops.size());
+
+    for (size_t i = 0; i < m_loops.size(); ++i) {
+      m_threads.emplace_back([this, i, &started] {
+        m_loops[i]->post([&started, i] { started[i].set_value(); });
+        m_loops[i]->run();
+      });
+    }
+
+    for (auto&& s : started) { /* (!) After start() returns every loop knows its own thread id */
+      s.get_future().wait();
+    }
+  }
+
+  void stop()
+  {
+    for (auto&& loop : m_loops) {
+      loop->stop();
+    }
+
+    for (auto&& t : m_threads) {
+      if (t.joinable()) {
+        t.join();
+      }
+    }
+
+    m_threads.clear();
+  }
+
+  /* (!) One SO_REUSEPORT socket per loop; returns the bound port, which is useful when asking for port 0 */
+  unsigned short listen(unsigned short port, EventLoop::AcceptCallback onAccept)
+  {
+    for (auto&& loop : m_loops) {
+      const int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (fd < 0) {
+        throwSystemError("socket");
+      }
+
+      const int one = 1;
+      ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+      sockaddr_in address{};
+      address.sin_family = AF_INET;
+      address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      address.sin_port = htons(port);
+
+      if (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || ::listen(fd, SOMAXCONN) < 0) {
+        ::close(fd);
+        throwSystemError("bind/listen");
+      }
+
+      socklen_t length = sizeof(address);
+      ::getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length);
+      port = ntohs(address.sin_port); /* (!) The remaining loops join the port the kernel picked for the first one */
+
+      loop->post([&loop, fd, onAccept] {
+        loop->listen(fd, onAccept);
+      });
+    }
+
+    return port;
+  }
+
+  /* (!) Blocking connect, then the socket is handed to the next loop in round-robin order */
+  std::shared_ptr<ConnectionHandle> connect(ConnectionInfo const& info)
+  {
+    const int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      throwSystemError("socket");
+    }
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(info.port);
+
+    if (::inet_pton(AF_INET, info.host.c_str(), &address.sin_addr) != 1 ||
+        ::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+      ::close(fd);
+      throwSystemError("connect");
+    }
+
+    const int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setNonBlocking(fd);
+
+    return next().adopt(fd);
+  }
+
+  EventLoop& next()
+  {
+    return *m_loops[m_next.fetch_add(1, std::memory_order_relaxed) % m_loops.size()];
+  }
+
+  size_t size() const
+  {
+    return m_loops.size();
+  }
+
+  const char* backendName() const
+  {
+    return m_loops.front()->backendName();
+  }
+
+  std::string const& fallbackReason() const
+  {
+    return m_loops.front()->fallbackReason();
+  }
+
+private:
+  std::vector<std::unique_ptr<EventLoop>> m_loops;
+  std::vector<std::thread> m_threads;
+  std::atomic<size_t> m_next{ 0 };
+};
@@ -0,0 +1,297 @@
+/*
+* Session 3, example 01 (io_uring):
+*
+* A thin wrapper over the raw io_uring system calls, so the example doesn't depend on liburing. It only
+* covers what the event loop needs: mapping the rings, handing out submission entries, submitting them
+* in one io_uring_enter() call, reaping completions, and registering buffers and files with the kernel.
+*
+* The constructor throws std::system_error when the kernel doesn't support io_uring, or when it has been
+* disabled (kernel.io_uring_disabled, seccomp filters in containers), which is how callers detect that
+* they have to fall back to plain system calls.
+*/
+#pragma once
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+class IoUring
+{
+public:
+  IoUring(unsigned entries, unsigned completionEntries)
+  {
+    io_uring_params params{};
+    params.flags = IORING_SETUP_CQSIZE; /* (!) Many connections keep a receive outstanding, size the CQ for bursts */
+    params.cq_entries = completionEntries;
+
+    m_fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+    if (m_fd < 0) {
+      throw std::system_error(errno, std::generic_category(), "io_uring_setup");
+    }
+
+    try {
+      mapRings(params);
+    } catch (...) {
+      release();
+      throw;
+    }
+  }
+
+  ~IoUring()
+  {
+    release();
+  }
+
+  IoUring(IoUring const&) = delete;
+  IoUring& operator=(IoUring const&) = delete;
+
+  int fd() const
+  {
+    return m_fd;
+  }
+
+  /* (!) Returns a zeroed entry; entries are only handed to the kernel by submit() */
+  io_uring_sqe* getSqe()
+  {
+    while (pending() >= m_sqEntries) {
+      submit(); /* (!) Queue is full: flush what we have instead of failing */
+      if (pending() >= m_sqEntries && stash() == 0) {
+        std::this_thread::yield(); /* (!) EAGAIN: the kernel is short of memory for a moment */
+      }
+    }
+
+    const unsigned index = m_localTail & m_sqMask;
+    io_uring_sqe* sqe = &m_sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    m_sqArray[index] = index;
+    ++m_localTail;
+
+    return sqe;
+  }
+
+  unsigned pending() const /* (!) Entries queued locally that the kernel hasn't consumed yet */
+  {
+    return m_localTail - atomicLoad(m_sqHead);
+  }
+
+  /* (!) One system call for everything queued since the last submit */
+  int submit()
+  {
+    const unsigned count = pending();
+    if (count == 0) {
+      return 0;
+    }
+
+    atomicStore(m_sqTail, m_localTail);
+
+    int submitted;
+    do {
+      submitted = static_cast<int>(::syscall(__NR_io_uring_enter, m_fd, count, 0, 0, nullptr, 0));
+    } while (submitted < 0 && errno == EINTR);
+
+    if (submitted < 0 && errno != EAGAIN && errno != EBUSY) { /* (!) Out of resources, or the CQ is full: the entries stay queued */
+      throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+    }
+
+    return submitted;
+  }
+
+  /* (!) Used during setup, when the result of an operation is needed before going on */
+  void submitAndWait(unsigned completions)
+  {
+    atomicStore(m_sqTail, m_localTail);
+
+    if (::syscall(__NR_io_uring_enter, m_fd, pending(), completions, IORING_ENTER_GETEVENTS, nullptr, 0) < 0) {
+      throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+    }
+  }
+
+  template<typename Function>
+  unsigned forEachCompletion(Function f)
+  {
+    stash();
+
+    size_t i = 0;
+    for (; i < m_completions.size(); ++i) { /* (!) f may queue entries, and getSqe() may stash more completions meanwhile */
+      const io_uring_cqe cqe = m_completions[i];
+      f(cqe);
+    }
+
+    m_completions.clear();
+    return static_cast<unsigned>(i);
+  }
+
+  /* (!) Completions taken out of the ring by getSqe() and not handed to forEachCompletion() yet */
+  bool stashed() const
+  {
+    return !m_completions.empty();
+  }
+
+  void registerBuffers(std::vector<iovec> const& buffers)
+  {
+    reg(IORING_REGISTER_BUFFERS, buffers.data(), static_cast<unsigned>(buffers.size()));
+  }
+
+  void registerFiles(std::vector<int> const& fds)
+  {
+    reg(IORING_REGISTER_FILES, fds.data(), static_cast<unsigned>(fds.size()));
+  }
+
+  void updateFile(unsigned slot, int fd)
+  {
+    io_uring_files_update update{};
+    update.offset = slot;
+    update.fds = reinterpret_cast<uint64_t>(&fd);
+    reg(IORING_REGISTER_FILES_UPDATE, &update, 1);
+  }
+
+  bool supports(std::initializer_list<int> ops)
+  {
+    std::vector<char> storage(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+    auto probe = reinterpret_cast<io_uring_probe*>(storage.data());
+
+    if (::syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+      return false;
+    }
+
+    for (auto op : ops) {
+      if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+private:
+  void mapRings(io_uring_params const& params)
+  {
+    m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+    const bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (singleMmap) {
+      m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+    }
+
+    m_sqRing = map(m_sqRingSize, IORING_OFF_SQ_RING);
+    m_cqRing = singleMmap ? m_sqRing : map(m_cqRingSize, IORING_OFF_CQ_RING);
+    m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    m_sqes = static_cast<io_uring_sqe*>(map(m_sqesSize, IORING_OFF_SQES));
+
+    auto sq = static_cast<char*>(m_sqRing);
+    m_sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    m_sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    m_sqFlags = reinterpret_cast<unsigned*>(sq + params.sq_off.flags);
+    m_sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    m_sqEntries = params.sq_entries;
+    m_sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+    auto cq = static_cast<char*>(m_cqRing);
+    m_cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    m_cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    m_cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    m_localTail = *m_sqTail;
+    m_completions.reserve(params.cq_entries);
+  }
+
+  /*
+  * (!) Copies the completions out of the ring, which gives their slots back to the kernel. A full
+  * completion queue makes io_uring_enter() refuse new entries with EBUSY, and getSqe() can't return
+  * until the kernel has consumed one, so it moves the completions aside instead of waiting for the loop.
+  */
+  size_t stash()
+  {
+    if (atomicLoad(m_sqFlags) & IORING_SQ_CQ_OVERFLOW) { /* (!) Completions the kernel kept aside while the CQ was full */
+      ::syscall(__NR_io_uring_enter, m_fd, 0, 0, IORING_ENTER_GETEVENTS, nullptr, 0);
+    }
+
+    unsigned head = *m_cqHead;
+    const unsigned tail = atomicLoad(m_cqTail);
+    const size_t count = tail - head;
+
+    for (; head != tail; ++head) {
+      m_completions.push_back(m_cqes[head & m_cqMask]);
+    }
+
+    atomicStore(m_cqHead, head);
+    return count;
+  }
+
+  void release()
+  {
+    if (m_sqes) {
+      ::munmap(m_sqes, m_sqesSize);
+    }
+    if (m_cqRing && m_cqRing != m_sqRing) {
+      ::munmap(m_cqRing, m_cqRingSize);
+    }
+    if (m_sqRing) {
+      ::munmap(m_sqRing, m_sqRingSize);
+    }
+    ::close(m_fd);
+  }
+
+  void* map(size_t size, off_t offset)
+  {
+    void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, offset);
+    if (p == MAP_FAILED) {
+      throw std::system_error(errno, std::generic_category(), "mmap io_uring");
+    }
+    return p;
+  }
+
+  void reg(unsigned opcode, const void* arg, unsigned count)
+  {
+    if (::syscall(__NR_io_uring_register, m_fd, opcode, arg, count) < 0) {
+      throw std::system_error(errno, std::generic_category(), "io_uring_register");
+    }
+  }
+
+  /* (!) The ring indices are shared with the kernel, so accesses need acquire/release semantics */
+  static unsigned atomicLoad(const unsigned* p)
+  {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+  }
+
+  static void atomicStore(unsigned* p, unsigned value)
+  {
+    __atomic_store_n(p, value, __ATOMIC_RELEASE);
+  }
+
+  int m_fd = -1;
+
+  void* m_sqRing = nullptr;
+  void* m_cqRing = nullptr;
+  size_t m_sqRingSize = 0;
+  size_t m_cqRingSize = 0;
+  io_uring_sqe* m_sqes = nullptr;
+  size_t m_sqesSize = 0;
+
+  unsigned* m_sqHead = nullptr;
+  unsigned* m_sqTail = nullptr;
+  unsigned* m_sqArray = nullptr;
+  unsigned* m_sqFlags = nullptr;
+  unsigned m_sqMask = 0;
+  unsigned m_sqEntries = 0;
+  unsigned m_localTail = 0;
+
+  unsigned* m_cqHead = nullptr;
+  unsigned* m_cqTail = nullptr;
+  unsigned m_cqMask = 0;
+  io_uring_cqe* m_cqes = nullptr;
+  std::vector<io_uring_cqe> m_completions; /* (!) Out of the ring, not handed to forEachCompletion()'s function yet */
+};
@@ -0,0 +1,367 @@
+/*
+* Session 3, example 01:
+*
+* Every SocketWrapper in s2t08 is used synchronously from the thread that calls it, so serving thousands
+* of connections that way means thousands of threads, most of them blocked in receiveData().
+*
+* Here the same SocketWrapper (still lazily connected through std::call_once) sits on top of a small
+* set of event loops (see EventLoop.h): one thread per core multiplexes all the sockets with an
+* edge-triggered epoll instance, and receiveData() either registers a callback that runs on the loop
+* thread or hands back a std::future that the loop fulfils when the next packet arrives.
+*
+* The program is also a loopback benchmark: it opens a large number of idle connections to measure how
+* much memory each one costs, and then keeps a smaller set of connections busy with ping-pong traffic
+* to measure throughput. The throughput run is repeated for each I/O backend: plain recv()/send() system
+* calls driven by epoll readiness, and io_uring with batched submissions, registered buffers and fixed
+* files. A pipeline depth above 1 keeps several packets in flight per connection, which is where batching
+* pays off. Each backend must also answer a packet whose sender shuts down its side of the connection
+* right after it, so that the end of the stream arrives with the packet. Built with
+* CONCURRENCY_METRICS=1, it also prints how often SocketWrapper::sendData was called and how long the
+* calls took (common/Metrics.h). Usage:
+*
+*   s3t01 [idle connections = 10000] [active connections = 1000] [seconds = 5] [payload bytes = 64]
+*         [pipeline depth = 1] [backend = both | auto | syscalls | io_uring]
+*/
+#include <iostream>
+
+#if defined(__linux__)
+
+#include <sys/resource.h>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+#include "../../common/Metrics.h" /* (!) Compiled away unless CONCURRENCY_METRICS=1 */
+#include "EventLoop.h"
+
+class ConnectionManager
+{
+public:
+  explicit ConnectionManager(EventLoopGroup& loops)
+    : m_loops(loops)
+  {
+  }
+
+  std::shared_ptr<ConnectionHandle> open(ConnectionInfo const& info)
+  {
+    return m_loops.connect(info);
+  }
+
+private:
+  EventLoopGroup& m_loops;
+};
+
+class SocketWrapper
+{
+public:
+  SocketWrapper(ConnectionInfo const& connectionDetails, ConnectionManager& connectionManager)
+    : m_connectionDetails(connectionDetails)
+    , m_connectionManager(connectionManager)
+  {
+  }
+
+  ~SocketWrapper()
+  {
+    if (m_connection) {
+      m_connection->close();
+    }
+  }
+
+  void sendData(Packet const& data) /* (!) Doesn't block: the packet is queued on the connection's loop */
+  {
+    metrics::ScopedTimer timer(sendLatency); /* (!) The first call may also pay for opening the connection */
+    packetsSent.increment();
+
+    std::call_once(connection_init_flag, &SocketWrapper::open_connection, this);
+    m_connection->sendData(data);
+  }
+
+  void receiveData(ConnectionHandle::ReceiveCallback callback) /* (!) Callback style: runs on the loop thread */
+  {
+    std::call_once(connection_init_flag, &SocketWrapper::open_connection, this);
+    m_connection->receiveData(std::move(callback));
+  }
+
+  std::future<Packet> receiveData() /* (!) Future style: only the caller that calls get() blocks */
+  {
+    std::call_once(connection_init_flag, &SocketWrapper::open_connection, this);
+    return m_connection->receiveData();
+  }
+
+  static inline metrics::Counter packetsSent;
+  static inline metrics::Histogram sendLatency;
+
+private:
+  ConnectionInfo m_connectionDetails;
+  ConnectionManager& m_connectionManager;
+  std::shared_ptr<ConnectionHandle> m_connection;
+
+  std::once_flag connection_init_flag;
+
+  void open_connection()
+  {
+    m_connection = m_connectionManager.open(m_connectionDetails);
+  }
+};
+
+static size_t residentBytes()
+{
+  std::ifstream statm("/proc/self/statm");
+  size_t pages = 0, resident = 0;
+  statm >> pages >> resident;
+  return resident * static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+}
+
+static size_t kernelTcpBytes() /* (!) Socket buffers live in the kernel and don't show up in RSS */
+{
+  std::ifstream sockstat("/proc/net/sockstat");
+  std::string line;
+
+  while (std::getline(sockstat, line)) {
+    if (line.compare(0, 4, "TCP:") == 0) {
+      std::istringstream fields(line);
+      std::string key;
+      size_t value;
+      while (fields >> key >> value) {
+        if (key == "mem") {
+          return value * static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+        }
+      }
+    }
+  }
+
+  return 0;
+}
+
+static size_t raiseFileLimit()
+{
+  rlimit limit{};
+  ::getrlimit(RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  ::setrlimit(RLIMIT_NOFILE, &limit);
+  return static_cast<size_t>(limit.rlim_cur);
+}
+
+template<typename Predicate>
+static bool waitFor(Predicate done, std::chrono::seconds timeout)
+{
+  const auto deadline = std::chrono::steady_clock::now() + timeout;
+
+  while (!done()) {
+    if (std::chrono::steady_clock::now() > deadline) {
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  return true;
+}
+
+/* (!) A plain blocking client: sends one packet, shuts down its sending side at once, and returns the reply */
+static std::string halfClosedRoundTrip(unsigned short port, std::string const& payload)
+{
+  const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  timeval timeout{ 5, 0 };
+  ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)); /* (!) A lost packet fails the check instead of hanging */
+
+  std::string reply;
+  if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) {
+    const uint32_t length = htonl(static_cast<uint32_t>(payload.size()));
+    std::string frame(reinterpret_cast<char const*>(&length), sizeof(length));
+    frame += payload;
+    ::send(fd, frame.data(), frame.size(), MSG_NOSIGNAL);
+    ::shutdown(fd, SHUT_WR); /* (!) The FIN may well arrive in the same read as the packet */
+
+    char buffer[256];
+    ssize_t n;
+    while ((n = ::recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+      reply.append(buffer, static_cast<size_t>(n));
+    }
+  }
+  ::close(fd);
+
+  return reply.size() >= sizeof(uint32_t) ? reply.substr(sizeof(uint32_t)) : std::string();
+}
+
+struct ActiveConnection
+{
+  std::unique_ptr<SocketWrapper> socket;
+  std::atomic<uint64_t> roundTrips{ 0 };
+};
+
+static void runThroughput(IoBackend backend, size_t active, int seconds, size_t payloadSize, unsigned depth)
+{
+  EventLoopGroup server(std::thread::hardware_concurrency(), backend);
+  EventLoopGroup clients(std::thread::hardware_concurrency(), backend);
+
+  const auto port = server.listen(0, [](std::shared_ptr<ConnectionHandle> connection) {
+    connection->receiveData([](ConnectionHandle& c, Packet p) { /* (!) Echo server */
+      c.sendData(std::move(p));
+    });
+  });
+
+  server.start();
+  clients.start();
+
+  ConnectionInfo info{ "127.0.0.1", port };
+  ConnectionManager manager(clients);
+
+  std::atomic<bool> running{ true };
+  std::vector<ActiveConnection> connections(active);
+  const Packet ping{ std::string(payloadSize, 'x') };
+
+  for (auto&& c : connections) {
+    c.socket = std::make_unique<SocketWrapper>(info, manager);
+    c.socket->receiveData([&c, &running](ConnectionHandle& handle, Packet p) {
+      c.roundTrips.fetch_add(1, std::memory_order_relaxed);
+      if (running.load(std::memory_order_relaxed)) {
+        handle.sendData(std::move(p));
+      }
+    });
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+
+  for (auto&& c : connections) {
+    for (unsigned i = 0; i < depth; ++i) {
+      c.socket->sendData(ping);
+    }
+  }
+
+  std::this_thread::sleep_for(std::chrono::seconds(seconds));
+  running = false;
+
+  const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  const bool answered = halfClosedRoundTrip(port, "Half closed") == "Half closed";
+
+  uint64_t roundTrips = 0;
+  for (auto&& c : connections) {
+    roundTrips += c.roundTrips.load();
+  }
+
+  std::cout << "Active connections: " << active << ", payload " << payloadSize << " bytes, pipeline depth " << depth
+            << ", backend " << clients.backendName() << std::endl;
+  if (!clients.fallbackReason().empty()) {
+    std::cout << "  (io_uring unavailable: " << clients.fallbackReason() << ")" << std::endl;
+  }
+  std::cout << "  round trips/s: " << static_cast<uint64_t>(roundTrips / elapsed.count()) << std::endl;
+  std::cout << "  payload MB/s (both directions): " << 2.0 * roundTrips * payloadSize / elapsed.count() / 1e6 << std::endl;
+  std::cout << "  packet followed by the end of the stream answered: " << (answered ? "yes" : "NO") << std::endl;
+
+  clients.stop(); /* (!) Echoes may still be in flight: no callback may run once connections is gone */
+  connections.clear();
+  server.stop();
+}
+
+int main(int argc, char* argv[])
+{
+  size_t idle = argc > 1 ? std::stoul(argv[1]) : 10000;
+  size_t active = argc > 2 ? std::stoul(argv[2]) : 1000;
+  const int seconds = argc > 3 ? std::stoi(argv[3]) : 5;
+  const size_t payloadSize = argc > 4 ? std::stoul(argv[4]) : 64;
+  const unsigned depth = argc > 5 ? static_cast<unsigned>(std::stoul(argv[5])) : 1;
+  const std::string backend = argc > 6 ? argv[6] : "both";
+
+  const size_t files = raiseFileLimit();
+  const size_t needed = 2 * (idle + active) + 64; /* (!) Both ends of every connection live in this process */
+
+  if (files < needed) {
+    const size_t budget = files > 64 + 2 * active ? (files - 64) / 2 - active : 0;
+    std::cout << "RLIMIT_NOFILE is " << files << ", reducing idle connections from " << idle << " to " << budget << std::endl;
+    idle = budget;
+  }
+
+  {
+    std::atomic<size_t> accepted{ 0 };
+
+    EventLoopGroup server;
+    EventLoopGroup clients;
+
+    const auto port = server.listen(0, [&accepted](std::shared_ptr<ConnectionHandle> connection) {
+      accepted.fetch_add(1, std::memory_order_relaxed);
+      connection->receiveData([](ConnectionHandle& c, Packet p) {
+        c.sendData(std::move(p));
+      });
+    });
+
+    server.start();
+    clients.start();
+
+    std::cout << "Event loops: " << server.size() << " server, " << clients.size() << " client, backend "
+              << server.backendName() << std::endl;
+
+    ConnectionInfo info{ "127.0.0.1", port };
+    ConnectionManager manager(clients);
+
+    /* (!) Memory cost of idle connections */
+    const auto rssBefore = residentBytes();
+    const auto kernelBefore = kernelTcpBytes();
+
+    std::vector<std::shared_ptr<ConnectionHandle>> idleConnections;
+    idleConnections.reserve(idle);
+
+    for (size_t i = 0; i < idle; ++i) {
+      idleConnections.emplace_back(manager.open(info));
+    }
+
+    if (!waitFor([&] { return accepted.load() >= idle; }, std::chrono::seconds(30))) {
+      std::cout << "Only " << accepted.load() << " of " << idle << " connections were accepted" << std::endl;
+    }
+
+    const auto rssAfter = residentBytes();
+    const auto kernelAfter = kernelTcpBytes();
+
+    if (idle) {
+      std::cout << "Idle connections: " << idle << std::endl;
+      std::cout << "  user-space bytes per connection (both ends): " << (rssAfter - rssBefore) / idle << std::endl;
+      std::cout << "  kernel TCP bytes per connection (both ends): " << (kernelAfter - kernelBefore) / idle << std::endl;
+    }
+
+    /* (!) Future style receive, the way a synchronous caller would use it */
+    SocketWrapper single(info, manager);
+    auto reply = single.receiveData();
+    single.sendData(Packet{ "Hello, event loop" });
+    std::cout << "Future style reply: " << reply.get().payload << std::endl;
+
+    idleConnections.clear();
+  }
+
+  /* (!) Throughput of active connections */
+  if (backend == "both" || backend == "syscalls") {
+    runThroughput(IoBackend::Syscalls, active, seconds, payloadSize, depth);
+  }
+  if (backend == "both" || backend == "io_uring") {
+    try {
+      runThroughput(IoBackend::IoUring, active, seconds, payloadSize, depth);
+    } catch (std::exception const& e) {
+      std::cout << "io_uring backend unavailable: " << e.what() << std::endl;
+    }
+  }
+  if (backend == "auto") {
+    runThroughput(IoBackend::Auto, active, seconds, payloadSize, depth);
+  }
+
+  if (metrics::Enabled) {
+    const auto sends = SocketWrapper::sendLatency.snapshot();
+    std::cout << "SocketWrapper::sendData: " << SocketWrapper::packetsSent.value() << " calls, p50 " << sends.percentile(50)
+              << " ns, p99 " << sends.percentile(99) << " ns" << std::endl;
+  }
+
+  return 0;
+}
+
+#else
+
+int main()
+{
+  std::cout << "This example uses epoll and only builds on Linux" << std::endl;
+
+  return 0;
+}
+
+#endif
@@ -0,0 +1,733 @@
+/*
+* Session 3, example 02 (futures):
+*
+* A lightweight Future<T>/Promise<T> pair with continuations. Unlike std::future, a Future can be chained
+* with then(): the continuation runs inline, either right away when the value is already there, or on the
+* thread that fulfils the promise. then(executor, f) hops to an Executor first, so work that shouldn't run
+* on the producer's thread goes to a fixed set of threads instead of a new std::thread per task.
+*
+* The shared state is a single atomic word plus storage for the value, the exception and one
+* continuation. Whoever arrives second between the producer (setValue) and the consumer (then/get)
+* runs the continuation, so no lock is taken on the fast path.
+*/
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/* (!) Like std::function, but move-only, so it can hold promises and other move-only state */
+template<typename Signature>
+class UniqueFunction;
+
+template<typename R, typename... Args>
+class UniqueFunction<R(Args...)>
+{
+public:
+  UniqueFunction() = default;
+
+  template<typename F, typename = std::enable_if_t<!std::is_same<std::decay_t<F>, UniqueFunction>::value>>
+  UniqueFunction(F&& f)
+    : m_callable(new Callable<std::decay_t<F>>(std::forward<F>(f)))
+  {
+  }
+
+  R operator()(Args... args)
+  {
+    return m_callable->call(std::forward<Args>(args)...);
+  }
+
+  explicit operator bool() const
+  {
+    return m_callable != nullptr;
+  }
+
+private:
+  struct Base
+  {
+    virtual ~Base() = default;
+    virtual R call(Args... args) = 0;
+  };
+
+  template<typename F>
+  struct Callable : Base
+  {
+    explicit Callable(F&& f)
+      : f(std::move(f))
+    {
+    }
+
+    explicit Callable(F const& f)
+      : f(f)
+    {
+    }
+
+    R call(Args... args) override
+    {
+      return f(std::forward<Args>(args)...);
+    }
+
+    F f;
+  };
+
+  std::unique_ptr<Base> m_callable;
+};
+
+/* (!) A fixed set of worker threads sharing one queue */
+class Executor
+{
+public:
+  explicit Executor(unsigned threads = std::thread::hardware_concurrency())
+  {
+    threads = threads != 0 ? threads : 2;
+
+    for (unsigned i = 0; i < threads; ++i) {
+      m_threads.emplace_back(&Executor::work, this);
+    }
+  }
+
+  ~Executor() /* (!) Runs what is already queued, then joins */
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_done = true;
+    }
+
+    m_condition.notify_all();
+
+    for (auto&& t : m_threads) {
+      t.join();
+    }
+  }
+
+  Executor(Executor const&) = delete;
+  Executor& operator=(Executor const&) = delete;
+
+  void execute(UniqueFunction<void()> task)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_tasks.emplace_back(std::move(task));
+    }
+
+    m_condition.notify_one();
+  }
+
+  static Executor& shared()
+  {
+    static Executor instance;
+    return instance;
+  }
+
+private:
+  void work()
+  {
+    for (;;) {
+      UniqueFunction<void()> task;
+
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_condition.wait(lock, [this] { return m_done || !m_tasks.empty(); });
+
+        if (m_tasks.empty()) {
+          return;
+        }
+
+        task = std::move(m_tasks.front());
+        m_tasks.pop_front();
+      }
+
+      task();
+    }
+  }
+
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
+  std::deque<UniqueFunction<void()>> m_tasks;
+  bool m_done = false;
+  std::vector<std::thread> m_threads;
+};
+
+struct Unit
+{
+};
+
+template<typename T>
+using Stored = std::conditional_t<std::is_void<T>::value, Unit, T>; /* (!) Future<void> stores an empty Unit */
+
+template<typename T>
+class Future;
+
+template<typename T>
+class Promise;
+
+namespace detail
+{
+  class StateBase : public std::enable_shared_from_this<StateBase>
+  {
+  public:
+    virtual ~StateBase() = default;
+
+    /*
+    * Runs the continuations this thread has queued (see dispatch). A continuation that blocks in get()
+    * calls it first: the future it waits for may be one it has just completed itself, whose continuation
+    * would otherwise sit in the queue behind it forever.
+    */
+    static void runDeferred()
+    {
+      auto& queue = deferred();
+      while (!queue.empty()) {
+        auto next = std::move(queue.front());
+        queue.pop_front();
+
+        try {
+          next->runContinuation();
+        } catch (...) {
+          if (!firstError()) {
+            firstError() = std::current_exception(); /* (!) The others still run; dispatch() rethrows it */
+          }
+        }
+      }
+    }
+
+  protected:
+    virtual void runContinuation() = 0;
+
+    /*
+    * A continuation usually completes the next future of the chain, which runs the next continuation,
+    * and so on: run naively, a long chain would recurse once per link. Continuations completed while
+    * this thread is already running one are queued and run by the outermost call instead.
+    */
+    void dispatch()
+    {
+      if (draining()) {
+        deferred().emplace_back(shared_from_this());
+        return;
+      }
+
+      struct Draining /* (!) Reset even if a continuation throws, or the thread would queue forever */
+      {
+        Draining()
+        {
+          draining() = true;
+        }
+
+        ~Draining()
+        {
+          draining() = false;
+        }
+      } scope;
+
+      deferred().emplace_front(shared_from_this());
+      runDeferred();
+
+      if (auto error = std::exchange(firstError(), nullptr)) {
+        std::rethrow_exception(error);
+      }
+    }
+
+  private:
+    static bool& draining()
+    {
+      thread_local bool draining = false;
+      return draining;
+    }
+
+    static std::deque<std::shared_ptr<StateBase>>& deferred()
+    {
+      thread_local std::deque<std::shared_ptr<StateBase>> deferred;
+      return deferred;
+    }
+
+    static std::exception_ptr& firstError()
+    {
+      thread_local std::exception_ptr error;
+      return error;
+    }
+  };
+
+  template<typename T>
+  class SharedState : public StateBase
+  {
+  public:
+    using Continuation = UniqueFunction<void(SharedState&)>;
+
+    void setValue(T value)
+    {
+      m_value.emplace(std::move(value));
+      publish();
+    }
+
+    void setException(std::exception_ptr error)
+    {
+      m_error = std::move(error);
+      publish();
+    }
+
+    void setContinuation(Continuation continuation)
+    {
+      m_continuation = std::move(continuation);
+
+      int expected = Empty;
+      if (!m_state.compare_exchange_strong(expected, Waiting, std::memory_order_acq_rel)) {
+        dispatch(); /* (!) Already ready: run inline, no queueing, no wakeup */
+      }
+    }
+
+    bool ready() const
+    {
+      return m_state.load(std::memory_order_acquire) == Ready;
+    }
+
+    bool hasError() const
+    {
+      return m_error != nullptr;
+    }
+
+    std::exception_ptr error() const
+    {
+      return m_error;
+    }
+
+    T take()
+    {
+      if (m_error) {
+        std::rethrow_exception(m_error);
+      }
+
+      return std::move(*m_value);
+    }
+
+  protected:
+    void runContinuation() override
+    {
+      auto continuation = std::move(m_continuation); /* (!) Released once run, so finished links don't keep the chain alive */
+      continuation(*this);
+    }
+
+  private:
+    enum
+    {
+      Empty,
+      Waiting, /* (!) A continuation is stored and the value isn't there yet */
+      Ready
+    };
+
+    void publish()
+    {
+      if (m_state.exchange(Ready, std::memory_order_acq_rel) == Waiting) {
+        dispatch(); /* (!) The consumer came first, the producer runs its continuation */
+      }
+    }
+
+    std::atomic<int> m_state{ Empty };
+    std::optional<T> m_value;
+    std::exception_ptr m_error;
+    Continuation m_continuation;
+  };
+
+  template<typename T>
+  struct IsFuture : std::false_type
+  {
+  };
+
+  template<typename T>
+  struct IsFuture<Future<T>> : std::true_type
+  {
+    using Inner = T;
+  };
+
+  template<typename F, typename T, bool = std::is_void<T>::value>
+  struct ResultOf
+  {
+    using Type = std::invoke_result_t<F, T>;
+  };
+
+  template<typename F, typename T>
+  struct ResultOf<F, T, true>
+  {
+    using Type = std::invoke_result_t<F>;
+  };
+
+  template<typename R>
+  struct Unwrap
+  {
+    using Type = R;
+  };
+
+  template<typename U>
+  struct Unwrap<Future<U>>
+  {
+    using Type = U; /* (!) A continuation returning Future<U> yields Future<U>, not Future<Future<U>> */
+  };
+}
+
+template<typename T>
+class Promise
+{
+public:
+  Promise()
+    : m_state(std::make_shared<detail::SharedState<Stored<T>>>())
+  {
+  }
+
+  ~Promise()
+  {
+    if (m_state && !m_satisfied) {
+      m_state->setException(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+    }
+  }
+
+  Promise(Promise&&) = default;
+  Promise& operator=(Promise&&) = default;
+
+  Future<T> getFuture()
+  {
+    return Future<T>(m_state);
+  }
+
+  template<typename U = T, typename = std::enable_if_t<!std::is_void<U>::value>>
+  void setValue(U value)
+  {
+    m_satisfied = true;
+    m_state->setValue(std::move(value));
+  }
+
+  template<typename U = T, typename = std::enable_if_t<std::is_void<U>::value>>
+  void setValue()
+  {
+    m_satisfied = true;
+    m_state->setValue(Unit{});
+  }
+
+  void setException(std::exception_ptr error)
+  {
+    m_satisfied = true;
+    m_state->setException(std::move(error));
+  }
+
+private:
+  template<typename>
+  friend class Future;
+
+  void setStored(Stored<T> value)
+  {
+    m_satisfied = true;
+    m_state->setValue(std::move(value));
+  }
+
+  std::shared_ptr<detail::SharedState<Stored<T>>> m_state;
+  bool m_satisfied = false;
+};
+
+template<typename T>
+class Future
+{
+public:
+  Future() = default;
+
+  explicit Future(std::shared_ptr<detail::SharedState<Stored<T>>> state)
+    : m_state(std::move(state))
+  {
+  }
+
+  bool valid() const
+  {
+    return m_state != nullptr;
+  }
+
+  bool isReady() const
+  {
+    return m_state && m_state->ready();
+  }
+
+  /*
+  * Blocks only if the value isn't there yet; like std::future::get() it consumes the future. Inside a
+  * continuation it first runs what that continuation has completed on this thread, but it must not
+  * wait for a value that only the caller of the continuation sets after it returns: that never comes.
+  */
+  T get()
+  {
+    auto state = std::move(m_state);
+
+    if (!state->ready()) {
+      std::mutex mutex;
+      std::condition_variable condition;
+      bool done = false;
+
+      state->setContinuation([&](detail::SharedState<Stored<T>>&) {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        condition.notify_one(); /* (!) Notify under the lock: the waiter owns these locals */
+      });
+      detail::StateBase::runDeferred(); /* (!) Doesn't throw: errors go to the dispatch() below us, if any */
+
+      std::unique_lock<std::mutex> lock(mutex);
+      condition.wait(lock, [&done] { return done; });
+    }
+
+    if constexpr (std::is_void<T>::value) {
+      state->take();
+    } else {
+      return state->take();
+    }
+  }
+
+  /* (!) f runs inline: now if the value is ready, otherwise on the thread that sets it */
+  template<typename F>
+  auto then(F&& f) -> Future<typename detail::Unwrap<typename detail::ResultOf<std::decay_t<F>, T>::Type>::Type>
+  {
+    using R = typename detail::ResultOf<std::decay_t<F>, T>::Type;
+    using Result = typename detail::Unwrap<R>::Type;
+
+    Promise<Result> promise;
+    auto future = promise.getFuture();
+
+    auto state = std::move(m_state);
+    state->setContinuation([promise = std::move(promise), f = std::forward<F>(f)](detail::SharedState<Stored<T>>& s) mutable {
+      if (s.hasError()) {
+        promise.setException(s.error()); /* (!) Errors skip the continuation and flow down the chain */
+        return;
+      }
+
+      try {
+        complete<R>(promise, f, s);
+      } catch (...) {
+        promise.setException(std::current_exception());
+      }
+    });
+
+    return future;
+  }
+
+  /* (!) Same, but f is scheduled on the executor */
+  template<typename F>
+  auto then(Executor& executor, F&& f)
+  {
+    return via(executor).then(std::forward<F>(f));
+  }
+
+  Future<T> via(Executor& executor)
+  {
+    Promise<T> promise;
+    auto future = promise.getFuture();
+
+    auto state = std::move(m_state);
+    state->setContinuation([promise = std::move(promise), &executor](detail::SharedState<Stored<T>>& s) mutable {
+      if (s.hasError()) {
+        executor.execute([promise = std::move(promise), error = s.error()]() mutable {
+          promise.setException(error);
+        });
+      } else {
+        executor.execute([promise = std::move(promise), value = s.take()]() mutable {
+          promise.setStored(std::move(value));
+        });
+      }
+    });
+
+    return future;
+  }
+
+private:
+  template<typename>
+  friend class Future;
+
+  template<typename R, typename Result, typename F>
+  static void complete(Promise<Result>& promise, F& f, detail::SharedState<Stored<T>>& s)
+  {
+    if constexpr (detail::IsFuture<R>::value) {
+      invoke(f, s).forwardTo(std::move(promise));
+    } else if constexpr (std::is_void<R>::value) {
+      invoke(f, s);
+      promise.setValue();
+    } else {
+      promise.setValue(invoke(f, s));
+    }
+  }
+
+  template<typename F>
+  static decltype(auto) invoke(F& f, detail::SharedState<Stored<T>>& s)
+  {
+    if constexpr (std::is_void<T>::value) {
+      s.take();
+      return f();
+    } else {
+      return f(s.take());
+    }
+  }
+
+  void forwardTo(Promise<T> promise)
+  {
+    auto state = std::move(m_state);
+    state->setContinuation([promise = std::move(promise)](detail::SharedState<Stored<T>>& s) mutable {
+      if (s.hasError()) {
+        promise.setException(s.error());
+      } else {
+        promise.setStored(s.take());
+      }
+    });
+  }
+
+  template<typename U>
+  friend void attach(Future<U>& future, UniqueFunction<void(detail::SharedState<Stored<U>>&)> continuation);
+
+  std::shared_ptr<detail::SharedState<Stored<T>>> m_state;
+};
+
+template<typename U>
+void attach(Future<U>& future, UniqueFunction<void(detail::SharedState<Stored<U>>&)> continuation)
+{
+  auto state = std::move(future.m_state);
+  state->setContinuation(std::move(continuation));
+}
+
+template<typename T>
+Future<std::decay_t<T>> makeReadyFuture(T&& value)
+{
+  Promise<std::decay_t<T>> promise;
+  promise.setValue(std::forward<T>(value));
+  return promise.getFuture();
+}
+
+inline Future<void> makeReadyFuture()
+{
+  Promise<void> promise;
+  promise.setValue();
+  return promise.getFuture();
+}
+
+template<typename F, typename... Args>
+auto async(Executor& executor, F&& f, Args&&... args) -> Future<std::invoke_result_t<std::decay_t<F>, std::decay_t<Args>...>>
+{
+  using R = std::invoke_result_t<std::decay_t<F>, std::decay_t<Args>...>;
+
+  Promise<R> promise;
+  auto future = promise.getFuture();
+
+  executor.execute([promise = std::move(promise), f = std::forward<F>(f), args = std::make_tuple(std::forward<Args>(args)...)]() mutable {
+    try {
+      if constexpr (std::is_void<R>::value) {
+        std::apply(f, std::move(args));
+        promise.setValue();
+      } else {
+        promise.setValue(std::apply(f, std::move(args)));
+      }
+    } catch (...) {
+      promise.setException(std::current_exception());
+    }
+  });
+
+  return future;
+}
+
+/* (!) Completes when every input has, or with the first exception; values keep the input order */
+template<typename T>
+auto whenAll(std::vector<Future<T>> futures) -> Future<std::conditional_t<std::is_void<T>::value, void, std::vector<Stored<T>>>>
+{
+  using Result = std::conditional_t<std::is_void<T>::value, void, std::vector<Stored<T>>>;
+
+  struct Context
+  {
+    explicit Context(size_t n)
+      : values(n)
+      , remaining(n)
+    {
+    }
+
+    std::vector<std::optional<Stored<T>>> values;
+    std::atomic<size_t> remaining;
+    std::atomic<bool> failed{ false };
+    Promise<Result> promise;
+  };
+
+  auto context = std::make_shared<Context>(futures.size());
+  auto future = context->promise.getFuture();
+
+  if (futures.empty()) {
+    if constexpr (std::is_void<T>::value) {
+      context->promise.setValue();
+    } else {
+      context->promise.setValue({});
+    }
+    return future;
+  }
+
+  for (size_t i = 0; i < futures.size(); ++i) {
+    attach<T>(futures[i], [context, i](detail::SharedState<Stored<T>>& s) {
+      if (s.hasError()) {
+        if (!context->failed.exchange(true)) {
+          context->promise.setException(s.error());
+        }
+        return;
+      }
+
+      context->values[i].emplace(s.take()); /* (!) Each input writes only its own slot */
+
+      if (context->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1 && !context->failed.load()) {
+        if constexpr (std::is_void<T>::value) {
+          context->promise.setValue();
+        } else {
+          std::vector<Stored<T>> values;
+          values.reserve(context->values.size());
+          for (auto&& v : context->values) {
+            values.emplace_back(std::move(*v));
+          }
+          context->promise.setValue(std::move(values));
+        }
+      }
+    });
+  }
+
+  return future;
+}
+
+template<typename T>
+using WhenAnyResult = std::conditional_t<std::is_void<T>::value, size_t, std::pair<size_t, Stored<T>>>;
+
+/* (!) Completes with the index (and value) of the first input to finish. There must be at least one */
+template<typename T>
+Future<WhenAnyResult<T>> whenAny(std::vector<Future<T>> futures)
+{
+  if (futures.empty()) {
+    throw std::invalid_argument("whenAny: no futures"); /* (!) Nothing could ever finish first */
+  }
+
+  struct Context
+  {
+    std::atomic<bool> done{ false };
+    Promise<WhenAnyResult<T>> promise;
+  };
+
+  auto context = std::make_shared<Context>();
+  auto future = context->promise.getFuture();
+
+  for (size_t i = 0; i < futures.size(); ++i) {
+    attach<T>(futures[i], [context, i](detail::SharedState<Stored<T>>& s) {
+      if (context->done.exchange(true)) {
+        return;
+      }
+
+      if (s.hasError()) {
+        context->promise.setException(s.error());
+      } else if constexpr (std::is_void<T>::value) {
+        context->promise.setValue(i);
+      } else {
+        context->promise.setValue(std::make_pair(i, s.take()));
+      }
+    });
+  }
+
+  return future;
+}
@@ -0,0 +1,197 @@
+/*
+* Session 3, example 02:
+*
+* The examples of session 1 start a std::thread per task and hand results back through references
+* (accumulateBlock writes into results[i]) followed by join(). Futures make the result part of the
+* interface instead: a task returns a Future<T>, and callers either block on get() or chain more work
+* with then(), which runs inline as soon as the value is available.
+*
+* Tasks run on a shared Executor (see Future.h), so the cost of starting a thread is paid once rather
+* than per task. whenAll() replaces the "join all the spawned threads" loop of s1t15, and whenAny()
+* lets a caller go on with whichever result comes first. A continuation may block in get(), as long as
+* what it waits for doesn't need it to return first.
+*
+* The second half of the program measures the overhead of a step in a chain of continuations against
+* starting a task with std::async and waiting on it with std::future::get(). Usage:
+*
+*   s3t02 [chain length = 100000] [std::async steps = 2000]
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <string>
+#include <tuple>
+
+#include "Future.h"
+
+void hello()
+{
+  std::cout << "Hello concurrent world\n";
+}
+
+template<typename Iterator, typename T>
+Future<T> accumulateParallel(Executor& executor, Iterator first, Iterator last, T init)
+{
+  const auto length = std::distance(first, last);
+
+  if (!length) {
+    return makeReadyFuture(init);
+  }
+
+  const unsigned long min_per_thread = 25;
+  const unsigned long max_threads = (length + min_per_thread - 1) / min_per_thread;
+  const unsigned long hardware_threads = std::thread::hardware_concurrency();
+  const unsigned long num_blocks = std::min(hardware_threads != 0 ? hardware_threads : 2, max_threads);
+
+  const auto block_size = length / num_blocks;
+
+  std::vector<Future<T>> blocks; /* (!) One future per block instead of a shared results vector */
+  blocks.reserve(num_blocks);
+
+  Iterator block_start = first;
+
+  for (unsigned long i = 0; i < num_blocks; ++i) {
+    Iterator block_end = block_start;
+
+    if (i == num_blocks - 1) {
+      block_end = last;
+    } else {
+      std::advance(block_end, block_size);
+    }
+
+    blocks.emplace_back(async(executor, [block_start, block_end] {
+      return std::accumulate(block_start, block_end, T());
+    }));
+
+    block_start = block_end;
+  }
+
+  return whenAll(std::move(blocks)).then([init](std::vector<T> results) { /* (!) No join: the sum runs when the last block completes */
+    return std::accumulate(results.begin(), results.end(), init);
+  });
+}
+
+template<typename Function>
+double nanosecondsPerStep(size_t steps, Function f)
+{
+  const auto start = std::chrono::steady_clock::now();
+  f();
+  const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / static_cast<double>(steps);
+}
+
+int main(int argc, char* argv[])
+{
+  const size_t chain = argc > 1 ? std::stoul(argv[1]) : 100000;
+  const size_t asyncSteps = argc > 2 ? std::stoul(argv[2]) : 2000;
+
+  auto& executor = Executor::shared();
+
+  /* (!) s1t01: the task runs on the shared executor, get() replaces join() */
+  async(executor, hello).get();
+
+  /* (!) s1t12: ownership of the result is transferred instead of ownership of a thread */
+  auto getAnswer = [&executor] {
+    return async(executor, [] { return 42; });
+  };
+  std::cout << "Continuation result: " << getAnswer().then([](int i) { return std::to_string(i * 2); }).get() << std::endl;
+
+  /* (!) s1t15 with futures */
+  std::vector<int> numbers(1000);
+  std::default_random_engine generator;
+  std::uniform_int_distribution<int> distribution(0, 10);
+  std::generate(numbers.begin(), numbers.end(), [&] { return distribution(generator); });
+
+  std::cout << "accumulateParallel: " << accumulateParallel(executor, numbers.begin(), numbers.end(), 0).get()
+            << " (std::accumulate: " << std::accumulate(numbers.begin(), numbers.end(), 0) << ")" << std::endl;
+
+  /* (!) First of several results */
+  std::vector<Future<std::string>> replicas;
+  for (int i = 0; i < 3; ++i) {
+    replicas.emplace_back(async(executor, [i] {
+      std::this_thread::sleep_for(std::chrono::milliseconds(30 * (3 - i)));
+      return "replica " + std::to_string(i);
+    }));
+  }
+  std::cout << "whenAny: " << whenAny(std::move(replicas)).get().second << " answered first" << std::endl;
+
+  try {
+    whenAny(std::vector<Future<int>>());
+  } catch (std::invalid_argument const& e) {
+    std::cout << "whenAny of nothing: " << e.what() << std::endl;
+  }
+
+  /* (!) A continuation that completes a promise and waits for what that promise's continuation makes */
+  Promise<int> inner;
+  auto doubled = inner.getFuture().then([](int i) { return i * 2; });
+  const int nested = makeReadyFuture(21)
+                       .then([&inner, &doubled](int i) {
+                         inner.setValue(i); /* (!) Its continuation is queued on this thread, behind this one */
+                         return doubled.get();
+                       })
+                       .get();
+  std::cout << "get() inside a continuation: " << nested << std::endl;
+
+  /* (!) Exceptions travel down the chain, skipping continuations */
+  try {
+    async(executor, []() -> int { throw std::runtime_error("task failed"); })
+      .then([](int i) { return i + 1; })
+      .get();
+  } catch (std::exception const& e) {
+    std::cout << "Propagated exception: " << e.what() << std::endl;
+  }
+
+  std::cout << std::endl << "Per-step overhead:" << std::endl;
+
+  const auto readyChain = nanosecondsPerStep(chain, [chain] {
+    auto f = makeReadyFuture(0);
+    for (size_t i = 0; i < chain; ++i) {
+      f = f.then([](int x) { return x + 1; });
+    }
+    if (f.get() != static_cast<int>(chain)) {
+      std::cout << "wrong result" << std::endl;
+    }
+  });
+  std::cout << "  then() on a ready value (inline):          " << readyChain << " ns" << std::endl;
+
+  const auto pendingChain = nanosecondsPerStep(chain, [chain] {
+    Promise<int> promise;
+    auto f = promise.getFuture();
+    for (size_t i = 0; i < chain; ++i) {
+      f = f.then([](int x) { return x + 1; });
+    }
+    promise.setValue(0); /* (!) The whole chain runs on this thread, one continuation after the other */
+    f.get();
+  });
+  std::cout << "  then() attached before the value is set:   " << pendingChain << " ns" << std::endl;
+
+  const auto executorChain = nanosecondsPerStep(chain, [chain, &executor] {
+    auto f = async(executor, [] { return 0; });
+    for (size_t i = 0; i < chain; ++i) {
+      f = f.then(executor, [](int x) { return x + 1; });
+    }
+    f.get();
+  });
+  std::cout << "  then(executor) (one queue hop per step):   " << executorChain << " ns" << std::endl;
+
+  const auto futureGet = nanosecondsPerStep(asyncSteps, [asyncSteps, &executor] {
+    int x = 0;
+    for (size_t i = 0; i < asyncSteps; ++i) {
+      x = async(executor, [x] { return x + 1; }).get();
+    }
+  });
+  std::cout << "  async(executor) + Future::get():           " << futureGet << " ns" << std::endl;
+
+  const auto stdAsync = nanosecondsPerStep(asyncSteps, [asyncSteps] {
+    int x = 0;
+    for (size_t i = 0; i < asyncSteps; ++i) {
+      x = std::async(std::launch::async, [x] { return x + 1; }).get(); /* (!) A new thread per step */
+    }
+  });
+  std::cout << "  std::async + std::future::get():           " << stdAsync << " ns" << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,417 @@
+/*
+* Session 3, example 03 (awaitables):
+*
+* Coroutine counterparts of the blocking primitives of session 2. Where std::mutex, a condition variable
+* or std::call_once put the calling thread to sleep, these suspend the calling coroutine instead and
+* leave the worker thread free to run other coroutines. Waiters are resumed through the Scheduler, never
+* inline from unlock()/push()/set(), so releasing a lock doesn't run somebody else's critical section on
+* the releasing coroutine's stack.
+*
+* AsyncMutex   - co_await lock() / scopedLock(). Ownership belongs to the coroutine, not to a thread:
+*                it may be released on a different worker than the one that acquired it, and an
+*                AsyncLock can be moved out of one coroutine into another, like std::unique_lock in s2t06.
+* AsyncQueue   - unbounded producer/consumer queue, co_await pop() suspends while it is empty.
+* AsyncOnce    - std::call_once for an asynchronous initializer; concurrent callers wait for the first.
+* AsyncEvent   - manual reset event, co_await wait() suspends until set() is called.
+*/
+#pragma once
+
+#include <atomic>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "Task.h"
+
+class AsyncLock;
+
+class AsyncMutex
+{
+public:
+  explicit AsyncMutex(Scheduler& scheduler)
+    : m_scheduler(scheduler)
+  {
+  }
+
+  AsyncMutex(AsyncMutex const&) = delete;
+  AsyncMutex& operator=(AsyncMutex const&) = delete;
+
+  bool tryLock()
+  {
+    std::lock_guard<std::mutex> guard(m_guard);
+    return !std::exchange(m_locked, true);
+  }
+
+  auto lock() noexcept /* (!) co_await mutex.lock(), then unlock() by hand */
+  {
+    struct Awaiter
+    {
+      AsyncMutex& mutex;
+
+      bool await_ready() const noexcept
+      {
+        return false;
+      }
+
+      bool await_suspend(std::coroutine_handle<> handle)
+      {
+        std::lock_guard<std::mutex> guard(mutex.m_guard);
+
+        if (!mutex.m_locked) {
+          mutex.m_locked = true;
+          return false; /* (!) Uncontended: go on without suspending */
+        }
+
+        mutex.m_waiters.push_back(handle);
+        return true;
+      }
+
+      void await_resume() const noexcept
+      {
+      }
+    };
+
+    return Awaiter{ *this };
+  }
+
+  Task<AsyncLock> scopedLock();
+
+  void unlock()
+  {
+    std::coroutine_handle<> next;
+
+    {
+      std::lock_guard<std::mutex> guard(m_guard);
+
+      if (m_waiters.empty()) {
+        m_locked = false;
+        return;
+      }
+
+      next = m_waiters.front(); /* (!) Hand the lock over directly: m_locked stays set, nobody can barge in */
+      m_waiters.pop_front();
+    }
+
+    m_scheduler.enqueue(next);
+  }
+
+private:
+  Scheduler& m_scheduler;
+  std::mutex m_guard; /* (!) Only protects the waiter list, never held across a suspension */
+  bool m_locked = false;
+  std::deque<std::coroutine_handle<>> m_waiters;
+};
+
+class AsyncLock
+{
+public:
+  AsyncLock() noexcept = default;
+
+  AsyncLock(AsyncMutex& mutex, std::adopt_lock_t) noexcept
+    : m_mutex(&mutex)
+  {
+  }
+
+  AsyncLock(AsyncLock&& other) noexcept
+    : m_mutex(std::exchange(other.m_mutex, nullptr))
+  {
+  }
+
+  AsyncLock& operator=(AsyncLock&& other) noexcept
+  {
+    if (this != &other) {
+      unlock();
+      m_mutex = std::exchange(other.m_mutex, nullptr);
+    }
+    return *this;
+  }
+
+  ~AsyncLock()
+  {
+    unlock();
+  }
+
+  AsyncLock(AsyncLock const&) = delete;
+  AsyncLock& operator=(AsyncLock const&) = delete;
+
+  bool ownsLock() const noexcept
+  {
+    return m_mutex != nullptr;
+  }
+
+  void unlock()
+  {
+    if (m_mutex) {
+      std::exchange(m_mutex, nullptr)->unlock();
+    }
+  }
+
+private:
+  AsyncMutex* m_mutex = nullptr;
+};
+
+inline Task<AsyncLock> AsyncMutex::scopedLock()
+{
+  co_await lock();
+  co_return AsyncLock(*this, std::adopt_lock);
+}
+
+template<typename T>
+class AsyncQueue
+{
+public:
+  explicit AsyncQueue(Scheduler& scheduler)
+    : m_scheduler(scheduler)
+  {
+  }
+
+  AsyncQueue(AsyncQueue const&) = delete;
+  AsyncQueue& operator=(AsyncQueue const&) = delete;
+
+  void push(T value)
+  {
+    std::coroutine_handle<> consumer;
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if (m_waiters.empty()) {
+        m_items.push_back(std::move(value));
+        return;
+      }
+
+      PopAwaiter* waiter = m_waiters.front(); /* (!) Give the value straight to the oldest waiting consumer */
+      m_waiters.pop_front();
+      waiter->value.emplace(std::move(value));
+      consumer = waiter->handle;
+    }
+
+    m_scheduler.enqueue(consumer);
+  }
+
+  bool tryPop(T& value)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (m_items.empty()) {
+      return false;
+    }
+
+    value = std::move(m_items.front());
+    m_items.pop_front();
+    return true;
+  }
+
+  auto pop() noexcept
+  {
+    return PopAwaiter{ *this, std::nullopt, nullptr };
+  }
+
+private:
+  struct PopAwaiter
+  {
+    AsyncQueue& queue;
+    std::optional<T> value;
+    std::coroutine_handle<> handle;
+
+    bool await_ready() const noexcept
+    {
+      return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> awaiting)
+    {
+      std::lock_guard<std::mutex> lock(queue.m_mutex);
+
+      if (!queue.m_items.empty()) {
+        value.emplace(std::move(queue.m_items.front()));
+        queue.m_items.pop_front();
+        return false;
+      }
+
+      handle = awaiting;
+      queue.m_waiters.push_back(this); /* (!) The awaiter lives in the suspended coroutine's frame */
+      return true;
+    }
+
+    T await_resume()
+    {
+      return std::move(*value);
+    }
+  };
+
+  Scheduler& m_scheduler;
+  std::mutex m_mutex;
+  std::deque<T> m_items;
+  std::deque<PopAwaiter*> m_waiters;
+};
+
+class AsyncOnce
+{
+public:
+  explicit AsyncOnce(Scheduler& scheduler)
+    : m_scheduler(scheduler)
+  {
+  }
+
+  AsyncOnce(AsyncOnce const&) = delete;
+  AsyncOnce& operator=(AsyncOnce const&) = delete;
+
+  bool done() const noexcept
+  {
+    return m_state.load(std::memory_order_acquire) == State::Done;
+  }
+
+  /* (!) init() returns a Task<void>. If it throws, the exception goes to its caller and the next caller retries, like std::call_once */
+  template<typename Function>
+  Task<void> callOnce(Function init)
+  {
+    for (;;) {
+      if (done()) {
+        co_return;
+      }
+
+      bool initializer = false;
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_state.load(std::memory_order_relaxed) == State::Idle) {
+          m_state.store(State::Running, std::memory_order_relaxed);
+          initializer = true;
+        }
+      }
+
+      if (!initializer) {
+        co_await Waiter{ *this };
+        continue;
+      }
+
+      std::exception_ptr error;
+      try {
+        co_await init();
+      } catch (...) {
+        error = std::current_exception();
+      }
+
+      finish(error ? State::Idle : State::Done);
+
+      if (error) {
+        std::rethrow_exception(error);
+      }
+
+      co_return;
+    }
+  }
+
+private:
+  enum class State { Idle, Running, Done };
+
+  struct Waiter
+  {
+    AsyncOnce& once;
+
+    bool await_ready() const noexcept
+    {
+      return once.done();
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+      std::lock_guard<std::mutex> lock(once.m_mutex);
+
+      if (once.m_state.load(std::memory_order_relaxed) != State::Running) {
+        return false;
+      }
+
+      once.m_waiters.push_back(handle);
+      return true;
+    }
+
+    void await_resume() const noexcept
+    {
+    }
+  };
+
+  void finish(State state)
+  {
+    std::vector<std::coroutine_handle<>> waiters;
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_state.store(state, std::memory_order_release);
+      waiters.swap(m_waiters);
+    }
+
+    m_scheduler.enqueueAll(waiters);
+  }
+
+  Scheduler& m_scheduler;
+  std::mutex m_mutex;
+  std::atomic<State> m_state{ State::Idle }; /* (!) Read without the lock on the fast path, written under it */
+  std::vector<std::coroutine_handle<>> m_waiters;
+};
+
+class AsyncEvent
+{
+public:
+  explicit AsyncEvent(Scheduler& scheduler)
+    : m_scheduler(scheduler)
+  {
+  }
+
+  AsyncEvent(AsyncEvent const&) = delete;
+  AsyncEvent& operator=(AsyncEvent const&) = delete;
+
+  void set()
+  {
+    std::vector<std::coroutine_handle<>> waiters;
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_set.store(true, std::memory_order_release);
+      waiters.swap(m_waiters);
+    }
+
+    m_scheduler.enqueueAll(waiters);
+  }
+
+  auto wait() noexcept
+  {
+    struct Awaiter
+    {
+      AsyncEvent& event;
+
+      bool await_ready() const noexcept
+      {
+        return event.m_set.load(std::memory_order_acquire);
+      }
+
+      bool await_suspend(std::coroutine_handle<> handle)
+      {
+        std::lock_guard<std::mutex> lock(event.m_mutex);
+
+        if (event.m_set.load(std::memory_order_relaxed)) {
+          return false;
+        }
+
+        event.m_waiters.push_back(handle);
+        return true;
+      }
+
+      void await_resume() const noexcept
+      {
+      }
+    };
+
+    return Awaiter{ *this };
+  }
+
+private:
+  Scheduler& m_scheduler;
+  std::mutex m_mutex;
+  std::atomic<bool> m_set{ false };
+  std::vector<std::coroutine_handle<>> m_waiters;
+};
@@ -0,0 +1,391 @@
+/*
+* Session 3, example 03 (tasks):
+*
+* Task<T> is a lazily started coroutine: nothing runs until somebody co_awaits it, and when it finishes
+* it resumes its awaiter directly (symmetric transfer), so a chain of co_awaits costs a few function calls
+* and no thread hand-offs.
+*
+* The Scheduler is a fixed set of worker threads resuming coroutine handles from a shared queue.
+* co_await scheduler.schedule() moves the current coroutine onto one of those threads; spawn() starts a
+* Task there without waiting for it, and syncWait() blocks a plain thread until a Task completes.
+*/
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+template<typename T = void>
+class Task;
+
+namespace detail
+{
+  struct PromiseBase
+  {
+    struct FinalAwaiter
+    {
+      bool await_ready() const noexcept
+      {
+        return false;
+      }
+
+      template<typename Promise>
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> finished) noexcept
+      {
+        auto continuation = finished.promise().continuation;
+        return continuation ? continuation : std::noop_coroutine(); /* (!) Resume the awaiter without growing the stack */
+      }
+
+      void await_resume() const noexcept
+      {
+      }
+    };
+
+    std::suspend_always initial_suspend() const noexcept /* (!) Lazy: runs only once awaited */
+    {
+      return {};
+    }
+
+    FinalAwaiter final_suspend() const noexcept
+    {
+      return {};
+    }
+
+    void unhandled_exception() noexcept
+    {
+      error = std::current_exception();
+    }
+
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+  };
+
+  template<typename T>
+  struct TaskPromise : PromiseBase
+  {
+    Task<T> get_return_object() noexcept;
+
+    void return_value(T v)
+    {
+      value.emplace(std::move(v));
+    }
+
+    T result()
+    {
+      if (error) {
+        std::rethrow_exception(error);
+      }
+      return std::move(*value);
+    }
+
+    std::optional<T> value;
+  };
+
+  template<>
+  struct TaskPromise<void> : PromiseBase
+  {
+    Task<void> get_return_object() noexcept;
+
+    void return_void() const noexcept
+    {
+    }
+
+    void result()
+    {
+      if (error) {
+        std::rethrow_exception(error);
+      }
+    }
+  };
+}
+
+template<typename T>
+class Task
+{
+public:
+  using promise_type = detail::TaskPromise<T>;
+  using Handle = std::coroutine_handle<promise_type>;
+
+  explicit Task(Handle handle) noexcept
+    : m_handle(handle)
+  {
+  }
+
+  Task(Task&& other) noexcept
+    : m_handle(std::exchange(other.m_handle, nullptr))
+  {
+  }
+
+  Task& operator=(Task&& other) noexcept
+  {
+    if (this != &other) {
+      if (m_handle) {
+        m_handle.destroy();
+      }
+      m_handle = std::exchange(other.m_handle, nullptr);
+    }
+    return *this;
+  }
+
+  ~Task()
+  {
+    if (m_handle) {
+      m_handle.destroy();
+    }
+  }
+
+  Task(Task const&) = delete;
+  Task& operator=(Task const&) = delete;
+
+  auto operator co_await() && noexcept
+  {
+    struct Awaiter
+    {
+      Handle handle;
+
+      bool await_ready() const noexcept
+      {
+        return false;
+      }
+
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+      {
+        handle.promise().continuation = awaiting;
+        return handle; /* (!) Start the task on this thread, right now */
+      }
+
+      T await_resume()
+      {
+        return handle.promise().result();
+      }
+    };
+
+    return Awaiter{ m_handle };
+  }
+
+private:
+  Handle m_handle;
+};
+
+namespace detail
+{
+  template<typename T>
+  Task<T> TaskPromise<T>::get_return_object() noexcept
+  {
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+  }
+
+  inline Task<void> TaskPromise<void>::get_return_object() noexcept
+  {
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+  }
+
+  /* (!) Fire and forget: starts eagerly and frees its own frame when done */
+  struct Detached
+  {
+    struct promise_type
+    {
+      Detached get_return_object() const noexcept
+      {
+        return {};
+      }
+
+      std::suspend_never initial_suspend() const noexcept
+      {
+        return {};
+      }
+
+      std::suspend_never final_suspend() const noexcept
+      {
+        return {};
+      }
+
+      void return_void() const noexcept
+      {
+      }
+
+      void unhandled_exception() const noexcept
+      {
+        std::terminate(); /* (!) Nobody is left to observe it, just like an exception escaping a std::thread */
+      }
+    };
+  };
+}
+
+class Scheduler
+{
+public:
+  explicit Scheduler(unsigned threads = std::thread::hardware_concurrency())
+  {
+    threads = threads != 0 ? threads : 2;
+
+    for (unsigned i = 0; i < threads; ++i) {
+      m_threads.emplace_back(&Scheduler::work, this);
+    }
+  }
+
+  ~Scheduler() /* (!) Resumes what is already queued, then joins */
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_done = true;
+    }
+
+    m_condition.notify_all();
+
+    for (auto&& t : m_threads) {
+      t.join();
+    }
+  }
+
+  Scheduler(Scheduler const&) = delete;
+  Scheduler& operator=(Scheduler const&) = delete;
+
+  auto schedule() noexcept
+  {
+    struct Awaiter
+    {
+      Scheduler& scheduler;
+
+      bool await_ready() const noexcept
+      {
+        return false;
+      }
+
+      void await_suspend(std::coroutine_handle<> handle)
+      {
+        scheduler.enqueue(handle);
+      }
+
+      void await_resume() const noexcept
+      {
+      }
+    };
+
+    return Awaiter{ *this };
+  }
+
+  void enqueue(std::coroutine_handle<> handle)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_ready.push_back(handle);
+    }
+
+    m_condition.notify_one();
+  }
+
+  template<typename Handles>
+  void enqueueAll(Handles const& handles) /* (!) One lock acquisition when many waiters become ready together */
+  {
+    if (handles.empty()) {
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_ready.insert(m_ready.end(), handles.begin(), handles.end());
+    }
+
+    m_condition.notify_all();
+  }
+
+  void spawn(Task<void> task)
+  {
+    run(std::move(task));
+  }
+
+  size_t threads() const
+  {
+    return m_threads.size();
+  }
+
+private:
+  detail::Detached run(Task<void> task)
+  {
+    co_await schedule();
+    co_await std::move(task);
+  }
+
+  void work()
+  {
+    std::deque<std::coroutine_handle<>> batch;
+
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_condition.wait(lock, [this] { return m_done || !m_ready.empty(); });
+
+        if (m_ready.empty()) {
+          return;
+        }
+
+        const size_t take = std::max<size_t>(1, m_ready.size() / m_threads.size()); /* (!) Take a fair share per lock acquisition */
+        for (size_t i = 0; i < take; ++i) {
+          batch.push_back(m_ready.front());
+          m_ready.pop_front();
+        }
+      }
+
+      while (!batch.empty()) {
+        auto handle = batch.front();
+        batch.pop_front();
+        handle.resume();
+      }
+    }
+  }
+
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
+  std::deque<std::coroutine_handle<>> m_ready;
+  bool m_done = false;
+  std::vector<std::thread> m_threads;
+};
+
+/* (!) Blocks the calling (non-coroutine) thread until the task has completed */
+template<typename T>
+T syncWait(Task<T> task)
+{
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool done = false;
+  std::optional<std::conditional_t<std::is_void<T>::value, char, T>> value;
+  std::exception_ptr error;
+
+  auto runner = [&]() -> detail::Detached {
+    try {
+      if constexpr (std::is_void<T>::value) {
+        co_await std::move(task);
+      } else {
+        value.emplace(co_await std::move(task));
+      }
+    } catch (...) {
+      error = std::current_exception();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    done = true;
+    condition.notify_one();
+  };
+
+  runner();
+
+  std::unique_lock<std::mutex> lock(mutex);
+  condition.wait(lock, [&done] { return done; });
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+
+  if constexpr (!std::is_void<T>::value) {
+    return std::move(*value);
+  }
+}
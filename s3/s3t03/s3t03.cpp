@@ -0,0 +1,319 @@
+/*
+* Session 3, example 03:
+*
+* The examples of session 2 protect shared data with a mutex and a thread that blocks while it waits:
+* every concurrent activity costs a whole thread, with its own stack and a trip through the kernel
+* scheduler whenever it has to wait. C++20 coroutines let the same code suspend at each co_await
+* instead, so thousands of activities can share a handful of worker threads (see Task.h).
+*
+* The session 2 patterns carry over almost unchanged with the primitives of Awaitables.h:
+*
+* - s2t06: getLock() acquires an AsyncMutex, prepares the data (hopping to another worker thread while
+*   it holds the lock) and returns the AsyncLock to processData(), exactly as with std::unique_lock.
+* - s2t07: the resource is lazily initialized through AsyncOnce, whose initializer is itself asynchronous.
+* - A producer/consumer pair talks through an AsyncQueue, where s2t09 would block on a condition variable.
+*
+* The second half is a benchmark: a large number of coroutines, all alive at the same time, take turns
+* incrementing a shared counter under an AsyncMutex and yield back to the scheduler after each increment.
+* The same workload then runs with one std::thread per task, std::mutex and std::this_thread::yield(). It
+* reports memory per task and the time and context switches per yield. Usage:
+*
+*   s3t03 [coroutines = 100000] [yields per task = 100] [threads = 10000]
+*/
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <latch>
+#include <memory>
+#include <string>
+#include <system_error>
+
+#if defined(__linux__)
+#include <sys/resource.h>
+#include <unistd.h>
+#include <fstream>
+#endif
+
+#include "Awaitables.h"
+
+Scheduler scheduler(4);
+
+AsyncMutex some_mutex(scheduler);
+
+void doSomething()
+{
+  std::cout << "Doing something on thread " << std::this_thread::get_id() << std::endl;
+}
+
+Task<> prepareData()
+{
+  co_await scheduler.schedule(); /* (!) Suspends holding the lock, may resume on another worker thread */
+  std::cout << "Preparing data on thread " << std::this_thread::get_id() << std::endl;
+}
+
+Task<AsyncLock> getLock()
+{
+  AsyncLock lk = co_await some_mutex.scopedLock();
+  co_await prepareData();
+  co_return lk; /* (!) Ownership moves to the caller, as with std::unique_lock */
+}
+
+Task<> processData()
+{
+  AsyncLock lk(co_await getLock());
+  doSomething();
+}
+
+class Widget
+{
+public:
+  void doSomething() const
+  {
+    std::cout << "Do something" << std::endl;
+  }
+};
+
+std::shared_ptr<Widget> resource_ptr;
+AsyncOnce resource_flag(scheduler);
+
+Task<> initializeResource()
+{
+  co_await scheduler.schedule(); /* (!) Stands in for asynchronous work, e.g. reading a configuration */
+  resource_ptr.reset(new Widget);
+}
+
+Task<> useResource()
+{
+  co_await resource_flag.callOnce(initializeResource); /* (!) Concurrent callers suspend until the first one finishes */
+  resource_ptr->doSomething();
+}
+
+Task<> producer(AsyncQueue<int>& queue, int count)
+{
+  for (int i = 1; i <= count; ++i) {
+    queue.push(i);
+    co_await scheduler.schedule();
+  }
+  queue.push(0); /* (!) End of stream */
+}
+
+Task<int> consumer(AsyncQueue<int>& queue)
+{
+  int sum = 0;
+  for (;;) {
+    const int value = co_await queue.pop();
+    if (value == 0) {
+      co_return sum;
+    }
+    sum += value;
+  }
+}
+
+struct Usage
+{
+  size_t virtualBytes = 0;
+  size_t residentBytes = 0;
+  long contextSwitches = 0;
+};
+
+#if defined(__linux__)
+
+static Usage usage()
+{
+  Usage u;
+
+  std::ifstream statm("/proc/self/statm");
+  size_t pages = 0, resident = 0;
+  statm >> pages >> resident;
+  u.virtualBytes = pages * static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+  u.residentBytes = resident * static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+
+  rusage r{};
+  ::getrusage(RUSAGE_SELF, &r); /* (!) Voluntary + involuntary, summed over all threads of the process */
+  u.contextSwitches = r.ru_nvcsw + r.ru_nivcsw;
+
+  return u;
+}
+
+#else
+
+static Usage usage()
+{
+  return Usage{}; /* (!) Only timings are reported on other platforms */
+}
+
+#endif
+
+struct Measurement
+{
+  size_t tasks = 0;
+  double spawnSeconds = 0;
+  double runSeconds = 0;
+  Usage parked;
+  Usage before;
+  Usage after;
+};
+
+static void report(const char* name, Measurement const& m, size_t yields)
+{
+  const double switches = static_cast<double>(m.tasks) * static_cast<double>(yields);
+
+  std::cout << name << ": " << m.tasks << " tasks" << std::endl;
+  std::cout << "  spawn:                 " << m.spawnSeconds * 1e9 / m.tasks << " ns per task" << std::endl;
+  std::cout << "  resident memory:       " << (m.parked.residentBytes - m.before.residentBytes) / m.tasks << " bytes per task" << std::endl;
+  std::cout << "  virtual memory:        " << (m.parked.virtualBytes - m.before.virtualBytes) / m.tasks << " bytes per task" << std::endl;
+  std::cout << "  yield:                 " << m.runSeconds * 1e9 / switches << " ns" << std::endl;
+  std::cout << "  kernel context switches per yield: "
+            << static_cast<double>(m.after.contextSwitches - m.parked.contextSwitches) / switches << std::endl;
+}
+
+static Measurement benchmarkCoroutines(size_t tasks, size_t yields)
+{
+  Measurement m;
+  m.tasks = tasks;
+
+  Scheduler workers(std::thread::hardware_concurrency());
+  AsyncEvent gate(workers);
+  AsyncMutex mutex(workers);
+  std::atomic<size_t> parked{ 0 };
+  std::latch finished(static_cast<std::ptrdiff_t>(tasks));
+  uint64_t counter = 0;
+
+  auto task = [&]() -> Task<> {
+    parked.fetch_add(1, std::memory_order_relaxed);
+    co_await gate.wait();
+
+    for (size_t i = 0; i < yields; ++i) {
+      co_await mutex.lock();
+      ++counter;
+      mutex.unlock();
+      co_await workers.schedule(); /* (!) Back of the ready queue: a user-space context switch */
+    }
+
+    finished.count_down();
+  };
+
+  m.before = usage();
+  auto start = std::chrono::steady_clock::now();
+
+  for (size_t i = 0; i < tasks; ++i) {
+    workers.spawn(task());
+  }
+  while (parked.load() != tasks) {
+    std::this_thread::yield();
+  }
+
+  m.spawnSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  m.parked = usage();
+
+  start = std::chrono::steady_clock::now();
+  gate.set();
+  finished.wait();
+  m.runSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  m.after = usage();
+
+  if (counter != tasks * yields) {
+    std::cout << "Coroutine counter is " << counter << ", expected " << tasks * yields << std::endl;
+  }
+
+  return m;
+}
+
+static Measurement benchmarkThreads(size_t tasks, size_t yields)
+{
+  Measurement m;
+
+  std::mutex gateMutex;
+  std::condition_variable gateCondition;
+  bool open = false;
+  std::atomic<size_t> parked{ 0 };
+  std::mutex mutex;
+  uint64_t counter = 0;
+
+  std::vector<std::thread> threads;
+  threads.reserve(tasks);
+
+  m.before = usage();
+  auto start = std::chrono::steady_clock::now();
+
+  try {
+    for (size_t i = 0; i < tasks; ++i) {
+      threads.emplace_back([&] {
+        {
+          std::unique_lock<std::mutex> lock(gateMutex);
+          parked.fetch_add(1, std::memory_order_relaxed);
+          gateCondition.wait(lock, [&open] { return open; });
+        }
+
+        for (size_t j = 0; j < yields; ++j) {
+          {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++counter;
+          }
+          std::this_thread::yield(); /* (!) Back to the kernel scheduler */
+        }
+      });
+    }
+  } catch (std::system_error const& e) { /* (!) Out of threads or address space long before 100000 */
+    std::cout << "Could only start " << threads.size() << " of " << tasks << " threads: " << e.what() << std::endl;
+  }
+
+  m.tasks = threads.size();
+
+  while (parked.load() != m.tasks) {
+    std::this_thread::yield();
+  }
+
+  m.spawnSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  m.parked = usage();
+
+  start = std::chrono::steady_clock::now();
+  {
+    std::lock_guard<std::mutex> lock(gateMutex);
+    open = true;
+  }
+  gateCondition.notify_all();
+
+  for (auto&& t : threads) {
+    t.join();
+  }
+
+  m.runSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  m.after = usage();
+
+  if (counter != m.tasks * yields) {
+    std::cout << "Thread counter is " << counter << ", expected " << m.tasks * yields << std::endl;
+  }
+
+  return m;
+}
+
+int main(int argc, char* argv[])
+{
+  const size_t coroutines = argc > 1 ? std::stoul(argv[1]) : 100000;
+  const size_t yields = argc > 2 ? std::stoul(argv[2]) : 100;
+  const size_t threads = argc > 3 ? std::stoul(argv[3]) : 10000;
+
+  /* (!) s2t06 */
+  syncWait(processData());
+
+  /* (!) s2t07 */
+  std::latch users(3);
+  for (int i = 0; i < 3; ++i) {
+    scheduler.spawn([](std::latch& done) -> Task<> {
+      co_await useResource();
+      done.count_down();
+    }(users));
+  }
+  users.wait();
+
+  /* (!) Producer/consumer */
+  AsyncQueue<int> queue(scheduler);
+  scheduler.spawn(producer(queue, 100));
+  std::cout << "Consumer sum: " << syncWait(consumer(queue)) << std::endl << std::endl;
+
+  report("Coroutines", benchmarkCoroutines(coroutines, yields), yields);
+  report("Thread per task", benchmarkThreads(threads, yields), yields);
+
+  return 0;
+}
@@ -0,0 +1,152 @@
+/*
+* Session 3, example 04:
+*
+* Every example so far starts a std::thread per task and joins it through a ThreadGuard. That is fine for
+* a handful of long running tasks, but when tasks are short the thread creation and the join dominate.
+*
+* The ThreadPool in common/ThreadPool.h keeps a fixed set of workers alive and only queues the tasks.
+* submit() hands the result back as a std::future, the queue can be bounded so fast producers are slowed
+* down instead of piling up work, and shutdown() either drains the queue or discards it.
+*
+* The program shows graceful and immediate shutdown, and then measures the latency of a task round
+* trip (submit, run, get the result) against constructing a thread, guarding it and joining it. Usage:
+*
+*   s3t04 [tasks = 20000] [pool threads = hardware concurrency]
+*/
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "../../common/ThreadGuard.h"
+#include "../../common/ThreadPool.h"
+
+struct BackgroundTask
+{
+  explicit BackgroundTask(std::atomic<int>& done_)
+    : done(done_)
+  {
+  }
+
+  int operator()() const
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    return ++done;
+  }
+
+private:
+  std::atomic<int>& done;
+};
+
+template<typename Function>
+double nanosecondsPerTask(size_t tasks, Function f)
+{
+  const auto start = std::chrono::steady_clock::now();
+  f();
+  const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / static_cast<double>(tasks);
+}
+
+void shutdownModes()
+{
+  for (auto mode : { ShutdownMode::Drain, ShutdownMode::Immediate }) {
+    std::atomic<int> done{ 0 };
+    ThreadPool pool(2, 64);
+    std::vector<std::future<int>> results;
+
+    for (int i = 0; i < 20; ++i) {
+      results.emplace_back(pool.submit(BackgroundTask(done)));
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(25)); /* (!) Let a few of them run */
+    const auto discarded = pool.shutdown(mode);
+
+    size_t broken = 0;
+    for (auto&& r : results) {
+      try {
+        r.get();
+      } catch (std::future_error const&) { /* (!) Discarded before it ran */
+        ++broken;
+      }
+    }
+
+    std::cout << (mode == ShutdownMode::Drain ? "Drain:     " : "Immediate: ") << done << " tasks ran, " << discarded
+              << " discarded, " << broken << " broken futures" << std::endl;
+  }
+}
+
+void boundedQueue()
+{
+  ThreadPool pool(1, 4); /* (!) One worker and room for four queued tasks */
+  std::atomic<int> done{ 0 };
+
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<std::future<int>> results;
+  for (int i = 0; i < 12; ++i) {
+    results.emplace_back(pool.submit(BackgroundTask(done))); /* (!) Blocks once four tasks are waiting */
+  }
+  const std::chrono::duration<double, std::milli> blocked = std::chrono::steady_clock::now() - start;
+
+  std::cout << "Bounded queue: submitting 12 tasks of 10ms blocked the producer for " << blocked.count() << " ms" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+  const size_t tasks = argc > 1 ? std::stoul(argv[1]) : 20000;
+  const unsigned threads = argc > 2 ? static_cast<unsigned>(std::stoul(argv[2])) : std::thread::hardware_concurrency();
+
+  shutdownModes();
+  boundedQueue();
+
+  auto futureFailure = ThreadPool(1).submit([]() -> int { throw std::runtime_error("task failed"); });
+  try {
+    futureFailure.get();
+  } catch (std::exception const& e) {
+    std::cout << "Exception through the future: " << e.what() << std::endl;
+  }
+
+  std::cout << std::endl << "Per-task cost over " << tasks << " empty tasks:" << std::endl;
+
+  std::atomic<size_t> counter{ 0 };
+  auto emptyTask = [&counter] { counter.fetch_add(1, std::memory_order_relaxed); };
+
+  const auto guarded = nanosecondsPerTask(tasks, [&] {
+    for (size_t i = 0; i < tasks; ++i) {
+      ThreadGuard g(std::thread{ emptyTask }); /* (!) Create, run and join a thread per task */
+    }
+  });
+  std::cout << "  std::thread + ThreadGuard per task:       " << guarded << " ns" << std::endl;
+
+  ThreadPool pool(threads);
+
+  const auto roundTrip = nanosecondsPerTask(tasks, [&] {
+    for (size_t i = 0; i < tasks; ++i) {
+      pool.submit(emptyTask).get(); /* (!) Latency: the next task is only submitted once the previous one ran */
+    }
+  });
+  std::cout << "  ThreadPool::submit() + get() round trip:  " << roundTrip << " ns" << std::endl;
+
+  const auto throughput = nanosecondsPerTask(tasks, [&] {
+    std::vector<std::future<void>> results;
+    results.reserve(tasks);
+    for (size_t i = 0; i < tasks; ++i) {
+      results.emplace_back(pool.submit(emptyTask));
+    }
+    for (auto&& r : results) {
+      r.get();
+    }
+  });
+  std::cout << "  ThreadPool::submit() batch, then get():   " << throughput << " ns" << std::endl;
+
+  const auto spawnedThroughput = nanosecondsPerTask(tasks, [&] {
+    std::vector<std::thread> spawned;
+    spawned.reserve(tasks);
+    JoinThreads joiner(spawned); /* (!) Joins them all at the end of the scope, even if spawning fails */
+    for (size_t i = 0; i < tasks; ++i) {
+      spawned.emplace_back(emptyTask);
+    }
+  });
+  std::cout << "  std::thread batch + JoinThreads:          " << spawnedThroughput << " ns" << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,177 @@
+/*
+* Session 3, example 05:
+*
+* The worker threads of the earlier examples (BackgroundTask::doSomething, contains() in s2t01, the
+* findElementsTask lambda in S2t02) report through std::cout << ... << std::endl. Every line takes the
+* stream's lock and flushes it, so with many threads the output, and not the work, sets the pace.
+*
+* The Logger in common/Logger.h gives each thread its own ring buffer: log() copies its arguments into
+* the ring and returns, and a background thread formats and writes everything with one flush per batch.
+* If a thread logs faster than the drain thread keeps up, records are dropped and counted rather than
+* making the thread wait.
+*
+* The program runs S2t02's find task with the logger, then measures the latency of a single log call from
+* 1 to 64 threads, against std::cout with std::endl. During the measurement standard output is redirected
+* to the null device, so that both sides pay for formatting and system calls but not for a terminal. Usage:
+*
+*   s3t05 [calls per thread = 20000] [max threads = 64] [records per thread = 8192]
+*/
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#define dup _dup
+#define dup2 _dup2
+#define close _close
+#define open _open
+#define O_WRONLY _O_WRONLY
+static const char* const nullDevice = "NUL";
+#else
+#include <fcntl.h>
+#include <unistd.h>
+static const char* const nullDevice = "/dev/null";
+#endif
+
+#include "../../common/Containers.h"
+#include "../../common/Logger.h"
+#include "../../common/ThreadGuard.h"
+
+/* (!) Points file descriptor 1 somewhere else for the lifetime of the object */
+class StdoutRedirect
+{
+public:
+  explicit StdoutRedirect(const char* path)
+  {
+    std::cout.flush();
+    std::fflush(stdout);
+
+    m_saved = dup(1);
+    const int fd = open(path, O_WRONLY);
+    dup2(fd, 1);
+    close(fd);
+  }
+
+  ~StdoutRedirect()
+  {
+    std::cout.flush();
+    std::fflush(stdout);
+
+    dup2(m_saved, 1);
+    close(m_saved);
+  }
+
+  StdoutRedirect(StdoutRedirect const&) = delete;
+  StdoutRedirect& operator=(StdoutRedirect const&) = delete;
+
+private:
+  int m_saved;
+};
+
+struct Latency
+{
+  double mean = 0;
+  double p99 = 0;
+  double max = 0;
+};
+
+/* (!) Every thread times each of its calls; the percentiles are over all calls of all threads */
+template<typename Function>
+Latency measure(unsigned threads, size_t calls, Function logOnce)
+{
+  std::vector<std::vector<double>> samples(threads, std::vector<double>(calls));
+
+  {
+    std::vector<std::thread> workers;
+    JoinThreads joiner(workers);
+
+    for (unsigned t = 0; t < threads; ++t) {
+      workers.emplace_back([&samples, t, calls, &logOnce] {
+        auto& mine = samples[t];
+        for (size_t i = 0; i < calls; ++i) {
+          const auto start = std::chrono::steady_clock::now();
+          logOnce(t, static_cast<int>(i));
+          mine[i] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        }
+      });
+    }
+  }
+
+  std::vector<double> all;
+  all.reserve(threads * calls);
+  for (auto&& s : samples) {
+    all.insert(all.end(), s.begin(), s.end());
+  }
+  std::sort(all.begin(), all.end());
+
+  Latency latency;
+  for (auto v : all) {
+    latency.mean += v;
+  }
+  latency.mean /= static_cast<double>(all.size());
+  latency.p99 = all[all.size() * 99 / 100];
+  latency.max = all.back();
+  return latency;
+}
+
+int main(int argc, char* argv[])
+{
+  const size_t calls = argc > 1 ? std::stoul(argv[1]) : 20000;
+  const unsigned maxThreads = argc > 2 ? static_cast<unsigned>(std::stoul(argv[2])) : 64;
+  const size_t records = argc > 3 ? std::stoul(argv[3]) : 8192;
+
+  {
+    Logger logger;
+    ThreadSafeLinkedList<> mySafeLinkedList;
+
+    ThreadGuard addElementsTask(std::thread([&mySafeLinkedList] {
+      for (auto i = 0; i < 5; ++i) {
+        mySafeLinkedList.add(i);
+      }
+    }));
+
+    ThreadGuard findElementsTask(std::thread([&mySafeLinkedList, &logger] {
+      for (auto i = 0; i < 5; ++i) {
+        logger.info("{} is {}in the list", i, mySafeLinkedList.contains(i) ? "" : "NOT "); /* (!) No lock, no flush */
+      }
+    }));
+  }
+
+  std::cout << std::endl << "Latency of one call, " << calls << " calls per thread (ns):" << std::endl;
+  std::cout << std::setw(8) << "threads" << std::setw(12) << "cout mean" << std::setw(10) << "p99" << std::setw(12) << "max"
+            << std::setw(14) << "logger mean" << std::setw(10) << "p99" << std::setw(12) << "max" << std::setw(12) << "dropped"
+            << std::endl;
+
+  for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+    Latency streamed;
+    Latency logged;
+    uint64_t dropped = 0;
+
+    {
+      StdoutRedirect redirect(nullDevice);
+
+      streamed = measure(threads, calls, [](unsigned t, int i) {
+        std::cout << "Thread " << t << " found element " << i << " in the list" << std::endl;
+      });
+
+      Logger logger(std::cout, records);
+      logged = measure(threads, calls, [&logger](unsigned t, int i) {
+        logger.info("Thread {} found element {} in the list", t, i);
+      });
+      logger.flush();
+      dropped = logger.dropped();
+    }
+
+    std::cout << std::fixed << std::setprecision(0) << std::setw(8) << threads << std::setw(12) << streamed.mean
+              << std::setw(10) << streamed.p99 << std::setw(12) << streamed.max << std::setw(14) << logged.mean << std::setw(10)
+              << logged.p99 << std::setw(12) << logged.max << std::setw(12) << dropped << std::endl;
+  }
+
+  return 0;
+}
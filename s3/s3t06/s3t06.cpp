@@ -0,0 +1,230 @@
+/*
+* Session 3, example 06:
+*
+* In s1t04 the BackgroundTask runs its million iterations on a detached thread, and s1t07 detaches its
+* threads the same way: once started, nothing can stop them, and at shutdown they keep burning cores (or
+* worse, keep using locals that no longer exist).
+*
+* With the StopSource/StopToken pair of common/StopToken.h the task checks a token as it goes, and the
+* JoiningThread that runs it requests a stop before joining, so leaving the scope ends the loop instead of
+* waiting for it. Threads blocked on a condition variable or a BlockingQueue are woken by the stop request
+* itself, through a stop callback, rather than noticing it at their next timeout.
+*
+* The program measures how long a shutdown takes with 1000 tasks in flight: first 1000 threads that are
+* busy, blocked on a queue or blocked on a condition variable, stopped through a shared StopSource and
+* compared with the same threads polling a flag every 10ms; then 1000 tasks queued on a ThreadPool, shut
+* down immediately or drained. Usage:
+*
+*   s3t06 [tasks = 1000] [pool task duration in microseconds = 2000]
+*/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../../common/BlockingQueue.h"
+#include "../../common/StopToken.h"
+#include "../../common/ThreadGuard.h"
+#include "../../common/ThreadPool.h"
+
+using Clock = std::chrono::steady_clock;
+
+struct BackgroundTask
+{
+  int& i;
+
+  explicit BackgroundTask(int& i_)
+    : i(i_)
+  {
+  }
+
+  void operator()(StopToken token) const
+  {
+    for (unsigned j = 0; j < 1000000 && !token.stopRequested(); ++j) { /* (!) Checked once per iteration */
+      doSomething(i);
+    }
+  }
+
+  void doSomething(int) const
+  {
+    for (int k = 0; k < 100; ++k) { /* (!) Stands in for the output of s1t04 */
+      i = (i * 31 + k) % 1000003;
+    }
+  }
+};
+
+void notOops()
+{
+  auto localState = 0;
+  const auto start = Clock::now();
+
+  {
+    JoiningThread myThread{ BackgroundTask(localState) };
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  } /* (!) Stop requested and thread joined: localState is not used after this line */
+
+  std::cout << "BackgroundTask stopped and joined after "
+            << std::chrono::duration<double, std::milli>(Clock::now() - start).count() << " ms" << std::endl;
+}
+
+double milliseconds(Clock::duration d)
+{
+  return std::chrono::duration<double, std::milli>(d).count();
+}
+
+/* (!) A third of the tasks computes, a third waits on a queue, a third waits on a condition variable */
+void stopInFlightThreads(size_t tasks)
+{
+  StopSource source;
+  BlockingQueue<int> queue;
+  std::mutex mutex;
+  std::condition_variable condition;
+  std::vector<Clock::time_point> noticed(tasks);
+  std::atomic<size_t> started{ 0 };
+
+  std::vector<JoiningThread> threads;
+  threads.reserve(tasks);
+
+  for (size_t i = 0; i < tasks; ++i) {
+    threads.emplace_back([&, i, token = source.getToken()] {
+      ++started;
+
+      switch (i % 3) {
+        case 0: {
+          volatile unsigned sink = 0;
+          while (!token.stopRequested()) {
+            sink = sink + 1;
+          }
+          break;
+        }
+        case 1: {
+          int value;
+          queue.pop(value, token); /* (!) Nothing is ever pushed */
+          break;
+        }
+        default: {
+          std::unique_lock<std::mutex> lock(mutex);
+          interruptibleWait(condition, lock, token, [] { return false; }); /* (!) Never notified otherwise */
+          break;
+        }
+      }
+
+      noticed[i] = Clock::now();
+    });
+  }
+
+  while (started.load() != tasks) {
+    std::this_thread::yield();
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(50)); /* (!) Let the blocked ones reach their wait */
+
+  const auto request = Clock::now();
+  source.requestStop();
+  const auto requested = Clock::now();
+  threads.clear();
+  const auto joined = Clock::now();
+
+  std::cout << "Stop tokens, " << tasks << " threads:" << std::endl;
+  std::cout << "  requestStop() (runs the wake-up callbacks): " << milliseconds(requested - request) << " ms" << std::endl;
+  std::cout << "  last task noticed the stop after:           "
+            << milliseconds(*std::max_element(noticed.begin(), noticed.end()) - request) << " ms" << std::endl;
+  std::cout << "  all threads joined after:                   " << milliseconds(joined - request) << " ms" << std::endl;
+}
+
+/* (!) The usual alternative: a flag, and waits with a timeout so that the flag gets checked. Same mix of busy and blocked tasks */
+void stopPollingThreads(size_t tasks)
+{
+  std::atomic<bool> stop{ false };
+  std::mutex mutex;
+  std::condition_variable condition;
+  std::vector<Clock::time_point> noticed(tasks);
+  std::atomic<size_t> started{ 0 };
+
+  std::vector<JoiningThread> threads;
+  threads.reserve(tasks);
+
+  for (size_t i = 0; i < tasks; ++i) {
+    threads.emplace_back([&, i] {
+      ++started;
+
+      if (i % 3 == 0) {
+        volatile unsigned sink = 0;
+        while (!stop.load(std::memory_order_relaxed)) {
+          sink = sink + 1;
+        }
+      } else {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stop.load()) {
+          condition.wait_for(lock, std::chrono::milliseconds(10));
+        }
+      }
+
+      noticed[i] = Clock::now();
+    });
+  }
+
+  while (started.load() != tasks) {
+    std::this_thread::yield();
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+  const auto request = Clock::now();
+  stop = true;
+  threads.clear();
+  const auto joined = Clock::now();
+
+  std::cout << "Polling every 10ms, " << tasks << " threads:" << std::endl;
+  std::cout << "  last task noticed the stop after:           "
+            << milliseconds(*std::max_element(noticed.begin(), noticed.end()) - request) << " ms" << std::endl;
+  std::cout << "  all threads joined after:                   " << milliseconds(joined - request) << " ms" << std::endl;
+}
+
+void shutdownPool(size_t tasks, std::chrono::microseconds duration, ShutdownMode mode)
+{
+  ThreadPool pool;
+  std::atomic<size_t> completed{ 0 };
+  std::atomic<size_t> interrupted{ 0 };
+
+  for (size_t i = 0; i < tasks; ++i) {
+    pool.submit([&, duration](StopToken token) {
+      const auto end = Clock::now() + duration;
+      while (Clock::now() < end) { /* (!) A busy task that checks its token */
+        if (token.stopRequested()) {
+          ++interrupted;
+          return;
+        }
+      }
+      ++completed;
+    });
+  }
+
+  std::this_thread::sleep_for(duration); /* (!) Some tasks are running, most are queued */
+
+  const auto request = Clock::now();
+  const auto discarded = pool.shutdown(mode);
+  const auto joined = Clock::now();
+
+  std::cout << (mode == ShutdownMode::Drain ? "ThreadPool drain:     " : "ThreadPool immediate: ") << milliseconds(joined - request)
+            << " ms (" << completed << " completed, " << interrupted << " interrupted, " << discarded << " discarded)" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+  const size_t tasks = argc > 1 ? std::stoul(argv[1]) : 1000;
+  const std::chrono::microseconds duration(argc > 2 ? std::stoul(argv[2]) : 2000);
+
+  notOops();
+
+  std::cout << std::endl;
+  stopInFlightThreads(tasks);
+  stopPollingThreads(tasks);
+
+  std::cout << std::endl << tasks << " pool tasks of " << duration.count() << " us on " << std::thread::hardware_concurrency()
+            << " workers:" << std::endl;
+  shutdownPool(tasks, duration, ShutdownMode::Immediate);
+  shutdownPool(tasks, duration, ShutdownMode::Drain);
+
+  return 0;
+}
@@ -0,0 +1,143 @@
+/*
+* Session 3, example 07:
+*
+* s1t14 recognizes the master thread by storing its std::thread::id in a global and comparing against it.
+* That works for one special thread; a real program has several kinds (pool workers, I/O threads, a
+* logger), and wants to know how much each kind costs.
+*
+* The ThreadRegistry in common/ThreadRegistry.h gives every thread a role, a name that the OS shows
+* (top -H, ps -L, gdb, perf) and a dense index. randomAlgorithm() asks for the role instead of comparing
+* ids, the ThreadPool workers and the Logger's drain thread register themselves, and per-thread counters
+* are a plain array indexed by ThreadRegistry::index().
+*
+* Under a mixed load (CPU bound pool tasks, I/O threads that mostly wait, a logging thread) the program
+* prints a snapshot per thread and the CPU time and context switches per role. Usage:
+*
+*   s3t07 [seconds = 2] [pool threads = hardware concurrency] [io threads = 2]
+*/
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../../common/BlockingQueue.h"
+#include "../../common/Logger.h"
+#include "../../common/ThreadGuard.h"
+#include "../../common/ThreadPool.h"
+#include "../../common/ThreadRegistry.h"
+
+void masterThreadWork()
+{
+  std::cout << "Doing master thread work" << std::endl;
+}
+
+void commonThreadWork()
+{
+  std::cout << "Doing common thread work" << std::endl;
+}
+
+void randomAlgorithm()
+{
+  if (ThreadRegistry::role() == ThreadRole::Master) { /* (!) No global std::thread::id to keep in sync */
+    masterThreadWork();
+  } else {
+    commonThreadWork();
+  }
+}
+
+double milliseconds(std::chrono::nanoseconds d)
+{
+  return std::chrono::duration<double, std::milli>(d).count();
+}
+
+int main(int argc, char* argv[])
+{
+  const int seconds = argc > 1 ? std::stoi(argv[1]) : 2;
+  const unsigned poolThreads = argc > 2 ? static_cast<unsigned>(std::stoul(argv[2])) : std::thread::hardware_concurrency();
+  const unsigned ioThreads = argc > 3 ? static_cast<unsigned>(std::stoul(argv[3])) : 2;
+
+  ThreadRegistry::instance().registerThread(ThreadRole::Master, "master");
+
+  {
+    JoiningThread t(randomAlgorithm);
+  }
+  {
+    JoiningThread t2(randomAlgorithm);
+  }
+  randomAlgorithm();
+
+  /* (!) Mixed load */
+  std::array<std::atomic<uint64_t>, ThreadRegistry::MaxThreads> tasksPerThread{};
+  BlockingQueue<int> requests;
+  Logger logger(std::cout, 4096, std::chrono::milliseconds(100));
+  ThreadPool pool(poolThreads);
+
+  std::vector<JoiningThread> io;
+  for (unsigned i = 0; i < ioThreads; ++i) {
+    io.emplace_back([&, i](StopToken token) {
+      ThreadRegistry::instance().registerThread(ThreadRole::IO, "io-" + std::to_string(i));
+
+      int request;
+      while (requests.pop(request, token)) { /* (!) Mostly blocked: many voluntary switches, little CPU */
+        pool.submit([&tasksPerThread, request] {
+          volatile double x = request;
+          for (int k = 0; k < 20000; ++k) {
+            x = x * 1.0000001 + 1;
+          }
+          tasksPerThread[ThreadRegistry::index()].fetch_add(1, std::memory_order_relaxed); /* (!) No hashing */
+        });
+      }
+    });
+  }
+
+  JoiningThread producer([&](StopToken token) {
+    ThreadRegistry::instance().registerThread(ThreadRole::Background, "producer");
+
+    for (int i = 0; !token.stopRequested(); ++i) {
+      requests.push(i, token);
+      if (i % 1000 == 0) {
+        logger.info("Produced {} requests", i);
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  });
+
+  std::this_thread::sleep_for(std::chrono::seconds(seconds));
+
+  const auto threads = ThreadRegistry::instance().snapshot();
+  const auto roles = ThreadRegistry::instance().usageByRole();
+
+  producer.requestStop();
+  producer.join();
+  for (auto&& t : io) {
+    t.requestStop();
+  }
+  io.clear();
+  pool.shutdown(ShutdownMode::Immediate);
+  logger.flush();
+
+  std::cout << std::endl << std::setw(6) << "index" << std::setw(12) << "role" << std::setw(12) << "name" << std::setw(10) << "tid"
+            << std::setw(12) << "cpu ms" << std::setw(12) << "voluntary" << std::setw(14) << "involuntary" << std::setw(10)
+            << "tasks" << std::endl;
+
+  for (auto&& t : threads) {
+    std::cout << std::setw(6) << t.index << std::setw(12) << roleName(t.role) << std::setw(12) << t.name << std::setw(10) << t.tid
+              << std::setw(12) << std::fixed << std::setprecision(1) << milliseconds(t.cpuTime) << std::setw(12)
+              << t.voluntarySwitches << std::setw(14) << t.involuntarySwitches << std::setw(10) << tasksPerThread[t.index]
+              << std::endl;
+  }
+
+  std::cout << std::endl << std::setw(12) << "role" << std::setw(8) << "live" << std::setw(8) << "exited" << std::setw(12) << "cpu ms"
+            << std::setw(12) << "voluntary" << std::setw(14) << "involuntary" << std::endl;
+
+  for (auto&& r : roles) {
+    std::cout << std::setw(12) << roleName(r.role) << std::setw(8) << r.liveThreads << std::setw(8) << r.exitedThreads
+              << std::setw(12) << milliseconds(r.cpuTime) << std::setw(12) << r.voluntarySwitches << std::setw(14)
+              << r.involuntarySwitches << std::endl;
+  }
+
+  return 0;
+}
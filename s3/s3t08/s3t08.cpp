@@ -0,0 +1,235 @@
+/*
+* Session 3, example 08:
+*
+* Counting how often something happens is the first thing anyone adds to a concurrent class, and the
+* obvious way, one std::atomic that every thread increments, scales backwards: every fetch_add needs
+* the cache line in exclusive state, so with N threads the line ping-pongs between N cores and each
+* increment waits for it.
+*
+* common/Metrics.h shards the counter instead: each thread increments its own cache line, and a read
+* adds the lines up. This program measures the cost of one increment with 1, 2, 4... threads for
+*
+*   - a single shared std::atomic<uint64_t> (relaxed fetch_add)
+*   - a ShardedCounter
+*   - a plain thread_local counter, as the lower bound
+*
+* then the cost of recording into a ShardedHistogram, and shows per-thread latency histograms being
+* merged: ThreadSafeStack::push with the instrumentation of common/Containers.h, whose counter and
+* histogram are only real when built with CONCURRENCY_METRICS=1 (without it metrics::Counter and
+* metrics::Histogram are empty). Usage:
+*
+*   s3t08 [increments per thread = 10000000] [max threads = 2 * hardware concurrency]
+*/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <stack>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../../common/Metrics.h"
+#include "../../common/ThreadGuard.h"
+
+using Clock = std::chrono::steady_clock;
+
+/* (!) Runs body(increments) on n threads that start together, returns nanoseconds per increment */
+template<typename Body>
+double perIncrement(unsigned threads, uint64_t increments, Body body)
+{
+  std::atomic<unsigned> ready{ 0 };
+  std::atomic<bool> go{ false };
+  std::vector<JoiningThread> running;
+
+  for (unsigned i = 0; i < threads; ++i) {
+    running.emplace_back([&] {
+      ThreadRegistry::index(); /* (!) Registration is not part of the measurement */
+      ++ready;
+      while (!go.load()) {
+        std::this_thread::yield();
+      }
+      body(increments);
+    });
+  }
+
+  while (ready.load() != threads) {
+    std::this_thread::yield();
+  }
+
+  const auto start = Clock::now();
+  go = true;
+  running.clear();
+  const auto elapsed = Clock::now() - start;
+
+  return std::chrono::duration<double, std::nano>(elapsed).count() / static_cast<double>(increments);
+}
+
+std::atomic<uint64_t> shared{ 0 };
+ShardedCounter sharded;
+ShardedHistogram histogram;
+std::atomic<uint64_t> threadLocalTotal{ 0 };
+
+void compareCounters(uint64_t increments, unsigned maxThreads)
+{
+  std::cout << std::setw(8) << "threads" << std::setw(16) << "shared atomic" << std::setw(16) << "ShardedCounter"
+            << std::setw(16) << "thread_local" << std::setw(16) << "histogram" << "   (ns per increment, per thread)" << std::endl;
+
+  for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+    shared = 0;
+    sharded.reset();
+    threadLocalTotal = 0;
+
+    const double a = perIncrement(threads, increments, [](uint64_t n) {
+      for (uint64_t i = 0; i < n; ++i) {
+        shared.fetch_add(1, std::memory_order_relaxed);
+      }
+    });
+
+    const double s = perIncrement(threads, increments, [](uint64_t n) {
+      for (uint64_t i = 0; i < n; ++i) {
+        sharded.increment();
+      }
+    });
+
+    const double t = perIncrement(threads, increments, [](uint64_t n) {
+      thread_local uint64_t local = 0;
+      for (uint64_t i = 0; i < n; ++i) {
+        local = local + 1;
+        std::atomic_signal_fence(std::memory_order_seq_cst); /* (!) Keeps the loop from being folded into one add */
+      }
+      threadLocalTotal += local;
+      local = 0;
+    });
+
+    const double h = perIncrement(threads, increments / 10, [](uint64_t n) {
+      for (uint64_t i = 0; i < n; ++i) {
+        histogram.record(i & 0xfff);
+      }
+    });
+
+    if (shared.load() != sharded.value() || sharded.value() != threadLocalTotal.load()) {
+      std::cout << "Counters disagree!" << std::endl;
+    }
+
+    std::cout << std::setw(8) << threads << std::fixed << std::setprecision(2) << std::setw(16) << a << std::setw(16) << s
+              << std::setw(16) << t << std::setw(16) << h << std::endl;
+  }
+}
+
+/* (!) ThreadSafeStack::push with the instrumentation of common/Containers.h, for any counter and histogram type */
+template<typename T, typename Counter, typename Histogram>
+class InstrumentedStack
+{
+public:
+  void push(T new_value)
+  {
+    ScopedLatency timer(pushLatency);
+    pushes.increment();
+
+    std::lock_guard<std::mutex> lock(m);
+    data.emplace(new_value);
+  }
+
+  static inline Counter pushes;
+  static inline Histogram pushLatency;
+
+private:
+  /* (!) metrics::ScopedTimer follows the build switch, this one follows the template arguments */
+  struct ScopedLatency
+  {
+    explicit ScopedLatency(Histogram& histogram)
+      : m_histogram(histogram)
+      , m_start(std::is_same<Histogram, ShardedHistogram>::value ? Clock::now() : Clock::time_point())
+    {
+    }
+
+    ~ScopedLatency()
+    {
+      if constexpr (std::is_same<Histogram, ShardedHistogram>::value) {
+        m_histogram.record(Clock::now() - m_start);
+      }
+    }
+
+    Histogram& m_histogram;
+    Clock::time_point m_start;
+  };
+
+  std::stack<T> data;
+  std::mutex m;
+};
+
+template<typename Stack>
+double pushCost(unsigned threads, uint64_t pushes)
+{
+  Stack stack;
+  return perIncrement(threads, pushes, [&stack](uint64_t n) {
+    for (uint64_t i = 0; i < n; ++i) {
+      stack.push(static_cast<int>(i));
+    }
+  });
+}
+
+void printHistogram(std::string const& name, HistogramSnapshot const& h)
+{
+  std::cout << std::setw(28) << std::left << name << std::right << std::setw(10) << h.count() << std::setw(10)
+            << std::setprecision(0) << h.mean() << std::setw(8) << h.min() << std::setw(8) << h.percentile(50) << std::setw(8)
+            << h.percentile(99) << std::setw(8) << h.percentile(99.9) << std::setw(10) << h.max() << std::endl;
+}
+
+void instrumentedPush(uint64_t pushes, unsigned threads)
+{
+  using Plain = InstrumentedStack<int, metrics::NullCounter, metrics::NullHistogram>;
+  using Measured = InstrumentedStack<int, ShardedCounter, ShardedHistogram>;
+
+  const double plain = pushCost<Plain>(threads, pushes);
+  const double measured = pushCost<Measured>(threads, pushes);
+
+  std::cout << std::endl << "ThreadSafeStack::push on " << threads << " threads: " << std::setprecision(1) << plain
+            << " ns without metrics, " << measured << " ns with a counter and a latency histogram" << std::endl;
+
+  /* (!) Each thread records into its own shard; snapshots of separate histograms merge the same way */
+  ShardedHistogram perThread[2];
+  {
+    Measured stack;
+    std::vector<JoiningThread> running;
+    for (auto&& h : perThread) {
+      running.emplace_back([&stack, &h, pushes] {
+        for (uint64_t i = 0; i < pushes / 10; ++i) {
+          const auto start = Clock::now();
+          stack.push(static_cast<int>(i));
+          h.record(Clock::now() - start);
+        }
+      });
+    }
+  }
+
+  auto merged = perThread[0].snapshot();
+  merged.merge(perThread[1].snapshot());
+
+  std::cout << std::endl << std::setw(28) << std::left << "latency (ns)" << std::right << std::setw(10) << "count" << std::setw(10)
+            << "mean" << std::setw(8) << "min" << std::setw(8) << "p50" << std::setw(8) << "p99" << std::setw(8) << "p99.9"
+            << std::setw(10) << "max" << std::endl;
+  printHistogram("push, all threads", Measured::pushLatency.snapshot());
+  printHistogram("thread A", perThread[0].snapshot());
+  printHistogram("thread B", perThread[1].snapshot());
+  printHistogram("A and B, merged", merged);
+
+  std::cout << std::endl << "metrics::Enabled = " << std::boolalpha << metrics::Enabled << ", sizeof(metrics::Counter) = "
+            << sizeof(metrics::Counter) << ", sizeof(metrics::Histogram) = " << sizeof(metrics::Histogram) << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+  const uint64_t increments = argc > 1 ? std::stoull(argv[1]) : 10000000;
+  const unsigned maxThreads = argc > 2 ? static_cast<unsigned>(std::stoul(argv[2])) : 2 * std::max(1u, std::thread::hardware_concurrency());
+
+  ThreadRegistry::instance().registerThread(ThreadRole::Master, "master");
+
+  compareCounters(increments, maxThreads);
+  instrumentedPush(increments / 10, std::min(4u, maxThreads));
+
+  return 0;
+}
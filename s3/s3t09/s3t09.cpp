@@ -0,0 +1,176 @@
+/*
+* Session 3, example 09:
+*
+* Tracing is only useful if it can stay compiled in: the slow run that needs explaining is never the one
+* that was built with the instrumentation. common/Trace.h therefore records nothing until
+* Tracer::start(), and this program measures what the instrumentation costs in each state:
+*
+*   - an empty scope and a std::mutex lock/unlock, without instrumentation
+*   - the same with trace::NullScope, what CONCURRENCY_TRACE=0 turns every trace::Scope into
+*   - with TraceScope and TracedMutex compiled in, tracing off
+*   - with tracing on
+*
+* Then it traces a run of the s1t15 parallel accumulate on JoiningThreads, with the blocks pushing their
+* partial results onto a ThreadSafeStack (common/Containers.h) locked by a TracedMutex, and writes the
+* trace for ui.perfetto.dev or chrome://tracing. Usage:
+*
+*   s3t09 [trace file = s3t09.trace.json] [iterations = 10000000]
+*/
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../../common/Containers.h"
+#include "../../common/ThreadGuard.h"
+#include "../../common/ThreadRegistry.h"
+#include "../../common/Trace.h"
+
+using Clock = std::chrono::steady_clock;
+
+template<typename Body>
+double nanosecondsPerIteration(uint64_t iterations, Body body)
+{
+  const auto start = Clock::now();
+  for (uint64_t i = 0; i < iterations; ++i) {
+    body();
+  }
+  return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / static_cast<double>(iterations);
+}
+
+volatile uint64_t sink = 0; /* (!) The work inside each scope, so the loops can't be removed */
+
+template<typename Scope>
+double scopeCost(uint64_t iterations)
+{
+  return nanosecondsPerIteration(iterations, [] {
+    Scope scope("scope", "benchmark");
+    sink = sink + 1;
+  });
+}
+
+struct NoScope
+{
+  NoScope(const char*, const char*)
+  {
+  }
+};
+
+template<typename Mutex>
+double lockCost(Mutex& m, uint64_t iterations)
+{
+  return nanosecondsPerIteration(iterations, [&m] {
+    std::lock_guard<Mutex> lock(m);
+    sink = sink + 1;
+  });
+}
+
+void overhead(uint64_t iterations)
+{
+  std::mutex plain;
+  TracedMutex traced("benchmark");
+
+  const double none = scopeCost<NoScope>(iterations);
+  const double null = scopeCost<trace::NullScope>(iterations);
+  const double off = scopeCost<TraceScope>(iterations);
+  const double plainLock = lockCost(plain, iterations);
+  const double offLock = lockCost(traced, iterations);
+
+  /* (!) Each one is an event of 40 bytes, all in this thread's buffer: past its capacity, the drops would be measured */
+  const uint64_t recorded = std::min<uint64_t>(iterations / 10, Tracer::ChunkSize * Tracer::MaxChunksPerThread / 2);
+
+  Tracer::instance().start();
+  const double on = scopeCost<TraceScope>(recorded);
+  const double onLock = lockCost(traced, recorded);
+  Tracer::instance().stop();
+  Tracer::instance().clear(); /* (!) Keep these events out of the trace file, and free the buffer for it */
+
+  std::cout << std::fixed << std::setprecision(2);
+  std::cout << std::setw(34) << "" << std::setw(12) << "scope" << std::setw(14) << "lock/unlock" << "   (ns)" << std::endl;
+  std::cout << std::setw(34) << std::left << "no instrumentation" << std::right << std::setw(12) << none << std::setw(14) << plainLock << std::endl;
+  std::cout << std::setw(34) << std::left << "CONCURRENCY_TRACE=0 (NullScope)" << std::right << std::setw(12) << null << std::setw(14) << "-" << std::endl;
+  std::cout << std::setw(34) << std::left << "compiled in, tracing off" << std::right << std::setw(12) << off << std::setw(14) << offLock << std::endl;
+  std::cout << std::setw(34) << std::left << "tracing on" << std::right << std::setw(12) << on << std::setw(14) << onLock << std::endl;
+}
+
+template<typename Iterator, typename T>
+struct accumulateBlock
+{
+  void operator()(Iterator first, Iterator last, T& result)
+  {
+    trace::Scope scope("accumulateBlock", "accumulate");
+    result = std::accumulate(first, last, result);
+  }
+};
+
+/* (!) ThreadSafeStack's lock, under its own name in the trace */
+struct StackMutex : TracedMutex
+{
+  StackMutex()
+    : TracedMutex("ThreadSafeStack")
+  {
+  }
+};
+
+/* (!) s1t15, with its threads in JoiningThreads and every block also reporting to a shared ThreadSafeStack */
+template<typename Iterator, typename T>
+T accumulateParallel(Iterator first, Iterator last, T init, unsigned blocks)
+{
+  const auto length = std::distance(first, last);
+  const auto blockSize = length / blocks;
+
+  std::vector<T> results(blocks);
+  ThreadSafeStack<T, StackMutex> reported;
+
+  auto block = [&](Iterator begin, Iterator end, size_t i) {
+    accumulateBlock<Iterator, T>()(begin, end, results[i]);
+    for (int k = 0; k < 100; ++k) { /* (!) Enough lock traffic to produce some waits */
+      reported.push(results[i]);
+    }
+  };
+
+  {
+    std::vector<JoiningThread> threads;
+    Iterator blockStart = first;
+    for (unsigned i = 0; i + 1 < blocks; ++i) {
+      Iterator blockEnd = std::next(blockStart, blockSize);
+      threads.emplace_back(block, blockStart, blockEnd, i);
+      blockStart = blockEnd;
+    }
+    block(blockStart, last, blocks - 1);
+  } /* (!) Joined here: each join is in the trace */
+
+  return std::accumulate(results.begin(), results.end(), init);
+}
+
+int main(int argc, char* argv[])
+{
+  const std::string path = argc > 1 ? argv[1] : "s3t09.trace.json";
+  const uint64_t iterations = argc > 2 ? std::stoull(argv[2]) : 10000000;
+
+  ThreadRegistry::instance().registerThread(ThreadRole::Master, "master");
+
+  overhead(iterations);
+
+  std::vector<int> numbers(10000000);
+  std::iota(numbers.begin(), numbers.end(), 0);
+  const unsigned blocks = std::max(4u, std::thread::hardware_concurrency());
+
+  Tracer::instance().start();
+  const auto start = Clock::now();
+  const auto sum = accumulateParallel(numbers.begin(), numbers.end(), 0LL, blocks);
+  const auto elapsed = Clock::now() - start;
+  Tracer::instance().stop();
+
+  std::cout << std::endl << "accumulateParallel over " << blocks << " blocks: " << sum << " in "
+            << std::chrono::duration<double, std::milli>(elapsed).count() << " ms, traced" << std::endl;
+  std::cout << Tracer::instance().writeFile(path) << " events written to " << path << " (" << Tracer::instance().dropped()
+            << " dropped)" << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,125 @@
+/*
+* Session 3, example 10:
+*
+* Two runs that take the same time can be slow for different reasons. This program puts the hardware
+* counters of common/PerfCounters.h around two workloads of the earlier sessions and reports them per
+* element or per operation:
+*
+*   - the s1t15 accumulateParallel over a vector that fits in the cache and one that doesn't: the big
+*     one is bound by memory, which shows as LLC misses per element and a lower IPC
+*   - ThreadSafeStack (s2t09, as kept in common/Containers.h), pushed by one thread and then by several:
+*     the contended one spends its cycles moving the lock's cache line between cores (HITM, where the CPU
+*     can count it) and in the kernel, so cycles per push grow while instructions per push barely move
+*
+* Every thread counts itself and the counts are added together. Counters that this machine doesn't let
+* us open are printed as n/a, with the reason. Usage:
+*
+*   s3t10 [elements of the big vector = 64M] [pushes per thread = 1000000] [threads = hardware concurrency]
+*/
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../../common/Containers.h"
+#include "../../common/PerfCounters.h"
+#include "../../common/ThreadGuard.h"
+
+using Clock = std::chrono::steady_clock;
+
+template<typename Iterator, typename T>
+struct accumulateBlock
+{
+  void operator()(Iterator first, Iterator last, T& result, PerfTotals& totals)
+  {
+    ScopedPerfCounters counters(totals); /* (!) Each thread counts its own block */
+    result = std::accumulate(first, last, result);
+  }
+};
+
+template<typename Iterator, typename T>
+T accumulateParallel(Iterator first, Iterator last, T init, unsigned threads, PerfTotals& totals)
+{
+  const auto blockSize = std::distance(first, last) / threads;
+  std::vector<T> results(threads);
+
+  {
+    std::vector<JoiningThread> running;
+    Iterator blockStart = first;
+    for (unsigned i = 0; i + 1 < threads; ++i) {
+      Iterator blockEnd = std::next(blockStart, blockSize);
+      running.emplace_back(accumulateBlock<Iterator, T>(), blockStart, blockEnd, std::ref(results[i]), std::ref(totals));
+      blockStart = blockEnd;
+    }
+    accumulateBlock<Iterator, T>()(blockStart, last, results[threads - 1], totals);
+  }
+
+  return std::accumulate(results.begin(), results.end(), init);
+}
+
+double milliseconds(Clock::duration d)
+{
+  return std::chrono::duration<double, std::milli>(d).count();
+}
+
+void accumulate(size_t elements, unsigned threads)
+{
+  std::vector<int> numbers(elements, 1);
+
+  PerfTotals totals;
+  const auto start = Clock::now();
+  const auto sum = accumulateParallel(numbers.begin(), numbers.end(), 0LL, threads, totals);
+  const auto elapsed = Clock::now() - start;
+
+  std::cout << "accumulateParallel, " << elements << " ints (" << elements * sizeof(int) / 1024 << " KB), " << threads
+            << " threads: " << sum << " in " << milliseconds(elapsed) << " ms" << std::endl << "  ";
+  printPerf(std::cout, totals.total(), elements, "per element");
+}
+
+void push(uint64_t pushes, unsigned threads)
+{
+  ThreadSafeStack<int> stack;
+  PerfTotals totals;
+
+  const auto start = Clock::now();
+  {
+    std::vector<JoiningThread> running;
+    for (unsigned t = 0; t < threads; ++t) {
+      running.emplace_back([&] {
+        ScopedPerfCounters counters(totals);
+        for (uint64_t i = 0; i < pushes; ++i) {
+          stack.push(static_cast<int>(i));
+        }
+      });
+    }
+  }
+  const auto elapsed = Clock::now() - start;
+
+  std::cout << "ThreadSafeStack::push, " << threads << " threads x " << pushes << ": " << milliseconds(elapsed) << " ms" << std::endl
+            << "  ";
+  printPerf(std::cout, totals.total(), pushes * threads, "per push");
+}
+
+int main(int argc, char* argv[])
+{
+  const size_t elements = argc > 1 ? std::stoull(argv[1]) : 64 * 1024 * 1024;
+  const uint64_t pushes = argc > 2 ? std::stoull(argv[2]) : 1000000;
+  const unsigned threads = argc > 3 ? static_cast<unsigned>(std::stoul(argv[3])) : std::max(2u, std::thread::hardware_concurrency());
+
+  const PerfCounters probe;
+  if (!probe.status().empty()) {
+    std::cout << "Unavailable counters:" << std::endl << probe.status() << std::endl << std::endl;
+  }
+
+  accumulate(32 * 1024, threads); /* (!) 128 KB: in L2 */
+  accumulate(elements, threads);
+
+  std::cout << std::endl;
+  push(pushes * threads, 1);
+  push(pushes, threads);
+
+  return 0;
+}
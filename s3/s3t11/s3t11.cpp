@@ -0,0 +1,251 @@
+/*
+* Session 3, example 11:
+*
+* accumulateParallel (s1t15) starts its threads, lets each sum a block, and joins them: one round, one
+* synchronization. An iterative computation - here a vector is summed, every element is then scaled by
+* the sum, and it is summed again, round after round - would pay for starting and joining the threads
+* every round. With the primitives of common/Barrier.h the threads are started once and meet at a
+* barrier between the rounds, whose completion function (run by the last thread to arrive, before the
+* others are released) adds up the partial sums.
+*
+* Then:
+*   - a Phaser whose workers register and leave while the phases go on
+*   - the round trip of a barrier (every thread arrives and waits, over and over) at 2 to 128 threads,
+*     for Barrier, Phaser and, built as C++20, std::barrier. The threads first meet at a Latch, so the
+*     clock starts once they are all running and the trips don't pay for creating them
+*   - a check that counting a Latch down past zero throws
+*
+* Usage:
+*
+*   s3t11 [elements = 1M] [rounds = 200] [round trips = 20000]
+*/
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if __has_include(<version>)
+#include <version> /* (!) Not __cplusplus: MSVC leaves it at 199711L unless /Zc:__cplusplus */
+#endif
+#if defined(__cpp_lib_barrier)
+#include <barrier>
+#define HAS_STD_BARRIER 1
+#else
+#define HAS_STD_BARRIER 0
+#endif
+
+#include "../../common/Barrier.h"
+#include "../../common/ThreadGuard.h"
+
+using Clock = std::chrono::steady_clock;
+
+double milliseconds(Clock::duration d)
+{
+  return std::chrono::duration<double, std::milli>(d).count();
+}
+
+/* (!) One round: the sum of the block, then the block scaled so that the whole vector sums to about 1 */
+void scaleBlock(std::vector<double>& values, size_t first, size_t last, double sum)
+{
+  for (size_t i = first; i < last; ++i) {
+    values[i] /= sum;
+  }
+}
+
+double sumBlock(std::vector<double> const& values, size_t first, size_t last)
+{
+  return std::accumulate(values.begin() + first, values.begin() + last, 0.0);
+}
+
+/* (!) Threads started and joined every round, the s1t15 way */
+double roundsWithThreads(std::vector<double> values, unsigned threads, unsigned rounds)
+{
+  const size_t block = values.size() / threads;
+  std::vector<double> partial(threads);
+  double sum = std::accumulate(values.begin(), values.end(), 0.0);
+
+  for (unsigned round = 0; round < rounds; ++round) {
+    {
+      std::vector<JoiningThread> running;
+      for (unsigned t = 0; t < threads; ++t) {
+        const size_t first = t * block;
+        const size_t last = t + 1 == threads ? values.size() : first + block;
+        running.emplace_back([&, t, first, last] {
+          scaleBlock(values, first, last, sum);
+          partial[t] = sumBlock(values, first, last);
+        });
+      }
+    }
+    sum = std::accumulate(partial.begin(), partial.end(), 0.0);
+  }
+  return sum;
+}
+
+/* (!) Threads started once; the barrier's completion adds the partial sums between the rounds */
+double roundsWithBarrier(std::vector<double> values, unsigned threads, unsigned rounds)
+{
+  const size_t block = values.size() / threads;
+  std::vector<double> partial(threads);
+  double sum = std::accumulate(values.begin(), values.end(), 0.0);
+
+  Barrier<std::function<void()>> barrier(threads, [&] { sum = std::accumulate(partial.begin(), partial.end(), 0.0); });
+
+  auto work = [&](unsigned t) {
+    const size_t first = t * block;
+    const size_t last = t + 1 == threads ? values.size() : first + block;
+    for (unsigned round = 0; round < rounds; ++round) {
+      scaleBlock(values, first, last, sum); /* (!) sum is only written by the completion, while everyone waits */
+      partial[t] = sumBlock(values, first, last);
+      barrier.arriveAndWait(t);
+    }
+  };
+
+  {
+    std::vector<JoiningThread> running;
+    for (unsigned t = 1; t < threads; ++t) {
+      running.emplace_back(work, t);
+    }
+    work(0);
+  }
+  return sum;
+}
+
+void iterate(size_t elements, unsigned threads, unsigned rounds)
+{
+  std::vector<double> values(elements);
+  for (size_t i = 0; i < elements; ++i) {
+    values[i] = 1.0 + static_cast<double>(i % 7);
+  }
+
+  std::cout << elements << " doubles, " << rounds << " rounds of scale and sum, " << threads << " threads:" << std::endl;
+
+  auto start = Clock::now();
+  const double joined = roundsWithThreads(values, threads, rounds);
+  const auto threadsElapsed = Clock::now() - start;
+
+  start = Clock::now();
+  const double barrier = roundsWithBarrier(values, threads, rounds);
+  const auto barrierElapsed = Clock::now() - start;
+
+  std::cout << "  threads per round: " << std::setw(10) << milliseconds(threadsElapsed) << " ms, sum " << joined << std::endl;
+  std::cout << "  barrier:           " << std::setw(10) << milliseconds(barrierElapsed) << " ms, sum " << barrier << std::endl;
+}
+
+/* (!) Workers join at different phases and leave after a number of phases of their own */
+void phaser()
+{
+  Phaser phaser(1); /* (!) main is a party, so that the phases can't run ahead before the workers registered */
+  std::vector<unsigned> phasesSeen(6);
+
+  {
+    std::vector<JoiningThread> running;
+    for (unsigned w = 0; w < phasesSeen.size(); ++w) {
+      phaser.registerParty();
+      running.emplace_back([&phaser, &phasesSeen, w] {
+        for (unsigned i = 0; i < 2 + w; ++i) {
+          phaser.arriveAndAwaitAdvance();
+          ++phasesSeen[w];
+        }
+        phaser.arriveAndDeregister();
+      });
+      phaser.arriveAndAwaitAdvance(); /* (!) main moves the phase on between the registrations */
+    }
+    phaser.arriveAndDeregister();
+  }
+
+  std::cout << "Phaser: 6 workers joined one phase apart and left after 2 to 7 phases; phases: " << phaser.phase()
+            << ", parties left: " << phaser.parties() << ", phases each worker saw:";
+  for (auto seen : phasesSeen) {
+    std::cout << ' ' << seen;
+  }
+  std::cout << std::endl;
+}
+
+/* (!) Round trip: every thread arrives and waits, trips times. wait(t) is the barrier of thread t */
+template<typename Wait>
+double roundTrip(unsigned threads, unsigned trips, Wait wait)
+{
+  Latch ready(threads);
+  Clock::time_point start;
+  {
+    std::vector<JoiningThread> running;
+    for (unsigned t = 1; t < threads; ++t) {
+      running.emplace_back([&wait, &ready, t, trips] {
+        ready.arriveAndWait();
+        for (unsigned i = 0; i < trips; ++i) {
+          wait(t);
+        }
+      });
+    }
+    ready.arriveAndWait(); /* (!) Released by the last thread to start */
+    start = Clock::now();
+    for (unsigned i = 0; i < trips; ++i) {
+      wait(0);
+    }
+  }
+  return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / trips;
+}
+
+void roundTrips(unsigned trips)
+{
+  std::cout << std::endl << "Barrier round trip, ns (" << trips << " trips; more threads than cores make every trip a sleep):" << std::endl;
+  std::cout << std::setw(8) << "threads" << std::setw(14) << "Barrier" << std::setw(14) << "Phaser";
+#if HAS_STD_BARRIER
+  std::cout << std::setw(14) << "std::barrier";
+#endif
+  std::cout << std::endl;
+
+  for (unsigned threads = 2; threads <= 128; threads *= 2) {
+    const unsigned n = std::max(100u, trips / threads); /* (!) Fewer trips where each is slow */
+
+    Barrier<> barrier(threads);
+    const double tree = roundTrip(threads, n, [&barrier](unsigned t) { barrier.arriveAndWait(t); });
+
+    Phaser phaser(threads);
+    const double phased = roundTrip(threads, n, [&phaser](unsigned) { phaser.arriveAndAwaitAdvance(); });
+
+    std::cout << std::setw(8) << threads << std::setw(14) << tree << std::setw(14) << phased;
+#if HAS_STD_BARRIER
+    std::barrier<> standard(threads);
+    std::cout << std::setw(14) << roundTrip(threads, n, [&standard](unsigned) { standard.arrive_and_wait(); });
+#endif
+    std::cout << std::endl;
+  }
+}
+
+/* (!) A Latch is one-shot: once released, a further countDown() is a bug, and reported as one */
+bool latchOvershootThrows()
+{
+  Latch latch(2);
+  latch.countDown(2);
+  latch.wait();
+  try {
+    latch.countDown();
+  } catch (std::logic_error const&) {
+    return true;
+  }
+  return false;
+}
+
+int main(int argc, char* argv[])
+{
+  const size_t elements = argc > 1 ? std::stoull(argv[1]) : 1024 * 1024;
+  const unsigned rounds = argc > 2 ? static_cast<unsigned>(std::stoul(argv[2])) : 200;
+  const unsigned trips = argc > 3 ? static_cast<unsigned>(std::stoul(argv[3])) : 20000;
+  const unsigned threads = std::max(2u, std::thread::hardware_concurrency());
+
+  iterate(elements, threads, rounds);
+  std::cout << std::endl;
+  phaser();
+  roundTrips(trips);
+  std::cout << std::endl << "Latch counted down past zero throws: " << (latchOvershootThrows() ? "yes" : "NO") << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,150 @@
+/*
+* Session 3, example 12:
+*
+* s1t15 splits a range into blocks only to add them up. common/ParallelSort.h uses the same split to
+* sort: parallelSort() sorts a block per thread and merges the sorted blocks with parallelMerge(), all
+* on a ThreadPool that is created once.
+*
+* The program sorts 10^6 elements and every tenfold up to the given maximum, as ints and as 32-byte
+* records ordered by a key, with std::sort, with std::sort(std::execution::par, ...) where the standard
+* library has it, and with parallelSort, and checks that they agree. Then it merges two sorted halves
+* with std::merge and parallelMerge. Sorting n elements needs memory for about three times n: the input,
+* the copy being sorted and the buffer of the merge. Usage:
+*
+*   s3t12 [max elements = 10^8] [pool threads = hardware concurrency]
+*
+* std::execution::par comes with Visual Studio; with GCC it needs TBB, so it is only used if the program
+* is built with CONCURRENCY_PARALLEL_STL=1 and linked with -ltbb.
+*/
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if !defined(CONCURRENCY_PARALLEL_STL)
+#if defined(_MSC_VER)
+#define CONCURRENCY_PARALLEL_STL 1
+#else
+#define CONCURRENCY_PARALLEL_STL 0
+#endif
+#endif
+
+#if CONCURRENCY_PARALLEL_STL
+#include <execution>
+#endif
+
+#include "../../common/ParallelSort.h"
+#include "../../common/ThreadPool.h"
+
+using Clock = std::chrono::steady_clock;
+
+struct Record
+{
+  uint64_t key;
+  uint32_t payload[6];
+};
+
+struct ByKey
+{
+  bool operator()(Record const& lhs, Record const& rhs) const
+  {
+    return lhs.key < rhs.key;
+  }
+};
+
+double milliseconds(Clock::duration d)
+{
+  return std::chrono::duration<double, std::milli>(d).count();
+}
+
+template<typename T, typename Make>
+std::vector<T> generate(size_t size, Make make)
+{
+  std::mt19937_64 random(size);
+  std::vector<T> values(size);
+  for (auto&& value : values) {
+    value = make(random());
+  }
+  return values;
+}
+
+/* (!) Sorts a copy of input, returns the milliseconds and leaves the sorted copy in result */
+template<typename T, typename Sort>
+double timeSort(std::vector<T> const& input, std::vector<T>& result, Sort sort)
+{
+  result = input;
+  const auto start = Clock::now();
+  sort(result);
+  return milliseconds(Clock::now() - start);
+}
+
+template<typename T, typename Compare>
+void compare(ThreadPool& pool, std::string const& what, std::vector<T> const& input, Compare comp)
+{
+  std::vector<T> expected;
+  std::vector<T> sorted;
+
+  std::cout << std::setw(12) << input.size() << std::setw(10) << what;
+  std::cout << std::setw(14) << timeSort(input, expected, [&](std::vector<T>& v) { std::sort(v.begin(), v.end(), comp); });
+#if CONCURRENCY_PARALLEL_STL
+  std::cout << std::setw(14)
+            << timeSort(input, sorted, [&](std::vector<T>& v) { std::sort(std::execution::par, v.begin(), v.end(), comp); });
+#endif
+  std::cout << std::setw(14) << timeSort(input, sorted, [&](std::vector<T>& v) { parallelSort(pool, v.begin(), v.end(), comp); });
+
+  const bool same = std::equal(sorted.begin(), sorted.end(), expected.begin(), [&](T const& lhs, T const& rhs) {
+    return !comp(lhs, rhs) && !comp(rhs, lhs); /* (!) Equal keys may be in any order: neither sort is stable */
+  });
+  std::cout << (same ? "" : "  wrong order!") << std::endl;
+}
+
+void merge(ThreadPool& pool, size_t size)
+{
+  auto values = generate<int>(size, [](uint64_t r) { return static_cast<int>(r % 1000000); });
+  std::sort(values.begin(), values.begin() + size / 2);
+  std::sort(values.begin() + size / 2, values.end());
+
+  std::vector<int> expected(size);
+  std::vector<int> merged(size);
+
+  auto start = Clock::now();
+  std::merge(values.begin(), values.begin() + size / 2, values.begin() + size / 2, values.end(), expected.begin());
+  const double sequential = milliseconds(Clock::now() - start);
+
+  start = Clock::now();
+  parallelMerge(pool, values.begin(), values.begin() + size / 2, values.begin() + size / 2, values.end(), merged.begin());
+  const double parallel = milliseconds(Clock::now() - start);
+
+  std::cout << "Merging two sorted halves of " << size << " ints: std::merge " << sequential << " ms, parallelMerge " << parallel
+            << " ms" << (merged == expected ? "" : "  wrong order!") << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+  const size_t maxElements = argc > 1 ? std::stoull(argv[1]) : 100000000;
+  const unsigned threads = argc > 2 ? static_cast<unsigned>(std::stoul(argv[2])) : std::thread::hardware_concurrency();
+
+  ThreadPool pool(threads);
+
+  std::cout << "Milliseconds, " << pool.threads() << " pool threads:" << std::endl;
+  std::cout << std::setw(12) << "elements" << std::setw(10) << "type" << std::setw(14) << "std::sort";
+#if CONCURRENCY_PARALLEL_STL
+  std::cout << std::setw(14) << "par std::sort";
+#endif
+  std::cout << std::setw(14) << "parallelSort" << std::endl;
+
+  for (size_t size = 1000000; size <= maxElements; size *= 10) {
+    compare(pool, "int", generate<int>(size, [](uint64_t r) { return static_cast<int>(r); }), std::less<>());
+    compare(pool, "Record", generate<Record>(size, [](uint64_t r) { return Record{ r, {} }; }), ByKey());
+  }
+
+  std::cout << std::endl;
+  merge(pool, std::min<size_t>(maxElements, 10000000));
+
+  return 0;
+}
@@ -0,0 +1,125 @@
+/*
+* Session 3, example 13:
+*
+* accumulateParallel (s1t15) over a std::list: the main thread calls std::advance block by block, so it
+* walks the whole list before it starts on its own block. The accumulateParallel of
+* common/ParallelReduce.h walks the list once and hands out chunks to a ThreadPool while it walks.
+*
+* Both reduce a list of 10^7 nodes twice: once adding ints, where walking the list is most of the work,
+* and once multiplying modulo a prime, where the workers have something to do. std::accumulate on one
+* thread is the reference. Usage:
+*
+*   s3t13 [nodes = 10^7] [pool threads = hardware concurrency]
+*/
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../../common/ParallelReduce.h"
+#include "../../common/ThreadPool.h"
+
+using Clock = std::chrono::steady_clock;
+
+/* (!) s1t15, with the operation as a parameter */
+template<typename Iterator, typename T, typename BinaryOperation>
+struct accumulateBlock
+{
+  void operator()(Iterator first, Iterator last, T& result, BinaryOperation op)
+  {
+    result = std::accumulate(first, last, result, op);
+  }
+};
+
+template<typename Iterator, typename T, typename BinaryOperation>
+T accumulateAdvance(Iterator first, Iterator last, T init, BinaryOperation op, T identity)
+{
+  auto length = std::distance(first, last); /* (!) Also a walk of the whole list */
+
+  if (!length) {
+    return init;
+  }
+
+  const unsigned long min_per_thread = 25;
+  const unsigned long max_threads = (length + min_per_thread - 1) / min_per_thread;
+  const unsigned long hardware_threads = std::thread::hardware_concurrency();
+  const unsigned long num_threads = std::min(hardware_threads != 0 ? hardware_threads : 2, max_threads);
+
+  const auto block_size = length / num_threads;
+
+  std::vector<T> results(num_threads, identity);
+  std::vector<std::thread> threads(num_threads - 1);
+
+  Iterator block_start = first;
+
+  for (unsigned long i = 0; i < (num_threads - 1); ++i) {
+    Iterator block_end = block_start;
+    std::advance(block_end, block_size); /* (!) O(block_size) for a list */
+    threads[i] = std::thread(accumulateBlock<Iterator, T, BinaryOperation>(), block_start, block_end, std::ref(results[i]), op);
+    block_start = block_end;
+  }
+
+  accumulateBlock<Iterator, T, BinaryOperation>()(block_start, last, results[num_threads - 1], op);
+  std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+
+  return std::accumulate(results.begin(), results.end(), init, op);
+}
+
+struct MultiplyModulo
+{
+  static constexpr uint64_t Prime = 1000000007;
+
+  uint64_t operator()(uint64_t lhs, uint64_t rhs) const
+  {
+    return lhs * rhs % Prime;
+  }
+};
+
+double milliseconds(Clock::duration d)
+{
+  return std::chrono::duration<double, std::milli>(d).count();
+}
+
+template<typename Reduce>
+void timeReduce(std::string const& what, Reduce reduce)
+{
+  const auto start = Clock::now();
+  const uint64_t result = reduce();
+  std::cout << "  " << std::left << std::setw(40) << what << std::right << std::setw(10) << milliseconds(Clock::now() - start)
+            << " ms  (" << result << ")" << std::endl;
+}
+
+template<typename BinaryOperation>
+void compare(ThreadPool& pool, std::list<uint64_t> const& list, std::string const& what, uint64_t identity, BinaryOperation op)
+{
+  std::cout << what << ":" << std::endl;
+  timeReduce("std::accumulate", [&] { return std::accumulate(list.begin(), list.end(), identity, op); });
+  timeReduce("s1t15, std::advance", [&] { return accumulateAdvance(list.begin(), list.end(), identity, op, identity); });
+  timeReduce("ParallelReduce.h, chunks while walking", [&] { return accumulateParallel(pool, list.begin(), list.end(), identity, op); });
+}
+
+int main(int argc, char* argv[])
+{
+  const size_t nodes = argc > 1 ? std::stoull(argv[1]) : 10000000;
+  const unsigned threads = argc > 2 ? static_cast<unsigned>(std::stoul(argv[2])) : std::thread::hardware_concurrency();
+
+  ThreadPool pool(threads);
+
+  std::list<uint64_t> list;
+  for (size_t i = 0; i < nodes; ++i) {
+    list.push_back(i % 1000 + 1);
+  }
+
+  std::cout << nodes << " list nodes, " << pool.threads() << " pool threads" << std::endl;
+  compare(pool, list, "Sum", 0, std::plus<>());
+  compare(pool, list, "Product modulo 10^9 + 7", 1, MultiplyModulo());
+
+  return 0;
+}
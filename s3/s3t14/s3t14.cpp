@@ -0,0 +1,174 @@
+/*
+* Session 3, example 14:
+*
+* The Widget of s2t04/s2t05 protects its state with a std::mutex, which every reader locks. Here the
+* state is a small configuration record that many threads read all the time and one thread rewrites
+* now and then, kept four ways:
+*
+*   - behind a std::mutex, like the Widget
+*   - behind a std::shared_mutex, readers taking it shared
+*   - in a SeqLocked<Config> (common/SeqLock.h), where readers write nothing and retry instead
+*   - in a MultiWriterSeqLocked<Config>, which also lets several writers take turns
+*
+* The writer sets every field of the record to the same number, so a reader that sees two different
+* numbers has read a torn record. For 1 to 64 readers the program prints the reads per second of all
+* readers together, with one writer writing every 50 microseconds. Usage:
+*
+*   s3t14 [reads per row = 1000000] [max readers = 64]
+*/
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../../common/SeqLock.h"
+#include "../../common/ThreadGuard.h"
+
+using Clock = std::chrono::steady_clock;
+
+struct Config
+{
+  uint64_t version = 0;
+  std::array<uint32_t, 6> limits{};
+};
+
+/* (!) The s2t05 Widget, with a record instead of the name */
+class MutexWidget
+{
+public:
+  Config read() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_config;
+  }
+
+  void write(Config const& config)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_config = config;
+  }
+
+private:
+  mutable std::mutex m_mutex;
+  Config m_config;
+};
+
+class SharedMutexWidget
+{
+public:
+  Config read() const
+  {
+    std::shared_lock<std::shared_mutex> lock(m_mutex);
+    return m_config;
+  }
+
+  void write(Config const& config)
+  {
+    std::unique_lock<std::shared_mutex> lock(m_mutex);
+    m_config = config;
+  }
+
+private:
+  mutable std::shared_mutex m_mutex;
+  Config m_config;
+};
+
+Config makeConfig(uint64_t version)
+{
+  Config config;
+  config.version = version;
+  config.limits.fill(static_cast<uint32_t>(version));
+  return config;
+}
+
+bool consistent(Config const& config)
+{
+  for (auto limit : config.limits) {
+    if (limit != static_cast<uint32_t>(config.version)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* (!) Returns millions of reads per second, over all readers. torn counts the inconsistent reads */
+template<typename Widget>
+double readThroughput(unsigned readers, uint64_t reads, uint64_t& torn)
+{
+  Widget widget;
+  std::atomic<bool> reading{ true };
+  std::atomic<uint64_t> inconsistent{ 0 };
+
+  JoiningThread writer([&] {
+    for (uint64_t version = 1; reading.load(std::memory_order_relaxed); ++version) {
+      widget.write(makeConfig(version));
+      std::this_thread::sleep_for(std::chrono::microseconds(50)); /* (!) Rarely written */
+    }
+  });
+
+  const auto start = Clock::now();
+  {
+    std::vector<JoiningThread> running;
+    for (unsigned r = 0; r < readers; ++r) {
+      running.emplace_back([&] {
+        uint64_t bad = 0;
+        for (uint64_t i = 0; i < reads; ++i) {
+          bad += consistent(widget.read()) ? 0 : 1;
+        }
+        inconsistent += bad;
+      });
+    }
+  }
+  const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  reading = false;
+
+  torn += inconsistent.load();
+  return readers * reads / seconds / 1e6;
+}
+
+int main(int argc, char* argv[])
+{
+  const uint64_t reads = argc > 1 ? std::stoull(argv[1]) : 1000000;
+  const unsigned maxReaders = argc > 2 ? static_cast<unsigned>(std::stoul(argv[2])) : 64;
+
+  std::cout << "Million reads per second, all readers together, one writer:" << std::endl;
+  std::cout << std::setw(8) << "readers" << std::setw(14) << "mutex" << std::setw(14) << "shared_mutex" << std::setw(14)
+            << "SeqLocked" << std::setw(14) << "multi-writer" << std::endl;
+
+  uint64_t torn = 0;
+  for (unsigned readers = 1; readers <= maxReaders; readers *= 2) {
+    const uint64_t n = std::max<uint64_t>(1000, reads / readers); /* (!) The same total per row, split among the readers */
+    std::cout << std::setw(8) << readers;
+    std::cout << std::setw(14) << readThroughput<MutexWidget>(readers, n, torn);
+    std::cout << std::setw(14) << readThroughput<SharedMutexWidget>(readers, n, torn);
+    std::cout << std::setw(14) << readThroughput<SeqLocked<Config>>(readers, n, torn);
+    std::cout << std::setw(14) << readThroughput<MultiWriterSeqLocked<Config>>(readers, n, torn) << std::endl;
+  }
+  std::cout << "Torn reads: " << torn << std::endl;
+
+  /* (!) Several writers: the multi-writer variant serializes them itself */
+  MultiWriterSeqLocked<Config> shared;
+  {
+    std::vector<JoiningThread> writers;
+    for (unsigned w = 0; w < 4; ++w) {
+      writers.emplace_back([&shared] {
+        for (int i = 0; i < 100000; ++i) {
+          shared.update([](Config& config) {
+            config = makeConfig(config.version + 1);
+          });
+        }
+      });
+    }
+  }
+  const Config last = shared.read();
+  std::cout << "4 writers x 100000 updates: version " << last.version << (consistent(last) ? "" : ", torn!") << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,188 @@
+/*
+* Session 3, example 15:
+*
+* swap() of s2t05 locks both Widgets' mutexes with std::lock and swaps their names. Under contention
+* (many threads swapping a few widgets in every order) std::lock's lock-and-back-off dominates, and a
+* reader of a name has to take the mutex as well.
+*
+* Here the name lives in a SwapCell (common/SwapCell.h): a read is a snapshot without a lock, a new name
+* is one compare-and-swap, and swap() exchanges two cells with a descriptor instead of two mutexes. The
+* program checks that the swaps neither lose nor duplicate a name, then measures swaps per second of 1
+* to 64 threads over 8 widgets, with only swaps and with nine reads per swap. Usage:
+*
+*   s3t15 [operations per row = 1000000] [max threads = 64] [name length = 256]
+*/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "../../common/SwapCell.h"
+#include "../../common/ThreadGuard.h"
+
+using Clock = std::chrono::steady_clock;
+
+/* (!) s2t05 */
+class Widget
+{
+public:
+  explicit Widget(std::string&& name)
+    : m_name(name)
+  {
+  }
+
+  std::string name() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_name;
+  }
+
+  size_t nameLength() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_name.size();
+  }
+
+  friend void swap(Widget& lhs, Widget& rhs)
+  {
+    if (&lhs != &rhs) {
+      std::unique_lock<std::mutex> lock_a(lhs.m_mutex, std::defer_lock);
+      std::unique_lock<std::mutex> lock_b(rhs.m_mutex, std::defer_lock);
+
+      std::lock(lock_a, lock_b);
+
+      std::swap(lhs.m_name, rhs.m_name);
+    }
+  }
+
+private:
+  mutable std::mutex m_mutex;
+  std::string m_name;
+};
+
+class SwapWidget
+{
+public:
+  explicit SwapWidget(std::string&& name)
+    : m_name(std::move(name))
+  {
+  }
+
+  std::string name() const
+  {
+    return *m_name.read();
+  }
+
+  size_t nameLength() const
+  {
+    return m_name.read()->size(); /* (!) No copy: the snapshot keeps the string alive */
+  }
+
+  friend void swap(SwapWidget& lhs, SwapWidget& rhs)
+  {
+    swap(lhs.m_name, rhs.m_name);
+  }
+
+private:
+  SwapCell<std::string> m_name;
+};
+
+template<typename W>
+std::vector<std::unique_ptr<W>> makeWidgets(size_t count, size_t length)
+{
+  std::vector<std::unique_ptr<W>> widgets;
+  for (size_t i = 0; i < count; ++i) {
+    widgets.push_back(std::make_unique<W>(std::string(length, static_cast<char>('a' + i))));
+  }
+  return widgets;
+}
+
+/* (!) Millions of operations per second. readsPerSwap reads of random widgets go with every swap */
+template<typename W>
+double throughput(unsigned threads, uint64_t operations, size_t length, unsigned readsPerSwap)
+{
+  auto widgets = makeWidgets<W>(8, length); /* (!) Few widgets: threads collide on the same pairs, in both orders */
+  std::atomic<uint64_t> checksum{ 0 };
+
+  const auto start = Clock::now();
+  {
+    std::vector<JoiningThread> running;
+    for (unsigned t = 0; t < threads; ++t) {
+      running.emplace_back([&, t] {
+        uint32_t state = 2463534242u + t;
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < operations / threads; ++i) {
+          state ^= state << 13;
+          state ^= state >> 17;
+          state ^= state << 5;
+          if (i % (readsPerSwap + 1) == 0) {
+            swap(*widgets[state % 8], *widgets[(state >> 8) % 8]);
+          } else {
+            sum += widgets[state % 8]->nameLength();
+          }
+        }
+        checksum += sum;
+      });
+    }
+  }
+  return operations / std::chrono::duration<double>(Clock::now() - start).count() / 1e6;
+}
+
+/* (!) After any number of swaps the widgets must still hold every name once */
+template<typename W>
+bool namesIntact(size_t length)
+{
+  auto widgets = makeWidgets<W>(8, length);
+  {
+    std::vector<JoiningThread> running;
+    for (unsigned t = 0; t < 8; ++t) {
+      running.emplace_back([&widgets, t] {
+        uint32_t state = 88675123u + t;
+        for (int i = 0; i < 100000; ++i) {
+          state ^= state << 13;
+          state ^= state >> 17;
+          state ^= state << 5;
+          swap(*widgets[state % 8], *widgets[(state >> 8) % 8]);
+        }
+      });
+    }
+  }
+
+  std::string first;
+  for (auto&& w : widgets) {
+    first += w->name().front();
+  }
+  std::sort(first.begin(), first.end());
+  return first == "abcdefgh";
+}
+
+int main(int argc, char* argv[])
+{
+  const uint64_t operations = argc > 1 ? std::stoull(argv[1]) : 1000000;
+  const unsigned maxThreads = argc > 2 ? static_cast<unsigned>(std::stoul(argv[2])) : 64;
+  const size_t length = argc > 3 ? std::stoull(argv[3]) : 256;
+
+  std::cout << "Names intact after concurrent swaps: std::lock " << (namesIntact<Widget>(length) ? "yes" : "NO")
+            << ", SwapCell " << (namesIntact<SwapWidget>(length) ? "yes" : "NO") << std::endl
+            << std::endl;
+
+  std::cout << "Million operations per second, 8 widgets, names of " << length << " characters:" << std::endl;
+  std::cout << std::setw(8) << "threads" << std::setw(14) << "std::lock" << std::setw(14) << "SwapCell" << std::setw(20)
+            << "std::lock 9 reads" << std::setw(20) << "SwapCell 9 reads" << std::endl;
+
+  for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+    std::cout << std::setw(8) << threads;
+    std::cout << std::setw(14) << throughput<Widget>(threads, operations, length, 0);
+    std::cout << std::setw(14) << throughput<SwapWidget>(threads, operations, length, 0);
+    std::cout << std::setw(20) << throughput<Widget>(threads, operations, length, 9);
+    std::cout << std::setw(20) << throughput<SwapWidget>(threads, operations, length, 9) << std::endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,169 @@
+/*
+* Session 3, example 16:
+*
+* ThreadSafeLinkedList (S2t02) allocates each list node from the global heap inside its critical section,
+* so every add() holds the lock for a malloc, and the mallocs of all threads contend in the heap on top
+* of that. The list is kept here three ways:
+*
+*   - std::list<int> with the default allocator, the node made under the lock (S2t02)
+*   - std::list<int, PoolAllocator<int>> (common/PoolAllocator.h), the node still made under the lock
+*   - the pool, with the node made before taking the lock and spliced in under it (common/Containers.h)
+*
+* The stack of common/Containers.h keeps the same pooled list and splices the same way (at the front),
+* so it is measured against the "pool splice" column; std::stack<int>, on a std::deque, is the container
+* of s2t09.
+* For 1 to 64 threads the program prints millions of inserts per second of all threads together, then,
+* in a second run that reads the clock inside the lock, the mean time the lock was held per insert. The
+* lists are freed by the main thread, so the nodes travel back to the other threads through the central
+* pool. Usage:
+*
+*   s3t16 [inserts per row = 1000000] [max threads = 64]
+*/
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <stack>
+#include <string>
+#include <vector>
+
+#include "../../common/Metrics.h"
+#include "../../common/PoolAllocator.h"
+#include "../../common/ThreadGuard.h"
+
+using Clock = std::chrono::steady_clock;
+
+/* (!) Made under the lock: emplace allocates while holding it */
+template<typename Container>
+struct InsertUnderLock
+{
+  static void insert(Container& container, std::mutex& mutex, int value, ShardedHistogram* hold)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto start = hold ? Clock::now() : Clock::time_point();
+    container.emplace_back(value);
+    if (hold) {
+      hold->record(Clock::now() - start);
+    }
+  }
+};
+
+/* (!) Made before the lock: only the splice is under it */
+template<typename Container>
+struct SpliceUnderLock
+{
+  static void insert(Container& container, std::mutex& mutex, int value, ShardedHistogram* hold)
+  {
+    Container node(1, value);
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto start = hold ? Clock::now() : Clock::time_point();
+    container.splice(container.end(), node);
+    if (hold) {
+      hold->record(Clock::now() - start);
+    }
+  }
+};
+
+/* (!) std::stack has no splice, and its deque only allocates once per 512 bytes of elements */
+struct StackPush
+{
+  static void insert(std::stack<int>& stack, std::mutex& mutex, int value, ShardedHistogram* hold)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto start = hold ? Clock::now() : Clock::time_point();
+    stack.push(value);
+    if (hold) {
+      hold->record(Clock::now() - start);
+    }
+  }
+};
+
+/* (!) Millions of inserts per second. With hold, the lock is timed instead, and its mean goes to holdNs */
+template<typename Container, typename Insert>
+double insertThroughput(unsigned threads, uint64_t inserts, double* holdNs = nullptr)
+{
+  Container container;
+  std::mutex mutex;
+  ShardedHistogram hold;
+  ShardedHistogram* timed = holdNs ? &hold : nullptr;
+
+  const auto start = Clock::now();
+  {
+    std::vector<JoiningThread> running;
+    for (unsigned t = 0; t < threads; ++t) {
+      running.emplace_back([&, t] {
+        for (uint64_t i = t; i < inserts; i += threads) {
+          Insert::insert(container, mutex, static_cast<int>(i), timed);
+        }
+      });
+    }
+  }
+  const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  if (holdNs) {
+    *holdNs = hold.snapshot().mean();
+  }
+  return inserts / seconds / 1e6; /* (!) The container is freed after the clock stops */
+}
+
+using DefaultList = std::list<int>;
+using PoolList = std::list<int, PoolAllocator<int>>;
+
+struct Variant
+{
+  const char* name;
+  double (*run)(unsigned, uint64_t, double*);
+};
+
+const Variant variants[] = {
+  { "list", insertThroughput<DefaultList, InsertUnderLock<DefaultList>> },
+  { "pool list", insertThroughput<PoolList, InsertUnderLock<PoolList>> },
+  { "pool splice", insertThroughput<PoolList, SpliceUnderLock<PoolList>> },
+  { "std::stack", insertThroughput<std::stack<int>, StackPush> },
+};
+
+int main(int argc, char* argv[])
+{
+  const uint64_t inserts = argc > 1 ? std::stoull(argv[1]) : 1000000;
+  const unsigned maxThreads = argc > 2 ? static_cast<unsigned>(std::stoul(argv[2])) : 64;
+
+  std::cout << "Million inserts per second, all threads together:" << std::endl;
+  std::cout << std::setw(8) << "threads";
+  for (auto&& variant : variants) {
+    std::cout << std::setw(14) << variant.name;
+  }
+  std::cout << std::endl;
+
+  for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+    std::cout << std::setw(8) << threads;
+    for (auto&& variant : variants) {
+      std::cout << std::setw(14) << variant.run(threads, inserts, nullptr);
+    }
+    std::cout << std::endl;
+  }
+
+  std::cout << std::endl << "Mean lock hold time per insert, nanoseconds (includes two clock reads):" << std::endl;
+  std::cout << std::setw(8) << "threads";
+  for (auto&& variant : variants) {
+    std::cout << std::setw(14) << variant.name;
+  }
+  std::cout << std::endl;
+
+  for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+    std::cout << std::setw(8) << threads;
+    for (auto&& variant : variants) {
+      double holdNs = 0;
+      variant.run(threads, inserts, &holdNs);
+      std::cout << std::setw(14) << holdNs;
+    }
+    std::cout << std::endl;
+  }
+
+  std::cout << std::endl
+            << "Pool: " << NodePool::instance().chunks() << " chunks carved, " << NodePool::instance().centralTransfers()
+            << " batches through the central pool" << std::endl;
+
+  return 0;
+}
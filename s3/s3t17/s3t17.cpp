@@ -0,0 +1,172 @@
+/*
+* Session 3, example 17:
+*
+* With many threads, the mutex of ThreadSafeStack (s2t09) and of WrapperData::processData (s2t03) is
+* mostly busy travelling between cores, together with the data it protects. FlatCombining<T>
+* (common/FlatCombining.h) lets one thread at a time, the combiner, run the operations that all the
+* others have published, in one pass over data that stays in its cache.
+*
+* The stack is measured four ways, every thread pushing a value and popping one:
+*
+*   - ThreadSafeStack (common/Containers.h), a mutex around a list
+*   - LockFreeStack (common/LockFreeStack.h), a Treiber stack with epoch reclamation
+*   - FlatCombining<std::vector<int>>, one operation per push and per pop
+*   - the same, with 8 pushes and then 8 pops in one operation each: a batch costs what a push costs
+*
+* and processData with a std::mutex against FlatCombining<Data>::apply. The popped values must add up to
+* the pushed ones, and the processed Data must have counted every call. For 8 to 128 threads the
+* program prints millions of operations (pushes and pops, or calls) per second of all threads together.
+* Usage:
+*
+*   s3t17 [operations per row = 1000000] [min threads = 8] [max threads = 128]
+*/
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../../common/Containers.h"
+#include "../../common/LockFreeStack.h"
+#include "../../common/ThreadGuard.h"
+
+using Clock = std::chrono::steady_clock;
+
+double millionsPerSecond(uint64_t operations, Clock::time_point start)
+{
+  return operations / std::chrono::duration<double>(Clock::now() - start).count() / 1e6;
+}
+
+/* (!) Every thread pushes, then pops, operations / 2 times in all. wrong counts sums that don't add up */
+template<typename Stack>
+double stackThroughput(unsigned threads, uint64_t operations, uint64_t& wrong)
+{
+  Stack stack;
+  std::atomic<int64_t> balance{ 0 };
+
+  const auto start = Clock::now();
+  {
+    std::vector<JoiningThread> running;
+    for (unsigned t = 0; t < threads; ++t) {
+      running.emplace_back([&, t] {
+        int64_t sum = 0;
+        for (uint64_t i = t; i < operations / 2; i += threads) {
+          int value = static_cast<int>(i);
+          stack.push(value);
+          sum += value;
+          if (stack.try_pop(value)) { /* (!) Never fails: every thread pushed before it pops */
+            sum -= value;
+          }
+        }
+        balance += sum;
+      });
+    }
+  }
+  const double result = millionsPerSecond(operations / 2 * 2, start);
+
+  wrong += balance.load() != 0;
+  return result;
+}
+
+double batchThroughput(unsigned threads, uint64_t operations, uint64_t& wrong)
+{
+  constexpr size_t Batch = 8;
+  CombiningStack stack;
+  std::atomic<int64_t> balance{ 0 };
+
+  const auto start = Clock::now();
+  {
+    std::vector<JoiningThread> running;
+    for (unsigned t = 0; t < threads; ++t) {
+      running.emplace_back([&, t] {
+        int64_t sum = 0;
+        int values[Batch];
+        for (uint64_t i = t * Batch; i < operations / 2; i += threads * Batch) {
+          for (size_t j = 0; j < Batch; ++j) {
+            values[j] = static_cast<int>(i + j);
+            sum += values[j];
+          }
+          stack.push_range(values, values + Batch);
+
+          const size_t popped = stack.try_pop_n(values, Batch);
+          for (size_t j = 0; j < popped; ++j) {
+            sum -= values[j];
+          }
+        }
+        balance += sum;
+      });
+    }
+  }
+  const double result = millionsPerSecond(operations / 2 / Batch * Batch * 2, start); /* (!) Pushed and popped elements */
+
+  wrong += balance.load() != 0;
+  return result;
+}
+
+template<typename Wrapper>
+double processThroughput(unsigned threads, uint64_t operations, uint64_t& wrong)
+{
+  Wrapper wrapper;
+
+  const auto start = Clock::now();
+  {
+    std::vector<JoiningThread> running;
+    for (unsigned t = 0; t < threads; ++t) {
+      running.emplace_back([&, t] {
+        for (uint64_t i = t; i < operations; i += threads) {
+          wrapper.processData([i](Data& data) { data.doSomething(i); });
+        }
+      });
+    }
+  }
+  const double result = millionsPerSecond(operations, start);
+
+  wrong += wrapper.calls() != operations;
+  return result;
+}
+
+int main(int argc, char* argv[])
+{
+  const uint64_t operations = argc > 1 ? std::stoull(argv[1]) : 1000000;
+  const unsigned minThreads = argc > 2 ? static_cast<unsigned>(std::stoul(argv[2])) : 8;
+  const unsigned maxThreads = argc > 3 ? static_cast<unsigned>(std::stoul(argv[3])) : 128;
+
+  std::cout << "Million operations per second, all threads together:" << std::endl;
+  std::cout << std::setw(8) << "threads" << std::setw(14) << "mutex stack" << std::setw(14) << "lock-free" << std::setw(14)
+            << "combining" << std::setw(14) << "combining x8" << std::setw(16) << "mutex process" << std::setw(18)
+            << "combining process" << std::endl;
+
+  uint64_t wrong = 0;
+  for (unsigned threads = minThreads; threads <= maxThreads; threads *= 2) {
+    std::cout << std::setw(8) << threads;
+    std::cout << std::setw(14) << stackThroughput<ThreadSafeStack<int>>(threads, operations, wrong);
+    std::cout << std::setw(14) << stackThroughput<LockFreeStack<int>>(threads, operations, wrong);
+    std::cout << std::setw(14) << stackThroughput<CombiningStack>(threads, operations, wrong);
+    std::cout << std::setw(14) << batchThroughput(threads, operations, wrong);
+    std::cout << std::setw(16) << processThroughput<WrapperData<>>(threads, operations, wrong);
+    std::cout << std::setw(18) << processThroughput<CombiningWrapperData>(threads, operations, wrong) << std::endl;
+  }
+  std::cout << "Runs with lost or duplicated values: " << wrong << std::endl;
+
+  /* (!) How much a combiner gets done per pass decides the gain */
+  CombiningStack stack;
+  {
+    std::vector<JoiningThread> running;
+    for (unsigned t = 0; t < maxThreads; ++t) {
+      running.emplace_back([&stack] {
+        int value;
+        for (int i = 0; i < 10000; ++i) {
+          stack.push(i);
+          stack.try_pop(value);
+        }
+      });
+    }
+  }
+  const auto& combining = stack.combining();
+  std::cout << maxThreads << " threads: " << combining.operations() << " operations in " << combining.combines()
+            << " combining passes" << std::endl;
+
+  return 0;
+}
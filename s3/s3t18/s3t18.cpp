@@ -0,0 +1,221 @@
+/*
+* Session 3, example 18:
+*
+* ThreadSafeLinkedList::add (S2t02) under a std::mutex lets a thread that has just unlocked take the
+* lock again at once, while the threads woken for it are still on their way: some producers add far
+* more than others, and some hardly get in at all. The list of common/Containers.h takes its lock type as
+* a parameter, and is run here with std::mutex and with the locks of common/QueueLocks.h, which hand the
+* lock over in arrival order: TicketLock, McsLock and ClhLock.
+*
+* For 1 to 128 threads, each adding to the list for a fixed time, the program prints millions of adds
+* per second of all threads together, and the coefficient of variation of the adds per thread (the
+* standard deviation as a percentage of the mean: 0 when every thread got in equally often). The list
+* must end up with as many elements as the threads counted.
+*
+* Then each lock is taken together with a std::mutex by std::lock, in one order by half the threads and
+* in the other by the rest, and now and then by a try_lock() of its own. std::lock holds one of the two
+* and only tries the other, so a try_lock() that waited would deadlock here. Every acquisition must be
+* counted once. Usage:
+*
+*   s3t18 [milliseconds per run = 100] [max threads = 128]
+*/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../../common/Containers.h"
+#include "../../common/QueueLocks.h"
+#include "../../common/ThreadGuard.h"
+
+using Clock = std::chrono::steady_clock;
+
+struct Result
+{
+  double millionsPerSecond = 0;
+  double variation = 0; /* (!) Percent */
+  bool complete = true;
+};
+
+template<typename Mutex>
+Result addFor(unsigned threads, std::chrono::milliseconds duration)
+{
+  ThreadSafeLinkedList<Mutex> list;
+  std::vector<uint64_t> adds(threads);
+  std::atomic<bool> started{ false };
+  std::atomic<bool> running{ true };
+
+  Clock::time_point start;
+  {
+    std::vector<JoiningThread> producers;
+    for (unsigned t = 0; t < threads; ++t) {
+      producers.emplace_back([&, t] {
+        while (!started.load()) { /* (!) Nobody gets a head start while the others are being created */
+          std::this_thread::yield();
+        }
+        uint64_t count = 0;
+        while (running.load(std::memory_order_relaxed)) {
+          list.add(static_cast<int>(count++));
+        }
+        adds[t] = count;
+      });
+    }
+
+    start = Clock::now();
+    started = true;
+    std::this_thread::sleep_for(duration);
+    running = false;
+  }
+  const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  uint64_t total = 0;
+  for (auto count : adds) {
+    total += count;
+  }
+  const double mean = static_cast<double>(total) / threads;
+  double squares = 0;
+  for (auto count : adds) {
+    squares += (count - mean) * (count - mean);
+  }
+
+  Result result;
+  result.millionsPerSecond = total / seconds / 1e6;
+  result.variation = mean > 0 ? 100 * std::sqrt(squares / threads) / mean : 0;
+  result.complete = list.size() == total;
+  return result;
+}
+
+/* (!) Returns millions of acquisitions per second; complete is false if the count protected by the lock is off */
+template<typename Mutex>
+double lockBothFor(unsigned threads, std::chrono::milliseconds duration, bool& complete)
+{
+  Mutex queued;
+  std::mutex other;
+  uint64_t guarded = 0; /* (!) Only changed while holding queued */
+  std::vector<uint64_t> acquisitions(threads);
+  std::atomic<bool> running{ true };
+
+  const auto start = Clock::now();
+  {
+    std::vector<JoiningThread> lockers;
+    for (unsigned t = 0; t < threads; ++t) {
+      lockers.emplace_back([&, t] {
+        uint64_t count = 0;
+        while (running.load(std::memory_order_relaxed)) {
+          if (count % 4 == 3) {
+            if (queued.try_lock()) { /* (!) Fails while anybody holds it or waits for it */
+              ++guarded;
+              ++count;
+              queued.unlock();
+            }
+            continue;
+          }
+          if (t % 2 == 0) {
+            std::lock(queued, other);
+          } else {
+            std::lock(other, queued);
+          }
+          ++guarded;
+          ++count;
+          other.unlock();
+          queued.unlock();
+        }
+        acquisitions[t] = count;
+      });
+    }
+    std::this_thread::sleep_for(duration);
+    running = false;
+  }
+  const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  uint64_t total = 0;
+  for (auto count : acquisitions) {
+    total += count;
+  }
+  complete = guarded == total;
+  return total / seconds / 1e6;
+}
+
+struct Variant
+{
+  const char* name;
+  Result (*run)(unsigned, std::chrono::milliseconds);
+  double (*lockBoth)(unsigned, std::chrono::milliseconds, bool&);
+};
+
+const Variant variants[] = {
+  { "std::mutex", addFor<std::mutex>, lockBothFor<std::mutex> },
+  { "TicketLock", addFor<TicketLock>, lockBothFor<TicketLock> },
+  { "McsLock", addFor<McsLock>, lockBothFor<McsLock> },
+  { "ClhLock", addFor<ClhLock>, lockBothFor<ClhLock> },
+};
+
+int main(int argc, char* argv[])
+{
+  const std::chrono::milliseconds duration(argc > 1 ? std::stoul(argv[1]) : 100);
+  const unsigned maxThreads = argc > 2 ? static_cast<unsigned>(std::stoul(argv[2])) : 128;
+
+  std::vector<unsigned> rows;
+  for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+    rows.push_back(threads);
+  }
+
+  std::vector<std::vector<Result>> results;
+  bool complete = true;
+  for (auto threads : rows) {
+    results.emplace_back();
+    for (auto&& variant : variants) {
+      results.back().push_back(variant.run(threads, duration));
+      complete = complete && results.back().back().complete;
+    }
+  }
+
+  std::cout << "Million adds per second, all threads together:" << std::endl;
+  std::cout << std::setw(8) << "threads";
+  for (auto&& variant : variants) {
+    std::cout << std::setw(14) << variant.name;
+  }
+  std::cout << std::endl;
+  for (size_t row = 0; row < rows.size(); ++row) {
+    std::cout << std::setw(8) << rows[row];
+    for (auto&& result : results[row]) {
+      std::cout << std::setw(14) << result.millionsPerSecond;
+    }
+    std::cout << std::endl;
+  }
+
+  std::cout << std::endl << "Variation of the adds per thread, % of the mean (lower is fairer):" << std::endl;
+  std::cout << std::setw(8) << "threads";
+  for (auto&& variant : variants) {
+    std::cout << std::setw(14) << variant.name;
+  }
+  std::cout << std::endl;
+  for (size_t row = 0; row < rows.size(); ++row) {
+    std::cout << std::setw(8) << rows[row];
+    for (auto&& result : results[row]) {
+      std::cout << std::setw(14) << std::fixed << std::setprecision(1) << result.variation;
+    }
+    std::cout << std::defaultfloat << std::setprecision(6) << std::endl;
+  }
+
+  std::cout << std::endl << "Every add in the list: " << (complete ? "yes" : "NO") << std::endl;
+
+  const unsigned lockers = std::max(2u, std::min(maxThreads, 8u));
+  bool counted = true;
+  std::cout << std::endl << "Million acquisitions per second with std::lock and try_lock, " << lockers << " threads:" << std::endl;
+  for (auto&& variant : variants) {
+    bool right = true;
+    std::cout << std::setw(14) << variant.name << std::setw(14) << variant.lockBoth(lockers, duration, right) << std::endl;
+    counted = counted && right;
+  }
+  std::cout << "Every acquisition counted: " << (counted ? "yes" : "NO") << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,126 @@
+/*
+* Session 3, example 19:
+*
+* WrapperData::processData (s2t03) runs the caller's function under a mutex, on the caller's thread:
+* with many threads, Data moves from core to core with the mutex. Here Data belongs to an Actor
+* (common/Actor.h) instead, whose single owner thread runs the functions that the others post to its
+* lock-free mailbox, in batches. The functions still receive a Data&, but only ever on the owner thread,
+* while the callers go on with their own work.
+*
+* For 8 to 128 threads, every thread processes its share of the operations through:
+*
+*   - processData with a std::mutex, as in s2t03
+*   - Actor::post, fire and forget, waiting at the end until the owner has run everything
+*   - Actor::post, with a call() whose future is waited for every 64 operations, as a caller that now
+*     and then needs an answer would
+*
+* and the program prints millions of operations per second of all threads together, checks that Data
+* counted every one of them, and shows how many messages the owner ran per batch. Usage:
+*
+*   s3t19 [operations per row = 1000000] [min threads = 8] [max threads = 128]
+*/
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../../common/Actor.h"
+#include "../../common/Containers.h"
+#include "../../common/ThreadGuard.h"
+
+using Clock = std::chrono::steady_clock;
+
+double millionsPerSecond(uint64_t operations, Clock::time_point start)
+{
+  return operations / std::chrono::duration<double>(Clock::now() - start).count() / 1e6;
+}
+
+double lockedThroughput(unsigned threads, uint64_t operations, uint64_t& wrong)
+{
+  WrapperData<> wrapper;
+
+  const auto start = Clock::now();
+  {
+    std::vector<JoiningThread> running;
+    for (unsigned t = 0; t < threads; ++t) {
+      running.emplace_back([&, t] {
+        for (uint64_t i = t; i < operations; i += threads) {
+          wrapper.processData([i](Data& data) { data.doSomething(i); });
+        }
+      });
+    }
+  }
+  const double result = millionsPerSecond(operations, start);
+
+  wrong += wrapper.calls() != operations;
+  return result;
+}
+
+/* (!) callEvery 0: posts only */
+double actorThroughput(unsigned threads, uint64_t operations, uint64_t callEvery, uint64_t& wrong, double* batch = nullptr)
+{
+  Actor<Data> actor("data");
+
+  const auto start = Clock::now();
+  {
+    std::vector<JoiningThread> running;
+    for (unsigned t = 0; t < threads; ++t) {
+      running.emplace_back([&, t] {
+        uint64_t n = 0;
+        for (uint64_t i = t; i < operations; i += threads) {
+          if (callEvery != 0 && ++n % callEvery == 0) {
+            actor.call([i](Data& data) { data.doSomething(i); }).get(); /* (!) Also waits for everything this thread posted before */
+          } else {
+            actor.post([i](Data& data) { data.doSomething(i); });
+          }
+        }
+      });
+    }
+  }
+  const uint64_t calls = actor.call([](Data& data) { return data.calls; }).get(); /* (!) Runs after every post */
+  const double result = millionsPerSecond(operations, start);
+
+  wrong += calls != operations;
+  if (batch) {
+    *batch = static_cast<double>(actor.messages()) / actor.batches();
+  }
+  return result;
+}
+
+int main(int argc, char* argv[])
+{
+  const uint64_t operations = argc > 1 ? std::stoull(argv[1]) : 1000000;
+  const unsigned minThreads = argc > 2 ? static_cast<unsigned>(std::stoul(argv[2])) : 8;
+  const unsigned maxThreads = argc > 3 ? static_cast<unsigned>(std::stoul(argv[3])) : 128;
+
+  std::cout << "Million operations per second, all threads together:" << std::endl;
+  std::cout << std::setw(8) << "threads" << std::setw(14) << "processData" << std::setw(14) << "post" << std::setw(18)
+            << "post, call/64" << std::setw(16) << "mean batch" << std::endl;
+
+  uint64_t wrong = 0;
+  for (unsigned threads = minThreads; threads <= maxThreads; threads *= 2) {
+    double batch = 0;
+    std::cout << std::setw(8) << threads;
+    std::cout << std::setw(14) << lockedThroughput(threads, operations, wrong);
+    std::cout << std::setw(14) << actorThroughput(threads, operations, 0, wrong, &batch);
+    std::cout << std::setw(18) << actorThroughput(threads, operations, 64, wrong);
+    std::cout << std::setw(16) << batch << std::endl;
+  }
+  std::cout << "Runs that lost operations: " << wrong << std::endl;
+
+  /* (!) An exception comes back through the future of a call, and is counted for a post */
+  Actor<Data> actor("data");
+  auto failed = actor.call([](Data&) -> int { throw std::runtime_error("no answer"); });
+  actor.post([](Data&) { throw std::runtime_error("nobody listens"); });
+  try {
+    failed.get();
+  } catch (std::exception const& e) {
+    actor.call([](Data&) {}).get(); /* (!) Messages of one thread run in order: the post has run */
+    std::cout << "call: " << e.what() << ", posts failed: " << actor.failures() << std::endl;
+  }
+
+  return 0;
+}
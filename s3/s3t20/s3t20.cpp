@@ -0,0 +1,149 @@
+/*
+* Session 3, example 20:
+*
+* accumulateParallel (s1t15) sums the numbers that generate() put in a std::vector. When the numbers are
+* in a file, the obvious way is to read the file into a vector and sum that: the whole file is read before
+* the first addition, and it must fit in memory. accumulateFile (common/FileReduce.h) sums the file in
+* place, either memory-mapped or read in 4MB chunks that the workers sum while the next ones are read.
+*
+* The program writes a file of random 32-bit numbers (if it isn't there already with the right size),
+* then sums it three ways, each once with the file evicted from the page cache first ("cold", Linux
+* only: elsewhere both passes find it cached unless it is larger than RAM) and once right after, with
+* the file cached. It prints gigabytes per second; the three sums must agree. A file larger than RAM can
+* only be summed in place, so the vector is skipped when the file takes more than half of it. Usage:
+*
+*   s3t20 [file size in MB = 1024] [file = s3t20.bin] [threads = hardware threads]
+*/
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../../common/FileReduce.h"
+#include "../../common/ParallelReduce.h"
+#include "../../common/ThreadPool.h"
+
+using Clock = std::chrono::steady_clock;
+
+uint64_t physicalMemory()
+{
+#if defined(_WIN32)
+  MEMORYSTATUSEX status{};
+  status.dwLength = sizeof(status);
+  return ::GlobalMemoryStatusEx(&status) ? status.ullTotalPhys : 0;
+#else
+  return static_cast<uint64_t>(::sysconf(_SC_PHYS_PAGES)) * static_cast<uint64_t>(::sysconf(_SC_PAGE_SIZE));
+#endif
+}
+
+void writeInput(std::string const& path, uint64_t bytes)
+{
+  {
+    std::ifstream existing(path, std::ios::binary | std::ios::ate);
+    if (existing && static_cast<uint64_t>(existing.tellg()) == bytes) {
+      return;
+    }
+  }
+
+  std::cout << "Writing " << bytes / (1 << 20) << "MB to " << path << "..." << std::endl;
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  std::vector<uint32_t> buffer(1 << 20);
+  uint32_t state = 2463534242u;
+
+  for (uint64_t written = 0; written < bytes;) {
+    for (auto&& value : buffer) {
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      value = state;
+    }
+    const uint64_t n = std::min<uint64_t>(bytes - written, buffer.size() * sizeof(uint32_t));
+    out.write(reinterpret_cast<char const*>(buffer.data()), static_cast<std::streamsize>(n));
+    written += n;
+  }
+  if (!out) {
+    throw std::runtime_error("Can't write " + path);
+  }
+}
+
+uint64_t sumVector(ThreadPool& pool, std::string const& path)
+{
+  InputFile file(path);
+  std::vector<uint32_t> numbers(file.size() / sizeof(uint32_t));
+  file.read(0, reinterpret_cast<char*>(numbers.data()), numbers.size() * sizeof(uint32_t)); /* (!) All of it before the first addition */
+  return accumulateParallel(pool, numbers.begin(), numbers.end(), uint64_t(0));
+}
+
+uint64_t sumMapped(ThreadPool& pool, std::string const& path)
+{
+  return accumulateFile<uint32_t>(pool, path, uint64_t(0), std::plus<>(), FileAccess::Map);
+}
+
+uint64_t sumRead(ThreadPool& pool, std::string const& path)
+{
+  return accumulateFile<uint32_t>(pool, path, uint64_t(0), std::plus<>(), FileAccess::Read);
+}
+
+/* (!) Gigabytes per second of one pass; cold drops the file from the page cache first */
+double gigabytesPerSecond(uint64_t (*sum)(ThreadPool&, std::string const&), ThreadPool& pool, std::string const& path,
+                          uint64_t bytes, bool cold, uint64_t& result)
+{
+  if (cold) {
+    InputFile(path).evict();
+  }
+  const auto start = Clock::now();
+  result = sum(pool, path);
+  return bytes / std::chrono::duration<double>(Clock::now() - start).count() / 1e9;
+}
+
+int main(int argc, char* argv[])
+{
+  const uint64_t megabytes = argc > 1 ? std::stoull(argv[1]) : 1024;
+  const std::string path = argc > 2 ? argv[2] : "s3t20.bin";
+  const unsigned threads = argc > 3 ? static_cast<unsigned>(std::stoul(argv[3])) : std::thread::hardware_concurrency();
+
+  const uint64_t bytes = megabytes << 20;
+  writeInput(path, bytes);
+
+  ThreadPool pool(threads > 1 ? threads - 1 : 1); /* (!) The calling thread works too */
+
+  struct Way
+  {
+    const char* name;
+    uint64_t (*sum)(ThreadPool&, std::string const&);
+  };
+  const Way ways[] = { { "vector", sumVector }, { "mapped", sumMapped }, { "read", sumRead } };
+  const bool fitsInMemory = bytes < physicalMemory() / 2;
+
+  std::cout << "GB/s summing " << megabytes << "MB of uint32_t, " << pool.threads() + 1 << " threads:" << std::endl;
+  std::cout << std::setw(10) << "" << std::setw(10) << "cold" << std::setw(10) << "cached" << std::setw(24) << "sum" << std::endl;
+
+  uint64_t expected = 0;
+  bool agree = true;
+  for (auto&& way : ways) {
+    std::cout << std::setw(10) << way.name;
+    if (&way == &ways[0] && !fitsInMemory) {
+      std::cout << std::setw(10) << "-" << std::setw(10) << "-" << std::setw(24) << "larger than RAM / 2" << std::endl;
+      continue;
+    }
+
+    uint64_t cold = 0;
+    uint64_t cached = 0;
+    std::cout << std::setw(10) << gigabytesPerSecond(way.sum, pool, path, bytes, true, cold);
+    std::cout << std::setw(10) << gigabytesPerSecond(way.sum, pool, path, bytes, false, cached);
+    std::cout << std::setw(24) << cached << std::endl;
+
+    if (expected == 0) {
+      expected = cached;
+    }
+    agree = agree && cold == expected && cached == expected;
+  }
+  std::cout << "Sums agree: " << (agree ? "yes" : "NO") << std::endl;
+
+  return 0;
+}
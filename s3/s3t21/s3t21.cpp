@@ -0,0 +1,109 @@
+/*
+* Session 3, example 21:
+*
+* accumulateParallel (s1t15) gives every thread one block, so with doubles the additions happen in an
+* order that depends on the number of threads, and each thread count rounds differently: the same
+* program prints a different sum on a laptop and on a server. sumDeterministic (common/DeterministicReduce.h)
+* cuts the numbers into fixed leaves instead and combines them in a fixed tree, so that the threads only
+* decide who adds which leaf, never in what order.
+*
+* The program sums numbers of very different magnitudes, which cancel out a lot, with 1 to max threads:
+*
+*   - accumulateParallel
+*   - sumDeterministic with Summation::Plain, Compensated and Exact
+*
+* and prints the milliseconds of each, then the distinct results each way gave over all thread counts
+* (one, for the deterministic ones) and how far the first of them is from the exact sum, in units of its
+* last place. Usage:
+*
+*   s3t21 [numbers = 10000000] [max threads = 16]
+*/
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "../../common/DeterministicReduce.h"
+#include "../../common/ParallelReduce.h"
+#include "../../common/ThreadPool.h"
+
+using Clock = std::chrono::steady_clock;
+
+/* (!) Magnitudes from 1e-8 to 1e8, either sign: most of each sum is lost to rounding, then cancelled */
+std::vector<double> generate(size_t count)
+{
+  std::mt19937_64 random(2023);
+  std::uniform_real_distribution<double> mantissa(-1, 1);
+  std::uniform_int_distribution<int> exponent(-8, 8);
+
+  std::vector<double> numbers(count);
+  for (auto&& x : numbers) {
+    x = mantissa(random) * std::pow(10.0, exponent(random));
+  }
+  return numbers;
+}
+
+template<typename Sum>
+double timed(Sum sum, double& milliseconds)
+{
+  const auto start = Clock::now();
+  const double result = sum();
+  milliseconds = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+  return result;
+}
+
+int main(int argc, char* argv[])
+{
+  const size_t count = argc > 1 ? std::stoull(argv[1]) : 10000000;
+  const unsigned maxThreads = argc > 2 ? static_cast<unsigned>(std::stoul(argv[2])) : 16;
+
+  const std::vector<double> numbers = generate(count);
+
+  const char* names[] = { "accumulateParallel", "Plain", "Compensated", "Exact" };
+  std::set<double> results[4];
+  double first[4] = {};
+
+  std::cout << "Milliseconds summing " << count << " doubles:" << std::endl;
+  std::cout << std::setw(8) << "threads";
+  for (auto&& name : names) {
+    std::cout << std::setw(20) << name;
+  }
+  std::cout << std::endl;
+
+  for (unsigned threads = 1; threads <= maxThreads; ++threads) {
+    ThreadPool pool(threads);
+    double milliseconds[4];
+    double sums[4];
+
+    sums[0] = timed([&] { return accumulateParallel(pool, numbers.begin(), numbers.end(), 0.0); }, milliseconds[0]);
+    sums[1] = timed([&] { return sumDeterministic(pool, numbers.begin(), numbers.end(), Summation::Plain); }, milliseconds[1]);
+    sums[2] = timed([&] { return sumDeterministic(pool, numbers.begin(), numbers.end(), Summation::Compensated); }, milliseconds[2]);
+    sums[3] = timed([&] { return sumDeterministic(pool, numbers.begin(), numbers.end(), Summation::Exact); }, milliseconds[3]);
+
+    std::cout << std::setw(8) << threads;
+    for (int i = 0; i < 4; ++i) {
+      std::cout << std::setw(20) << milliseconds[i];
+      if (results[i].empty()) {
+        first[i] = sums[i];
+      }
+      results[i].insert(sums[i]);
+    }
+    std::cout << std::endl;
+  }
+
+  const double exact = first[3];
+  std::cout << std::endl << std::setw(20) << "" << std::setw(10) << "results" << std::setw(26) << "first" << std::setw(12)
+            << "ulps off" << std::endl;
+  for (int i = 0; i < 4; ++i) {
+    const double ulp = std::nextafter(std::fabs(exact), INFINITY) - std::fabs(exact);
+    std::cout << std::setw(20) << names[i] << std::setw(10) << results[i].size() << std::setw(26) << std::setprecision(17)
+              << first[i] << std::setw(12) << std::setprecision(6) << std::fabs(first[i] - exact) / ulp << std::endl;
+  }
+
+  return 0;
+}
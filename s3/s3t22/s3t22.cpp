@@ -0,0 +1,366 @@
+/*
+* Session 3, example 22:
+*
+* The containers of session 2 connect threads; processes need memory that both of them map. This example
+* starts copies of itself as peer processes and connects them through SharedRings and a
+* SharedReduction (common/SharedRing.h, common/SharedReduce.h) in SharedMemory regions:
+*
+*   - throughput: this process pushes the messages, a consumer process pops them and checks their order
+*   - latency: a message goes to an echo process and back, one at a time; the round trip over two
+*   - crash recovery: processes flooding a ring with large messages are killed at random moments, each
+*     followed by one that pushes a last message; a kill in the middle of a push leaves a cell claimed
+*     by a dead process, which the consumer frees instead of waiting for it forever. Then the other way
+*     round: processes popping large messages are killed, and a cell left claimed by a dead consumer is
+*     freed by the next consumer to reach it (or by the producer)
+*   - reduction: each of the participant processes sums its share of the numbers and contributes; the
+*     last one crashes after joining, and combine() reports its rank missing instead of hanging
+*
+* On one core every message wakes the other process through the scheduler; with a core each, the two
+* sides mostly spin. Usage:
+*
+*   s3t22 [messages = 1000000] [message bytes = 64] [participants = 4]
+*/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char** environ;
+#endif
+
+#include "../../common/ParallelReduce.h"
+#include "../../common/SharedMemory.h"
+#include "../../common/SharedReduce.h"
+#include "../../common/SharedRing.h"
+#include "../../common/ThreadPool.h"
+
+using Clock = std::chrono::steady_clock;
+
+const std::string Name = "/s3t22";
+constexpr size_t Capacity = 1024;
+constexpr size_t FloodBytes = 1 << 16; /* (!) Long pushes: a kill lands in the middle of one often enough */
+
+/* (!) Another copy of this program */
+class Peer
+{
+public:
+  Peer(std::string const& program, std::vector<std::string> arguments)
+  {
+    arguments.insert(arguments.begin(), program);
+#if defined(_WIN32)
+    std::string line;
+    for (auto&& a : arguments) {
+      line += "\"" + a + "\" ";
+    }
+    STARTUPINFOA startup{};
+    startup.cb = sizeof(startup);
+    if (!::CreateProcessA(nullptr, &line[0], nullptr, nullptr, FALSE, 0, nullptr, nullptr, &startup, &m_process)) {
+      throw std::runtime_error("Can't start " + program);
+    }
+    ::CloseHandle(m_process.hThread);
+#else
+    std::vector<char*> argv;
+    for (auto&& a : arguments) {
+      argv.push_back(&a[0]);
+    }
+    argv.push_back(nullptr);
+    if (::posix_spawnp(&m_process, program.c_str(), nullptr, nullptr, argv.data(), environ) != 0) {
+      throw std::runtime_error("Can't start " + program);
+    }
+#endif
+  }
+
+  ~Peer()
+  {
+    wait();
+  }
+
+  Peer(Peer const&) = delete;
+  Peer& operator=(Peer const&) = delete;
+
+  void kill()
+  {
+#if defined(_WIN32)
+    ::TerminateProcess(m_process.hProcess, 1);
+#else
+    ::kill(m_process, SIGKILL);
+#endif
+    wait();
+  }
+
+  void wait()
+  {
+    if (m_done) {
+      return;
+    }
+#if defined(_WIN32)
+    ::WaitForSingleObject(m_process.hProcess, INFINITE);
+    ::CloseHandle(m_process.hProcess);
+#else
+    int status;
+    ::waitpid(m_process, &status, 0);
+#endif
+    m_done = true;
+  }
+
+private:
+#if defined(_WIN32)
+  PROCESS_INFORMATION m_process{};
+#else
+  pid_t m_process = 0;
+#endif
+  bool m_done = false;
+};
+
+/* (!) A ring in a region of its own: "a" goes to the peer, "b" comes back, "c" is flooded */
+struct Channel
+{
+  Channel(std::string const& suffix, size_t messageBytes)
+    : memory(Name + suffix, SharedRing::bytes(Capacity, messageBytes))
+    , ring(SharedRing::create(memory.data(), Capacity, messageBytes))
+  {
+  }
+
+  explicit Channel(std::string const& suffix)
+    : memory(Name + suffix)
+    , ring(SharedRing::attach(memory.data()))
+  {
+  }
+
+  SharedMemory memory;
+  SharedRing* ring;
+};
+
+/* (!) The peers' side */
+int runPeer(std::string const& role, std::vector<std::string> const& arguments)
+{
+  if (role == "--consume") {
+    Channel in(".a");
+    Channel out(".b");
+    std::vector<char> message(in.ring->messageSize());
+    uint64_t wrong = 0;
+    for (uint64_t i = 0, count = std::stoull(arguments[0]); i < count; ++i) {
+      in.ring->pop(message.data());
+      uint64_t index;
+      std::memcpy(&index, message.data(), sizeof(index));
+      wrong += index != i;
+    }
+    out.ring->push(&wrong, sizeof(wrong));
+  } else if (role == "--echo") {
+    Channel in(".a");
+    Channel out(".b");
+    std::vector<char> message(in.ring->messageSize());
+    for (uint64_t i = 0, count = std::stoull(arguments[0]); i < count; ++i) {
+      const size_t size = in.ring->pop(message.data());
+      out.ring->push(message.data(), size);
+    }
+  } else if (role == "--flood") {
+    Channel out(".c");
+    const std::vector<char> message(FloodBytes, 'x');
+    for (;;) {
+      out.ring->push(message.data(), message.size());
+    }
+  } else if (role == "--sink") {
+    Channel in(".d");
+    std::vector<char> message(in.ring->messageSize());
+    for (;;) {
+      in.ring->pop(message.data());
+    }
+  } else if (role == "--last") {
+    Channel out(".c");
+    out.ring->push("!", 1); /* (!) The only one-byte message */
+  } else if (role == "--part") {
+    SharedMemory memory(Name + ".r");
+    auto* reduction = SharedReduction<double>::attach(memory.data());
+    const size_t rank = std::stoul(arguments[0]);
+    const uint64_t count = std::stoull(arguments[1]);
+
+    reduction->join(rank);
+    if (rank + 1 == reduction->participants()) {
+      std::_Exit(1); /* (!) Crashes after joining, before contributing */
+    }
+
+    std::vector<double> share;
+    for (uint64_t i = rank; i < count; i += reduction->participants()) {
+      share.push_back(static_cast<double>(i));
+    }
+    ThreadPool pool;
+    reduction->contribute(rank, accumulateParallel(pool, share.begin(), share.end(), 0.0));
+  }
+  return 0;
+}
+
+double throughput(std::string const& program, uint64_t messages, size_t messageBytes, uint64_t& wrong)
+{
+  Channel out(".a", messageBytes);
+  Channel in(".b", sizeof(uint64_t));
+  std::vector<char> message(messageBytes);
+
+  Peer consumer(program, { "--consume", std::to_string(messages) });
+  const auto start = Clock::now();
+  for (uint64_t i = 0; i < messages; ++i) {
+    std::memcpy(message.data(), &i, sizeof(i));
+    out.ring->push(message.data(), message.size());
+  }
+  in.ring->pop(&wrong);
+  return messages / std::chrono::duration<double>(Clock::now() - start).count() / 1e6;
+}
+
+/* (!) Microseconds of one way: half the round trips, sorted */
+std::vector<double> latencies(std::string const& program, uint64_t roundTrips, size_t messageBytes)
+{
+  Channel out(".a", messageBytes);
+  Channel in(".b", messageBytes);
+  std::vector<char> message(messageBytes);
+  std::vector<double> result;
+  result.reserve(roundTrips);
+
+  Peer echo(program, { "--echo", std::to_string(roundTrips) });
+  for (uint64_t i = 0; i < roundTrips; ++i) {
+    const auto start = Clock::now();
+    out.ring->push(message.data(), message.size());
+    in.ring->pop(message.data());
+    result.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count() / 2);
+  }
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+/* (!) Returns the cells recovered */
+uint64_t floodAndKill(std::string const& program, unsigned rounds, double& milliseconds)
+{
+  Channel in(".c", FloodBytes);
+  std::vector<char> message(FloodBytes);
+  std::mt19937 random(22);
+
+  const auto start = Clock::now();
+  for (unsigned round = 0; round < rounds; ++round) {
+    Peer flood(program, { "--flood" });
+    for (unsigned received = 0, wanted = 16 + random() % 64; received < wanted; ++received) {
+      in.ring->pop(message.data());
+    }
+    std::atomic<bool> killed{ false };
+    std::thread killer([&] {
+      std::this_thread::sleep_for(std::chrono::microseconds(random() % 2000));
+      flood.kill();
+      killed.store(true);
+    });
+    size_t size;
+    while (!killed.load()) {
+      in.ring->tryPop(message.data(), size); /* (!) Keeps the producer pushing until the kill */
+    }
+    killer.join();
+
+    Peer last(program, { "--last" });
+    while (in.ring->pop(message.data()) != 1) {
+    }
+  }
+  milliseconds = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+  return in.ring->recoveries();
+}
+
+/* (!) Returns the cells recovered. The sink that comes after a killed one finds its cell on the next lap */
+uint64_t drainAndKill(std::string const& program, unsigned rounds, double& milliseconds)
+{
+  Channel out(".d", FloodBytes);
+  std::vector<char> message(FloodBytes);
+  std::mt19937 random(22);
+
+  const auto start = Clock::now();
+  for (unsigned round = 0; round < rounds; ++round) {
+    Peer sink(program, { "--sink" });
+    for (size_t pushed = 0; pushed < Capacity;) {
+      pushed += out.ring->tryPush(message.data(), message.size()); /* (!) A lap: the sink must get past the cell of the previous round */
+    }
+    std::atomic<bool> killed{ false };
+    std::thread killer([&] {
+      std::this_thread::sleep_for(std::chrono::microseconds(random() % 2000));
+      sink.kill();
+      killed.store(true);
+    });
+    while (!killed.load()) {
+      out.ring->tryPush(message.data(), message.size()); /* (!) Keeps the consumer popping until the kill */
+    }
+    killer.join();
+
+    out.ring->push("!", 1);
+    size_t size = 0;
+    while (size != 1) {
+      size = out.ring->pop(message.data()); /* (!) Empties the ring for the next consumer */
+    }
+  }
+  milliseconds = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+  return out.ring->recoveries();
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc > 1 && argv[1][0] == '-') {
+    return runPeer(argv[1], std::vector<std::string>(argv + 2, argv + argc));
+  }
+
+  const std::string program = argv[0];
+  const uint64_t messages = argc > 1 ? std::stoull(argv[1]) : 1000000;
+  const size_t messageBytes = std::max<size_t>(sizeof(uint64_t), argc > 2 ? std::stoul(argv[2]) : 64);
+  const size_t participants = argc > 3 ? std::stoul(argv[3]) : 4;
+
+  uint64_t wrong = 0;
+  std::cout << "Throughput, " << messageBytes << "-byte messages between two processes: " << throughput(program, messages, messageBytes, wrong)
+            << " million per second, " << wrong << " out of order" << std::endl;
+
+  const std::vector<double> oneWay = latencies(program, std::max<uint64_t>(1, messages / 10), messageBytes);
+  std::cout << "Latency, one way in microseconds: median " << oneWay[oneWay.size() / 2] << ", 99th percentile "
+            << oneWay[oneWay.size() * 99 / 100] << ", max " << oneWay.back() << std::endl;
+
+  double milliseconds = 0;
+  const unsigned rounds = 20;
+  const uint64_t recovered = floodAndKill(program, rounds, milliseconds);
+  std::cout << "Crash recovery: " << rounds << " producers killed while pushing, " << recovered
+            << " cells freed from a dead producer, " << milliseconds << "ms" << std::endl;
+  const uint64_t freed = drainAndKill(program, rounds, milliseconds);
+  std::cout << "Crash recovery: " << rounds << " consumers killed while popping, " << freed
+            << " cells freed from a dead consumer, " << milliseconds << "ms" << std::endl;
+
+  SharedMemory memory(Name + ".r", SharedReduction<double>::bytes(participants));
+  auto* reduction = SharedReduction<double>::create(memory.data(), participants);
+  std::vector<std::unique_ptr<Peer>> peers;
+  for (size_t rank = 0; rank < participants; ++rank) {
+    peers.push_back(std::make_unique<Peer>(program, std::vector<std::string>{ "--part", std::to_string(rank), std::to_string(messages) }));
+  }
+  const auto start = Clock::now();
+  const auto combined = reduction->combine(0.0);
+  const double waited = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+  double expected = 0;
+  for (uint64_t i = 0; i < messages; ++i) {
+    expected += i % participants + 1 == participants ? 0 : static_cast<double>(i);
+  }
+  std::cout << "Reduction over " << participants << " processes: " << std::setprecision(15) << combined.value << " (expected "
+            << expected << "), missing ranks:";
+  for (auto&& rank : combined.missing) {
+    std::cout << " " << rank;
+  }
+  std::cout << std::setprecision(6) << ", " << waited << "ms" << std::endl;
+
+  for (auto&& suffix : { ".a", ".b", ".c", ".d", ".r" }) {
+    SharedMemory::remove(Name + suffix);
+  }
+  return 0;
+}
@@ -0,0 +1,188 @@
+/*
+* Session 3, example 23:
+*
+* ThreadSafeStack (s2t09) takes its lock once per value, so a producer with hundreds of values to push,
+* or a consumer that wants everything there is, pays for the lock (and its cache line) hundreds of times.
+* Its bulk operations (common/Containers.h) take the lock once per batch: push_range() splices a chain
+* of nodes made before locking, try_pop_n() unlinks up to n of them, and pop_all() swaps the whole list
+* out in O(1).
+* LockFreeStack (common/LockFreeStack.h) does the same with one CAS per batch, under the same names.
+*
+* Half the threads push batches of values, the other half pop until everything has been popped, each of
+* the stacks:
+*
+*   - one by one: push() and try_pop() once per value, the batch only counts the values
+*   - push_range() / try_pop_n() of a batch
+*   - push_range() / pop_all()
+*
+* and the program prints millions of values per second for batches of 1 to 256. The popped values must
+* add up to the pushed ones, and before measuring the program checks that every bulk operation of both
+* stacks leaves the values in the order that single pushes and pops would. Usage:
+*
+*   s3t23 [values per row = 4000000] [threads = 4]
+*/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../../common/Containers.h"
+#include "../../common/LockFreeStack.h"
+#include "../../common/ThreadGuard.h"
+
+using Clock = std::chrono::steady_clock;
+
+enum class Way
+{
+  OneByOne,
+  Batch,
+  All
+};
+
+/* (!) Both stacks have the same bulk operations, so one driver serves them */
+template<typename Stack>
+struct Driven
+{
+  Stack stack;
+
+  void push(std::vector<int> const& values, Way way)
+  {
+    if (way == Way::OneByOne) {
+      for (int value : values) {
+        stack.push(value);
+      }
+    } else {
+      stack.push_range(values.begin(), values.end());
+    }
+  }
+
+  size_t pop(std::vector<int>& values, size_t batch, Way way)
+  {
+    values.clear();
+    if (way == Way::OneByOne) {
+      int value = 0;
+      while (values.size() < batch && stack.try_pop(value)) {
+        values.push_back(value);
+      }
+      return values.size();
+    }
+    if (way == Way::Batch) {
+      return stack.try_pop_n(std::back_inserter(values), batch);
+    }
+    return stack.pop_all(std::back_inserter(values));
+  }
+};
+
+/* (!) wrong counts runs where the popped values don't add up to the pushed ones */
+template<typename Stack>
+double millionsPerSecond(unsigned threads, uint64_t values, size_t batch, Way way, uint64_t& wrong)
+{
+  Driven<Stack> stack;
+  const unsigned producers = std::max(1u, threads / 2);
+  const unsigned consumers = std::max(1u, threads - producers);
+  const uint64_t batches = values / batch;
+  std::atomic<uint64_t> popped{ 0 };
+  std::atomic<int64_t> balance{ 0 };
+
+  const auto start = Clock::now();
+  {
+    std::vector<JoiningThread> running;
+    for (unsigned p = 0; p < producers; ++p) {
+      running.emplace_back([&, p] {
+        std::vector<int> chunk(batch);
+        int64_t sum = 0;
+        for (uint64_t b = p; b < batches; b += producers) {
+          for (size_t i = 0; i < batch; ++i) {
+            chunk[i] = static_cast<int>(b * batch + i);
+            sum += chunk[i];
+          }
+          stack.push(chunk, way);
+        }
+        balance += sum;
+      });
+    }
+    for (unsigned c = 0; c < consumers; ++c) {
+      running.emplace_back([&] {
+        std::vector<int> chunk;
+        int64_t sum = 0;
+        while (popped.load(std::memory_order_relaxed) < batches * batch) {
+          const size_t n = stack.pop(chunk, batch, way);
+          if (n == 0) {
+            std::this_thread::yield(); /* (!) Empty: let a producer run */
+            continue;
+          }
+          for (int value : chunk) {
+            sum += value;
+          }
+          popped += n;
+        }
+        balance -= sum;
+      });
+    }
+  }
+  const double result = batches * batch / std::chrono::duration<double>(Clock::now() - start).count() / 1e6;
+
+  wrong += balance.load() != 0;
+  return result;
+}
+
+/* (!) A batch must end up as if pushed value by value: its last value on top, popped first */
+template<typename Stack>
+bool keepsOrder()
+{
+  Stack stack;
+  stack.push({ 1, 2, 3 });
+  const std::vector<int> more{ 4, 5, 6 };
+  stack.push_range(more.begin(), more.end());
+  stack.push(7);
+
+  std::vector<int> popped;
+  int value = 0;
+  if (stack.try_pop_n(std::back_inserter(popped), 2) != 2 || !stack.try_pop(value) || value != 5) {
+    return false;
+  }
+  if (stack.pop_all(std::back_inserter(popped)) != 4) {
+    return false;
+  }
+
+  return popped == std::vector<int>{ 7, 6, 4, 3, 2, 1 } && stack.empty() && stack.try_pop_n(std::back_inserter(popped), 1) == 0;
+}
+
+int main(int argc, char* argv[])
+{
+  const uint64_t values = argc > 1 ? std::stoull(argv[1]) : 4000000;
+  const unsigned threads = argc > 2 ? static_cast<unsigned>(std::stoul(argv[2])) : 4;
+
+  const bool ordered = keepsOrder<ThreadSafeStack<int>>() && keepsOrder<LockFreeStack<int>>();
+  std::cout << "push({...}), push_range, try_pop_n and pop_all keep the order of single pushes: " << (ordered ? "yes" : "NO")
+            << std::endl << std::endl;
+
+  const char* columns[] = { "mutex 1 by 1", "mutex try_pop_n", "mutex pop_all", "lock-free 1 by 1", "lock-free try_pop_n", "lock-free pop_all" };
+  std::cout << "Million values per second, " << threads << " threads:" << std::endl;
+  std::cout << std::setw(6) << "batch";
+  for (auto&& column : columns) {
+    std::cout << std::setw(20) << column;
+  }
+  std::cout << std::endl;
+
+  uint64_t wrong = 0;
+  for (size_t batch = 1; batch <= 256; batch *= 4) {
+    std::cout << std::setw(6) << batch;
+    for (Way way : { Way::OneByOne, Way::Batch, Way::All }) {
+      std::cout << std::setw(20) << millionsPerSecond<ThreadSafeStack<int>>(threads, values, batch, way, wrong);
+    }
+    for (Way way : { Way::OneByOne, Way::Batch, Way::All }) {
+      std::cout << std::setw(20) << millionsPerSecond<LockFreeStack<int>>(threads, values, batch, way, wrong);
+    }
+    std::cout << std::endl;
+  }
+  std::cout << "Runs where the sums don't add up: " << wrong << std::endl;
+
+  return 0;
+}